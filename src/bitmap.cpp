@@ -1,10 +1,38 @@
 #include <windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 #include <assert.h>
 #include "blob.h"
 #include "bitmap.h"
+#include "blank.h"
+#include "bmpcodec.h"
+#include "convert.h"
+#include "diff.h"
+#include "kernel.h"
+#include "logger.h"
+#include "parallel.h"
+#include "phash.h"
+#include "pixelview.h"
+#include "png.h"
+#include "qoi.h"
+#include "quantize.h"
+#include "resample.h"
+#include "ssim.h"
+#include "store.h"
+#include "tiled.h"
 
-void Log(LPCWSTR format, ...);
+// Pixel kernels hand out work to TaskScheduler in bands of this many rows.
+static const DWORD kBandHeight = 64;
 
 SafeDC SafeDC::Get(HWND hwnd) {
   return SafeDC(hwnd, GetDC(hwnd));
@@ -41,78 +69,256 @@ void DIB::Release() {
     bits_ = nullptr;
     lineSizeInBytes_ = 0;
   }
+  // GDI does not close a section passed to CreateDIBSection.  It can only be
+  // closed after the bitmap is deleted.
+  if (section_) {
+    CloseHandle(section_);
+    section_ = nullptr;
+  }
 }
 
-DIB DIB::LoadFromStream(std::istream &is, HDC dc, HANDLE section) {
-  DIB dib;
-  Blob blob;
-  BITMAPFILEHEADER fh = {0};
-  BITMAPINFOHEADER ih = {0};
-  Blob bitmapInfo;
-  LPVOID bits = nullptr;
+// Reads the file header, an info header of any version, and the color table.
+// |bitmapInfo| gets a plain BITMAPINFOHEADER followed by a color table with
+// all 2^biBitCount entries.  |masks| gets the red, green, blue and alpha
+// masks of BI_BITFIELDS and 16bpp bitmaps.
+static bool ReadHeaders(std::istream &is,
+                        BITMAPFILEHEADER &fh,
+                        Blob &bitmapInfo,
+                        DWORD (&masks)[4]) {
+  // BITMAPV5HEADER is the largest known header.  Its masks, like those of
+  // BITMAPV4HEADER, start right after the BITMAPINFOHEADER fields.
+  static const DWORD kMaxHeaderSize = 124;
+  static const DWORD kMasksInHeader = sizeof(BITMAPINFOHEADER) + 12;
+  static const DWORD kAlphaInHeader = sizeof(BITMAPINFOHEADER) + 16;
+  DWORD header[kMaxHeaderSize / sizeof(DWORD)] = {0};
+  auto &ih = *reinterpret_cast<BITMAPINFOHEADER*>(header);
 
   is.read(reinterpret_cast<LPSTR>(&fh), sizeof(fh));
   if (!is || fh.bfType != 0x4D42) {
     Log(L"Invalid bitmap data.\n");
-    goto cleanup;
+    return false;
   }
 
-  is.read(reinterpret_cast<LPSTR>(&ih), sizeof(ih));
+  is.read(reinterpret_cast<LPSTR>(header), sizeof(DWORD));
+  const DWORD headerSize = header[0];
   if (!is
-      || ih.biPlanes != 1
-      || ih.biCompression != BI_RGB) {
+      || headerSize < sizeof(BITMAPINFOHEADER)
+      || !is.read(reinterpret_cast<LPSTR>(header + 1),
+                  min(headerSize, kMaxHeaderSize) - sizeof(DWORD))
+      || (headerSize > kMaxHeaderSize
+          && !is.ignore(headerSize - kMaxHeaderSize))) {
+    Log(L"Invalid bitmap data.\n");
+    return false;
+  }
+
+  bool supported = ih.biPlanes == 1 && ih.biWidth > 0 && ih.biHeight != 0;
+  switch (ih.biCompression) {
+  case BI_RGB:
+    supported = supported
+                && (ih.biBitCount == 1 || ih.biBitCount == 4
+                    || ih.biBitCount == 8 || ih.biBitCount == 16
+                    || ih.biBitCount == 24 || ih.biBitCount == 32);
+    break;
+  case BI_RLE8:
+  case BI_RLE4:
+    // RLE bitmaps are always bottom-up.
+    supported = supported
+                && ih.biBitCount == (ih.biCompression == BI_RLE8 ? 8 : 4)
+                && ih.biHeight > 0;
+    break;
+  case BI_BITFIELDS:
+    supported = supported && (ih.biBitCount == 16 || ih.biBitCount == 32);
+    break;
+  default:
+    supported = false;
+    break;
+  }
+  if (!supported) {
     Log(L"Unsupported bitmap data.\n");
-    goto cleanup;
+    return false;
   }
 
-  const auto numColorEntries = ih.biBitCount >= 24 ? 0 : 1 << ih.biBitCount;
+  masks[0] = masks[1] = masks[2] = masks[3] = 0;
+  if (ih.biCompression == BI_BITFIELDS) {
+    if (headerSize >= kMasksInHeader) {
+      memcpy(masks, header + sizeof(BITMAPINFOHEADER) / sizeof(DWORD),
+             (headerSize >= kAlphaInHeader ? 4 : 3) * sizeof(DWORD));
+    }
+    else if (!is.read(reinterpret_cast<LPSTR>(masks), 3 * sizeof(DWORD))) {
+      Log(L"Failed to load bitfields.\n");
+      return false;
+    }
+  }
+  else if (ih.biBitCount == 16) {
+    // X1R5G5B5
+    masks[0] = 0x7c00;
+    masks[1] = 0x03e0;
+    masks[2] = 0x001f;
+  }
+
+  // biClrUsed may shorten the table in the file.  The rest stays black.
+  const DWORD numColorEntries = ih.biBitCount <= 8 ? 1 << ih.biBitCount : 0;
+  const DWORD numStoredEntries =
+    ih.biClrUsed > 0 && ih.biClrUsed < numColorEntries
+    ? ih.biClrUsed : numColorEntries;
   const auto colorTableSize = numColorEntries * sizeof(RGBQUAD);
 
   if (!bitmapInfo.Alloc(sizeof(BITMAPINFOHEADER) + colorTableSize)) {
     Log(L"Failed to allocate memory.\n");
-    goto cleanup;
+    return false;
   }
 
   auto &bi = *(bitmapInfo.As<BITMAPINFO>());
   bi.bmiHeader = ih;
-  if (!is.read(reinterpret_cast<LPSTR>(&bi.bmiColors), colorTableSize)) {
+  bi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+  bi.bmiHeader.biClrUsed = 0;
+  memset(bi.bmiColors, 0, colorTableSize);
+  if (!is.read(reinterpret_cast<LPSTR>(&bi.bmiColors),
+               numStoredEntries * sizeof(RGBQUAD))) {
     Log(L"Failed to load color table.\n");
-    goto cleanup;
+    return false;
+  }
+  return true;
+}
+
+// Pixels are read straight into the DIB section.  There is no intermediate
+// buffer to copy from.
+DIB DIB::LoadFromStream(std::istream &is, HDC dc, HANDLE section) {
+  DIB dib;
+  BITMAPFILEHEADER fh = {0};
+  Blob bitmapInfo;
+  DWORD masks[4];
+
+  if (is.peek() == 'q') {
+    return LoadQoi(is, dc, section);
+  }
+  if (!ReadHeaders(is, fh, bitmapInfo, masks)) {
+    return dib;
   }
 
   if (!is.seekg(fh.bfOffBits, std::ios::beg)) {
     Log(L"Invalid offset.\n");
-    goto cleanup;
+    return dib;
   }
 
-  const auto lineSizeInBytes = int((ih.biWidth * ih.biBitCount + 31) / 32) * 4;
-  const auto numPixels = lineSizeInBytes * std::abs(ih.biHeight);
+  const auto &header = bitmapInfo.As<BITMAPINFO>()->bmiHeader;
+  if (header.biCompression == BI_RLE8 || header.biCompression == BI_RLE4) {
+    return LoadRle(is, dc, section, bitmapInfo);
+  }
+  if (header.biBitCount == 16 || header.biCompression == BI_BITFIELDS) {
+    return LoadBitfields(is, dc, section, header, masks);
+  }
 
-  if (blob.Alloc(numPixels)) {
-    if (!is.read(blob.As<char>(), numPixels)) {
+  DIB newDib = CreateFromBitmapInfo(dc, bitmapInfo, section, /*offset*/0);
+  if (newDib) {
+    const auto &ih = newDib.GetBitmapInfo()->bmiHeader;
+    const auto numPixels = newDib.lineSizeInBytes_ * std::abs(ih.biHeight);
+    if (is.read(reinterpret_cast<LPSTR>(newDib.bits_), numPixels)) {
+      dib = std::move(newDib);
+    }
+    else {
       Log(L"Failed to load pixel data.\n");
-      goto cleanup;
     }
   }
-  else {
-    Log(L"Failed to allocate memory.\n");
-    goto cleanup;
+  return dib;
+}
+
+DIB DIB::LoadFromFile(LPCWSTR path, HDC dc, DWORD firstRow, DWORD numRows) {
+  DIB dib;
+  BITMAPFILEHEADER fh = {0};
+  Blob bitmapInfo;
+  DWORD masks[4];
+
+  std::ifstream is(path, std::ios::binary);
+  if (!is.is_open()) {
+    Log(L"Failed to open %ls\n", path);
+    return dib;
+  }
+  if (!ReadHeaders(is, fh, bitmapInfo, masks)) {
+    return dib;
   }
 
-  if (auto bitmap = CreateDIBSection(dc,
-                                     &bi,
-                                     DIB_RGB_COLORS,
-                                     &bits,
-                                     section,
-                                     /*dwOffset*/0)) {
-    dib.info_ = std::move(bitmapInfo);
-    dib.lineSizeInBytes_ = lineSizeInBytes;
-    dib.bitmap_ = bitmap;
-    dib.bits_ = bits;
-    memcpy(bits, blob, blob.Size());
+  // Rows are counted from the top of the image as in At(), whichever way
+  // the file stores them.
+  auto &ih = bitmapInfo.As<BITMAPINFO>()->bmiHeader;
+  const DWORD height = std::abs(ih.biHeight);
+  if (firstRow >= height) {
+    Log(L"Row %u is out of range.\n", firstRow);
+    return dib;
   }
 
-cleanup:
+  // Compressed and 16bpp pixels cannot be mapped.  They are decoded as a
+  // whole.
+  if (ih.biCompression != BI_RGB || ih.biBitCount == 16) {
+    if (firstRow > 0 || numRows < height) {
+      Log(L"Row ranges of compressed bitmaps are not supported.\n");
+      return dib;
+    }
+    is.seekg(0, std::ios::beg);
+    return LoadFromStream(is, dc, /*section*/nullptr);
+  }
+  numRows = min(numRows, height - firstRow);
+  const ULONGLONG lineSizeInBytes = ((ih.biWidth * ih.biBitCount + 31) / 32) * 4;
+  const DWORD fileRow = ih.biHeight > 0 ? height - firstRow - numRows : firstRow;
+  const ULONGLONG offset = fh.bfOffBits + lineSizeInBytes * fileRow;
+  const ULONGLONG end = offset + lineSizeInBytes * numRows;
+  ih.biHeight = ih.biHeight > 0 ? numRows : -static_cast<LONG>(numRows);
+  ih.biSizeImage = 0;
+
+  // CreateDIBSection can use the file itself as the pixel buffer if the
+  // pixels start at a DWORD boundary.  It maps the view read-write, and
+  // fails on a read-only or copy-on-write section, so the file is opened
+  // for writing even though nothing is written to it.
+  if (offset % sizeof(DWORD) == 0 && end <= MAXDWORD) {
+    HANDLE file = CreateFile(path,
+                             GENERIC_READ | GENERIC_WRITE,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             /*lpSecurityAttributes*/nullptr,
+                             OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL,
+                             /*hTemplateFile*/nullptr);
+    if (file != INVALID_HANDLE_VALUE) {
+      LARGE_INTEGER fileSize;
+      HANDLE mapping = nullptr;
+      if (GetFileSizeEx(file, &fileSize)
+          && static_cast<ULONGLONG>(fileSize.QuadPart) >= end) {
+        mapping = CreateFileMapping(file,
+                                    /*lpAttributes*/nullptr,
+                                    PAGE_READWRITE,
+                                    0, 0,
+                                    /*lpName*/nullptr);
+      }
+      CloseHandle(file);
+      if (mapping) {
+        dib = CreateFromBitmapInfo(dc,
+                                   bitmapInfo,
+                                   mapping,
+                                   static_cast<DWORD>(offset));
+        if (dib) {
+          dib.section_ = mapping;
+          return dib;
+        }
+        CloseHandle(mapping);
+      }
+    }
+    LogVerbose(L"%ls cannot be mapped - %08x.  Reading it instead.\n",
+        path,
+        GetLastError());
+  }
+
+  if (!is.seekg(offset, std::ios::beg)) {
+    Log(L"Invalid offset.\n");
+    return dib;
+  }
+  DIB newDib = CreateFromBitmapInfo(dc, bitmapInfo, /*section*/nullptr, 0);
+  if (newDib) {
+    if (is.read(reinterpret_cast<LPSTR>(newDib.bits_), end - offset)) {
+      dib = std::move(newDib);
+    }
+    else {
+      Log(L"Failed to load pixel data.\n");
+    }
+  }
   return dib;
 }
 
@@ -120,7 +326,7 @@ static Blob CreateBitmapInfo(LONG width,
                              LONG height,
                              WORD bitCount,
                              bool initWithGrayscaleTable) {
-  int colorTableEntries = bitCount >= 24 ? 0 : (1 << bitCount);
+  int colorTableEntries = bitCount > 8 ? 0 : (1 << bitCount);
   Blob blob(sizeof(BITMAPINFOHEADER) + sizeof(RGBQUAD) * colorTableEntries);
   if (auto p = blob.As<BITMAPINFO>()) {
     auto &ih = p->bmiHeader;
@@ -143,35 +349,313 @@ static Blob CreateBitmapInfo(LONG width,
   return blob;
 }
 
+// Header of a DIB with the size of |ih| in another format.  BI_BITFIELDS is
+// R5G6B5, with the masks in place of the color table.
+static Blob CreateConvertedInfo(const BITMAPINFOHEADER &ih,
+                                WORD bitCount,
+                                DWORD compression) {
+  static const DWORD kMask565[] = {0xf800, 0x07e0, 0x001f};
+  if (compression == BI_RGB) {
+    return CreateBitmapInfo(ih.biWidth,
+                            ih.biHeight,
+                            bitCount,
+                            /*initWithGrayscaleTable*/true);
+  }
+
+  Blob blob;
+  if (compression == BI_BITFIELDS && bitCount == 16) {
+    blob = CreateBitmapInfo(ih.biWidth,
+                            ih.biHeight,
+                            bitCount,
+                            /*initWithGrayscaleTable*/false);
+    if (blob && blob.Alloc(sizeof(BITMAPINFOHEADER) + sizeof(kMask565))) {
+      blob.As<BITMAPINFO>()->bmiHeader.biCompression = BI_BITFIELDS;
+      memcpy(blob + sizeof(BITMAPINFOHEADER), kMask565, sizeof(kMask565));
+    }
+    else {
+      blob = Blob();
+    }
+  }
+  return blob;
+}
+
+// Takes ownership of |bitmapInfo| only when it succeeds.
+DIB DIB::CreateFromBitmapInfo(HDC dc,
+                              Blob &bitmapInfo,
+                              HANDLE section,
+                              DWORD offset) {
+  DIB dib;
+  auto &bi = *(bitmapInfo.As<BITMAPINFO>());
+  auto &ih = bi.bmiHeader;
+  LPVOID bits = nullptr;
+  if (auto bitmap = CreateDIBSection(dc,
+                                     &bi,
+                                     DIB_RGB_COLORS,
+                                     &bits,
+                                     section,
+                                     offset)) {
+    dib.lineSizeInBytes_ = int((ih.biWidth * ih.biBitCount + 31) / 32) * 4;
+    dib.info_ = std::move(bitmapInfo);
+    dib.bitmap_ = bitmap;
+    dib.bits_ = bits;
+  }
+  else {
+    Log(L"CreateDIBSection failed - %08x\n", GetLastError());
+  }
+  return dib;
+}
+
+// QOI data is read in blocks of this size and decoded row by row, so
+// neither the whole file nor an extra copy of the pixels is in memory.
+DIB DIB::LoadQoi(std::istream &is, HDC dc, HANDLE section) {
+  static const SIZE_T kReadSize = 256 * 1024;
+  DIB dib;
+  BYTE header[kQoiHeaderSize];
+  DWORD width, height;
+  WORD bitCount;
+  if (!is.read(reinterpret_cast<LPSTR>(header), sizeof(header))
+      || !QoiDecoder::ReadHeader(header, sizeof(header),
+                                 width, height, bitCount)) {
+    Log(L"Invalid QOI data.\n");
+    return dib;
+  }
+
+  Blob bitmapInfo = CreateBitmapInfo(width,
+                                     height,
+                                     bitCount,
+                                     /*initWithGrayscaleTable*/true);
+  Blob buffer(kReadSize + QoiEncoder::MaxRowSize(width));
+  if (!bitmapInfo || !buffer) {
+    Log(L"Failed to allocate memory.\n");
+    return dib;
+  }
+
+  DIB newDib = CreateFromBitmapInfo(dc, bitmapInfo, section, /*offset*/0);
+  if (!newDib) {
+    return dib;
+  }
+
+  QoiDecoder decoder;
+  LPCBYTE begin = buffer;
+  LPCBYTE end = buffer;
+  bool eof = false;
+  for (DWORD y = 0; y < height; ++y) {
+    // Keep at least one worst-case row buffered.
+    if (!eof && SIZE_T(end - begin) < QoiEncoder::MaxRowSize(width)) {
+      const SIZE_T remaining = end - begin;
+      memmove(buffer, begin, remaining);
+      is.read(buffer.As<char>() + remaining, buffer.Size() - remaining);
+      eof = !is;
+      begin = buffer;
+      end = begin + remaining + static_cast<SIZE_T>(is.gcount());
+    }
+    if (!decoder.DecodeRow(begin, end, newDib.At(0, y), width, bitCount)) {
+      Log(L"Failed to load pixel data.\n");
+      return dib;
+    }
+  }
+  return newDib;
+}
+
+// RLE data is read as a whole and decoded into a zeroed DIB, so pixels the
+// data skips become index 0.
+DIB DIB::LoadRle(std::istream &is, HDC dc, HANDLE section, Blob &bitmapInfo) {
+  DIB dib;
+  auto &ih = bitmapInfo.As<BITMAPINFO>()->bmiHeader;
+  Blob data;
+  if (ih.biSizeImage > 0) {
+    if (!data.Alloc(ih.biSizeImage)
+        || !is.read(data.As<char>(), ih.biSizeImage)) {
+      Log(L"Failed to load pixel data.\n");
+      return dib;
+    }
+  }
+  else {
+    // biSizeImage is required for RLE, but not every writer sets it.
+    const auto start = is.tellg();
+    is.seekg(0, std::ios::end);
+    const auto size = static_cast<SIZE_T>(is.tellg() - start);
+    is.seekg(start);
+    if (!data.Alloc(size) || !is.read(data.As<char>(), size)) {
+      Log(L"Failed to load pixel data.\n");
+      return dib;
+    }
+  }
+
+  const WORD bitCount = ih.biBitCount;
+  ih.biCompression = BI_RGB;
+  ih.biSizeImage = 0;
+  DIB newDib = CreateFromBitmapInfo(dc, bitmapInfo, section, /*offset*/0);
+  if (newDib) {
+    const auto &header = newDib.GetBitmapInfo()->bmiHeader;
+    memset(newDib.bits_, 0, newDib.lineSizeInBytes_ * header.biHeight);
+    if (DecodeRle(data,
+                  data.Size(),
+                  bitCount,
+                  static_cast<LPBYTE>(newDib.bits_),
+                  newDib.lineSizeInBytes_,
+                  header.biWidth,
+                  header.biHeight)) {
+      dib = std::move(newDib);
+    }
+    else {
+      Log(L"Invalid RLE data.\n");
+    }
+  }
+  return dib;
+}
+
+// 16bpp and BI_BITFIELDS bitmaps are unpacked to 32bpp BI_RGB, the format
+// the rest of the code handles.  Rows are read in strips and unpacked in
+// parallel.
+DIB DIB::LoadBitfields(std::istream &is,
+                       HDC dc,
+                       HANDLE section,
+                       const BITMAPINFOHEADER &ih,
+                       const DWORD (&masks)[4]) {
+  static const DWORD kStripHeight = 256;
+  DIB dib;
+  const BitfieldUnpacker unpacker(ih.biBitCount,
+                                  masks[0], masks[1], masks[2], masks[3]);
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  const SIZE_T srcLineSize = ((width * ih.biBitCount + 31) / 32) * 4;
+
+  Blob bitmapInfo = CreateBitmapInfo(ih.biWidth,
+                                     ih.biHeight,
+                                     /*bitCount*/32,
+                                     /*initWithGrayscaleTable*/false);
+  Blob strip(srcLineSize * min(height, kStripHeight));
+  if (!bitmapInfo || !strip) {
+    Log(L"Failed to allocate memory.\n");
+    return dib;
+  }
+
+  DIB newDib = CreateFromBitmapInfo(dc, bitmapInfo, section, /*offset*/0);
+  if (!newDib) {
+    return dib;
+  }
+
+  // Rows are unpacked in file order, so the orientation does not matter.
+  auto dst = static_cast<LPBYTE>(newDib.bits_);
+  for (DWORD y = 0; y < height; y += kStripHeight) {
+    const DWORD rows = min(kStripHeight, height - y);
+    if (!is.read(strip.As<char>(), srcLineSize * rows)) {
+      Log(L"Failed to load pixel data.\n");
+      return dib;
+    }
+    LPCBYTE src = strip;
+    const DWORD stride = newDib.lineSizeInBytes_;
+    TaskScheduler::Default().ParallelFor(
+      0, rows, kBandHeight,
+      [&](DWORD begin, DWORD end) {
+        for (DWORD row = begin; row < end; ++row) {
+          unpacker.UnpackRow(src + srcLineSize * row,
+                             dst + SIZE_T(stride) * (y + row),
+                             width);
+        }
+      });
+  }
+  return newDib;
+}
+
 DIB DIB::CreateNew(HDC dc,
                    WORD bitCount,
                    LONG width,
                    LONG height,
                    HANDLE section,
                    bool initWithGrayscaleTable) {
+  LogVerbose(L"DIB %dx%d %dbpp\n", width, height, bitCount);
   DIB dib;
   if (width > 0 && height != 0) {
     Blob bitmapInfoBlob = CreateBitmapInfo(width,
                                            height,
                                            bitCount,
                                            initWithGrayscaleTable);
-    auto &bi = *(bitmapInfoBlob.As<BITMAPINFO>());
-    auto &ih = bi.bmiHeader;
-    LPVOID bits = nullptr;
-    if (auto bitmap = CreateDIBSection(dc,
-                                       &bi,
-                                       DIB_RGB_COLORS,
-                                       &bits,
-                                       section,
-                                       /*dwOffset*/0)) {
-      dib.info_ = std::move(bitmapInfoBlob);
-      dib.bitmap_ = bitmap;
-      dib.lineSizeInBytes_ = int((ih.biWidth * ih.biBitCount + 31) / 32) * 4;
-      dib.bits_ = bits;
-    }
-    else {
-      Log(L"CreateDIBSection failed - %08x\n", GetLastError());
-    }
+    dib = CreateFromBitmapInfo(dc, bitmapInfoBlob, section, /*offset*/0);
+  }
+  return dib;
+}
+
+// The pixels start at a DWORD boundary, as CreateDIBSection requires for a
+// section offset.  The gap after the color table is allowed by the format and
+// is counted in bfOffBits.
+DIB DIB::CreateOnFile(LPCWSTR path,
+                      HDC dc,
+                      WORD bitCount,
+                      LONG width,
+                      LONG height,
+                      bool initWithGrayscaleTable) {
+  DIB dib;
+  if (width <= 0 || height == 0) {
+    return dib;
+  }
+
+  Blob bitmapInfo = CreateBitmapInfo(width,
+                                     height,
+                                     bitCount,
+                                     initWithGrayscaleTable);
+  const ULONGLONG lineSizeInBytes = ((width * bitCount + 31) / 32) * 4;
+  const ULONGLONG headerSize = sizeof(BITMAPFILEHEADER) + bitmapInfo.Size();
+  const ULONGLONG offset = (headerSize + 3) & ~3ull;
+  const ULONGLONG fileSize = offset + lineSizeInBytes * std::abs(height);
+  if (!bitmapInfo || fileSize > MAXDWORD) {
+    Log(L"Cannot create a bitmap file of %llu bytes.\n", fileSize);
+    return dib;
+  }
+
+  HANDLE file = CreateFile(path,
+                           GENERIC_READ | GENERIC_WRITE,
+                           /*dwShareMode*/0,
+                           /*lpSecurityAttributes*/nullptr,
+                           CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL,
+                           /*hTemplateFile*/nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    Log(L"CreateFile failed - %08x\n", GetLastError());
+    return dib;
+  }
+
+  // Creating a mapping larger than the file extends the file.
+  HANDLE mapping = CreateFileMapping(file,
+                                     /*lpAttributes*/nullptr,
+                                     PAGE_READWRITE,
+                                     0,
+                                     static_cast<DWORD>(fileSize),
+                                     /*lpName*/nullptr);
+  CloseHandle(file);
+  if (!mapping) {
+    Log(L"CreateFileMapping failed - %08x\n", GetLastError());
+    DeleteFile(path);
+    return dib;
+  }
+
+  if (auto header = reinterpret_cast<LPBYTE>(
+        MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, offset))) {
+    BITMAPFILEHEADER fh = {0};
+    fh.bfType = 0x4D42;
+    fh.bfSize = static_cast<DWORD>(fileSize);
+    fh.bfOffBits = static_cast<DWORD>(offset);
+    memset(header, 0, offset);
+    memcpy(header, &fh, sizeof(fh));
+    memcpy(header + sizeof(fh), bitmapInfo, bitmapInfo.Size());
+    UnmapViewOfFile(header);
+
+    dib = CreateFromBitmapInfo(dc,
+                               bitmapInfo,
+                               mapping,
+                               static_cast<DWORD>(offset));
+  }
+  else {
+    Log(L"MapViewOfFile failed - %08x\n", GetLastError());
+  }
+
+  if (dib) {
+    dib.section_ = mapping;
+  }
+  else {
+    CloseHandle(mapping);
+    DeleteFile(path);
   }
   return dib;
 }
@@ -179,17 +663,20 @@ DIB DIB::CreateNew(HDC dc,
 DIB::DIB()
   : lineSizeInBytes_(0),
     bitmap_(nullptr),
-    bits_(nullptr)
+    bits_(nullptr),
+    section_(nullptr)
 {}
 
 DIB::DIB(DIB &&other)
   : info_(std::move(other.info_)),
     lineSizeInBytes_(other.lineSizeInBytes_),
     bitmap_(other.bitmap_),
-    bits_(other.bits_) {
+    bits_(other.bits_),
+    section_(other.section_) {
   other.bitmap_ = nullptr;
   other.lineSizeInBytes_ = 0;
   other.bits_ = nullptr;
+  other.section_ = nullptr;
 }
 
 DIB::~DIB() {
@@ -212,6 +699,10 @@ LPBYTE DIB::GetBits() {
   return reinterpret_cast<LPBYTE>(bits_);
 }
 
+bool DIB::IsMapped() const {
+  return section_ != nullptr;
+}
+
 DIB &DIB::operator=(DIB &&other) {
   if (this != &other) {
     Release();
@@ -219,31 +710,354 @@ DIB &DIB::operator=(DIB &&other) {
     std::swap(bitmap_, other.bitmap_);
     std::swap(lineSizeInBytes_, other.lineSizeInBytes_);
     std::swap(bits_, other.bits_);
+    std::swap(section_, other.section_);
   }
   return *this;
 }
 
+// Like CreateOnFile, the pixels are put at a DWORD boundary so that
+// LoadFromFile can map the file we write.
+static bool WriteFileHeader(std::ostream &os,
+                            const Blob &info,
+                            SIZE_T numPixels) {
+  if (numPixels > (1ull << 32)) {
+    os.setstate(std::ios::failbit);
+    return false;
+  }
+
+  static const char kPadding[sizeof(DWORD)] = {0};
+  const SIZE_T headerSize = sizeof(BITMAPFILEHEADER) + info.Size();
+  const SIZE_T offset = (headerSize + 3) & ~SIZE_T(3);
+  BITMAPFILEHEADER fh = {0};
+  fh.bfType = 0x4D42;
+  fh.bfSize = static_cast<DWORD>(offset + numPixels);
+  fh.bfOffBits = static_cast<DWORD>(offset);
+  os.write(reinterpret_cast<LPCSTR>(&fh), sizeof(fh));
+  os.write(info.As<char>(), info.Size());
+  os.write(kPadding, offset - headerSize);
+  return !!os;
+}
+
 std::ostream &DIB::Save(std::ostream &os) const {
   if (bitmap_) {
     const auto &ih = GetBitmapInfo()->bmiHeader;
     const SIZE_T numPixels = lineSizeInBytes_ * std::abs(ih.biHeight);
+    if (WriteFileHeader(os, info_, numPixels)) {
+      os.write(reinterpret_cast<LPCSTR>(bits_), numPixels);
+    }
+  }
+  return os;
+}
+
+// Converts and writes kStripRows rows at a time so that the converted image
+// never exists in memory as a whole.  Rows are written in memory order, and
+// the header keeps the sign of biHeight, so the file has the same orientation
+// as this DIB.
+std::ostream &DIB::SaveAs(std::ostream &os, WORD bitCount) const {
+  static const DWORD kStripRows = 128;
+  if (!bitmap_) {
+    return os;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  if (bitCount == ih.biBitCount) {
+    return Save(os);
+  }
+
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  const DWORD dstStride = ((width * bitCount + 31) / 32) * 4;
+  Blob info = CreateConvertedInfo(ih, bitCount, BI_RGB);
+  Blob strip(dstStride * min(kStripRows, height));
+  if (!info || !strip) {
+    Log(L"Failed to allocate memory.\n");
+    os.setstate(std::ios::failbit);
+    return os;
+  }
+  const PixelConverter converter(GetBitmapInfo(), info.As<BITMAPINFO>());
+  if (!converter.IsValid()) {
+    Log(L"Conversion from %dbpp to %dbpp is not supported.\n",
+        ih.biBitCount,
+        bitCount);
+    os.setstate(std::ios::failbit);
+    return os;
+  }
+  // Row padding is never touched by the converter.  Clear it once here.
+  memset(strip, 0, strip.Size());
+
+  if (!WriteFileHeader(os, info, SIZE_T(dstStride) * height)) {
+    return os;
+  }
+
+  auto src = reinterpret_cast<LPCBYTE>(bits_);
+  LPBYTE dst = strip;
+  const auto srcStride = lineSizeInBytes_;
+  for (DWORD y = 0; y < height && os; y += kStripRows) {
+    const DWORD rows = min(kStripRows, height - y);
+    TaskScheduler::Default().ParallelFor(
+      0, rows, kStripRows / 8,
+      [=, &converter](DWORD begin, DWORD end) {
+        Blob scratch(converter.ScratchSize(width));
+        for (DWORD i = begin; i < end; ++i) {
+          converter.ConvertRow(src + srcStride * (y + i),
+                               dst + dstStride * i,
+                               width,
+                               scratch);
+        }
+      });
+    os.write(strip.As<char>(), dstStride * rows);
+  }
+  return os;
+}
+
+std::ostream &DIB::SavePng(std::ostream &os, WORD bitCount, int level) const {
+  if (!bitmap_) {
+    return os;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const bool grayscale = bitCount == 8 && ih.biBitCount == 32;
+  if (bitCount != ih.biBitCount && !grayscale) {
+    Log(L"Conversion from %dbpp to %dbpp is not supported.\n",
+        ih.biBitCount,
+        bitCount);
+    os.setstate(std::ios::failbit);
+    return os;
+  }
+
+  const DWORD height = std::abs(ih.biHeight);
+  LPCBYTE top = At(0, 0);
+  const LONG stride = ih.biHeight >= 0
+                      ? -static_cast<LONG>(lineSizeInBytes_)
+                      : static_cast<LONG>(lineSizeInBytes_);
+  PngWriter png(os, level);
+  if (png.Begin(ih.biWidth,
+                height,
+                ih.biBitCount,
+                GetBitmapInfo()->bmiColors,
+                grayscale)
+      && png.WriteRows(top, stride, height)) {
+    png.End();
+  }
+  return os;
+}
+
+// Encodes rows top to bottom into a strip buffer, and passes the buffer to
+// |sink| whenever it fills up.
+bool DIB::EncodeQoi(WORD bitCount,
+                    const std::function<bool(LPCBYTE, SIZE_T)> &sink) const {
+  static const SIZE_T kStripSize = 256 * 1024;
+  if (!bitmap_) {
+    return false;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const bool grayscale = bitCount == 8 && ih.biBitCount == 32;
+  if ((bitCount != ih.biBitCount && !grayscale)
+      || (bitCount != 8 && bitCount != 24 && bitCount != 32)
+      || (bitCount == 8 && !grayscale
+          && !IsGrayscaleRamp(GetBitmapInfo()->bmiColors, 8))) {
+    Log(L"QOI encoding of %dbpp to %dbpp is not supported.\n",
+        ih.biBitCount,
+        bitCount);
+    return false;
+  }
+
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  const SIZE_T maxRowSize = QoiEncoder::MaxRowSize(width);
+  Blob strip(kStripSize + maxRowSize + kQoiEndSize + 1);
+  Blob gray(grayscale ? width : 0);
+  if (!strip || (grayscale && !gray)) {
+    Log(L"Failed to allocate memory.\n");
+    return false;
+  }
 
-    if (numPixels > (1ull << 32)) {
-      os.setstate(std::ios::failbit);
-      return os;
+  QoiEncoder encoder;
+  QoiEncoder::WriteHeader(strip, width, height, bitCount);
+  SIZE_T used = kQoiHeaderSize;
+  for (DWORD y = 0; y < height; ++y) {
+    LPCBYTE row = At(0, y);
+    if (grayscale) {
+      GrayscaleRow(row, gray, width);
+      row = gray;
     }
+    used += encoder.EncodeRow(row, width, bitCount, strip + used);
+    if (used >= kStripSize) {
+      if (!sink(strip, used)) {
+        return false;
+      }
+      used = 0;
+    }
+  }
+  used += encoder.Finish(strip + used);
+  return sink(strip, used);
+}
 
-    BITMAPFILEHEADER fh = {0};
-    fh.bfType = 0x4D42;
-    fh.bfSize = sizeof(fh) + info_.Size() + numPixels;
-    fh.bfOffBits = sizeof(fh) + info_.Size();
-    os.write(reinterpret_cast<LPCSTR>(&fh), sizeof(fh));
-    os.write(info_.As<char>(), info_.Size());
-    os.write(reinterpret_cast<LPCSTR>(bits_), numPixels);
+std::ostream &DIB::SaveQoi(std::ostream &os, WORD bitCount) const {
+  const bool encoded = EncodeQoi(bitCount, [&os](LPCBYTE data, SIZE_T size) {
+    return !!os.write(reinterpret_cast<LPCSTR>(data), size);
+  });
+  if (!encoded) {
+    os.setstate(std::ios::failbit);
   }
   return os;
 }
 
+bool DIB::SaveQoi(Blob &blob, WORD bitCount) const {
+  SIZE_T used = 0;
+  const bool encoded = EncodeQoi(bitCount, [&](LPCBYTE data, SIZE_T size) {
+    if (used + size > blob.Size()
+        && !blob.Alloc(max(used + size, blob.Size() * 2))) {
+      return false;
+    }
+    memcpy(blob + used, data, size);
+    used += size;
+    return true;
+  });
+  return encoded && blob.Alloc(used);
+}
+
+std::ostream &DIB::SaveTiled(std::ostream &os, DWORD tileSize) const {
+  if (!bitmap_) {
+    os.setstate(std::ios::failbit);
+    return os;
+  }
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  if (ih.biBitCount == 8 && !IsGrayscaleRamp(GetBitmapInfo()->bmiColors, 8)) {
+    Log(L"Tiled captures of 8bpp need a grayscale table.\n");
+    os.setstate(std::ios::failbit);
+    return os;
+  }
+  const DWORD height = std::abs(ih.biHeight);
+  TiledWriter writer(os, tileSize);
+  if (writer.Begin(ih.biWidth, height, ih.biBitCount)
+      && writer.WriteRows(At(0, 0),
+                          ih.biHeight < 0
+                            ? static_cast<LONG>(lineSizeInBytes_)
+                            : -static_cast<LONG>(lineSizeInBytes_),
+                          height)) {
+    writer.End();
+  }
+  return os;
+}
+
+// Rows are encoded kStripRows at a time in parallel, each into its own
+// worst-case slot, and then packed.  biSizeImage comes before the pixels, so
+// the encoded image is kept in memory until the end.  RLE bitmaps are always
+// bottom-up; rows are written from the bottom whatever this DIB's orientation.
+std::ostream &DIB::SaveRle8(std::ostream &os) const {
+  static const DWORD kStripRows = 128;
+  if (!bitmap_) {
+    return os;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  if (ih.biBitCount != 8 && ih.biBitCount != 32) {
+    Log(L"RLE8 from %dbpp is not supported.\n", ih.biBitCount);
+    os.setstate(std::ios::failbit);
+    return os;
+  }
+
+  const bool convert = ih.biBitCount == 32;
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  Blob info = CreateBitmapInfo(ih.biWidth,
+                               height,
+                               /*bitCount*/8,
+                               /*initWithGrayscaleTable*/convert);
+  const SIZE_T slotSize = MaxRle8RowSize(width);
+  const SIZE_T grayStride = convert ? (width + 15) & ~15 : 0;
+  Blob strip((slotSize + grayStride) * min(kStripRows, height));
+  if (!info || !strip) {
+    Log(L"Failed to allocate memory.\n");
+    os.setstate(std::ios::failbit);
+    return os;
+  }
+  if (!convert) {
+    memcpy(info.As<BITMAPINFO>()->bmiColors,
+           GetBitmapInfo()->bmiColors,
+           sizeof(RGBQUAD) * 256);
+  }
+
+  std::vector<BYTE> data;
+  SIZE_T sizes[kStripRows];
+  for (DWORD y = 0; y < height; y += kStripRows) {
+    const DWORD rows = min(kStripRows, height - y);
+    LPBYTE slots = strip;
+    LPBYTE gray = strip + slotSize * rows;
+    TaskScheduler::Default().ParallelFor(
+      0, rows, kStripRows / 8,
+      [=, &sizes](DWORD begin, DWORD end) {
+        for (DWORD i = begin; i < end; ++i) {
+          LPCBYTE src = At(0, height - 1 - (y + i));
+          if (convert) {
+            GrayscaleRow(src, gray + grayStride * i, width);
+            src = gray + grayStride * i;
+          }
+          sizes[i] = EncodeRle8Row(src,
+                                   width,
+                                   /*last*/y + i + 1 == height,
+                                   slots + slotSize * i);
+        }
+      });
+    for (DWORD i = 0; i < rows; ++i) {
+      LPCBYTE slot = slots + slotSize * i;
+      data.insert(data.end(), slot, slot + sizes[i]);
+    }
+  }
+
+  auto &header = info.As<BITMAPINFO>()->bmiHeader;
+  header.biCompression = BI_RLE8;
+  header.biSizeImage = static_cast<DWORD>(data.size());
+  if (WriteFileHeader(os, info, data.size())) {
+    os.write(reinterpret_cast<LPCSTR>(data.data()), data.size());
+  }
+  return os;
+}
+
+namespace {
+
+class DibOwner : public BlobSlice::Owner {
+public:
+  DIB dib_;
+
+  DibOwner(DIB &&dib)
+    : dib_(std::move(dib))
+  {}
+};
+
+}  // namespace
+
+BlobSlice DIB::Share(DIB &&dib) {
+  if (!dib.bitmap_) {
+    return BlobSlice();
+  }
+  const auto &ih = dib.GetBitmapInfo()->bmiHeader;
+  const DWORD height = std::abs(ih.biHeight);
+  const SIZE_T rowBytes = (SIZE_T(ih.biWidth) * ih.biBitCount + 7) / 8;
+  const LONG_PTR stride = ih.biHeight < 0
+                          ? static_cast<LONG_PTR>(dib.lineSizeInBytes_)
+                          : -static_cast<LONG_PTR>(dib.lineSizeInBytes_);
+  LPCBYTE top = dib.At(0, 0);
+  return BlobSlice(new DibOwner(std::move(dib)), top, rowBytes, stride, height);
+}
+
+const DIB *DIB::Shared(const BlobSlice &slice) {
+  const auto owner = dynamic_cast<const DibOwner*>(slice.GetOwner());
+  if (!owner) {
+    return nullptr;
+  }
+  const DIB &dib = owner->dib_;
+  const auto &ih = dib.GetBitmapInfo()->bmiHeader;
+  if (static_cast<LPCBYTE>(slice) != dib.At(0, 0)
+      || slice.Rows() != static_cast<DWORD>(std::abs(ih.biHeight))
+      || slice.RowBytes() != (SIZE_T(ih.biWidth) * ih.biBitCount + 7) / 8) {
+    return nullptr;
+  }
+  return &dib;
+}
+
 void DIB::CopyTo(Blob &blob) const {
   if (bitmap_) {
     const auto &ih = GetBitmapInfo()->bmiHeader;
@@ -275,19 +1089,12 @@ LPCBYTE DIB::At(DWORD x, DWORD y) const {
   return const_cast<DIB*>(this)->At(x, y);
 }
 
-LONG GetMagic(HDC dc) {return 1;}
-
 // https://msdn.microsoft.com/en-us/library/windows/desktop/dd183402(v=vs.85).aspx
 DIB DIB::CaptureFromHDC(HDC sourceDC,
                         WORD bitCount,
                         DWORD &width,
                         DWORD &height,
                         HANDLE section) {
-  auto magic = GetMagic(sourceDC);
-  Log(L"Magic factor: %d\n", magic);
-  width *= magic;
-  height *= magic;
-
   DIB dib;
   if (HDC memDC = CreateCompatibleDC(sourceDC)) {
     if (HBITMAP compatibleBitmap = CreateCompatibleBitmap(sourceDC,
@@ -299,13 +1106,14 @@ DIB DIB::CaptureFromHDC(HDC sourceDC,
                  sourceDC,
                  0, 0,
                  SRCCOPY)) {
-        // There is no meaning to initialize the color table because
-        // GetDIBits overwrites it anyway.
+        // GetDIBits is slow at converting formats.  The pixels are always
+        // taken as 32bpp, which needs no conversion, and then converted
+        // by ConvertTo.
         auto newDib = CreateNew(sourceDC,
-                                bitCount,
+                                /*bitCount*/32,
                                 width,
                                 height,
-                                section,
+                                bitCount == 32 ? section : nullptr,
                                 /*initWithGrayscaleTable*/false);
         if (GetDIBits(sourceDC,
                       compatibleBitmap,
@@ -314,7 +1122,9 @@ DIB DIB::CaptureFromHDC(HDC sourceDC,
                       newDib.bits_,
                       newDib.info_.As<BITMAPINFO>(),
                       DIB_RGB_COLORS)) {
-          dib = std::move(newDib);
+          dib = bitCount == 32
+            ? std::move(newDib)
+            : newDib.ConvertTo(bitCount, sourceDC, section);
         }
         else {
           Log(L"GetDIBits failed - %08x\n", GetLastError());
@@ -330,37 +1140,706 @@ DIB DIB::CaptureFromHDC(HDC sourceDC,
   return dib;
 }
 
+// Unlike CaptureFromHDC, BitBlt writes straight into the DIB section that
+// backs |path|.  There is no intermediate bitmap and no GetDIBits copy.
+DIB DIB::CaptureToFile(HDC sourceDC,
+                       WORD bitCount,
+                       DWORD &width,
+                       DWORD &height,
+                       LPCWSTR path) {
+  DIB dib = CreateOnFile(path,
+                         sourceDC,
+                         bitCount,
+                         width,
+                         height,
+                         /*initWithGrayscaleTable*/false);
+  if (!dib) {
+    return dib;
+  }
+
+  bool captured = false;
+  if (HDC memDC = CreateCompatibleDC(sourceDC)) {
+    auto oldBitmap = SelectObject(memDC, dib.bitmap_);
+    if (BitBlt(memDC,
+               0, 0, width, height,
+               sourceDC,
+               0, 0,
+               SRCCOPY)) {
+      captured = true;
+    }
+    else {
+      Log(L"BitBlt failed - %08x\n", GetLastError());
+    }
+    SelectObject(memDC, oldBitmap);
+    DeleteDC(memDC);
+  }
+
+  if (!captured) {
+    dib = DIB();
+    DeleteFile(path);
+  }
+  return dib;
+}
+
+// Rows are converted in bands in parallel and keep their order, so the
+// result has the same orientation as this DIB.
+DIB DIB::ConvertTo(WORD bitCount,
+                   HDC dc,
+                   HANDLE section,
+                   DWORD compression) const {
+  DIB dib;
+  if (!bitmap_) {
+    return dib;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  Blob info = CreateConvertedInfo(ih, bitCount, compression);
+  if (!info) {
+    Log(L"Conversion to %dbpp (compression %d) is not supported.\n",
+        bitCount,
+        compression);
+    return dib;
+  }
+  const PixelConverter converter(GetBitmapInfo(), info.As<BITMAPINFO>());
+  if (!converter.IsValid()) {
+    Log(L"Conversion from %dbpp to %dbpp is not supported.\n",
+        ih.biBitCount,
+        bitCount);
+    return dib;
+  }
+
+  DIB newDib = CreateFromBitmapInfo(dc, info, section, /*offset*/0);
+  if (!newDib) {
+    return dib;
+  }
+
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  auto src = reinterpret_cast<LPCBYTE>(bits_);
+  auto dst = reinterpret_cast<LPBYTE>(newDib.bits_);
+  const auto srcStride = lineSizeInBytes_;
+  const auto dstStride = newDib.lineSizeInBytes_;
+  TaskScheduler::Default().ParallelFor(
+    0, height, kBandHeight,
+    [=, &converter](DWORD begin, DWORD end) {
+      Blob scratch(converter.ScratchSize(width));
+      for (DWORD y = begin; y < end; ++y) {
+        converter.ConvertRow(src + srcStride * y,
+                             dst + dstStride * y,
+                             width,
+                             scratch);
+      }
+    });
+  return newDib;
+}
+
 bool DIB::ConvertToGrayscale(HDC dc, HANDLE section) {
-  bool ret = false;
-  const float B2YF = 0.114f;
-  const float G2YF = 0.587f;
-  const float R2YF = 0.299f;
-  const auto &bi = GetBitmapInfo();
-  if (bitmap_
-      && info_
-      && bi->bmiHeader.biBitCount == 32
-      && bi->bmiHeader.biHeight > 0) {
-    const DWORD width = bi->bmiHeader.biWidth;
-    const DWORD height = bi->bmiHeader.biHeight;
-    auto grayscale = CreateNew(dc,
-                               /*bitCount*/8,
-                               width,
-                               height,
-                               section,
-                               /*initWithGrayscaleTable*/true);
-    auto bitsSrc = reinterpret_cast<CONST RGBQUAD *>(bits_);
-    for (DWORD y = 0; y < height; ++y) {
-      auto bitsDst = reinterpret_cast<LPBYTE>(grayscale.bits_)
-                     + grayscale.lineSizeInBytes_ * y;
-      for (DWORD x = 0; x < width; ++x) {
-        *(bitsDst++) = static_cast<BYTE>(R2YF * bitsSrc->rgbRed
-                                         + G2YF * bitsSrc->rgbGreen
-                                         + B2YF * bitsSrc->rgbBlue);
-        ++bitsSrc;
+  DIB grayscale = ConvertTo(/*bitCount*/8, dc, section);
+  if (!grayscale) {
+    return false;
+  }
+  std::swap(*this, grayscale);
+  return true;
+}
+
+// Bands are whole rows of diff cells, so that no cell is updated by two
+// threads.  Once the budget is exceeded, remaining bands return right away.
+bool DIB::Diff(const DIB &other,
+               const DiffOptions &options,
+               DiffResult &result,
+               HDC dc) const {
+  result = DiffResult();
+  if (!bitmap_ || !other.bitmap_) {
+    return false;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const auto &otherHeader = other.GetBitmapInfo()->bmiHeader;
+  if (ih.biWidth != otherHeader.biWidth
+      || std::abs(ih.biHeight) != std::abs(otherHeader.biHeight)
+      || ih.biBitCount != otherHeader.biBitCount
+      || (ih.biBitCount != 8 && ih.biBitCount != 24 && ih.biBitCount != 32)) {
+    Log(L"Cannot compare %dx%d %dbpp with %dx%d %dbpp.\n",
+        ih.biWidth, std::abs(ih.biHeight), ih.biBitCount,
+        otherHeader.biWidth, std::abs(otherHeader.biHeight),
+        otherHeader.biBitCount);
+    return false;
+  }
+
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  if (options.makeImage) {
+    result.image = CreateNew(dc,
+                             /*bitCount*/8,
+                             width,
+                             -static_cast<LONG>(height),
+                             /*section*/nullptr,
+                             /*initWithGrayscaleTable*/true);
+    if (!result.image) {
+      return false;
+    }
+  }
+
+  ImageDiff diff(ih.biBitCount, width, height, options);
+  std::atomic<ULONGLONG> changed(0);
+  const DWORD cellRows = (height + kDiffCellSize - 1) / kDiffCellSize;
+  TaskScheduler::Default().ParallelFor(
+    0, cellRows, 1,
+    [&](DWORD begin, DWORD end) {
+      for (DWORD y = begin * kDiffCellSize;
+           y < min(end * kDiffCellSize, height);
+           ++y) {
+        if (changed > options.maxChangedPixels) {
+          return;
+        }
+        changed += diff.CompareRow(At(0, y),
+                                   other.At(0, y),
+                                   y,
+                                   result.image ? result.image.At(0, y)
+                                                : nullptr);
+      }
+    });
+
+  result.changedPixels = changed;
+  result.exceeded = changed > options.maxChangedPixels;
+  result.regions = diff.Regions();
+  return true;
+}
+
+bool DIB::DumpDiff(const DIB &reference,
+                   std::wostream &os,
+                   SIZE_T width,
+                   bool ascii) const {
+  if (!bitmap_ || !reference.bitmap_) {
+    Log(L"Nothing to compare.\n");
+    return false;
+  }
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const auto &ref = reference.GetBitmapInfo()->bmiHeader;
+  if (ih.biWidth != ref.biWidth
+      || std::abs(ih.biHeight) != std::abs(ref.biHeight)
+      || ih.biBitCount != ref.biBitCount) {
+    Log(L"%dx%d %dbpp cannot be compared with %dx%d %dbpp.\n",
+        ih.biWidth, ih.biHeight, ih.biBitCount,
+        ref.biWidth, ref.biHeight, ref.biBitCount);
+    return false;
+  }
+
+  const DWORD height = std::abs(ih.biHeight);
+  const SIZE_T rowBytes = (SIZE_T(ih.biWidth) * ih.biBitCount + 7) / 8;
+  width = max(width, SIZE_T(1));
+  HexDump dump(os, width, ascii);
+  DWORD changed = 0;
+  for (DWORD y = 0; y < height; ++y) {
+    LPCBYTE before = reference.At(0, y);
+    LPCBYTE after = At(0, y);
+    if (memcmp(before, after, rowBytes) == 0) {
+      continue;
+    }
+    ++changed;
+    dump.WriteText((L"Row " + std::to_wstring(y) + L"\r\n").c_str());
+    for (SIZE_T begin = 0; begin < rowBytes; begin += width) {
+      const SIZE_T count = min(width, rowBytes - begin);
+      if (memcmp(before + begin, after + begin, count) != 0) {
+        dump.WriteText(L"-");
+        dump.Write(before + begin, count, begin);
+        dump.WriteText(L"+");
+        dump.Write(after + begin, count, begin);
+      }
+    }
+  }
+  dump.WriteText((std::to_wstring(changed) + L" of "
+                  + std::to_wstring(height) + L" rows differ.\r\n").c_str());
+  dump.Flush();
+  return !!os;
+}
+
+bool DIB::Ssim(const DIB &other, SsimResult &result, DWORD tileSize) const {
+  result = SsimResult();
+  if (!bitmap_ || !other.bitmap_ || tileSize == 0) {
+    return false;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const auto &otherHeader = other.GetBitmapInfo()->bmiHeader;
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  if (ih.biWidth != otherHeader.biWidth
+      || std::abs(ih.biHeight) != std::abs(otherHeader.biHeight)
+      || ih.biBitCount != 8
+      || otherHeader.biBitCount != 8
+      || width < kSsimWindow
+      || height < kSsimWindow) {
+    Log(L"Cannot compute SSIM of %dx%d %dbpp with %dx%d %dbpp.\n",
+        ih.biWidth, std::abs(ih.biHeight), ih.biBitCount,
+        otherHeader.biWidth, std::abs(otherHeader.biHeight),
+        otherHeader.biBitCount);
+    return false;
+  }
+
+  SsimScorer scorer(width, height, tileSize);
+  const auto a = View<BYTE>();
+  const auto b = other.View<BYTE>();
+  TaskScheduler::Default().ParallelFor(
+    0, scorer.TileRows(), 1,
+    [&](DWORD begin, DWORD end) {
+      for (DWORD tileRow = begin; tileRow < end; ++tileRow) {
+        scorer.ScoreTileRow(tileRow, a, b);
+      }
+    });
+  scorer.GetResult(result);
+  return true;
+}
+
+// Bands are reduced to luma with the same converter as ConvertTo(8) and
+// summed into their own grids, so the hash of a capture and of its
+// grayscale copy are the same.
+bool DIB::Hash(ImageHash &hash) const {
+  hash = ImageHash();
+  if (!bitmap_) {
+    return false;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  Blob info = CreateConvertedInfo(ih, /*bitCount*/8, BI_RGB);
+  if (!info || width < 32 || height < 32) {
+    Log(L"Cannot hash %dx%d %dbpp.\n",
+        ih.biWidth, std::abs(ih.biHeight), ih.biBitCount);
+    return false;
+  }
+  const PixelConverter converter(GetBitmapInfo(), info.As<BITMAPINFO>());
+  if (!converter.IsValid()) {
+    Log(L"Conversion from %dbpp to 8bpp is not supported.\n",
+        ih.biBitCount);
+    return false;
+  }
+
+  const ImageHasher hasher(width, height);
+  std::vector<ULONGLONG> sums(ImageHasher::kGridCells);
+  std::mutex lock;
+  TaskScheduler::Default().ParallelFor(
+    0, height, kBandHeight,
+    [&](DWORD begin, DWORD end) {
+      Blob scratch(converter.ScratchSize(width));
+      std::vector<BYTE> gray(width);
+      std::vector<ULONGLONG> bandSums(ImageHasher::kGridCells);
+      for (DWORD y = begin; y < end; ++y) {
+        converter.ConvertRow(At(0, y), gray.data(), width, scratch);
+        hasher.AddRow(gray.data(), y, bandSums.data());
+      }
+      std::lock_guard<std::mutex> guard(lock);
+      for (DWORD i = 0; i < ImageHasher::kGridCells; ++i) {
+        sums[i] += bandSums[i];
+      }
+    });
+  hash = hasher.Finish(sums.data());
+  return true;
+}
+
+// The background is the most common of a grid of samples.  Bands count
+// the pixels off it in parallel and stop once the total is past near-blank,
+// which a frame with content is after a few rows.
+bool DIB::Classify(const BlankOptions &options, BlankResult &result) const {
+  result = BlankResult();
+  if (!bitmap_) {
+    return false;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  if ((ih.biBitCount != 8 && ih.biBitCount != 24 && ih.biBitCount != 32)
+      || width == 0 || height == 0) {
+    Log(L"Cannot classify %dx%d %dbpp.\n",
+        ih.biWidth, std::abs(ih.biHeight), ih.biBitCount);
+    return false;
+  }
+
+  const WORD bytesPerPixel = ih.biBitCount / 8;
+  std::vector<DWORD> samples;
+  for (DWORD i = 0; i < kBlankSamples; ++i) {
+    const DWORD y = static_cast<DWORD>((i * 2 + 1) * ULONGLONG(height)
+                                       / (kBlankSamples * 2));
+    for (DWORD j = 0; j < kBlankSamples; ++j) {
+      const DWORD x = static_cast<DWORD>((j * 2 + 1) * ULONGLONG(width)
+                                         / (kBlankSamples * 2));
+      DWORD sample = 0;
+      memcpy(&sample, At(x, y), bytesPerPixel);
+      samples.push_back(sample);
+    }
+  }
+  result.background = MostCommon(std::move(samples));
+
+  const ULONGLONG limit =
+    ULONGLONG(width) * height * options.nearBlankPpm / 1000000;
+  const BackgroundCounter counter(ih.biBitCount,
+                                  result.background,
+                                  options.tolerance);
+  std::atomic<ULONGLONG> differing(0);
+  TaskScheduler::Default().ParallelFor(
+    0, height, kBandHeight,
+    [&](DWORD begin, DWORD end) {
+      for (DWORD y = begin; y < end; ++y) {
+        if (differing > limit) {
+          return;
+        }
+        differing += counter.CountRow(At(0, y), width);
+      }
+    });
+
+  result.differing = differing;
+  result.content = result.differing == 0 ? FrameContent::Blank
+                   : result.differing <= limit ? FrameContent::NearBlank
+                   : FrameContent::Content;
+  return true;
+}
+
+DIB DIB::Resample(DWORD width,
+                  DWORD height,
+                  ResampleFilter filter,
+                  HDC dc) const {
+  const SIZE size = {static_cast<LONG>(width), static_cast<LONG>(height)};
+  std::vector<DIB> outputs;
+  return Resample(&size, 1, filter, dc, outputs)
+    ? std::move(outputs[0])
+    : DIB();
+}
+
+// The horizontal pass reads each source row once and filters it across for
+// every output, into an intermediate of the output's width and the source's
+// height.  The vertical pass then fills each output from its intermediate.
+bool DIB::Resample(const SIZE *sizes,
+                   DWORD count,
+                   ResampleFilter filter,
+                   HDC dc,
+                   std::vector<DIB> &outputs) const {
+  outputs.clear();
+  if (!bitmap_) {
+    return false;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  const DWORD channels = ih.biBitCount / 8;
+  if (ih.biBitCount != 8 && ih.biBitCount != 32) {
+    Log(L"Cannot resample %dbpp.\n", ih.biBitCount);
+    return false;
+  }
+  // Filtering 8bpp mixes the values of neighbours, which means something
+  // only if they are levels of gray rather than indices into a palette.
+  if (ih.biBitCount == 8 && !IsGrayscaleRamp(GetBitmapInfo()->bmiColors, 8)) {
+    Log(L"Resampling 8bpp needs a grayscale table.\n");
+    return false;
+  }
+
+  std::vector<ResampleKernel> across, down;
+  std::vector<std::vector<BYTE>> intermediates;
+  for (DWORD i = 0; i < count; ++i) {
+    if (sizes[i].cx <= 0 || sizes[i].cy <= 0) {
+      Log(L"Cannot resample to %dx%d.\n", sizes[i].cx, sizes[i].cy);
+      outputs.clear();
+      return false;
+    }
+    // The header is copied, which keeps the color table of 8bpp.
+    Blob info;
+    if (!info.Alloc(info_.Size())) {
+      outputs.clear();
+      return false;
+    }
+    memcpy(LPBYTE(info), LPCBYTE(info_), info_.Size());
+    auto &newHeader = info.As<BITMAPINFO>()->bmiHeader;
+    newHeader.biWidth = sizes[i].cx;
+    newHeader.biHeight = ih.biHeight < 0 ? -sizes[i].cy : sizes[i].cy;
+    newHeader.biSizeImage = 0;
+    DIB dib = CreateFromBitmapInfo(dc, info, /*section*/nullptr, /*offset*/0);
+    if (!dib) {
+      outputs.clear();
+      return false;
+    }
+    outputs.push_back(std::move(dib));
+    across.emplace_back(filter, width, sizes[i].cx);
+    down.emplace_back(filter, height, sizes[i].cy);
+    intermediates.emplace_back(SIZE_T(sizes[i].cx) * channels * height);
+  }
+
+  TaskScheduler::Default().ParallelFor(
+    0, height, kBandHeight,
+    [&](DWORD begin, DWORD end) {
+      for (DWORD y = begin; y < end; ++y) {
+        LPCBYTE row = At(0, y);
+        for (DWORD i = 0; i < count; ++i) {
+          const SIZE_T rowBytes = SIZE_T(sizes[i].cx) * channels;
+          ResampleRow(row,
+                      intermediates[i].data() + rowBytes * y,
+                      across[i],
+                      channels);
+        }
+      }
+    });
+
+  for (DWORD i = 0; i < count; ++i) {
+    const SIZE_T rowBytes = SIZE_T(sizes[i].cx) * channels;
+    const ResampleKernel &kernel = down[i];
+    DIB &output = outputs[i];
+    LPCBYTE intermediate = intermediates[i].data();
+    TaskScheduler::Default().ParallelFor(
+      0, sizes[i].cy, kBandHeight,
+      [&](DWORD begin, DWORD end) {
+        for (DWORD y = begin; y < end; ++y) {
+          ResampleColumns(intermediate + rowBytes * kernel.First(y),
+                          rowBytes,
+                          output.At(0, y),
+                          rowBytes,
+                          kernel.Weights(y),
+                          kernel.Taps());
+        }
+      });
+  }
+  return true;
+}
+
+// Colors are counted in bands in parallel.  Pixels of other formats are
+// expanded to 32bpp a row at a time, in both the count and the mapping.
+DIB DIB::Quantize(WORD bitCount,
+                  Dither dither,
+                  HDC dc,
+                  HANDLE section,
+                  WORD fallback) const {
+  DIB dib;
+  if (!bitmap_) {
+    return dib;
+  }
+
+  const auto &ih = GetBitmapInfo()->bmiHeader;
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  for (WORD depth : {bitCount, fallback}) {
+    if (depth != 0 && depth != 1 && depth != 4 && depth != 8) {
+      Log(L"Cannot quantize to %dbpp.\n", depth);
+      return dib;
+    }
+  }
+  Blob info32 = CreateBitmapInfo(ih.biWidth,
+                                 ih.biHeight,
+                                 /*bitCount*/32,
+                                 /*initWithGrayscaleTable*/false);
+  if (!info32) {
+    return dib;
+  }
+  const bool direct = ih.biBitCount == 32 && ih.biCompression == BI_RGB;
+  const PixelConverter converter(GetBitmapInfo(), info32.As<BITMAPINFO>());
+  if (!direct && !converter.IsValid()) {
+    Log(L"Conversion from %dbpp to 32bpp is not supported.\n",
+        ih.biBitCount);
+    return dib;
+  }
+  // |row| and |scratch| are per band, and unused for 32bpp.
+  auto pixelsOf = [&](DWORD y, std::vector<DWORD> &row, Blob &scratch) {
+    if (direct) {
+      return reinterpret_cast<const DWORD*>(At(0, y));
+    }
+    row.resize(width);
+    converter.ConvertRow(At(0, y),
+                         reinterpret_cast<LPBYTE>(row.data()),
+                         width,
+                         scratch);
+    return static_cast<const DWORD*>(row.data());
+  };
+  const SIZE_T scratchSize = direct ? 0 : converter.ScratchSize(width);
+
+  // Up to 65536 colors are counted exactly, which gives a better palette
+  // than the histogram even when they do not fit into one.
+  const DWORD maxColors = bitCount == 0 ? 256 : 1u << bitCount;
+  ColorCounter counter(65536);
+  std::atomic<bool> overflow(false);
+  std::mutex lock;
+  TaskScheduler::Default().ParallelFor(
+    0, height, kBandHeight,
+    [&](DWORD begin, DWORD end) {
+      std::vector<DWORD> row;
+      Blob scratch(scratchSize);
+      ColorCounter band(65536);
+      for (DWORD y = begin; y < end && !overflow; ++y) {
+        if (!band.AddRow(pixelsOf(y, row, scratch), width)) {
+          overflow = true;
+        }
+      }
+      std::lock_guard<std::mutex> guard(lock);
+      if (!overflow && !counter.Merge(band)) {
+        overflow = true;
       }
+    });
+
+  std::vector<DWORD> colors, counts;
+  if (!overflow) {
+    counter.GetColors(colors, counts);
+  }
+  else if (bitCount != 0 || fallback != 0) {
+    ColorHistogram histogram;
+    TaskScheduler::Default().ParallelFor(
+      0, height, kBandHeight,
+      [&](DWORD begin, DWORD end) {
+        std::vector<DWORD> row;
+        Blob scratch(scratchSize);
+        ColorHistogram band;
+        for (DWORD y = begin; y < end; ++y) {
+          band.AddRow(pixelsOf(y, row, scratch), width);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        histogram.Merge(band);
+      });
+    histogram.GetColors(colors, counts);
+  }
+
+  const bool exact = !overflow && colors.size() <= maxColors;
+  if (bitCount == 0) {
+    if (exact) {
+      bitCount = colors.size() <= 2 ? 1 : colors.size() <= 16 ? 4 : 8;
+    }
+    else if (fallback != 0) {
+      bitCount = fallback;
+    }
+    else {
+      return dib;
+    }
+  }
+
+  Blob info = CreateBitmapInfo(ih.biWidth,
+                               ih.biHeight,
+                               bitCount,
+                               /*initWithGrayscaleTable*/false);
+  if (!info) {
+    return dib;
+  }
+  RGBQUAD *palette = info.As<BITMAPINFO>()->bmiColors;
+  const DWORD tableSize = 1u << bitCount;
+  memset(palette, 0, sizeof(RGBQUAD) * tableSize);
+  DWORD used = 0;
+  if (exact) {
+    for (; used < colors.size(); ++used) {
+      palette[used].rgbRed = static_cast<BYTE>(colors[used] >> 16);
+      palette[used].rgbGreen = static_cast<BYTE>(colors[used] >> 8);
+      palette[used].rgbBlue = static_cast<BYTE>(colors[used]);
+    }
+    dither = Dither::None;
+  }
+  else {
+    used = MedianCut(colors, counts, tableSize, palette);
+  }
+
+  dib = CreateFromBitmapInfo(dc, info, section, /*offset*/0);
+  if (!dib) {
+    return dib;
+  }
+
+  const PaletteMapper mapper(palette, used);
+  if (dither == Dither::FloydSteinberg) {
+    // The error of a row goes to the next, so rows are mapped in order.
+    std::vector<DWORD> row;
+    Blob scratch(scratchSize);
+    std::vector<BYTE> indices(width);
+    std::vector<int> errors;
+    for (DWORD y = 0; y < height; ++y) {
+      mapper.DiffuseRow(pixelsOf(y, row, scratch),
+                        indices.data(),
+                        width,
+                        errors);
+      PackIndices(indices.data(), dib.At(0, y), width, bitCount);
     }
-    std::swap(*this, grayscale);
-    ret = true;
+    return dib;
+  }
+
+  TaskScheduler::Default().ParallelFor(
+    0, height, kBandHeight,
+    [&](DWORD begin, DWORD end) {
+      std::vector<DWORD> row;
+      Blob scratch(scratchSize);
+      std::vector<BYTE> indices(width);
+      for (DWORD y = begin; y < end; ++y) {
+        mapper.MapRow(pixelsOf(y, row, scratch),
+                      indices.data(),
+                      width,
+                      y,
+                      dither);
+        PackIndices(indices.data(), dib.At(0, y), width, bitCount);
+      }
+    });
+  return dib;
+}
+
+bool DIB::SaveToStore(CaptureStore &store,
+                      LPCWSTR manifestPath,
+                      LPCWSTR basePath) const {
+  if (!bitmap_) {
+    return false;
+  }
+  return store.Put(manifestPath,
+                   GetBitmapInfo(),
+                   info_.Size(),
+                   reinterpret_cast<LPCBYTE>(bits_),
+                   lineSizeInBytes_,
+                   basePath);
+}
+
+DIB DIB::LoadFromStore(const CaptureStore &store,
+                       LPCWSTR manifestPath,
+                       HDC dc,
+                       HANDLE section) {
+  DIB dib;
+  CaptureStore::Manifest manifest;
+  if (!store.ReadManifest(manifestPath, manifest)) {
+    return dib;
+  }
+
+  DIB newDib = CreateFromBitmapInfo(dc, manifest.info, section, /*offset*/0);
+  if (!newDib) {
+    return dib;
   }
-  return ret;
-}
\ No newline at end of file
+  if (!store.ReadPixels(manifest,
+                        reinterpret_cast<LPBYTE>(newDib.bits_),
+                        newDib.lineSizeInBytes_)) {
+    return dib;
+  }
+  return newDib;
+}
+
+DIB DIB::LoadTiled(LPCWSTR path,
+                   HDC dc,
+                   const RECT *rect,
+                   HANDLE section) {
+  DIB dib;
+  TiledReader reader;
+  if (!reader.Open(path)) {
+    return dib;
+  }
+  const auto &header = reader.GetHeader();
+  RECT whole;
+  SetRect(&whole, 0, 0, header.width, header.height);
+  if (!rect) {
+    rect = &whole;
+  }
+  if (rect->left >= rect->right || rect->top >= rect->bottom) {
+    Log(L"Invalid rectangle.\n");
+    return dib;
+  }
+
+  Blob bitmapInfo = CreateBitmapInfo(rect->right - rect->left,
+                                     -(rect->bottom - rect->top),
+                                     header.bitCount,
+                                     /*initWithGrayscaleTable*/true);
+  if (!bitmapInfo) {
+    Log(L"Failed to allocate memory.\n");
+    return dib;
+  }
+  DIB newDib = CreateFromBitmapInfo(dc, bitmapInfo, section, /*offset*/0);
+  if (newDib
+      && reader.ReadRect(*rect,
+                         reinterpret_cast<LPBYTE>(newDib.bits_),
+                         static_cast<LONG>(newDib.lineSizeInBytes_))) {
+    dib = std::move(newDib);
+  }
+  return dib;
+}
@@ -13,28 +13,101 @@ public:
   operator HDC();
 };
 
+template<class T> class PixelView;
+struct DiffOptions;
+struct DiffResult;
+struct SsimResult;
+struct ImageHash;
+struct BlankOptions;
+struct BlankResult;
+class CaptureStore;
+enum class ResampleFilter;
+enum class Dither;
+
 class DIB {
 private:
   Blob info_;
   HBITMAP bitmap_;
   DWORD lineSizeInBytes_;
   LPVOID bits_;
+  HANDLE section_;
 
   void Release();
+  bool EncodeQoi(WORD bitCount,
+                 const std::function<bool(LPCBYTE, SIZE_T)> &sink) const;
+  static DIB LoadQoi(std::istream &is, HDC dc, HANDLE section);
+  static DIB LoadRle(std::istream &is,
+                     HDC dc,
+                     HANDLE section,
+                     Blob &bitmapInfo);
+  static DIB LoadBitfields(std::istream &is,
+                           HDC dc,
+                           HANDLE section,
+                           const BITMAPINFOHEADER &ih,
+                           const DWORD (&masks)[4]);
+  static DIB CreateFromBitmapInfo(HDC dc,
+                                  Blob &bitmapInfo,
+                                  HANDLE section,
+                                  DWORD offset);
 
 public:
-  static DIB LoadFromStream(std::istream &is, HDC dc, HANDLE section);
+  // Reads a BMP, or a QOI image written by SaveQoi.  RLE bitmaps are
+  // decoded to 8bpp or 4bpp; 16bpp and BI_BITFIELDS ones to 32bpp.
+  static DIB LoadFromStream(std::istream &is, HDC dc, HANDLE section = nullptr);
+  // Loads rows [firstRow, firstRow + numRows) counted from the top.  The DIB
+  // is backed by the file itself when the pixel data is DWORD-aligned and
+  // the file can be opened for writing, which GDI needs to map it; see
+  // IsMapped.  The pixels of such a DIB are the file's, so treat it as
+  // read-only, or ConvertTo a copy to draw on.
+  static DIB LoadFromFile(LPCWSTR path,
+                          HDC dc,
+                          DWORD firstRow = 0,
+                          DWORD numRows = MAXDWORD);
   static DIB CreateNew(HDC dc,
                        WORD bitCount,
                        LONG width,
                        LONG height,
-                       HANDLE section,
-                       bool initWithGrayscaleTable);
+                       HANDLE section = nullptr,
+                       bool initWithGrayscaleTable = false);
+  // Creates |path| pre-sized with the headers written, and returns a DIB
+  // whose pixels are the file's pixel data.  Drawing into the DIB writes the
+  // file; there is nothing to Save.
+  static DIB CreateOnFile(LPCWSTR path,
+                          HDC dc,
+                          WORD bitCount,
+                          LONG width,
+                          LONG height,
+                          bool initWithGrayscaleTable);
   static DIB CaptureFromHDC(HDC sourceDC,
                             WORD bitCount,
                             DWORD &width,
                             DWORD &height,
                             HANDLE section);
+  static DIB CaptureToFile(HDC sourceDC,
+                           WORD bitCount,
+                           DWORD &width,
+                           DWORD &height,
+                           LPCWSTR path);
+  // Reads a capture written by SaveToStore.
+  static DIB LoadFromStore(const CaptureStore &store,
+                           LPCWSTR manifestPath,
+                           HDC dc,
+                           HANDLE section = nullptr);
+  // Reads |rect| of a tiled capture written by SaveTiled, or all of it
+  // without |rect|; see tiled.h.  Only the tiles |rect| crosses are read.
+  // The DIB is top-down.
+  static DIB LoadTiled(LPCWSTR path,
+                       HDC dc,
+                       const RECT *rect = nullptr,
+                       HANDLE section = nullptr);
+
+  // Hands |dib| over to a slice of its pixels, rows from the top, that any
+  // number of stages can read at once.  The DIB is released with the last
+  // slice referring to it.
+  static BlobSlice Share(DIB &&dib);
+  // The DIB behind a slice from Share, or nullptr for any other slice,
+  // including rows or columns of one.
+  static const DIB *Shared(const BlobSlice &slice);
 
   DIB();
   DIB(DIB &&other);
@@ -45,9 +118,97 @@ public:
   const BITMAPINFO *GetBitmapInfo() const;
   RGBQUAD *GetColorTable();
   LPBYTE GetBits();
+  // Whether the pixels are a view of a file, from CreateOnFile or
+  // LoadFromFile.
+  bool IsMapped() const;
   std::ostream &Save(std::ostream &os) const;
+  std::ostream &SaveAs(std::ostream &os, WORD bitCount) const;
+  // |bitCount| is either this DIB's bit depth, or 8 from 32bpp to save as
+  // grayscale.  |level| is the deflate level from 0 (store) to 9.
+  std::ostream &SavePng(std::ostream &os, WORD bitCount, int level) const;
+  // Lossless and much faster than PNG, for intermediate frames.  |bitCount|
+  // is this DIB's bit depth (8bpp needs a grayscale table), or 8 from 32bpp.
+  std::ostream &SaveQoi(std::ostream &os, WORD bitCount) const;
+  bool SaveQoi(Blob &blob, WORD bitCount) const;
+  // Writes a tiled capture of |tileSize| pixel tiles; see tiled.h.  There is
+  // no limit on the size, and any part can be read without the rest.  8bpp
+  // needs a grayscale table; 24bpp and 32bpp are saved as they are.
+  std::ostream &SaveTiled(std::ostream &os, DWORD tileSize) const;
+  // BI_RLE8 from 8bpp, or from 32bpp converted to grayscale.  Flat captures
+  // shrink to a fraction of the size and any BMP reader opens them.
+  std::ostream &SaveRle8(std::ostream &os) const;
+  // Writes the pixels to |store| and a manifest referring to them to
+  // |manifestPath|; see store.h.  Pixels already in the store are not
+  // written again.  With |basePath|, a capture of the same size saved to
+  // |store| before, only the tiles that changed since are listed.
+  bool SaveToStore(CaptureStore &store,
+                   LPCWSTR manifestPath,
+                   LPCWSTR basePath = nullptr) const;
   void CopyTo(Blob &blob) const;
+  // Returns a copy in another format: 1, 4, 8, 16, 24 or 32bpp.  Formats of
+  // 8bpp or less get a grayscale table.  |compression| is BI_RGB, or
+  // BI_BITFIELDS for R5G6B5 instead of X1R5G5B5.
+  DIB ConvertTo(WORD bitCount,
+                HDC dc,
+                HANDLE section = nullptr,
+                DWORD compression = BI_RGB) const;
   bool ConvertToGrayscale(HDC dc, HANDLE section);
+  // Compares with |other| of the same size and bit depth (8, 24 or 32); see
+  // diff.h.  Returns false if the two cannot be compared.  |dc| is needed
+  // only for DiffOptions::makeImage.
+  bool Diff(const DIB &other,
+            const DiffOptions &options,
+            DiffResult &result,
+            HDC dc = nullptr) const;
+  // Writes the bytes of the rows that differ from |reference| of the same
+  // size and bit depth as hex, |width| bytes a line; see HexDump.  Of each
+  // such row, only the lines with a difference are written, the one of
+  // |reference| prefixed with '-' above the one of this DIB with '+', so a
+  // changed region shows as just its columns.
+  bool DumpDiff(const DIB &reference,
+                std::wostream &os,
+                SIZE_T width = 16,
+                bool ascii = false) const;
+  // Structural similarity with |other| of the same size, both 8bpp; see
+  // ssim.h.  Convert color captures with ConvertTo(8) first.  Returns false
+  // if the two cannot be compared.
+  bool Ssim(const DIB &other, SsimResult &result, DWORD tileSize = 64) const;
+  // Perceptual hashes of the luma; see phash.h.  Any bit depth of at least
+  // 32x32 pixels.
+  bool Hash(ImageHash &hash) const;
+  // Whether this is a blank frame, all or nearly all one color; see
+  // blank.h.  8, 24 or 32bpp.
+  bool Classify(const BlankOptions &options, BlankResult &result) const;
+  // Resizes an 8bpp or 32bpp DIB with |filter|; see resample.h.  The copy
+  // has the same format and orientation.  8bpp needs a grayscale table;
+  // ConvertTo(32) a palette image first.
+  DIB Resample(DWORD width,
+               DWORD height,
+               ResampleFilter filter,
+               HDC dc) const;
+  // Resizes to each of |count| |sizes| at once, reading the pixels only
+  // once, e.g. for a set of thumbnails.
+  bool Resample(const SIZE *sizes,
+                DWORD count,
+                ResampleFilter filter,
+                HDC dc,
+                std::vector<DIB> &outputs) const;
+  // Returns an indexed copy of 1, 4 or 8bpp; see quantize.h.  A capture of
+  // few enough colors keeps them exactly; others get a median-cut palette
+  // and |dither|.  With |bitCount| 0, the smallest depth that holds every
+  // color is picked.  Beyond 256 colors, |fallback| bits are used then, or
+  // nothing is returned if it is 0; the colors are counted only once either
+  // way.
+  DIB Quantize(WORD bitCount,
+               Dither dither,
+               HDC dc,
+               HANDLE section = nullptr,
+               WORD fallback = 0) const;
+  // Typed views of the pixels, defined in pixelview.h.  Use them in loops;
+  // At checks bounds and reads the header on every call, and cannot point
+  // at a pixel of less than a byte.
+  template<class T> PixelView<T> View();
+  template<class T> PixelView<const T> View() const;
   LPBYTE At(DWORD x, DWORD y);
   LPCBYTE At(DWORD x, DWORD y) const;
 };
@@ -0,0 +1,98 @@
+#include <windows.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include <vector>
+#include "blank.h"
+
+static const DWORD kChunkPixels = 16;
+
+BlankOptions::BlankOptions()
+  : nearBlankPpm(1000) {
+  tolerance[0] = tolerance[1] = tolerance[2] = 4;
+  tolerance[3] = 0xff;
+}
+
+BlankResult::BlankResult()
+  : content(FrameContent::Content),
+    background(0),
+    differing(0)
+{}
+
+DWORD MostCommon(std::vector<DWORD> samples) {
+  std::sort(samples.begin(), samples.end());
+  DWORD best = 0, bestCount = 0;
+  for (SIZE_T i = 0; i < samples.size();) {
+    SIZE_T end = i + 1;
+    while (end < samples.size() && samples[end] == samples[i]) {
+      ++end;
+    }
+    if (end - i > bestCount) {
+      best = samples[i];
+      bestCount = static_cast<DWORD>(end - i);
+    }
+    i = end;
+  }
+  return best;
+}
+
+BackgroundCounter::BackgroundCounter(WORD bitCount,
+                                     DWORD background,
+                                     const BYTE *tolerance)
+  : bytesPerPixel_(bitCount / 8) {
+  for (int c = 0; c < 4; ++c) {
+    background_[c] = static_cast<BYTE>(background >> (c * 8));
+    tolerance_[c] = tolerance[c];
+  }
+  // Chunks start on a pixel, so the pattern of each vector is fixed.
+  for (int i = 0; i < 64; ++i) {
+    const int c = bytesPerPixel_ == 1 ? 0 : i % bytesPerPixel_;
+    backgroundChunk_[i] = background_[c];
+    toleranceChunk_[i] = tolerance_[c];
+  }
+}
+
+DWORD BackgroundCounter::CountRow(LPCBYTE row, DWORD width) const {
+  __m128i background[4], tolerance[4];
+  for (WORD v = 0; v < bytesPerPixel_; ++v) {
+    background[v] = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(backgroundChunk_) + v);
+    tolerance[v] = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(toleranceChunk_) + v);
+  }
+  const __m128i zero = _mm_setzero_si128();
+
+  DWORD differing = 0;
+  DWORD x = 0;
+  while (x < width) {
+    if (x + kChunkPixels <= width) {
+      LPCBYTE chunk = row + SIZE_T(x) * bytesPerPixel_;
+      __m128i excess = zero;
+      for (WORD v = 0; v < bytesPerPixel_; ++v) {
+        const __m128i p =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk) + v);
+        const __m128i d = _mm_or_si128(_mm_subs_epu8(p, background[v]),
+                                       _mm_subs_epu8(background[v], p));
+        excess = _mm_or_si128(excess, _mm_subs_epu8(d, tolerance[v]));
+      }
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(excess, zero)) == 0xffff) {
+        x += kChunkPixels;
+        continue;
+      }
+    }
+
+    const DWORD stop = min(width, x + kChunkPixels);
+    for (; x < stop; ++x) {
+      LPCBYTE p = row + SIZE_T(x) * bytesPerPixel_;
+      for (WORD c = 0; c < bytesPerPixel_; ++c) {
+        const BYTE d = static_cast<BYTE>(p[c] > background_[c]
+                                         ? p[c] - background_[c]
+                                         : background_[c] - p[c]);
+        if (d > tolerance_[c]) {
+          ++differing;
+          break;
+        }
+      }
+    }
+  }
+  return differing;
+}
@@ -0,0 +1,58 @@
+// Tells a capture of a page that has not painted yet, all or nearly all one
+// color, from a capture with content, so that it can be taken again rather
+// than saved.
+
+enum class FrameContent {
+  // Every pixel is the background.
+  Blank,
+  // A few pixels are not, e.g. a spinner or a caret on an empty page.
+  NearBlank,
+  Content,
+};
+
+struct BlankOptions {
+  // Largest difference per channel from the background that still counts as
+  // background: blue, green, red, alpha.  8bpp compares pixel values against
+  // the first.  Alpha is ignored by default because GDI leaves it undefined.
+  BYTE tolerance[4];
+  // A frame with at most this many pixels per million off the background is
+  // near-blank.  Counting stops past it.
+  DWORD nearBlankPpm;
+
+  BlankOptions();
+};
+
+struct BlankResult {
+  FrameContent content;
+  // The most common pixel of a grid of samples, its bytes from the lowest.
+  DWORD background;
+  // Pixels off the background.  A lower bound for Content.
+  ULONGLONG differing;
+
+  BlankResult();
+};
+
+// The grid of samples is kBlankSamples on a side.
+const DWORD kBlankSamples = 16;
+
+// The most common of |samples|.
+DWORD MostCommon(std::vector<DWORD> samples);
+
+// Counts the pixels of rows off a background color.  Chunks of 16 pixels
+// are compared to the background with SSE2 and skipped when they all match,
+// so a blank row costs a few instructions per chunk.
+class BackgroundCounter {
+private:
+  WORD bytesPerPixel_;
+  BYTE background_[4];
+  BYTE tolerance_[4];
+  // The background and tolerance repeated across a chunk.
+  BYTE backgroundChunk_[64];
+  BYTE toleranceChunk_[64];
+
+public:
+  // |bitCount| is 8, 24 or 32.
+  BackgroundCounter(WORD bitCount, DWORD background, const BYTE *tolerance);
+
+  DWORD CountRow(LPCBYTE row, DWORD width) const;
+};
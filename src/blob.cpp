@@ -2,42 +2,378 @@
 #include <strsafe.h>
 #include <stdio.h>
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include "blob.h"
+#include "logger.h"
 
-void Log(LPCWSTR Format, ...);
+static const SIZE_T kDefaultPoolCache = 64 * 1024 * 1024;
+static const DWORD kSmallestClassShift = 6;
+
+BlobPool::Stats::Stats()
+  : acquired(0),
+    reused(0),
+    released(0),
+    dropped(0),
+    extended(0),
+    bytesInUse(0),
+    peakBytesInUse(0),
+    bytesCached(0)
+{}
+
+BlobPool &BlobPool::Default() {
+  static BlobPool pool(kDefaultPoolCache);
+  return pool;
+}
+
+DWORD BlobPool::ClassOf(SIZE_T size) {
+  if (size <= (SIZE_T(1) << kSmallestClassShift)) {
+    return 0;
+  }
+  if (size > (SIZE_T(1) << (sizeof(SIZE_T) * 8 - 1))) {
+    return kClasses;
+  }
+  // 2^k < size <= 2^(k+1), split into four steps of 2^(k-2).
+  DWORD k = kSmallestClassShift;
+  while ((SIZE_T(2) << k) < size) {
+    ++k;
+  }
+  const SIZE_T step = SIZE_T(1) << (k - 2);
+  const SIZE_T sub = (size - (SIZE_T(1) << k) + step - 1) / step;
+  return (k - kSmallestClassShift) * 4 + static_cast<DWORD>(sub);
+}
+
+SIZE_T BlobPool::ClassSize(DWORD index) {
+  if (index == 0) {
+    return SIZE_T(1) << kSmallestClassShift;
+  }
+  const DWORD k = (index - 1) / 4 + kSmallestClassShift;
+  const SIZE_T sub = (index - 1) % 4 + 1;
+  return (SIZE_T(1) << k) + (sub << (k - 2));
+}
+
+static SIZE_T PageSize() {
+  static const SIZE_T size = []() {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return static_cast<SIZE_T>(si.dwPageSize);
+  }();
+  return size;
+}
+
+static SIZE_T RoundUp(SIZE_T size, SIZE_T unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+// Without SeLockMemoryPrivilege every attempt fails the same way, so large
+// pages are not tried again after the first failure.
+static std::atomic<bool> largePagesFailed(false);
+
+// A heap buffer is the first kBlobAlignment boundary past the start of its
+// block, which leaves room for the pointer to the block just before it.
+static LPVOID &HeapBlock(LPVOID buffer) {
+  return reinterpret_cast<LPVOID*>(buffer)[-1];
+}
+
+BlobPool::BlobPool(SIZE_T maxCached)
+  : heap_(GetProcessHeap()),
+    maxCached_(maxCached) {
+  InitializeSRWLock(&lock_);
+  for (DWORD b = 0; b < kBackings; ++b) {
+    for (DWORD i = 0; i < kClasses; ++i) {
+      free_[b][i] = nullptr;
+    }
+  }
+}
+
+BlobPool::~BlobPool() {
+  Trim();
+  if (stats_.bytesInUse > 0) {
+    Log(L"%u bytes of a BlobPool are still in use.\n",
+        static_cast<DWORD>(stats_.bytesInUse));
+  }
+}
+
+LPVOID BlobPool::Allocate(SIZE_T capacity, BlobBacking &backing) {
+  if (backing == BlobBacking::LargePages) {
+    const SIZE_T largePage = GetLargePageMinimum();
+    if (LPVOID buffer = VirtualAlloc(nullptr,
+                                     RoundUp(capacity, largePage),
+                                     MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                     PAGE_READWRITE)) {
+      return buffer;
+    }
+    LogWarning(L"Large pages are not available - %08x\n", GetLastError());
+    largePagesFailed = true;
+    backing = BlobBacking::Virtual;
+  }
+
+  if (backing == BlobBacking::Virtual) {
+    LPVOID buffer = VirtualAlloc(nullptr,
+                                 RoundUp(capacity, PageSize()) * 2,
+                                 MEM_RESERVE,
+                                 PAGE_NOACCESS);
+    if (buffer && !VirtualAlloc(buffer,
+                                RoundUp(capacity, PageSize()),
+                                MEM_COMMIT,
+                                PAGE_READWRITE)) {
+      VirtualFree(buffer, 0, MEM_RELEASE);
+      buffer = nullptr;
+    }
+    return buffer;
+  }
+
+  auto block = reinterpret_cast<LPBYTE>(
+    HeapAlloc(heap_, 0, capacity + kBlobAlignment));
+  if (!block) {
+    return nullptr;
+  }
+  auto buffer = reinterpret_cast<LPVOID>(
+    (reinterpret_cast<ULONG_PTR>(block) + kBlobAlignment)
+    & ~static_cast<ULONG_PTR>(kBlobAlignment - 1));
+  HeapBlock(buffer) = block;
+  return buffer;
+}
+
+void BlobPool::Free(LPVOID buffer, BlobBacking backing) {
+  if (backing == BlobBacking::Heap) {
+    HeapFree(heap_, 0, HeapBlock(buffer));
+  }
+  else {
+    VirtualFree(buffer, 0, MEM_RELEASE);
+  }
+}
+
+LPVOID BlobPool::Acquire(SIZE_T size, BlobBacking &backing, SIZE_T &capacity) {
+  const DWORD index = ClassOf(size);
+  if (index >= kClasses) {
+    return nullptr;
+  }
+  capacity = ClassSize(index);
+  if (backing == BlobBacking::LargePages
+      && (largePagesFailed
+          || GetLargePageMinimum() == 0
+          || capacity < GetLargePageMinimum())) {
+    backing = BlobBacking::Virtual;
+  }
+
+  AcquireSRWLockExclusive(&lock_);
+  LPVOID &head = free_[static_cast<int>(backing)][index];
+  LPVOID buffer = head;
+  if (buffer) {
+    head = *reinterpret_cast<LPVOID*>(buffer);
+    stats_.bytesCached -= capacity;
+    ++stats_.reused;
+  }
+  ReleaseSRWLockExclusive(&lock_);
+  LogVerbose(L"BlobPool %p: %u bytes of class %u%s\n",
+             this,
+             static_cast<DWORD>(capacity),
+             index,
+             buffer ? L" reused" : L"");
+
+  if (!buffer) {
+    buffer = Allocate(capacity, backing);
+    if (!buffer) {
+      return nullptr;
+    }
+  }
+
+  AcquireSRWLockExclusive(&lock_);
+  ++stats_.acquired;
+  stats_.bytesInUse += capacity;
+  stats_.peakBytesInUse = max(stats_.peakBytesInUse, stats_.bytesInUse);
+  ReleaseSRWLockExclusive(&lock_);
+  return buffer;
+}
+
+bool BlobPool::Extend(LPVOID buffer,
+                      BlobBacking backing,
+                      SIZE_T size,
+                      SIZE_T &capacity) {
+  const DWORD index = ClassOf(size);
+  if (index >= kClasses) {
+    return false;
+  }
+  const SIZE_T extended = ClassSize(index);
+
+  bool done = false;
+  if (backing == BlobBacking::Heap) {
+    LPVOID block = HeapBlock(buffer);
+    const SIZE_T offset =
+      reinterpret_cast<LPBYTE>(buffer) - reinterpret_cast<LPBYTE>(block);
+    done = HeapReAlloc(heap_,
+                       HEAP_REALLOC_IN_PLACE_ONLY,
+                       block,
+                       extended + offset) != nullptr;
+  }
+  else if (backing == BlobBacking::Virtual) {
+    // The rest of the reservation, or whatever else is there.
+    const SIZE_T committed = RoundUp(capacity, PageSize());
+    const SIZE_T needed = RoundUp(extended, PageSize());
+    LPBYTE end = reinterpret_cast<LPBYTE>(buffer) + committed;
+    MEMORY_BASIC_INFORMATION mbi;
+    done = needed <= committed
+           || (VirtualQuery(end, &mbi, sizeof(mbi)) == sizeof(mbi)
+               && mbi.AllocationBase == buffer
+               && mbi.State == MEM_RESERVE
+               && mbi.RegionSize >= needed - committed
+               && VirtualAlloc(end,
+                               needed - committed,
+                               MEM_COMMIT,
+                               PAGE_READWRITE));
+  }
+  if (!done) {
+    return false;
+  }
+
+  AcquireSRWLockExclusive(&lock_);
+  ++stats_.extended;
+  stats_.bytesInUse += extended - capacity;
+  stats_.peakBytesInUse = max(stats_.peakBytesInUse, stats_.bytesInUse);
+  ReleaseSRWLockExclusive(&lock_);
+  capacity = extended;
+  return true;
+}
+
+void BlobPool::Release(LPVOID buffer, BlobBacking backing, SIZE_T capacity) {
+  AcquireSRWLockExclusive(&lock_);
+  ++stats_.released;
+  stats_.bytesInUse -= capacity;
+  const bool keep = stats_.bytesCached + capacity <= maxCached_;
+  if (keep) {
+    LPVOID &head = free_[static_cast<int>(backing)][ClassOf(capacity)];
+    *reinterpret_cast<LPVOID*>(buffer) = head;
+    head = buffer;
+    stats_.bytesCached += capacity;
+  }
+  else {
+    ++stats_.dropped;
+  }
+  ReleaseSRWLockExclusive(&lock_);
+
+  if (!keep) {
+    Free(buffer, backing);
+  }
+}
+
+void BlobPool::Trim() {
+  LPVOID lists[kBackings][kClasses];
+  AcquireSRWLockExclusive(&lock_);
+  for (DWORD b = 0; b < kBackings; ++b) {
+    for (DWORD i = 0; i < kClasses; ++i) {
+      lists[b][i] = free_[b][i];
+      free_[b][i] = nullptr;
+    }
+  }
+  stats_.bytesCached = 0;
+  ReleaseSRWLockExclusive(&lock_);
+
+  for (DWORD b = 0; b < kBackings; ++b) {
+    for (LPVOID buffer : lists[b]) {
+      while (buffer) {
+        LPVOID next = *reinterpret_cast<LPVOID*>(buffer);
+        Free(buffer, static_cast<BlobBacking>(b));
+        buffer = next;
+      }
+    }
+  }
+}
+
+BlobPool::Stats BlobPool::GetStats() const {
+  AcquireSRWLockExclusive(&lock_);
+  Stats stats = stats_;
+  ReleaseSRWLockExclusive(&lock_);
+  return stats;
+}
 
 void Blob::Release() {
   if (buffer_) {
-    HeapFree(heap_, 0, buffer_);
+    pool_->Release(buffer_, source_, capacity_);
     buffer_ = nullptr;
     size_ = 0;
+    capacity_ = 0;
   }
 }
 
 Blob::Blob()
-  : heap_(GetProcessHeap()),
+  : pool_(&BlobPool::Default()),
+    backing_(BlobBacking::Heap),
+    source_(BlobBacking::Heap),
     buffer_(nullptr),
-    size_(0)
+    size_(0),
+    capacity_(0)
 {}
 
 Blob::Blob(SIZE_T size)
-  : heap_(GetProcessHeap()),
+  : pool_(&BlobPool::Default()),
+    backing_(BlobBacking::Heap),
+    source_(BlobBacking::Heap),
+    buffer_(nullptr),
+    size_(0),
+    capacity_(0)
+{
+  Alloc(size);
+}
+
+Blob::Blob(BlobPool &pool)
+  : pool_(&pool),
+    backing_(BlobBacking::Heap),
+    source_(BlobBacking::Heap),
+    buffer_(nullptr),
+    size_(0),
+    capacity_(0)
+{}
+
+Blob::Blob(SIZE_T size, BlobPool &pool)
+  : pool_(&pool),
+    backing_(BlobBacking::Heap),
+    source_(BlobBacking::Heap),
     buffer_(nullptr),
-    size_(0)
+    size_(0),
+    capacity_(0)
 {
   Alloc(size);
 }
 
+Blob::Blob(SIZE_T size,
+           SIZE_T alignment,
+           BlobBacking backing,
+           BlobPool &pool)
+  : pool_(&pool),
+    backing_(backing == BlobBacking::Heap && alignment > kBlobAlignment
+             ? BlobBacking::Virtual
+             : backing),
+    source_(backing_),
+    buffer_(nullptr),
+    size_(0),
+    capacity_(0)
+{
+  if (alignment == 0
+      || (alignment & (alignment - 1)) != 0
+      || alignment > PageSize()) {
+    Log(L"Alignment of %u bytes is not supported.\n",
+        static_cast<DWORD>(alignment));
+    return;
+  }
+  Alloc(size);
+}
+
 Blob::Blob(Blob &&other)
-  : heap_(GetProcessHeap()),
+  : pool_(&BlobPool::Default()),
+    backing_(BlobBacking::Heap),
+    source_(BlobBacking::Heap),
     buffer_(nullptr),
-    size_(0) {
+    size_(0),
+    capacity_(0) {
   std::swap(buffer_, other.buffer_);
-  std::swap(heap_, other.heap_);
+  std::swap(pool_, other.pool_);
+  std::swap(backing_, other.backing_);
+  std::swap(source_, other.source_);
   std::swap(size_, other.size_);
+  std::swap(capacity_, other.capacity_);
 }
 
 Blob::~Blob() {
@@ -55,11 +391,15 @@ Blob::operator LPCBYTE() const {
 Blob &Blob::operator=(Blob &&other) {
   if (this != &other) {
     Release();
-    heap_ = other.heap_;
+    pool_ = other.pool_;
+    backing_ = other.backing_;
+    source_ = other.source_;
     buffer_ = other.buffer_;
     size_ = other.size_;
+    capacity_ = other.capacity_;
     other.buffer_ = nullptr;
     other.size_ = 0;
+    other.capacity_ = 0;
   }
   return *this;
 }
@@ -68,54 +408,332 @@ SIZE_T Blob::Size() const {
   return size_;
 }
 
+// A buffer is moved to another class when it grows out of its own and
+// cannot be extended in place, or shrinks to less than half of it.
 bool Blob::Alloc(SIZE_T size) {
-  if (buffer_) {
-    buffer_ = HeapReAlloc(GetProcessHeap(), 0, buffer_, size);
+  if (buffer_ && size <= capacity_ && size > capacity_ / 2) {
+    size_ = size;
+    return true;
+  }
+  if (size == 0) {
     if (buffer_) {
-      size_ = size;
+      size_ = 0;
     }
-    else {
-      Log(L"HeapReAlloc failed - %08x\n", GetLastError());
+    return buffer_ != nullptr;
+  }
+  if (buffer_
+      && size > capacity_
+      && pool_->Extend(buffer_, source_, size, capacity_)) {
+    size_ = size;
+    return true;
+  }
+
+  SIZE_T capacity;
+  BlobBacking source = backing_;
+  LPVOID buffer = pool_->Acquire(size, source, capacity);
+  if (!buffer) {
+    Log(L"HeapAlloc failed - %08x\n", GetLastError());
+    return false;
+  }
+  if (buffer_) {
+    memcpy(buffer, buffer_, min(size_, size));
+    pool_->Release(buffer_, source_, capacity_);
+  }
+  source_ = source;
+  buffer_ = buffer;
+  size_ = size;
+  capacity_ = capacity;
+  return true;
+}
+
+BlobSlice::Owner::Owner()
+  : ref_(0)
+{}
+
+BlobSlice::Owner::~Owner() {}
+
+namespace {
+
+class BlobOwner : public BlobSlice::Owner {
+public:
+  Blob blob_;
+
+  BlobOwner(Blob &&blob)
+    : blob_(std::move(blob))
+  {}
+};
+
+}  // namespace
+
+void BlobSlice::Release() {
+  if (owner_ && InterlockedDecrement(&owner_->ref_) == 0) {
+    delete owner_;
+  }
+  owner_ = nullptr;
+  data_ = nullptr;
+  rowBytes_ = 0;
+  stride_ = 0;
+  rows_ = 0;
+}
+
+BlobSlice::BlobSlice()
+  : owner_(nullptr),
+    data_(nullptr),
+    rowBytes_(0),
+    stride_(0),
+    rows_(0)
+{}
+
+BlobSlice::BlobSlice(Blob &&blob)
+  : BlobSlice(std::move(blob), blob.Size(), blob.Size(), 1)
+{}
+
+BlobSlice::BlobSlice(Blob &&blob,
+                     SIZE_T rowBytes,
+                     LONG_PTR stride,
+                     DWORD rows)
+  : BlobSlice() {
+  if (LPCBYTE data = blob) {
+    *this = BlobSlice(new BlobOwner(std::move(blob)),
+                      data,
+                      rowBytes,
+                      stride,
+                      rows);
+  }
+}
+
+BlobSlice::BlobSlice(Owner *owner,
+                     LPCBYTE data,
+                     SIZE_T rowBytes,
+                     LONG_PTR stride,
+                     DWORD rows)
+  : owner_(owner),
+    data_(data),
+    rowBytes_(rowBytes),
+    stride_(stride),
+    rows_(rows) {
+  if (owner_) {
+    InterlockedIncrement(&owner_->ref_);
+  }
+}
+
+BlobSlice::BlobSlice(const BlobSlice &other)
+  : BlobSlice(other.owner_,
+              other.data_,
+              other.rowBytes_,
+              other.stride_,
+              other.rows_)
+{}
+
+BlobSlice::BlobSlice(BlobSlice &&other)
+  : BlobSlice() {
+  std::swap(owner_, other.owner_);
+  std::swap(data_, other.data_);
+  std::swap(rowBytes_, other.rowBytes_);
+  std::swap(stride_, other.stride_);
+  std::swap(rows_, other.rows_);
+}
+
+BlobSlice::~BlobSlice() {
+  Release();
+}
+
+BlobSlice &BlobSlice::operator=(const BlobSlice &other) {
+  if (this != &other) {
+    BlobSlice copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+BlobSlice &BlobSlice::operator=(BlobSlice &&other) {
+  if (this != &other) {
+    Release();
+    std::swap(owner_, other.owner_);
+    std::swap(data_, other.data_);
+    std::swap(rowBytes_, other.rowBytes_);
+    std::swap(stride_, other.stride_);
+    std::swap(rows_, other.rows_);
+  }
+  return *this;
+}
+
+BlobSlice::operator LPCBYTE() const {
+  return data_;
+}
+
+SIZE_T BlobSlice::RowBytes() const {
+  return rowBytes_;
+}
+
+LONG_PTR BlobSlice::Stride() const {
+  return stride_;
+}
+
+DWORD BlobSlice::Rows() const {
+  return rows_;
+}
+
+LPCBYTE BlobSlice::Row(DWORD y) const {
+  return y < rows_ ? data_ + stride_ * static_cast<LONG_PTR>(y) : nullptr;
+}
+
+LONG BlobSlice::RefCount() const {
+  return owner_ ? owner_->ref_ : 0;
+}
+
+const BlobSlice::Owner *BlobSlice::GetOwner() const {
+  return owner_;
+}
+
+BlobSlice BlobSlice::Rows(DWORD first, DWORD count) const {
+  if (first > rows_ || count > rows_ - first || count == 0) {
+    Log(L"Rows %u to %u are out of range.\n", first, first + count);
+    return BlobSlice();
+  }
+  return BlobSlice(owner_, Row(first), rowBytes_, stride_, count);
+}
+
+BlobSlice BlobSlice::Columns(SIZE_T offset, SIZE_T size) const {
+  if (offset > rowBytes_ || size > rowBytes_ - offset || size == 0
+      || rows_ == 0) {
+    Log(L"Bytes %u to %u are out of range.\n",
+        static_cast<DWORD>(offset),
+        static_cast<DWORD>(offset + size));
+    return BlobSlice();
+  }
+  return BlobSlice(owner_, data_ + offset, size, stride_, rows_);
+}
+
+namespace {
+
+// In characters.
+const SIZE_T kHexDumpBufferSize = 64 * 1024;
+const wchar_t kHexDigits[] = L"0123456789abcdef";
+
+struct HexTables {
+  wchar_t hex[256][2];
+  // Printable ASCII as it is, and a dot for the rest.
+  wchar_t ascii[256];
+
+  HexTables() {
+    for (int i = 0; i < 256; ++i) {
+      hex[i][0] = kHexDigits[i >> 4];
+      hex[i][1] = kHexDigits[i & 15];
+      ascii[i] = i >= 0x20 && i < 0x7f ? static_cast<wchar_t>(i) : L'.';
     }
   }
-  else if (size > 0) {
-    buffer_ = HeapAlloc(GetProcessHeap(), 0, size);
-    if (buffer_) {
-      size_ = size;
+};
+
+const HexTables &GetHexTables() {
+  static const HexTables tables;
+  return tables;
+}
+
+}  // namespace
+
+HexDump::HexDump(std::wostream &os, SIZE_T width, bool ascii)
+  : os_(os),
+    width_(max(width, SIZE_T(1))),
+    ascii_(ascii),
+    used_(0)
+{}
+
+HexDump::~HexDump() {
+  Flush();
+}
+
+wchar_t *HexDump::Reserve(SIZE_T count) {
+  if (used_ + count > buffer_.Size() / sizeof(wchar_t)) {
+    Flush();
+    const SIZE_T size = max(count, kHexDumpBufferSize) * sizeof(wchar_t);
+    if (buffer_.Size() < size && !buffer_.Alloc(size)) {
+      os_.setstate(std::ios::badbit);
+      return nullptr;
     }
-    else {
-      Log(L"HeapAlloc failed - %08x\n", GetLastError());
+  }
+  return buffer_.As<wchar_t>() + used_;
+}
+
+void HexDump::Flush() {
+  if (used_) {
+    os_.write(buffer_.As<wchar_t>(), used_);
+    used_ = 0;
+  }
+}
+
+void HexDump::WriteText(LPCWSTR text) {
+  const SIZE_T length = wcslen(text);
+  if (wchar_t *p = Reserve(length)) {
+    memcpy(p, text, length * sizeof(wchar_t));
+    used_ += length;
+  }
+}
+
+void HexDump::Write(LPCBYTE data, SIZE_T size, ULONGLONG offset) {
+  const auto &tables = GetHexTables();
+  // Up to 16 digits and a colon, three characters a byte and a space every
+  // eight bytes, the same again for ASCII, and a line break.
+  const SIZE_T lineMax = 17 + width_ * 3 + width_ / 8
+                         + (ascii_ ? 2 + width_ + width_ / 8 : 0) + 2;
+  for (SIZE_T begin = 0; begin < size; begin += width_, offset += width_) {
+    wchar_t *const start = Reserve(lineMax);
+    if (!start) {
+      return;
     }
+    wchar_t *p = start;
+    int digits = 4;
+    while (digits < 16 && (offset >> (digits * 4))) {
+      ++digits;
+    }
+    while (digits--) {
+      *p++ = kHexDigits[(offset >> (digits * 4)) & 15];
+    }
+    *p++ = L':';
+
+    const SIZE_T count = min(width_, size - begin);
+    LPCBYTE line = data + begin;
+    for (SIZE_T i = 0; i < (ascii_ ? width_ : count); ++i) {
+      if (i > 0 && i % 8 == 0) {
+        *p++ = L' ';
+      }
+      *p++ = L' ';
+      if (i < count) {
+        *p++ = tables.hex[line[i]][0];
+        *p++ = tables.hex[line[i]][1];
+      }
+      else {
+        *p++ = L' ';
+        *p++ = L' ';
+      }
+    }
+    if (ascii_) {
+      *p++ = L' ';
+      for (SIZE_T i = 0; i < count; ++i) {
+        if (i % 8 == 0) {
+          *p++ = L' ';
+        }
+        *p++ = tables.ascii[line[i]];
+      }
+    }
+    *p++ = L'\r';
+    *p++ = L'\n';
+    used_ += p - start;
   }
-  return buffer_ != nullptr;
 }
 
-void Blob::Dump(std::wostream &os, size_t width, size_t ellipsis) const {
+void Blob::Dump(std::wostream &os,
+                size_t width,
+                size_t ellipsis,
+                bool ascii) const {
   if (auto p = reinterpret_cast<LPCBYTE>(buffer_)) {
     os << L"Total: " << size_ << L" (=0x"
        << std::hex << size_ << L") bytes\r\n";
 
-    size_t bytesLeft = min(size_, ellipsis);
-    int lineCount = 0;
-    while (bytesLeft) {
-      size_t i;
-      for (i = 0; bytesLeft && i < width; ++i) {
-        if (i == 0)
-          os << std::hex << std::setfill(L'0') << std::setw(4)
-             << (lineCount * width) << L':';
-
-        if (i > 0 && i % 8 == 0)
-          os << L"  " << std::hex << std::setfill(L'0') << std::setw(2) << *(p++);
-        else
-          os << L' ' << std::hex << std::setfill(L'0') << std::setw(2) << *(p++);
-
-        --bytesLeft;
-      }
-      ++lineCount;
-      if (i == width) os << L"\r\n";
+    HexDump dump(os, width, ascii);
+    dump.Write(p, min(size_, ellipsis), 0);
+    if (size_ > ellipsis) {
+      dump.WriteText(L" ...\r\n");
     }
-
-    if (size_ > ellipsis)
-      os << L" ...\r\n";
   }
 }
@@ -1,14 +1,114 @@
-class Blob {
+// A cache line, and a whole AVX-512 vector.
+const SIZE_T kBlobAlignment = 64;
+
+enum class BlobBacking {
+  // The process heap.
+  Heap,
+  // VirtualAlloc.  Page-aligned, and twice the size is reserved so that the
+  // buffer can grow in place.
+  Virtual,
+  // Large pages for buffers of at least GetLargePageMinimum(), which needs
+  // SeLockMemoryPrivilege enabled.  Virtual for smaller ones, or when large
+  // pages cannot be had.
+  LargePages,
+};
+
+// Recycles the buffers of Blobs.  Sizes are rounded up to a size class, a
+// quarter of a power of two apart, and a released buffer stays on the free
+// list of its class for the next Blob of about the same size, so a batch of
+// captures allocates its headers and strips once rather than for every
+// frame.  Cached bytes are capped; buffers beyond the cap go back to the
+// heap.
+//
+// A pool of its own is the arena of a job: Blobs created with it return
+// their buffers to it, and all of them are freed at once when the pool is
+// destroyed.  The Blobs must be gone by then.
+//
+// Every buffer is aligned to at least kBlobAlignment, so SIMD kernels can
+// use aligned loads on them without a prologue.
+class BlobPool {
+public:
+  struct Stats {
+    // Buffers handed out, and how many of them came off a free list.
+    ULONGLONG acquired;
+    ULONGLONG reused;
+    ULONGLONG released;
+    // Released buffers freed right away because of the cap.
+    ULONGLONG dropped;
+    // Buffers grown without moving them.
+    ULONGLONG extended;
+    SIZE_T bytesInUse;
+    SIZE_T peakBytesInUse;
+    SIZE_T bytesCached;
+
+    Stats();
+  };
+
 private:
+  // Class 0 is 64 bytes, and each power of two from there up to half the
+  // address space has four classes.
+  static const DWORD kClasses = (sizeof(SIZE_T) * 8 - 7) * 4 + 1;
+  static const DWORD kBackings = 3;
+
   HANDLE heap_;
+  SIZE_T maxCached_;
+  mutable SRWLOCK lock_;
+  // A free buffer holds the pointer to the next one of its class.
+  LPVOID free_[kBackings][kClasses];
+  Stats stats_;
+
+  LPVOID Allocate(SIZE_T capacity, BlobBacking &backing);
+  void Free(LPVOID buffer, BlobBacking backing);
+
+public:
+  static BlobPool &Default();
+  // The class of a buffer of |size| bytes, or kClasses if it is too large.
+  static DWORD ClassOf(SIZE_T size);
+  static SIZE_T ClassSize(DWORD index);
+
+  // Up to |maxCached| bytes of released buffers are kept.
+  explicit BlobPool(SIZE_T maxCached);
+  ~BlobPool();
+
+  // Returns a buffer of at least |size| bytes, and its |capacity|, the size
+  // of its class.  |backing| is updated to where the buffer came from, e.g.
+  // Virtual for LargePages that could not be had.
+  LPVOID Acquire(SIZE_T size, BlobBacking &backing, SIZE_T &capacity);
+  // Grows |buffer| to the class of |size| without moving it, if the memory
+  // after it is free.  Updates |capacity| on success.
+  bool Extend(LPVOID buffer,
+              BlobBacking backing,
+              SIZE_T size,
+              SIZE_T &capacity);
+  void Release(LPVOID buffer, BlobBacking backing, SIZE_T capacity);
+  // Frees every cached buffer.
+  void Trim();
+  Stats GetStats() const;
+};
+
+class Blob {
+private:
+  BlobPool *pool_;
+  // What the Blob asked for, and where its buffer came from.
+  BlobBacking backing_;
+  BlobBacking source_;
   LPVOID buffer_;
   SIZE_T size_;
+  SIZE_T capacity_;
 
   void Release();
 
 public:
   Blob();
   Blob(SIZE_T size);
+  explicit Blob(BlobPool &pool);
+  Blob(SIZE_T size, BlobPool &pool);
+  // |alignment| is a power of two up to the page size.  Alignments beyond
+  // kBlobAlignment are served by Virtual.
+  Blob(SIZE_T size,
+       SIZE_T alignment,
+       BlobBacking backing,
+       BlobPool &pool = BlobPool::Default());
   Blob(Blob &&other);
   ~Blob();
 
@@ -22,6 +122,112 @@ public:
   }
   Blob &operator=(Blob &&other);
   SIZE_T Size() const;
+  // Resizes the buffer, keeping its contents up to the smaller size.  A
+  // buffer that still fits is kept, and one that can be extended in place
+  // is not copied.  On failure, the buffer is left as it was.
   bool Alloc(SIZE_T size);
-  void Dump(std::wostream &os, size_t width, size_t ellipsis) const;
+  // Writes the first |ellipsis| bytes as hex, |width| bytes a line, with
+  // the same bytes as ASCII after each line if |ascii|; see HexDump.
+  void Dump(std::wostream &os,
+            size_t width,
+            size_t ellipsis,
+            bool ascii = false) const;
+};
+
+// Formats bytes as lines of hex such as
+//   0040: 00 01 02 03 04 05 06 07  08 09 0a 0b 0c 0d 0e 0f  ........ ........
+// from lookup tables into a buffer of its own, which is written to the
+// stream only when it is full, so that megabytes of pixels take a fraction
+// of a second.  The offset has at least four digits.
+class HexDump {
+private:
+  std::wostream &os_;
+  SIZE_T width_;
+  bool ascii_;
+  Blob buffer_;
+  // In characters.
+  SIZE_T used_;
+
+  // Makes room for |count| more characters.
+  wchar_t *Reserve(SIZE_T count);
+
+public:
+  HexDump(std::wostream &os, SIZE_T width, bool ascii);
+  ~HexDump();
+
+  // Writes |size| bytes of |data| in lines, the first labeled |offset|.  A
+  // short last line is padded so that its ASCII lines up.
+  void Write(LPCBYTE data, SIZE_T size, ULONGLONG offset);
+  // Writes |text| as it is, e.g. a heading or the prefix of a line.
+  void WriteText(LPCWSTR text);
+  void Flush();
+};
+
+// An immutable view of rows of bytes, shared by reference count so that
+// several stages, e.g. hashing, thumbnails and encoding, can read one
+// capture at once without a copy each.  Slices of rows and columns of a
+// slice are views of the same memory, so a tile costs no more than a
+// pointer.  The memory is freed with the last slice referring to it,
+// whichever thread that is on.
+class BlobSlice {
+public:
+  // Keeps the memory of slices alive, and is deleted with the last of them.
+  class Owner {
+  private:
+    friend class BlobSlice;
+    volatile LONG ref_;
+
+  protected:
+    Owner();
+
+  public:
+    virtual ~Owner();
+  };
+
+private:
+  Owner *owner_;
+  LPCBYTE data_;
+  SIZE_T rowBytes_;
+  LONG_PTR stride_;
+  DWORD rows_;
+
+  void Release();
+
+public:
+  BlobSlice();
+  // Takes over |blob| as one row of its size.
+  explicit BlobSlice(Blob &&blob);
+  // Takes over |blob| as |rows| rows of |rowBytes| bytes, each |stride|
+  // bytes after the one before.
+  BlobSlice(Blob &&blob, SIZE_T rowBytes, LONG_PTR stride, DWORD rows);
+  // Takes over a new |owner| of the memory |data| points to.  |stride| is
+  // negative for rows stored bottom-up.
+  BlobSlice(Owner *owner,
+            LPCBYTE data,
+            SIZE_T rowBytes,
+            LONG_PTR stride,
+            DWORD rows);
+  BlobSlice(const BlobSlice &other);
+  BlobSlice(BlobSlice &&other);
+  ~BlobSlice();
+
+  BlobSlice &operator=(const BlobSlice &other);
+  BlobSlice &operator=(BlobSlice &&other);
+  // The first row, or nullptr for an empty slice.
+  operator LPCBYTE() const;
+  SIZE_T RowBytes() const;
+  LONG_PTR Stride() const;
+  DWORD Rows() const;
+  LPCBYTE Row(DWORD y) const;
+  // The number of slices sharing the memory.
+  LONG RefCount() const;
+  // What keeps the memory alive, or nullptr for a view of memory owned
+  // elsewhere.
+  const Owner *GetOwner() const;
+
+  // Rows [first, first + count).  Empty if out of range.
+  BlobSlice Rows(DWORD first, DWORD count) const;
+  // Bytes [offset, offset + size) of every row, e.g. the pixels of a tile
+  // with Rows.  Empty if out of range.
+  BlobSlice Columns(SIZE_T offset, SIZE_T size) const;
 };
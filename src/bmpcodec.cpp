@@ -0,0 +1,291 @@
+#include <windows.h>
+#include <intrin.h>
+#include <emmintrin.h>
+#include <vector>
+#include "bmpcodec.h"
+
+static inline void PutNibble(LPBYTE row, DWORD x, BYTE value) {
+  BYTE &b = row[x >> 1];
+  b = (x & 1) ? static_cast<BYTE>((b & 0xf0) | value)
+              : static_cast<BYTE>((b & 0x0f) | (value << 4));
+}
+
+// Writes |count| pixels from |x|, which the caller has checked fit in the
+// row.  |fill| gives the n-th pixel's value.
+template<class F>
+static inline void PutPixels(LPBYTE row,
+                             WORD bitCount,
+                             DWORD x,
+                             DWORD count,
+                             F fill) {
+  if (bitCount == 8) {
+    for (DWORD i = 0; i < count; ++i) {
+      row[x + i] = fill(i);
+    }
+  }
+  else {
+    for (DWORD i = 0; i < count; ++i) {
+      PutNibble(row, x + i, fill(i));
+    }
+  }
+}
+
+bool DecodeRle(LPCBYTE src,
+               SIZE_T size,
+               WORD bitCount,
+               LPBYTE bits,
+               DWORD stride,
+               DWORD width,
+               DWORD height) {
+  enum : BYTE {
+    kEndOfLine = 0,
+    kEndOfBitmap = 1,
+    kDelta = 2,
+  };
+
+  // |x| never goes past |width|: every code that moves it right is checked
+  // first.
+  LPCBYTE end = src + size;
+  DWORD x = 0, y = 0;
+  while (end - src >= 2 && y < height) {
+    const BYTE count = src[0];
+    const BYTE value = src[1];
+    src += 2;
+    LPBYTE row = bits + SIZE_T(stride) * y;
+
+    if (count > 0) {
+      // Encoded mode: |count| pixels of one index, or of two alternating
+      // nibbles for RLE4.
+      if (count > width - x) {
+        return false;
+      }
+      if (bitCount == 8) {
+        memset(row + x, value, count);
+      }
+      else {
+        const BYTE nibbles[] = {
+          static_cast<BYTE>(value >> 4),
+          static_cast<BYTE>(value & 0x0f),
+        };
+        PutPixels(row, bitCount, x, count,
+                  [&](DWORD i) {return nibbles[i & 1];});
+      }
+      x += count;
+      continue;
+    }
+
+    switch (value) {
+    case kEndOfLine:
+      x = 0;
+      ++y;
+      break;
+    case kEndOfBitmap:
+      return true;
+    case kDelta:
+      if (end - src < 2 || src[0] > width - x || src[1] > height - y) {
+        return false;
+      }
+      x += src[0];
+      y += src[1];
+      src += 2;
+      break;
+    default: {
+      // Absolute mode: |value| literal pixels, padded to a WORD boundary.
+      const SIZE_T bytes = bitCount == 8 ? value : (value + 1) / 2;
+      const SIZE_T padded = (bytes + 1) & ~1;
+      if (static_cast<SIZE_T>(end - src) < bytes || value > width - x) {
+        return false;
+      }
+      if (bitCount == 8) {
+        memcpy(row + x, src, value);
+      }
+      else {
+        LPCBYTE literal = src;
+        PutPixels(row, bitCount, x, value,
+                  [&](DWORD i) {
+                    return static_cast<BYTE>(
+                      (i & 1) ? literal[i >> 1] & 0x0f : literal[i >> 1] >> 4);
+                  });
+      }
+      x += value;
+      src += min(padded, static_cast<SIZE_T>(end - src));
+      break;
+    }
+    }
+  }
+  // Some writers leave out the final end-of-bitmap.
+  return true;
+}
+
+SIZE_T MaxRle8RowSize(DWORD width) {
+  // Two bytes per pixel when every pixel is a run of one, plus the
+  // end-of-line.
+  return SIZE_T(width) * 2 + 2;
+}
+
+// Runs shorter than this are folded into absolute mode.  A run costs two
+// bytes, so shorter ones do not pay for breaking a literal.
+static const DWORD kMinRun = 3;
+
+SIZE_T EncodeRle8Row(LPCBYTE src, DWORD width, bool last, LPBYTE dst) {
+  LPBYTE out = dst;
+  DWORD x = 0;
+  while (x < width) {
+    DWORD run = 1;
+    while (x + run < width && run < 255 && src[x + run] == src[x]) {
+      ++run;
+    }
+    if (run >= kMinRun || x + run == width) {
+      *out++ = static_cast<BYTE>(run);
+      *out++ = src[x];
+      x += run;
+      continue;
+    }
+
+    // Collect literals up to the next run worth encoding.
+    DWORD literal = run;
+    while (x + literal < width && literal < 255) {
+      const BYTE v = src[x + literal];
+      if (x + literal + kMinRun <= width
+          && src[x + literal + 1] == v
+          && src[x + literal + 2] == v) {
+        break;
+      }
+      ++literal;
+    }
+    if (literal < kMinRun) {
+      // Absolute mode needs at least three pixels.
+      for (DWORD i = 0; i < literal; ++i) {
+        *out++ = 1;
+        *out++ = src[x + i];
+      }
+    }
+    else {
+      *out++ = 0;
+      *out++ = static_cast<BYTE>(literal);
+      memcpy(out, src + x, literal);
+      out += literal;
+      if (literal & 1) {
+        *out++ = 0;
+      }
+    }
+    x += literal;
+  }
+  *out++ = 0;
+  *out++ = last ? 1 : 0;
+  return out - dst;
+}
+
+// Scales an n-bit channel value to 8 bits.
+static inline BYTE Expand(DWORD value, DWORD width) {
+  if (width == 0) {
+    return 0;
+  }
+  if (width >= 8) {
+    return static_cast<BYTE>(value >> (width - 8));
+  }
+  const DWORD top = (1u << width) - 1;
+  return static_cast<BYTE>((value * 255 + top / 2) / top);
+}
+
+BitfieldUnpacker::BitfieldUnpacker(WORD bitCount,
+                                   DWORD redMask,
+                                   DWORD greenMask,
+                                   DWORD blueMask,
+                                   DWORD alphaMask)
+  : bitCount_(bitCount),
+    identity_(false),
+    vectorizable_(true) {
+  const DWORD masks[] = {blueMask, greenMask, redMask, alphaMask};
+  for (int i = 0; i < 4; ++i) {
+    auto &c = channels_[i];
+    c.mask = masks[i];
+    c.shift = 0;
+    c.width = 0;
+    unsigned long lowest;
+    if (_BitScanForward(&lowest, c.mask)) {
+      c.shift = lowest;
+      // Masks are contiguous in any sane bitmap.  Count the bits anyway.
+      for (DWORD m = c.mask >> c.shift; m & 1; m >>= 1) {
+        ++c.width;
+      }
+    }
+    if (c.width != 0 && c.width < 8) {
+      vectorizable_ = false;
+    }
+  }
+
+  identity_ = bitCount == 32
+              && blueMask == 0x000000ff
+              && greenMask == 0x0000ff00
+              && redMask == 0x00ff0000
+              && (alphaMask == 0 || alphaMask == 0xff000000);
+
+  if (bitCount == 16) {
+    table_.resize(1 << 16);
+    for (DWORD px = 0; px < table_.size(); ++px) {
+      table_[px] = Unpack(px);
+    }
+  }
+}
+
+DWORD BitfieldUnpacker::Unpack(DWORD px) const {
+  DWORD bgra = 0;
+  for (int i = 0; i < 4; ++i) {
+    const auto &c = channels_[i];
+    bgra |= static_cast<DWORD>(Expand((px & c.mask) >> c.shift, c.width))
+            << (i * 8);
+  }
+  return bgra;
+}
+
+void BitfieldUnpacker::UnpackRow(LPCBYTE src, LPBYTE dst, DWORD width) const {
+  auto out = reinterpret_cast<LPDWORD>(dst);
+  if (bitCount_ == 16) {
+    auto in = reinterpret_cast<const WORD*>(src);
+    for (DWORD x = 0; x < width; ++x) {
+      out[x] = table_[in[x]];
+    }
+    return;
+  }
+
+  auto in = reinterpret_cast<const DWORD*>(src);
+  if (identity_) {
+    // Without an alpha mask the fourth byte is undefined.  Clear it.
+    const DWORD keep = channels_[3].mask | 0x00ffffff;
+    for (DWORD x = 0; x < width; ++x) {
+      out[x] = in[x] & keep;
+    }
+    return;
+  }
+
+  DWORD x = 0;
+  if (vectorizable_) {
+    // Every channel is at least 8 bits wide, so its top 8 bits are
+    // (px & mask) >> (shift + width - 8).  They go to byte i of the result.
+    __m128i masks[4], rightShifts[4], leftShifts[4];
+    for (int i = 0; i < 4; ++i) {
+      const auto &c = channels_[i];
+      const int right = c.width ? static_cast<int>(c.shift + c.width - 8) : 0;
+      masks[i] = _mm_set1_epi32(static_cast<int>(c.mask));
+      rightShifts[i] = _mm_cvtsi32_si128(right);
+      leftShifts[i] = _mm_cvtsi32_si128(i * 8);
+    }
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    for (; x + 4 <= width; x += 4) {
+      const __m128i px =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + x));
+      __m128i bgra = _mm_setzero_si128();
+      for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_srl_epi32(_mm_and_si128(px, masks[i]),
+                                  rightShifts[i]);
+        v = _mm_sll_epi32(_mm_and_si128(v, byteMask), leftShifts[i]);
+        bgra = _mm_or_si128(bgra, v);
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), bgra);
+    }
+  }
+  for (; x < width; ++x) {
+    out[x] = Unpack(in[x]);
+  }
+}
@@ -0,0 +1,45 @@
+// Decodes BI_RLE8 (|bitCount| == 8) or BI_RLE4 (|bitCount| == 4) data into
+// the bits of a bottom-up DIB whose rows are |stride| bytes.  Pixels the
+// data skips with delta or end-of-line codes are left untouched.  Returns
+// false on a code that does not fit in the image: a run past the end of its
+// row, or a delta past the right or the top.
+bool DecodeRle(LPCBYTE src,
+               SIZE_T size,
+               WORD bitCount,
+               LPBYTE bits,
+               DWORD stride,
+               DWORD width,
+               DWORD height);
+
+// Encodes one row of 8bpp pixels in BI_RLE8, followed by end-of-line, or
+// end-of-bitmap if |last|.  The output is at most MaxRle8RowSize bytes.
+SIZE_T MaxRle8RowSize(DWORD width);
+SIZE_T EncodeRle8Row(LPCBYTE src, DWORD width, bool last, LPBYTE dst);
+
+// Unpacks 16bpp or 32bpp pixels with arbitrary channel masks to 32bpp BGRA.
+// Each channel is scaled to 8 bits.  16bpp goes through a 64K-entry table;
+// 32bpp masks of 8 bits or more are unpacked with SSE2.
+class BitfieldUnpacker {
+private:
+  struct Channel {
+    DWORD mask;
+    DWORD shift;
+    DWORD width;
+  };
+
+  WORD bitCount_;
+  Channel channels_[4];  // blue, green, red, alpha
+  bool identity_;
+  bool vectorizable_;
+  std::vector<DWORD> table_;
+
+  DWORD Unpack(DWORD px) const;
+
+public:
+  BitfieldUnpacker(WORD bitCount,
+                   DWORD redMask,
+                   DWORD greenMask,
+                   DWORD blueMask,
+                   DWORD alphaMask);
+  void UnpackRow(LPCBYTE src, LPBYTE dst, DWORD width) const;
+};
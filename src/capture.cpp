@@ -0,0 +1,300 @@
+#include <windows.h>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "blob.h"
+#include "bitmap.h"
+#include "logger.h"
+#include "phash.h"
+#include "quantize.h"
+#include "resample.h"
+#include "store.h"
+#include "tiled.h"
+#include "capture.h"
+
+ImageFormat FormatFromPath(LPCWSTR path) {
+  LPCWSTR ext = wcsrchr(path, L'.');
+  if (ext && _wcsicmp(ext, L".png") == 0) {
+    return ImageFormat::Png;
+  }
+  if (ext && _wcsicmp(ext, L".qoi") == 0) {
+    return ImageFormat::Qoi;
+  }
+  if (ext && _wcsicmp(ext, L".rle") == 0) {
+    return ImageFormat::BitmapRle8;
+  }
+  if (ext && _wcsicmp(ext, L".cap") == 0) {
+    return ImageFormat::Store;
+  }
+  if (ext && _wcsicmp(ext, L".tcap") == 0) {
+    return ImageFormat::Tiled;
+  }
+  return ImageFormat::Bitmap;
+}
+
+CaptureSaver::Options::Options()
+  : duplicateBits(-1),
+    storeTileSize(0),
+    storeDeltas(0),
+    indexedColor(false)
+{}
+
+CaptureSaver::Options &CaptureSaver::GetOptions() {
+  return options_;
+}
+
+bool CaptureSaver::SavesIndexed(ImageFormat format) const {
+  return options_.indexedColor
+         && (format == ImageFormat::Png || format == ImageFormat::Bitmap);
+}
+
+CaptureStore &CaptureSaver::StoreFor(LPCWSTR output) {
+  std::wstring directory(output);
+  const auto slash = directory.find_last_of(L"\\/");
+  directory.resize(slash == std::wstring::npos ? 0 : slash + 1);
+  directory += L"objects";
+  if (!store_ || directory != storeDirectory_) {
+    // Deltas need tiles.
+    const DWORD tileSize = options_.storeTileSize
+                           ? options_.storeTileSize
+                           : options_.storeDeltas ? 64 : 0;
+    store_ = std::make_unique<CaptureStore>(directory.c_str(), tileSize);
+    storeDirectory_ = directory;
+    deltaChain_.clear();
+  }
+  return *store_;
+}
+
+bool CaptureSaver::SaveToStore(const DIB &dib,
+                               LPCWSTR output,
+                               WORD bitCount) {
+  CaptureStore &store = StoreFor(output);
+  // A delta on the capture before, unless the chain is long enough or this
+  // overwrites a capture in it, which would break the deltas on it.
+  bool delta = !deltaChain_.empty()
+               && deltaChain_.size() <= options_.storeDeltas;
+  for (const auto &path : deltaChain_) {
+    if (path == output) {
+      delta = false;
+    }
+  }
+  const LPCWSTR base = delta ? deltaChain_.back().c_str() : nullptr;
+
+  const auto before = store.GetStats();
+  bool saved = false;
+  if (dib.GetBitmapInfo()->bmiHeader.biBitCount == bitCount) {
+    saved = dib.SaveToStore(store, output, base);
+  }
+  else {
+    DIB converted = dib.ConvertTo(bitCount, /*dc*/nullptr);
+    saved = converted && converted.SaveToStore(store, output, base);
+  }
+  if (saved) {
+    const auto &after = store.GetStats();
+    LogInfo(L"Stored %s: %u bytes written, %u tiles unchanged\n",
+        output,
+        static_cast<DWORD>(after.bytesWritten - before.bytesWritten),
+        static_cast<DWORD>(after.unchanged - before.unchanged));
+    if (!delta) {
+      deltaChain_.clear();
+    }
+    deltaChain_.push_back(output);
+  }
+  return saved;
+}
+
+bool CaptureSaver::Encode(const DIB &dib,
+                          LPCWSTR path,
+                          ImageFormat format,
+                          WORD bitCount) {
+  // A color capture of at most 256 colors is saved exactly in the smallest
+  // indexed depth, instead of |bitCount|.  Others get a palette of 256
+  // colors, dithered.
+  if (SavesIndexed(format)
+      && dib.GetBitmapInfo()->bmiHeader.biBitCount >= 16) {
+    DIB indexed = dib.Quantize(/*bitCount*/0,
+                               Dither::FloydSteinberg,
+                               /*dc*/nullptr,
+                               /*section*/nullptr,
+                               /*fallback*/8);
+    if (indexed) {
+      return Encode(indexed,
+                    path,
+                    format,
+                    indexed.GetBitmapInfo()->bmiHeader.biBitCount);
+    }
+  }
+
+  std::ofstream os(path, std::ios::binary);
+  if (!os.is_open()) {
+    return false;
+  }
+  if (format == ImageFormat::Png) {
+    dib.SavePng(os, bitCount, kPngLevel);
+  }
+  else if (format == ImageFormat::BitmapRle8) {
+    dib.SaveRle8(os);
+  }
+  else if (format == ImageFormat::Bitmap) {
+    dib.SaveAs(os, bitCount);
+  }
+  else if (format == ImageFormat::Tiled) {
+    if (dib.GetBitmapInfo()->bmiHeader.biBitCount == bitCount) {
+      dib.SaveTiled(os, kDefaultTileSize);
+    }
+    else if (DIB converted = dib.ConvertTo(bitCount, /*dc*/nullptr)) {
+      converted.SaveTiled(os, kDefaultTileSize);
+    }
+    else {
+      os.setstate(std::ios::failbit);
+    }
+  }
+  else if (format == ImageFormat::Qoi) {
+    dib.SaveQoi(os, bitCount);
+  }
+  else {
+    os.setstate(std::ios::failbit);
+  }
+  os.close();
+  return !!os;
+}
+
+bool CaptureSaver::Thumbnails(const DIB &dib,
+                              std::vector<DIB> &thumbnails) const {
+  const auto &ih = dib.GetBitmapInfo()->bmiHeader;
+  std::vector<SIZE> sizes;
+  for (DWORD width : options_.thumbnailWidths) {
+    const SIZE size = {
+      static_cast<LONG>(width),
+      max(MulDiv(std::abs(ih.biHeight), width, ih.biWidth), 1),
+    };
+    sizes.push_back(size);
+  }
+  return dib.Resample(sizes.data(),
+                      static_cast<DWORD>(sizes.size()),
+                      ResampleFilter::Lanczos3,
+                      /*dc*/nullptr,
+                      thumbnails);
+}
+
+void CaptureSaver::WriteThumbnails(const std::vector<DIB> &thumbnails,
+                                   LPCWSTR output,
+                                   WORD bitCount) const {
+  for (SIZE_T i = 0; i < thumbnails.size(); ++i) {
+    const std::wstring path = std::wstring(output) + L"."
+      + std::to_wstring(options_.thumbnailWidths[i]) + L".png";
+    std::ofstream os(path.c_str(), std::ios::binary);
+    if (os.is_open()) {
+      thumbnails[i].SavePng(os, bitCount, kPngLevel);
+    }
+  }
+}
+
+void CaptureSaver::SaveThumbnails(const DIB &dib, LPCWSTR output) const {
+  std::vector<DIB> thumbnails;
+  if (!options_.thumbnailWidths.empty() && Thumbnails(dib, thumbnails)) {
+    WriteThumbnails(thumbnails,
+                    output,
+                    dib.GetBitmapInfo()->bmiHeader.biBitCount);
+  }
+}
+
+bool CaptureSaver::ShouldSave(const DIB &dib,
+                              LPCWSTR output,
+                              ImageHash &hash,
+                              bool &hashed) const {
+  hashed = dib.Hash(hash);
+  DWORD id, distance;
+  if (hashed
+      && options_.duplicateBits >= 0
+      && savedHashes_.FindNearest(hash.dhash,
+                                  options_.duplicateBits,
+                                  id,
+                                  distance)) {
+    LogInfo(L"Skipped %s: %u bits from %s\n",
+        output,
+        distance,
+        savedPaths_[id].c_str());
+    return false;
+  }
+  return true;
+}
+
+void CaptureSaver::RecordSaved(const ImageHash &hash, LPCWSTR output) {
+  savedHashes_.Insert(hash.dhash, static_cast<DWORD>(savedPaths_.size()));
+  savedPaths_.push_back(output);
+  const std::wstring hashPath = std::wstring(output) + L".phash";
+  std::ofstream os(hashPath.c_str(), std::ios::out);
+  if (os.is_open()) {
+    hash.Save(os);
+  }
+}
+
+bool CaptureSaver::Save(BlobSlice capture, LPCWSTR output, WORD bitCount) {
+  const DIB *dib = DIB::Shared(capture);
+  if (!dib) {
+    return false;
+  }
+  const ImageFormat format = FormatFromPath(output);
+  const WORD depth = dib->GetBitmapInfo()->bmiHeader.biBitCount;
+
+  // Each thread holds a slice of its own until it is done with the pixels,
+  // so the capture is freed by whichever stage finishes last.
+  ImageHash hash;
+  bool hashed = false;
+  bool save = false;
+  std::thread hasher([&, capture]() mutable {
+    save = ShouldSave(*dib, output, hash, hashed);
+    capture = BlobSlice();
+  });
+  std::vector<DIB> thumbnails;
+  bool resampled = false;
+  std::thread thumbnailer;
+  if (!options_.thumbnailWidths.empty()) {
+    thumbnailer = std::thread([&, capture]() mutable {
+      resampled = Thumbnails(*dib, thumbnails);
+      capture = BlobSlice();
+    });
+  }
+
+  // The store dedups by content and keeps a chain of deltas, so a capture
+  // goes into it only once it is known to be saved.  Other formats are
+  // encoded meanwhile into a file next to |output|.
+  bool saved = false;
+  if (format == ImageFormat::Store) {
+    hasher.join();
+    saved = save && SaveToStore(*dib, output, bitCount);
+    capture = BlobSlice();
+  }
+  else {
+    const std::wstring temp = std::wstring(output) + L".tmp";
+    const bool encoded = Encode(*dib, temp.c_str(), format, bitCount);
+    capture = BlobSlice();
+    hasher.join();
+    saved = save && encoded;
+    if (saved
+        && !MoveFileEx(temp.c_str(), output, MOVEFILE_REPLACE_EXISTING)) {
+      Log(L"Failed to replace %s - %08x\n", output, GetLastError());
+      saved = false;
+    }
+    if (!saved) {
+      DeleteFile(temp.c_str());
+    }
+  }
+  if (thumbnailer.joinable()) {
+    thumbnailer.join();
+  }
+  if (saved) {
+    if (hashed) {
+      RecordSaved(hash, output);
+    }
+    if (resampled) {
+      WriteThumbnails(thumbnails, output, depth);
+    }
+  }
+  return saved;
+}
@@ -0,0 +1,102 @@
+// Saving of captures: near-duplicate detection, encoding in the format the
+// file name says, and thumbnails.  A capture is handed over as a BlobSlice
+// from DIB::Share, and hashing, thumbnails and encoding read it at once on
+// threads of their own.  Nothing is written over the output until the
+// capture is known to be saved, so a failed or skipped capture leaves the
+// file that was there before.  Include this after blob.h, bitmap.h,
+// phash.h and store.h.
+
+enum class ImageFormat {
+  Bitmap,
+  BitmapRle8,
+  Png,
+  Qoi,
+  Store,
+  Tiled,
+};
+
+// Captures are saved in the format the chosen file name says.
+ImageFormat FormatFromPath(LPCWSTR path);
+
+class CaptureSaver {
+public:
+  struct Options {
+    // Captures within this many bits of the dHash of one saved before are
+    // not saved.  Negative saves every capture.
+    int duplicateBits;
+    // Tile size of the capture store, or 0 to store whole frames.
+    DWORD storeTileSize;
+    // Captures in a row saved as deltas on the one before, or 0 to save
+    // every capture in full.
+    DWORD storeDeltas;
+    // Widths of the PNG thumbnails written next to every saved capture.
+    std::vector<DWORD> thumbnailWidths;
+    // Save color PNG and BMP captures with a palette.
+    bool indexedColor;
+    Options();
+  };
+
+private:
+  static const int kPngLevel = 6;
+
+  Options options_;
+
+  // The store of .cap captures, in the "objects" directory next to them.
+  // Recreated when captures are saved to another directory.
+  std::unique_ptr<CaptureStore> store_;
+  std::wstring storeDirectory_;
+  // The captures saved to the store since the last full one, which each
+  // delta depends on.
+  std::vector<std::wstring> deltaChain_;
+
+  // dHashes of the captures saved in this session, and their paths by id.
+  // dHash rather than pHash, because captures of a page are the same size
+  // and dHash moves less for a small local change.
+  HashIndex savedHashes_;
+  std::vector<std::wstring> savedPaths_;
+
+  CaptureStore &StoreFor(LPCWSTR output);
+  bool SaveToStore(const DIB &dib, LPCWSTR output, WORD bitCount);
+  // Writes |dib| to |path| in |format|, any but Store.
+  bool Encode(const DIB &dib,
+              LPCWSTR path,
+              ImageFormat format,
+              WORD bitCount);
+  // Resamples |dib| to the widths of |options_.thumbnailWidths|.
+  bool Thumbnails(const DIB &dib, std::vector<DIB> &thumbnails) const;
+  void WriteThumbnails(const std::vector<DIB> &thumbnails,
+                       LPCWSTR output,
+                       WORD bitCount) const;
+
+public:
+  Options &GetOptions();
+
+  // --indexed applies to PNG and BMP, which have palettes.  The capture is
+  // taken in color for it and quantized in memory.
+  bool SavesIndexed(ImageFormat format) const;
+
+  // Hashes a capture before it is saved as |output|.  Returns false if it
+  // is a near-duplicate of a capture saved before and need not be saved
+  // again.  |hashed| is false if the capture cannot be hashed.
+  bool ShouldSave(const DIB &dib,
+                  LPCWSTR output,
+                  ImageHash &hash,
+                  bool &hashed) const;
+  // Indexes a saved capture and writes its hashes next to it, in
+  // |output|.phash.
+  void RecordSaved(const ImageHash &hash, LPCWSTR output);
+
+  // Writes |output|.<width>.png for each width of the thumbnail option.
+  // All of them are resampled in one pass over the capture.
+  void SaveThumbnails(const DIB &dib, LPCWSTR output) const;
+
+  // Saves a capture shared by DIB::Share as |output| in |bitCount|, with
+  // its thumbnails and hashes, unless it is a near-duplicate.  The hash,
+  // the thumbnails and the encoded file are computed at the same time, and
+  // each stage drops the capture when it is done with it.  A near-duplicate
+  // is encoded for nothing, which costs less than waiting for the hash.
+  // The file replaces |output| only once it is complete; a manifest that a
+  // delta is based on is refused and left as it is.  Returns true if the
+  // capture was saved.
+  bool Save(BlobSlice capture, LPCWSTR output, WORD bitCount);
+};
@@ -0,0 +1,266 @@
+#include <windows.h>
+#include <intrin.h>
+#include <immintrin.h>
+#include <memory>
+#include <vector>
+#include "bmpcodec.h"
+#include "convert.h"
+#include "kernel.h"
+
+static const DWORD kMask555[] = {0x7c00, 0x03e0, 0x001f};
+static const DWORD kMask565[] = {0xf800, 0x07e0, 0x001f};
+
+static bool Is565(const BITMAPINFO *bi) {
+  auto masks = reinterpret_cast<const DWORD*>(bi->bmiColors);
+  return bi->bmiHeader.biCompression == BI_BITFIELDS
+         && masks[0] == kMask565[0]
+         && masks[1] == kMask565[1]
+         && masks[2] == kMask565[2];
+}
+
+// Expands packed indices through a table of 8 / bitCount pixels per byte.
+template<class T>
+static void ExpandIndexed(LPCBYTE src,
+                          T *dst,
+                          DWORD width,
+                          WORD bitCount,
+                          const T *table) {
+  const DWORD perByte = 8 / bitCount;
+  const DWORD fullBytes = width / perByte;
+  for (DWORD i = 0; i < fullBytes; ++i) {
+    memcpy(dst, table + src[i] * perByte, perByte * sizeof(T));
+    dst += perByte;
+  }
+  if (const DWORD rest = width % perByte) {
+    memcpy(dst, table + src[fullBytes] * perByte, rest * sizeof(T));
+  }
+}
+
+static void PackIndexed(LPCBYTE gray,
+                        LPBYTE dst,
+                        DWORD width,
+                        WORD bitCount,
+                        const BYTE *grayToIndex) {
+  const DWORD perByte = 8 / bitCount;
+  for (DWORD x = 0; x < width; x += perByte) {
+    BYTE b = 0;
+    for (DWORD i = 0; i < perByte; ++i) {
+      b = static_cast<BYTE>(b << bitCount);
+      if (x + i < width) {
+        b |= grayToIndex[gray[x + i]];
+      }
+    }
+    *dst++ = b;
+  }
+}
+
+static void Expand24To32(LPCBYTE src, LPDWORD dst, DWORD width) {
+  DWORD x = 0;
+  if (HasSSSE3()) {
+    const __m128i shuffle =
+      _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    // Each load takes 16 bytes for 12 bytes of pixels.
+    for (; x * 3 + 16 <= width * 3; x += 4) {
+      const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 3));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+                       _mm_shuffle_epi8(v, shuffle));
+    }
+  }
+  for (; x < width; ++x) {
+    LPCBYTE p = src + x * 3;
+    dst[x] = p[0] | (p[1] << 8) | (p[2] << 16);
+  }
+}
+
+static void Pack32To24(const DWORD *src, LPBYTE dst, DWORD width) {
+  DWORD x = 0;
+  if (HasSSSE3()) {
+    const __m128i shuffle =
+      _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    // Each store writes 16 bytes for 12 bytes of pixels.  The next store
+    // overwrites the extra bytes.
+    for (; x * 3 + 16 <= width * 3; x += 4) {
+      const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 3),
+                       _mm_shuffle_epi8(v, shuffle));
+    }
+  }
+  for (; x < width; ++x) {
+    LPBYTE p = dst + x * 3;
+    p[0] = static_cast<BYTE>(src[x]);
+    p[1] = static_cast<BYTE>(src[x] >> 8);
+    p[2] = static_cast<BYTE>(src[x] >> 16);
+  }
+}
+
+// Each channel is truncated to its top bits.
+template<bool k565>
+static inline WORD Pack16(DWORD px) {
+  const DWORD b = (px >> 3) & 0x1f;
+  const DWORD g = k565 ? (px >> 10) & 0x3f : (px >> 11) & 0x1f;
+  const DWORD r = (px >> 19) & 0x1f;
+  return static_cast<WORD>(k565 ? (r << 11) | (g << 5) | b
+                                : (r << 10) | (g << 5) | b);
+}
+
+template<bool k565>
+static inline __m128i Pack16SSE2(__m128i px) {
+  const __m128i mask5 = _mm_set1_epi32(0x1f);
+  const __m128i b = _mm_and_si128(_mm_srli_epi32(px, 3), mask5);
+  const __m128i g = k565
+    ? _mm_and_si128(_mm_srli_epi32(px, 10), _mm_set1_epi32(0x3f))
+    : _mm_and_si128(_mm_srli_epi32(px, 11), mask5);
+  const __m128i r = _mm_and_si128(_mm_srli_epi32(px, 19), mask5);
+  return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, k565 ? 11 : 10),
+                                   _mm_slli_epi32(g, 5)),
+                      b);
+}
+
+template<bool k565>
+static void Pack32To16(const DWORD *src, LPBYTE dst, DWORD width) {
+  auto out = reinterpret_cast<WORD*>(dst);
+  // packs_epi32 saturates signed values.  Biasing by 0x8000 keeps R5G6B5
+  // values with the top bit set intact.
+  const __m128i bias32 = _mm_set1_epi32(0x8000);
+  const __m128i bias16 = _mm_set1_epi16(static_cast<short>(0x8000));
+  DWORD x = 0;
+  for (; x + 8 <= width; x += 8) {
+    auto p = reinterpret_cast<const __m128i*>(src + x);
+    const __m128i lo = _mm_sub_epi32(Pack16SSE2<k565>(_mm_loadu_si128(p)),
+                                     bias32);
+    const __m128i hi = _mm_sub_epi32(Pack16SSE2<k565>(_mm_loadu_si128(p + 1)),
+                                     bias32);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x),
+                     _mm_add_epi16(_mm_packs_epi32(lo, hi), bias16));
+  }
+  for (; x < width; ++x) {
+    out[x] = Pack16<k565>(src[x]);
+  }
+}
+
+PixelConverter::PixelConverter(const BITMAPINFO *src, const BITMAPINFO *dst)
+  : srcBitCount_(src->bmiHeader.biBitCount),
+    dstBitCount_(dst->bmiHeader.biBitCount),
+    dst565_(Is565(dst)),
+    valid_(false) {
+  auto supported = [](WORD bitCount) {
+    return bitCount == 1 || bitCount == 4 || bitCount == 8
+           || bitCount == 16 || bitCount == 24 || bitCount == 32;
+  };
+  if (!supported(srcBitCount_) || !supported(dstBitCount_)) {
+    return;
+  }
+
+  if (srcBitCount_ <= 8) {
+    // Luma of each palette entry.  RGBQUAD is laid out as BGRA.
+    const DWORD numColors = 1 << srcBitCount_;
+    BYTE gray[256];
+    GrayscaleRowScalar(reinterpret_cast<LPCBYTE>(src->bmiColors),
+                       gray,
+                       numColors);
+
+    const DWORD perByte = 8 / srcBitCount_;
+    const DWORD indexMask = numColors - 1;
+    expandColor_.resize(256 * perByte);
+    expandGray_.resize(256 * perByte);
+    for (DWORD b = 0; b < 256; ++b) {
+      for (DWORD i = 0; i < perByte; ++i) {
+        const DWORD index =
+          (b >> (8 - srcBitCount_ * (i + 1))) & indexMask;
+        const auto &color = src->bmiColors[index];
+        expandColor_[b * perByte + i] =
+          color.rgbBlue | (color.rgbGreen << 8) | (color.rgbRed << 16);
+        expandGray_[b * perByte + i] = gray[index];
+      }
+    }
+  }
+  else if (srcBitCount_ == 16) {
+    const DWORD *masks = src->bmiHeader.biCompression == BI_BITFIELDS
+      ? reinterpret_cast<const DWORD*>(src->bmiColors)
+      : kMask555;
+    unpack16_.reset(
+      new BitfieldUnpacker(16, masks[0], masks[1], masks[2], /*alpha*/0));
+  }
+
+  if (dstBitCount_ <= 8) {
+    const DWORD top = (1 << dstBitCount_) - 1;
+    for (DWORD level = 0; level < 256; ++level) {
+      grayToIndex_[level] = static_cast<BYTE>((level * top + 127) / 255);
+    }
+  }
+  valid_ = true;
+}
+
+PixelConverter::~PixelConverter() {}
+
+bool PixelConverter::IsValid() const {
+  return valid_;
+}
+
+SIZE_T PixelConverter::ScratchSize(DWORD width) const {
+  // A BGRA row, then a gray row.
+  return SIZE_T(width) * 5 + 16;
+}
+
+void PixelConverter::ConvertRow(LPCBYTE src,
+                                LPBYTE dst,
+                                DWORD width,
+                                LPBYTE scratch) const {
+  LPBYTE gray = scratch + SIZE_T(width) * 4;
+  if (srcBitCount_ <= 8 && dstBitCount_ <= 8) {
+    if (dstBitCount_ == 8) {
+      ExpandIndexed(src, dst, width, srcBitCount_, expandGray_.data());
+    }
+    else {
+      ExpandIndexed(src, gray, width, srcBitCount_, expandGray_.data());
+      PackIndexed(gray, dst, width, dstBitCount_, grayToIndex_);
+    }
+    return;
+  }
+
+  // To BGRA.  If the destination is 32bpp, that is the destination itself.
+  const DWORD *bgra = reinterpret_cast<const DWORD*>(src);
+  if (srcBitCount_ != 32) {
+    auto out = reinterpret_cast<LPDWORD>(dstBitCount_ == 32 ? dst : scratch);
+    switch (srcBitCount_) {
+    case 24:
+      Expand24To32(src, out, width);
+      break;
+    case 16:
+      unpack16_->UnpackRow(src, reinterpret_cast<LPBYTE>(out), width);
+      break;
+    default:
+      ExpandIndexed(src, out, width, srcBitCount_, expandColor_.data());
+      break;
+    }
+    bgra = out;
+  }
+
+  switch (dstBitCount_) {
+  case 32:
+    if (bgra != reinterpret_cast<const DWORD*>(dst)) {
+      memcpy(dst, bgra, SIZE_T(width) * 4);
+    }
+    break;
+  case 24:
+    Pack32To24(bgra, dst, width);
+    break;
+  case 16:
+    if (dst565_) {
+      Pack32To16<true>(bgra, dst, width);
+    }
+    else {
+      Pack32To16<false>(bgra, dst, width);
+    }
+    break;
+  case 8:
+    GrayscaleRow(reinterpret_cast<LPCBYTE>(bgra), dst, width);
+    break;
+  default:
+    GrayscaleRow(reinterpret_cast<LPCBYTE>(bgra), gray, width);
+    PackIndexed(gray, dst, width, dstBitCount_, grayToIndex_);
+    break;
+  }
+}
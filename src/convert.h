@@ -0,0 +1,32 @@
+class BitfieldUnpacker;
+
+// Converts rows of pixels between DIB formats: 1, 4 and 8bpp with a color
+// table, 16bpp (X1R5G5B5, or R5G6B5 as BI_BITFIELDS), 24bpp and 32bpp.
+//
+// 32bpp BGRA is the hub.  Other formats are expanded to it through lookup
+// tables or SIMD shuffles, and packed from it with SIMD.  Destinations of
+// 8bpp or less get grayscale ramps, so an 8bpp pixel is its luma.  Indexed
+// sources going there skip the hub and map each index to its gray level.
+class PixelConverter {
+private:
+  WORD srcBitCount_;
+  WORD dstBitCount_;
+  bool dst565_;
+  bool valid_;
+  // Pixels of each source byte value: 8 / srcBitCount_ of them.
+  std::vector<DWORD> expandColor_;
+  std::vector<BYTE> expandGray_;
+  // Nearest index of each gray level in the destination ramp.
+  BYTE grayToIndex_[256];
+  std::unique_ptr<BitfieldUnpacker> unpack16_;
+
+public:
+  // Both are the headers of DIBs, with their color tables or masks.
+  PixelConverter(const BITMAPINFO *src, const BITMAPINFO *dst);
+  ~PixelConverter();
+
+  bool IsValid() const;
+  // Bytes of |scratch| ConvertRow needs for a row of |width| pixels.
+  SIZE_T ScratchSize(DWORD width) const;
+  void ConvertRow(LPCBYTE src, LPBYTE dst, DWORD width, LPBYTE scratch) const;
+};
@@ -0,0 +1,690 @@
+#include <windows.h>
+#include <intrin.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include "deflate.h"
+
+namespace {
+
+const DWORD kWindowSize = 32768;
+const DWORD kWindowMask = kWindowSize - 1;
+const DWORD kMinMatch = 3;
+const DWORD kMaxMatch = 258;
+const DWORD kHashBits = 15;
+const DWORD kMaxStored = 65535;
+// Symbols per block.  Larger blocks amortize the dynamic tree header, smaller
+// ones adapt faster to changing content.
+const DWORD kMaxSymbols = 32768;
+
+const int kNumLitLen = 286;
+const int kNumDist = 30;
+const int kNumCodeLen = 19;
+
+const WORD kLengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+const BYTE kLengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+const WORD kDistBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577,
+};
+const BYTE kDistExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+const BYTE kCodeLenOrder[kNumCodeLen] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+struct LevelConfig {
+  DWORD maxChain;
+  DWORD niceLength;
+  bool lazy;
+};
+
+const LevelConfig kLevels[10] = {
+  {0, 0, false},
+  {4, 16, false},
+  {8, 32, false},
+  {16, 64, false},
+  {16, 32, true},
+  {32, 64, true},
+  {64, 128, true},
+  {128, kMaxMatch, true},
+  {512, kMaxMatch, true},
+  {2048, kMaxMatch, true},
+};
+
+struct Tables {
+  BYTE lengthCode[kMaxMatch + 1];
+  BYTE distCodeLow[256];    // distance - 1 < 256
+  BYTE distCodeHigh[256];   // (distance - 1) >> 7
+  DWORD crc[8][256];
+
+  Tables() {
+    for (int code = 0; code < 29; ++code) {
+      const int count = 1 << kLengthExtra[code];
+      for (int i = 0; i < count && kLengthBase[code] + i <= kMaxMatch; ++i) {
+        lengthCode[kLengthBase[code] + i] = static_cast<BYTE>(code);
+      }
+    }
+    // 258 has its own code even though 227 + 31 also reaches it.  Code 28
+    // comes last in the loop above, so it already won.
+
+    for (int code = 0; code < kNumDist; ++code) {
+      const DWORD first = kDistBase[code] - 1;
+      const DWORD last = first + (1u << kDistExtra[code]);
+      for (DWORD d = first; d < last; ++d) {
+        if (d < 256) {
+          distCodeLow[d] = static_cast<BYTE>(code);
+        }
+        else {
+          distCodeHigh[d >> 7] = static_cast<BYTE>(code);
+        }
+      }
+    }
+
+    for (DWORD i = 0; i < 256; ++i) {
+      DWORD c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      }
+      crc[0][i] = c;
+    }
+    for (DWORD i = 0; i < 256; ++i) {
+      for (int t = 1; t < 8; ++t) {
+        crc[t][i] = crc[0][crc[t - 1][i] & 0xff] ^ (crc[t - 1][i] >> 8);
+      }
+    }
+  }
+
+  BYTE DistCode(DWORD distance) const {
+    --distance;
+    return distance < 256 ? distCodeLow[distance] : distCodeHigh[distance >> 7];
+  }
+};
+
+const Tables &GetTables() {
+  static const Tables tables;
+  return tables;
+}
+
+class BitWriter {
+private:
+  std::vector<BYTE> &out_;
+  ULONGLONG bits_;
+  int count_;
+
+public:
+  BitWriter(std::vector<BYTE> &out) : out_(out), bits_(0), count_(0) {}
+
+  // Deflate packs bits LSB first.  |n| must not exceed 32.
+  void Put(DWORD value, int n) {
+    bits_ |= static_cast<ULONGLONG>(value) << count_;
+    count_ += n;
+    if (count_ >= 32) {
+      const BYTE b[4] = {
+        static_cast<BYTE>(bits_),
+        static_cast<BYTE>(bits_ >> 8),
+        static_cast<BYTE>(bits_ >> 16),
+        static_cast<BYTE>(bits_ >> 24),
+      };
+      out_.insert(out_.end(), b, b + 4);
+      bits_ >>= 32;
+      count_ -= 32;
+    }
+  }
+
+  void AlignToByte() {
+    while (count_ > 0) {
+      out_.push_back(static_cast<BYTE>(bits_));
+      bits_ >>= 8;
+      count_ -= 8;
+    }
+    bits_ = 0;
+    count_ = 0;
+  }
+
+  void PutBytes(LPCBYTE p, SIZE_T n) {
+    out_.insert(out_.end(), p, p + n);
+  }
+};
+
+// Huffman code lengths limited to |maxBits|.  When the optimal tree is too
+// deep, the frequencies are flattened and the tree is rebuilt, which costs a
+// fraction of a percent against package-merge and is much simpler.
+void BuildLengths(const DWORD *freq, int n, int maxBits, BYTE *lengths) {
+  std::vector<DWORD> weights(freq, freq + n);
+  for (;;) {
+    memset(lengths, 0, n);
+    typedef std::pair<ULONGLONG, int> Node;
+    std::priority_queue<Node, std::vector<Node>, std::greater<Node>> heap;
+    std::vector<int> parent(2 * n, -1);
+    int used = 0, last = 0;
+    for (int i = 0; i < n; ++i) {
+      if (weights[i]) {
+        heap.push(Node(weights[i], i));
+        ++used;
+        last = i;
+      }
+    }
+    if (used == 0) {
+      return;
+    }
+    if (used == 1) {
+      // Keep the code complete; some inflaters reject a lone 1-bit code.
+      lengths[last] = 1;
+      lengths[last == 0 ? 1 : 0] = 1;
+      return;
+    }
+
+    int next = n;
+    while (heap.size() > 1) {
+      const Node a = heap.top();
+      heap.pop();
+      const Node b = heap.top();
+      heap.pop();
+      parent[a.second] = next;
+      parent[b.second] = next;
+      heap.push(Node(a.first + b.first, next++));
+    }
+
+    // Internal nodes are numbered in creation order, so a parent always has
+    // a larger index and depths can be filled from the root down.
+    std::vector<int> depth(next, 0);
+    for (int i = next - 2; i >= n; --i) {
+      depth[i] = depth[parent[i]] + 1;
+    }
+    int deepest = 0;
+    for (int i = 0; i < n; ++i) {
+      if (weights[i]) {
+        depth[i] = depth[parent[i]] + 1;
+        deepest = max(deepest, depth[i]);
+      }
+    }
+    if (deepest <= maxBits) {
+      for (int i = 0; i < n; ++i) {
+        lengths[i] = static_cast<BYTE>(weights[i] ? depth[i] : 0);
+      }
+      return;
+    }
+    for (auto &w : weights) {
+      w = w ? (w + 1) / 2 : 0;
+    }
+  }
+}
+
+// Canonical codes, bit-reversed so that BitWriter can emit them LSB first.
+void BuildCodes(const BYTE *lengths, int n, WORD *codes) {
+  WORD count[16] = {0};
+  WORD next[16] = {0};
+  for (int i = 0; i < n; ++i) {
+    ++count[lengths[i]];
+  }
+  count[0] = 0;
+  WORD code = 0;
+  for (int bits = 1; bits < 16; ++bits) {
+    code = static_cast<WORD>((code + count[bits - 1]) << 1);
+    next[bits] = code;
+  }
+  for (int i = 0; i < n; ++i) {
+    const int len = lengths[i];
+    if (len) {
+      WORD c = next[len]++;
+      WORD reversed = 0;
+      for (int b = 0; b < len; ++b) {
+        reversed = static_cast<WORD>((reversed << 1) | (c & 1));
+        c >>= 1;
+      }
+      codes[i] = reversed;
+    }
+  }
+}
+
+struct Symbol {
+  WORD litlen;    // literal byte, or match length when dist != 0
+  WORD dist;
+};
+
+class BlockEncoder {
+private:
+  BitWriter &writer_;
+  std::vector<Symbol> symbols_;
+  DWORD litFreq_[kNumLitLen];
+  DWORD distFreq_[kNumDist];
+
+  void WriteSymbols(const BYTE *litLens,
+                    const WORD *litCodes,
+                    const BYTE *distLens,
+                    const WORD *distCodes) {
+    const auto &t = GetTables();
+    for (const auto &s : symbols_) {
+      if (s.dist == 0) {
+        writer_.Put(litCodes[s.litlen], litLens[s.litlen]);
+        continue;
+      }
+      const int lc = t.lengthCode[s.litlen];
+      writer_.Put(litCodes[257 + lc], litLens[257 + lc]);
+      if (kLengthExtra[lc]) {
+        writer_.Put(s.litlen - kLengthBase[lc], kLengthExtra[lc]);
+      }
+      const int dc = t.DistCode(s.dist);
+      writer_.Put(distCodes[dc], distLens[dc]);
+      if (kDistExtra[dc]) {
+        writer_.Put(s.dist - kDistBase[dc], kDistExtra[dc]);
+      }
+    }
+    writer_.Put(litCodes[256], litLens[256]);
+  }
+
+  ULONGLONG ExtraBits() const {
+    ULONGLONG bits = 0;
+    for (int i = 0; i < 29; ++i) {
+      bits += static_cast<ULONGLONG>(litFreq_[257 + i]) * kLengthExtra[i];
+    }
+    for (int i = 0; i < kNumDist; ++i) {
+      bits += static_cast<ULONGLONG>(distFreq_[i]) * kDistExtra[i];
+    }
+    return bits;
+  }
+
+public:
+  BlockEncoder(BitWriter &writer) : writer_(writer) {
+    symbols_.reserve(kMaxSymbols);
+    Reset();
+  }
+
+  void Reset() {
+    symbols_.clear();
+    memset(litFreq_, 0, sizeof(litFreq_));
+    memset(distFreq_, 0, sizeof(distFreq_));
+  }
+
+  bool Full() const {
+    return symbols_.size() >= kMaxSymbols;
+  }
+
+  void Literal(BYTE b) {
+    symbols_.push_back({b, 0});
+    ++litFreq_[b];
+  }
+
+  void Match(DWORD length, DWORD distance) {
+    const auto &t = GetTables();
+    symbols_.push_back({static_cast<WORD>(length), static_cast<WORD>(distance)});
+    ++litFreq_[257 + t.lengthCode[length]];
+    ++distFreq_[t.DistCode(distance)];
+  }
+
+  // Emits the pending symbols as whichever of dynamic, fixed or stored is
+  // smallest.  |raw| is the input the symbols were made from.
+  void Flush(LPCBYTE raw, SIZE_T rawSize) {
+    if (rawSize == 0) {
+      return;
+    }
+    litFreq_[256] = 1;
+
+    BYTE litLens[kNumLitLen], distLens[kNumDist];
+    BuildLengths(litFreq_, kNumLitLen, 15, litLens);
+    BuildLengths(distFreq_, kNumDist, 15, distLens);
+    int numLit = kNumLitLen;
+    while (numLit > 257 && litLens[numLit - 1] == 0) --numLit;
+    if (std::count(distLens, distLens + kNumDist, 0) == kNumDist) {
+      // No matches at all, but the header still needs a distance tree.
+      distLens[0] = distLens[1] = 1;
+    }
+    int numDist = kNumDist;
+    while (numDist > 1 && distLens[numDist - 1] == 0) --numDist;
+
+    // Run-length encode the code lengths with symbols 16, 17 and 18.
+    BYTE all[kNumLitLen + kNumDist];
+    memcpy(all, litLens, numLit);
+    memcpy(all + numLit, distLens, numDist);
+    const int numAll = numLit + numDist;
+    std::vector<std::pair<BYTE, BYTE>> rle;  // (symbol, extra value)
+    DWORD clFreq[kNumCodeLen] = {0};
+    for (int i = 0; i < numAll;) {
+      const BYTE len = all[i];
+      int run = 1;
+      while (i + run < numAll && all[i + run] == len) ++run;
+      i += run;
+      if (len == 0) {
+        while (run >= 11) {
+          const int n = min(run, 138);
+          rle.push_back(std::make_pair(BYTE(18), static_cast<BYTE>(n - 11)));
+          run -= n;
+        }
+        if (run >= 3) {
+          rle.push_back(std::make_pair(BYTE(17), static_cast<BYTE>(run - 3)));
+          run = 0;
+        }
+      }
+      else {
+        rle.push_back(std::make_pair(len, BYTE(0)));
+        --run;
+        while (run >= 3) {
+          const int n = min(run, 6);
+          rle.push_back(std::make_pair(BYTE(16), static_cast<BYTE>(n - 3)));
+          run -= n;
+        }
+      }
+      while (run-- > 0) {
+        rle.push_back(std::make_pair(len, BYTE(0)));
+      }
+    }
+    for (const auto &r : rle) {
+      ++clFreq[r.first];
+    }
+    BYTE clLens[kNumCodeLen];
+    BuildLengths(clFreq, kNumCodeLen, 7, clLens);
+    int numCl = kNumCodeLen;
+    while (numCl > 4 && clLens[kCodeLenOrder[numCl - 1]] == 0) --numCl;
+
+    const ULONGLONG extra = ExtraBits();
+    ULONGLONG dynamicBits = 3 + 5 + 5 + 4 + 3 * numCl + extra;
+    for (int i = 0; i < kNumCodeLen; ++i) {
+      dynamicBits += static_cast<ULONGLONG>(clFreq[i]) * clLens[i];
+    }
+    dynamicBits += 2ull * clFreq[16] + 3ull * clFreq[17] + 7ull * clFreq[18];
+    for (int i = 0; i < kNumLitLen; ++i) {
+      dynamicBits += static_cast<ULONGLONG>(litFreq_[i]) * litLens[i];
+    }
+    for (int i = 0; i < kNumDist; ++i) {
+      dynamicBits += static_cast<ULONGLONG>(distFreq_[i]) * distLens[i];
+    }
+
+    BYTE fixedLit[288], fixedDist[kNumDist];
+    memset(fixedLit, 8, 144);
+    memset(fixedLit + 144, 9, 112);
+    memset(fixedLit + 256, 7, 24);
+    memset(fixedLit + 280, 8, 8);
+    memset(fixedDist, 5, sizeof(fixedDist));
+    ULONGLONG fixedBits = 3 + extra;
+    for (int i = 0; i < kNumLitLen; ++i) {
+      fixedBits += static_cast<ULONGLONG>(litFreq_[i]) * fixedLit[i];
+    }
+    for (int i = 0; i < kNumDist; ++i) {
+      fixedBits += static_cast<ULONGLONG>(distFreq_[i]) * 5;
+    }
+
+    const ULONGLONG storedBits =
+      (rawSize + kMaxStored - 1) / kMaxStored * (3 + 7 + 32) + rawSize * 8;
+
+    if (storedBits < dynamicBits && storedBits < fixedBits) {
+      for (SIZE_T offset = 0; offset < rawSize; offset += kMaxStored) {
+        const WORD len = static_cast<WORD>(min(rawSize - offset,
+                                               static_cast<SIZE_T>(kMaxStored)));
+        writer_.Put(0, 3);
+        writer_.AlignToByte();
+        writer_.Put(len, 16);
+        writer_.Put(static_cast<WORD>(~len), 16);
+        writer_.PutBytes(raw + offset, len);
+      }
+    }
+    else if (fixedBits <= dynamicBits) {
+      WORD litCodes[288], distCodes[kNumDist];
+      BuildCodes(fixedLit, 288, litCodes);
+      BuildCodes(fixedDist, kNumDist, distCodes);
+      writer_.Put(1 << 1, 3);
+      WriteSymbols(fixedLit, litCodes, fixedDist, distCodes);
+    }
+    else {
+      WORD litCodes[kNumLitLen], distCodes[kNumDist], clCodes[kNumCodeLen];
+      BuildCodes(litLens, kNumLitLen, litCodes);
+      BuildCodes(distLens, kNumDist, distCodes);
+      BuildCodes(clLens, kNumCodeLen, clCodes);
+      writer_.Put(2 << 1, 3);
+      writer_.Put(numLit - 257, 5);
+      writer_.Put(numDist - 1, 5);
+      writer_.Put(numCl - 4, 4);
+      for (int i = 0; i < numCl; ++i) {
+        writer_.Put(clLens[kCodeLenOrder[i]], 3);
+      }
+      for (const auto &r : rle) {
+        writer_.Put(clCodes[r.first], clLens[r.first]);
+        if (r.first == 16) writer_.Put(r.second, 2);
+        else if (r.first == 17) writer_.Put(r.second, 3);
+        else if (r.first == 18) writer_.Put(r.second, 7);
+      }
+      WriteSymbols(litLens, litCodes, distLens, distCodes);
+    }
+    Reset();
+  }
+};
+
+inline DWORD Hash3(LPCBYTE p) {
+  const DWORD v = (p[0] << 16) | (p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+inline DWORD MatchLength(LPCBYTE a, LPCBYTE b, DWORD maxLength) {
+  DWORD n = 0;
+  while (n + 4 <= maxLength) {
+    DWORD x, y;
+    memcpy(&x, a + n, 4);
+    memcpy(&y, b + n, 4);
+    if (const DWORD diff = x ^ y) {
+      unsigned long index;
+      _BitScanForward(&index, diff);
+      return n + index / 8;
+    }
+    n += 4;
+  }
+  while (n < maxLength && a[n] == b[n]) ++n;
+  return n;
+}
+
+class MatchFinder {
+private:
+  LPCBYTE base_;
+  SIZE_T total_;
+  std::vector<LONG> head_;
+  std::vector<LONG> prev_;
+
+public:
+  MatchFinder(LPCBYTE base, SIZE_T total)
+    : base_(base),
+      total_(total),
+      head_(1 << kHashBits, -1),
+      prev_(kWindowSize, -1)
+  {}
+
+  void Insert(SIZE_T pos) {
+    if (pos + kMinMatch <= total_) {
+      const DWORD h = Hash3(base_ + pos);
+      prev_[pos & kWindowMask] = head_[h];
+      head_[h] = static_cast<LONG>(pos);
+    }
+  }
+
+  // Chains only ever go back in time, and a slot of prev_ is overwritten
+  // only by a position 32KB later, so stopping at the window limit is enough
+  // to never follow a stale link.
+  DWORD Find(SIZE_T pos, const LevelConfig &config, DWORD &distance) const {
+    if (pos + kMinMatch > total_) {
+      return 0;
+    }
+    const DWORD maxLength = static_cast<DWORD>(min(total_ - pos,
+                                                   static_cast<SIZE_T>(kMaxMatch)));
+    const LONG limit = pos > kWindowSize
+                       ? static_cast<LONG>(pos - kWindowSize) : 0;
+    LPCBYTE current = base_ + pos;
+    DWORD best = kMinMatch - 1;
+    DWORD chain = config.maxChain;
+    for (LONG cand = head_[Hash3(current)];
+         cand >= limit && chain > 0;
+         cand = prev_[cand & kWindowMask], --chain) {
+      LPCBYTE candidate = base_ + cand;
+      if (candidate[best] != current[best] || candidate[0] != current[0]) {
+        continue;
+      }
+      const DWORD len = MatchLength(candidate, current, maxLength);
+      if (len > best) {
+        best = len;
+        distance = static_cast<DWORD>(pos - cand);
+        if (len >= config.niceLength || len == maxLength) {
+          break;
+        }
+      }
+    }
+    // A 3-byte match far away usually costs more than three literals.
+    if (best == kMinMatch && distance > 4096) {
+      return 0;
+    }
+    return best >= kMinMatch ? best : 0;
+  }
+};
+
+}  // namespace
+
+DWORD Crc32(DWORD crc, LPCBYTE data, SIZE_T size) {
+  const auto &t = GetTables().crc;
+  crc = ~crc;
+  while (size >= 8) {
+    DWORD lo, hi;
+    memcpy(&lo, data, 4);
+    memcpy(&hi, data + 4, 4);
+    lo ^= crc;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff]
+          ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+          ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+          ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    data += 8;
+    size -= 8;
+  }
+  while (size--) {
+    crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+DWORD Adler32(DWORD adler, LPCBYTE data, SIZE_T size) {
+  const DWORD kBase = 65521;
+  // The largest n such that 255n(n+1)/2 + (n+1)(kBase-1) fits in 32 bits.
+  const SIZE_T kMaxRun = 5552;
+  DWORD a = adler & 0xffff;
+  DWORD b = adler >> 16;
+  while (size > 0) {
+    SIZE_T run = min(size, kMaxRun);
+    size -= run;
+    while (run--) {
+      a += *data++;
+      b += a;
+    }
+    a %= kBase;
+    b %= kBase;
+  }
+  return (b << 16) | a;
+}
+
+DWORD Adler32Combine(DWORD adler1, DWORD adler2, ULONGLONG size2) {
+  const DWORD kBase = 65521;
+  const DWORD rem = static_cast<DWORD>(size2 % kBase);
+  DWORD sum1 = adler1 & 0xffff;
+  DWORD sum2 = static_cast<DWORD>((static_cast<ULONGLONG>(rem) * sum1) % kBase);
+  sum1 += (adler2 & 0xffff) + kBase - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + kBase - rem;
+  if (sum1 >= kBase) sum1 -= kBase;
+  if (sum1 >= kBase) sum1 -= kBase;
+  if (sum2 >= (kBase << 1)) sum2 -= (kBase << 1);
+  if (sum2 >= kBase) sum2 -= kBase;
+  return sum1 | (sum2 << 16);
+}
+
+void DeflateChunk(LPCBYTE data,
+                  SIZE_T size,
+                  SIZE_T dictSize,
+                  int level,
+                  std::vector<BYTE> &out) {
+  BitWriter writer(out);
+  level = max(0, min(level, 9));
+  dictSize = min(dictSize, static_cast<SIZE_T>(kWindowSize));
+
+  if (level == 0) {
+    for (SIZE_T offset = 0; offset < size; offset += kMaxStored) {
+      const WORD len = static_cast<WORD>(min(size - offset,
+                                             static_cast<SIZE_T>(kMaxStored)));
+      writer.Put(0, 3);
+      writer.AlignToByte();
+      writer.Put(len, 16);
+      writer.Put(static_cast<WORD>(~len), 16);
+      writer.PutBytes(data + offset, len);
+    }
+  }
+  else if (size > 0) {
+    const auto &config = kLevels[level];
+    LPCBYTE base = data - dictSize;
+    const SIZE_T total = dictSize + size;
+    MatchFinder finder(base, total);
+    BlockEncoder block(writer);
+
+    for (SIZE_T i = 0; i < dictSize; ++i) {
+      finder.Insert(i);
+    }
+
+    SIZE_T blockStart = dictSize;
+    SIZE_T i = dictSize;
+    while (i < total) {
+      DWORD distance = 0;
+      DWORD length = finder.Find(i, config, distance);
+      finder.Insert(i);
+
+      // Lazy evaluation: if the next position has a longer match, emit
+      // this byte as a literal and take that match instead.
+      while (config.lazy && length && length < config.niceLength) {
+        DWORD nextDistance = 0;
+        const DWORD next = finder.Find(i + 1, config, nextDistance);
+        if (next <= length) {
+          break;
+        }
+        block.Literal(base[i]);
+        ++i;
+        finder.Insert(i);
+        length = next;
+        distance = nextDistance;
+      }
+
+      if (length) {
+        block.Match(length, distance);
+        // Fast levels skip indexing the inside of long matches, which are
+        // mostly runs of one color anyway.
+        if (config.lazy || length <= config.niceLength) {
+          for (DWORD k = 1; k < length; ++k) {
+            finder.Insert(i + k);
+          }
+        }
+        i += length;
+      }
+      else {
+        block.Literal(base[i]);
+        ++i;
+      }
+
+      if (block.Full()) {
+        block.Flush(base + blockStart, i - blockStart);
+        blockStart = i;
+      }
+    }
+    block.Flush(base + blockStart, total - blockStart);
+  }
+
+  // Empty stored block (sync flush).
+  writer.Put(0, 3);
+  writer.AlignToByte();
+  writer.Put(0xffff0000, 32);
+  writer.AlignToByte();
+}
+
+void FinishDeflate(std::vector<BYTE> &out) {
+  // Final fixed-Huffman block with nothing but end-of-block.
+  BitWriter writer(out);
+  writer.Put(1 | (1 << 1), 3);
+  writer.Put(0, 7);
+  writer.AlignToByte();
+}
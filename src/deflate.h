@@ -0,0 +1,20 @@
+DWORD Crc32(DWORD crc, LPCBYTE data, SIZE_T size);
+DWORD Adler32(DWORD adler, LPCBYTE data, SIZE_T size);
+DWORD Adler32Combine(DWORD adler1, DWORD adler2, ULONGLONG size2);
+
+// Compresses data[0, size) into raw deflate blocks (RFC 1951).  Up to 32KB
+// before |data| (|dictSize| bytes) is used as history but not emitted, so
+// chunks of one buffer can be compressed independently and still refer back
+// across chunk boundaries, as pigz does.
+//
+// The output ends with an empty stored block, which leaves it byte-aligned
+// and not final.  Outputs of consecutive chunks can be concatenated, and
+// FinishDeflate closes the stream.
+//
+// |level| is 0 (store) to 9 (best).
+void DeflateChunk(LPCBYTE data,
+                  SIZE_T size,
+                  SIZE_T dictSize,
+                  int level,
+                  std::vector<BYTE> &out);
+void FinishDeflate(std::vector<BYTE> &out);
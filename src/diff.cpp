@@ -0,0 +1,190 @@
+#include <windows.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include "blob.h"
+#include "bitmap.h"
+#include "diff.h"
+
+// Pixels checked by one vector pass.  Whole chunks that are within the
+// tolerance, which is nearly all of a typical diff, are skipped without
+// looking at single pixels.
+static const DWORD kChunkPixels = 16;
+
+DiffOptions::DiffOptions()
+  : maxChangedPixels(~0ull),
+    makeImage(false) {
+  tolerance[0] = tolerance[1] = tolerance[2] = 0;
+  tolerance[3] = 0xff;
+}
+
+DiffResult::DiffResult()
+  : changedPixels(0),
+    exceeded(false)
+{}
+
+ImageDiff::ImageDiff(WORD bitCount,
+                     DWORD width,
+                     DWORD height,
+                     const DiffOptions &options)
+  : bytesPerPixel_(bitCount / 8),
+    width_(width),
+    height_(height),
+    ignore_(options.ignore),
+    cellsX_((width + kDiffCellSize - 1) / kDiffCellSize),
+    cellsY_((height + kDiffCellSize - 1) / kDiffCellSize) {
+  memcpy(tolerance_, options.tolerance, sizeof(tolerance_));
+  const Cell empty = {MAXLONG, MAXLONG, 0, 0};
+  cells_.assign(SIZE_T(cellsX_) * cellsY_, empty);
+}
+
+void ImageDiff::Mark(DWORD x, DWORD y) {
+  Cell &cell = cells_[SIZE_T(y / kDiffCellSize) * cellsX_ + x / kDiffCellSize];
+  cell.left = min(cell.left, static_cast<LONG>(x));
+  cell.top = min(cell.top, static_cast<LONG>(y));
+  cell.right = max(cell.right, static_cast<LONG>(x + 1));
+  cell.bottom = max(cell.bottom, static_cast<LONG>(y + 1));
+}
+
+// Largest channel difference of a pixel, or 0 if every channel is within
+// the tolerance.
+static inline BYTE PixelDiff(LPCBYTE a,
+                             LPCBYTE b,
+                             WORD bytesPerPixel,
+                             const BYTE *tolerance) {
+  BYTE largest = 0;
+  bool changed = false;
+  for (WORD c = 0; c < bytesPerPixel; ++c) {
+    const BYTE d = static_cast<BYTE>(a[c] > b[c] ? a[c] - b[c] : b[c] - a[c]);
+    if (d > tolerance[c]) {
+      changed = true;
+      largest = max(largest, d);
+    }
+  }
+  return changed ? max(largest, static_cast<BYTE>(1)) : 0;
+}
+
+DWORD ImageDiff::CompareRow(LPCBYTE a, LPCBYTE b, DWORD y, LPBYTE image) {
+  if (image) {
+    memset(image, 0, width_);
+  }
+
+  // Columns outside the ignored rectangles that cover this row.
+  std::vector<std::pair<DWORD, DWORD>> hidden;
+  for (const auto &rect : ignore_) {
+    if (static_cast<LONG>(y) >= rect.top && static_cast<LONG>(y) < rect.bottom
+        && rect.left < rect.right) {
+      hidden.emplace_back(static_cast<DWORD>(max(rect.left, 0L)),
+                          static_cast<DWORD>(max(rect.right, 0L)));
+    }
+  }
+  std::sort(hidden.begin(), hidden.end());
+
+  // The tolerance repeated across a chunk.  Chunks start on a pixel, so the
+  // pattern of each vector is fixed.
+  __m128i tolerance[4];
+  for (WORD v = 0; v < bytesPerPixel_; ++v) {
+    BYTE pattern[16];
+    for (int i = 0; i < 16; ++i) {
+      pattern[i] = tolerance_[bytesPerPixel_ == 1 ? 0
+                              : (v * 16 + i) % bytesPerPixel_];
+    }
+    tolerance[v] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+  }
+  const __m128i zero = _mm_setzero_si128();
+
+  DWORD changed = 0;
+  DWORD x = 0;
+  auto next = hidden.begin();
+  while (x < width_) {
+    // Skip hidden columns, then compare up to the next hidden span.
+    while (next != hidden.end() && next->first <= x) {
+      x = max(x, next->second);
+      ++next;
+    }
+    const DWORD end = next == hidden.end()
+                      ? width_
+                      : min(next->first, width_);
+    while (x < end) {
+      if (x + kChunkPixels <= end) {
+        const SIZE_T offset = SIZE_T(x) * bytesPerPixel_;
+        __m128i excess = zero;
+        for (WORD v = 0; v < bytesPerPixel_; ++v) {
+          const __m128i va =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + offset) + v);
+          const __m128i vb =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + offset) + v);
+          const __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb),
+                                         _mm_subs_epu8(vb, va));
+          excess = _mm_or_si128(excess, _mm_subs_epu8(d, tolerance[v]));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(excess, zero)) == 0xffff) {
+          x += kChunkPixels;
+          continue;
+        }
+      }
+
+      const DWORD stop = min(end, x + kChunkPixels);
+      for (; x < stop; ++x) {
+        const SIZE_T offset = SIZE_T(x) * bytesPerPixel_;
+        if (const BYTE d = PixelDiff(a + offset,
+                                     b + offset,
+                                     bytesPerPixel_,
+                                     tolerance_)) {
+          ++changed;
+          Mark(x, y);
+          if (image) {
+            image[x] = d;
+          }
+        }
+      }
+    }
+  }
+  return changed;
+}
+
+std::vector<RECT> ImageDiff::Regions() const {
+  std::vector<RECT> regions;
+  std::vector<bool> visited(cells_.size());
+  std::vector<DWORD> stack;
+  for (DWORD start = 0; start < cells_.size(); ++start) {
+    if (visited[start] || cells_[start].right == 0) {
+      continue;
+    }
+
+    // Flood fill over the 8 neighbors.
+    RECT box = {MAXLONG, MAXLONG, 0, 0};
+    visited[start] = true;
+    stack.push_back(start);
+    while (!stack.empty()) {
+      const DWORD i = stack.back();
+      stack.pop_back();
+      const Cell &cell = cells_[i];
+      box.left = min(box.left, cell.left);
+      box.top = min(box.top, cell.top);
+      box.right = max(box.right, cell.right);
+      box.bottom = max(box.bottom, cell.bottom);
+
+      const LONG cx = i % cellsX_;
+      const LONG cy = i / cellsX_;
+      for (LONG ny = cy - 1; ny <= cy + 1; ++ny) {
+        for (LONG nx = cx - 1; nx <= cx + 1; ++nx) {
+          if (nx < 0 || ny < 0
+              || nx >= static_cast<LONG>(cellsX_)
+              || ny >= static_cast<LONG>(cellsY_)) {
+            continue;
+          }
+          const DWORD n = ny * cellsX_ + nx;
+          if (!visited[n] && cells_[n].right != 0) {
+            visited[n] = true;
+            stack.push_back(n);
+          }
+        }
+      }
+    }
+    regions.push_back(box);
+  }
+  return regions;
+}
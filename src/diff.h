@@ -0,0 +1,69 @@
+// Compares two captures of the same size and format for visual regression.
+// Include this after bitmap.h.
+
+struct DiffOptions {
+  // Largest difference per channel that still counts as equal: blue, green,
+  // red, alpha.  8bpp compares pixel values against the first.  Alpha is
+  // ignored by default because GDI leaves it undefined.
+  BYTE tolerance[4];
+  // Regions such as ads and clocks, in pixels from the top-left.
+  std::vector<RECT> ignore;
+  // The comparison stops once more pixels than this have changed.
+  ULONGLONG maxChangedPixels;
+  // Fills DiffResult::image with the largest channel difference of each
+  // changed pixel, 0 elsewhere.
+  bool makeImage;
+
+  DiffOptions();
+};
+
+struct DiffResult {
+  ULONGLONG changedPixels;
+  // The comparison stopped early.  changedPixels is then a lower bound and
+  // regions are incomplete.
+  bool exceeded;
+  // Bounding boxes of connected changed areas, from the top.
+  std::vector<RECT> regions;
+  DIB image;
+
+  DiffResult();
+};
+
+// Compares the rows of two images and tracks where they differ.  The image
+// is divided into kDiffCellSize-pixel square cells, each keeping the bounds
+// of its changed pixels; adjacent changed cells are then merged into
+// regions.  Rows of different cell rows can be compared in parallel.
+const DWORD kDiffCellSize = 32;
+
+class ImageDiff {
+private:
+  struct Cell {
+    LONG left;
+    LONG top;
+    LONG right;
+    LONG bottom;
+  };
+
+  WORD bytesPerPixel_;
+  DWORD width_;
+  DWORD height_;
+  BYTE tolerance_[4];
+  std::vector<RECT> ignore_;
+  DWORD cellsX_;
+  DWORD cellsY_;
+  std::vector<Cell> cells_;
+
+  void Mark(DWORD x, DWORD y);
+
+public:
+  // |bitCount| is 8, 24 or 32.
+  ImageDiff(WORD bitCount,
+            DWORD width,
+            DWORD height,
+            const DiffOptions &options);
+
+  // Compares row |y| and returns the number of changed pixels.  |image| is
+  // the row of the difference image, or nullptr.
+  DWORD CompareRow(LPCBYTE a, LPCBYTE b, DWORD y, LPBYTE image);
+  std::vector<RECT> Regions() const;
+};
@@ -5,15 +5,14 @@
 #include <mshtml.h>
 #include "resource.h"
 #include "eventsink.h"
-
-void Log(LPCWSTR format, ...);
+#include "logger.h"
 
 EventSink::EventSink(HWND container)
   : ref_(1), container_(container)
 {}
 
 EventSink::~EventSink() {
-  Log(L"%s\n", __FUNCTIONW__);
+  LogVerbose(L"%s\n", __FUNCTIONW__);
 }
 
 STDMETHODIMP EventSink::QueryInterface(REFIID riid, void **ppvObject) {
@@ -101,7 +100,7 @@ static void SetDesignMode(CComQIPtr<IWebBrowser2> &wb, bool value) {
     if (CComQIPtr<IHTMLDocument2> doc = dispatch) {
       CComBSTR value_str(value ? L"on" : L"off");
       if (SUCCEEDED(doc->put_designMode(value_str))) {
-        Log(L"designMode has been set to %s\n", BSTR(value_str));
+        LogInfo(L"designMode has been set to %s\n", BSTR(value_str));
       }
     }
   }
@@ -124,7 +123,7 @@ STDMETHODIMP EventSink::Invoke(_In_  DISPID dispIdMember,
         && pDispParams->rgvarg[0].pvarVal->vt == VT_BSTR
         && pDispParams->rgvarg[1].vt == VT_DISPATCH) {
       if (CComQIPtr<IWebBrowser2> wb = pDispParams->rgvarg[1].pdispVal) {
-        Log(L"Received DWebBrowserEvents2.DocumentComplete: %s\n",
+        LogInfo(L"Received DWebBrowserEvents2.DocumentComplete: %s\n",
             pDispParams->rgvarg[0].pvarVal->bstrVal);
         LPCWSTR SuppressAlert = L"window.alert=function(){};"
                                 L"window.confirm=function(){};"
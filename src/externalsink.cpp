@@ -3,8 +3,7 @@
 #include <map>
 #include <windows.h>
 #include <atlbase.h>
-
-void Log(LPCWSTR format, ...);
+#include "logger.h"
 
 static constexpr DISPID FirstMethodId = 100;
 
@@ -22,7 +21,7 @@ private:
   std::vector<HRESULT(ExternalSink::*)(MethodContext&)> methods_;
 
   HRESULT Log(MethodContext &context) {
-    ::Log(L"%s\n", __FUNCTIONW__);
+    LogVerbose(L"%s\n", __FUNCTIONW__);
     return S_OK;
   }
 
@@ -30,7 +29,7 @@ private:
     HRESULT hr = E_INVALIDARG;
     if (context.params->cArgs == 1
         && context.params->rgvarg[0].vt == VT_BSTR) {
-      ::Log(L"%s\n", V_BSTR(&context.params->rgvarg[0]));
+      LogInfo(L"%s\n", V_BSTR(&context.params->rgvarg[0]));
       hr = S_OK;
     }
     return hr;
@@ -57,7 +56,7 @@ public:
   }
 
   ~ExternalSink() {
-    ::Log(L"%s\n", __FUNCTIONW__);
+    LogVerbose(L"%s\n", __FUNCTIONW__);
   }
 
   // IUnknown
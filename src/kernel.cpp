@@ -0,0 +1,139 @@
+#include <windows.h>
+#include <intrin.h>
+#include <immintrin.h>
+#include "kernel.h"
+
+// BT.601 luma weights in Q15.  They sum up to 1 << 15 so that a white pixel
+// stays 255.  Every code path below computes exactly
+//   (R * 9798 + G * 19235 + B * 3735) >> 15
+// so the result does not depend on which kernel the CPU ends up running.
+static const int kWeightB = 3735;
+static const int kWeightG = 19235;
+static const int kWeightR = 9798;
+static const int kLumaShift = 15;
+
+bool HasSSSE3() {
+  static const bool supported = []() {
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+  }();
+  return supported;
+}
+
+bool HasAVX2() {
+  static const bool supported = []() {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+      return false;
+    }
+
+    // AVX2 needs OSXSAVE + AVX, and the OS must save the YMM state.
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+      return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+  }();
+  return supported;
+}
+
+void GrayscaleRowScalar(LPCBYTE src, LPBYTE dst, DWORD width) {
+  for (DWORD x = 0; x < width; ++x) {
+    dst[x] = static_cast<BYTE>((src[0] * kWeightB
+                                + src[1] * kWeightG
+                                + src[2] * kWeightR) >> kLumaShift);
+    src += 4;
+  }
+}
+
+// Four BGRA pixels to four 32bit lumas.  pmaddwd sums B*wB+G*wG and R*wR+A*0
+// for each pixel, and one shift folds the two halves together.
+static inline __m128i Luma4SSE2(__m128i pixels, __m128i weights) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights);
+  __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), weights);
+  lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+  hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+  lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 2, 0));
+  hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 2, 0));
+  return _mm_srli_epi32(_mm_unpacklo_epi64(lo, hi), kLumaShift);
+}
+
+void GrayscaleRowSSE2(LPCBYTE src, LPBYTE dst, DWORD width) {
+  const __m128i weights = _mm_setr_epi16(kWeightB, kWeightG, kWeightR, 0,
+                                         kWeightB, kWeightG, kWeightR, 0);
+  DWORD x = 0;
+  for (; x + 16 <= width; x += 16) {
+    auto p = reinterpret_cast<const __m128i*>(src + x * 4);
+    const __m128i y0 = Luma4SSE2(_mm_loadu_si128(p + 0), weights);
+    const __m128i y1 = Luma4SSE2(_mm_loadu_si128(p + 1), weights);
+    const __m128i y2 = Luma4SSE2(_mm_loadu_si128(p + 2), weights);
+    const __m128i y3 = Luma4SSE2(_mm_loadu_si128(p + 3), weights);
+    const __m128i y = _mm_packus_epi16(_mm_packs_epi32(y0, y1),
+                                       _mm_packs_epi32(y2, y3));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), y);
+  }
+  GrayscaleRowScalar(src + x * 4, dst + x, width - x);
+}
+
+// Same as Luma4SSE2 on two 128bit lanes.  Lane-local unpacking keeps pixel
+// order within each lane, so the result is [y0..y3 | y4..y7].
+static inline __m256i Luma8AVX2(__m256i pixels, __m256i weights) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), weights);
+  __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), weights);
+  lo = _mm256_add_epi32(lo, _mm256_srli_epi64(lo, 32));
+  hi = _mm256_add_epi32(hi, _mm256_srli_epi64(hi, 32));
+  lo = _mm256_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 2, 0));
+  hi = _mm256_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 2, 0));
+  return _mm256_srli_epi32(_mm256_unpacklo_epi64(lo, hi), kLumaShift);
+}
+
+void GrayscaleRowAVX2(LPCBYTE src, LPBYTE dst, DWORD width) {
+  const __m256i weights = _mm256_setr_epi16(kWeightB, kWeightG, kWeightR, 0,
+                                            kWeightB, kWeightG, kWeightR, 0,
+                                            kWeightB, kWeightG, kWeightR, 0,
+                                            kWeightB, kWeightG, kWeightR, 0);
+  // Packing is lane-local too, which leaves dwords in the order
+  // [a0 b0 c0 d0 | a1 b1 c1 d1].  One permute puts them back in place.
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  DWORD x = 0;
+  for (; x + 32 <= width; x += 32) {
+    auto p = reinterpret_cast<const __m256i*>(src + x * 4);
+    const __m256i y0 = Luma8AVX2(_mm256_loadu_si256(p + 0), weights);
+    const __m256i y1 = Luma8AVX2(_mm256_loadu_si256(p + 1), weights);
+    const __m256i y2 = Luma8AVX2(_mm256_loadu_si256(p + 2), weights);
+    const __m256i y3 = Luma8AVX2(_mm256_loadu_si256(p + 3), weights);
+    __m256i y = _mm256_packus_epi16(_mm256_packs_epi32(y0, y1),
+                                    _mm256_packs_epi32(y2, y3));
+    y = _mm256_permutevar8x32_epi32(y, order);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), y);
+  }
+  _mm256_zeroupper();
+  GrayscaleRowSSE2(src + x * 4, dst + x, width - x);
+}
+
+void GrayscaleRow(LPCBYTE src, LPBYTE dst, DWORD width) {
+  static const GrayscaleRowFunc kernel =
+    HasAVX2() ? GrayscaleRowAVX2 : GrayscaleRowSSE2;
+  kernel(src, dst, width);
+}
+
+bool IsGrayscaleRamp(const RGBQUAD *colorTable, WORD bitCount) {
+  const DWORD numColors = 1 << bitCount;
+  for (DWORD i = 0; i < numColors; ++i) {
+    const BYTE level = static_cast<BYTE>(i * 255 / (numColors - 1));
+    if (colorTable[i].rgbRed != level
+        || colorTable[i].rgbGreen != level
+        || colorTable[i].rgbBlue != level) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,15 @@
+typedef void (*GrayscaleRowFunc)(LPCBYTE src, LPBYTE dst, DWORD width);
+
+bool HasSSSE3();
+bool HasAVX2();
+
+// Converts |width| BGRA pixels to 8bpp luma.  All variants produce the same
+// bytes; GrayscaleRow picks the fastest one the CPU supports.
+void GrayscaleRowScalar(LPCBYTE src, LPBYTE dst, DWORD width);
+void GrayscaleRowSSE2(LPCBYTE src, LPBYTE dst, DWORD width);
+void GrayscaleRowAVX2(LPCBYTE src, LPBYTE dst, DWORD width);
+void GrayscaleRow(LPCBYTE src, LPBYTE dst, DWORD width);
+
+// True if the 2^bitCount entries of |colorTable| are an even ramp from black
+// to white, i.e. a pixel value is its own gray level.
+bool IsGrayscaleRamp(const RGBQUAD *colorTable, WORD bitCount);
@@ -0,0 +1,687 @@
+#include <windows.h>
+#include <strsafe.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.h"
+
+namespace {
+
+// Bytes of the ring of each thread.  A record larger than this, e.g. with
+// a string of tens of thousands of characters, is dropped.
+const DWORD kRingSize = 64 * 1024;
+const DWORD kDrainIntervalMs = 20;
+// The level of padding up to the end of a ring, where a record did not fit.
+const DWORD kPadding = MAXDWORD;
+
+// Set once the logging thread is gone at exit.  Records logged after that,
+// e.g. by destructors of other statics, go to the debugger right away.
+std::atomic<bool> loggerClosed(false);
+
+SIZE_T Align8(SIZE_T size) {
+  return (size + 7) & ~SIZE_T(7);
+}
+
+// A record is this header, |count| LogArgs and the characters of their
+// strings, each from a multiple of 8 bytes.
+struct RecordHeader {
+  DWORD size;
+  DWORD level;
+  DWORD threadId;
+  DWORD count;
+  ULONGLONG sequence;
+  FILETIME time;
+  LPCWSTR format;
+};
+
+struct Entry {
+  ULONGLONG sequence;
+  LogLevel level;
+  DWORD threadId;
+  FILETIME time;
+  std::wstring text;
+};
+
+// Formats one conversion of printf with a value of its own type.
+template<class T>
+void AppendFormatted(std::wstring &text, const std::wstring &spec, T value) {
+  WCHAR buffer[512];
+  if (SUCCEEDED(StringCchPrintf(buffer,
+                                ARRAYSIZE(buffer),
+                                spec.c_str(),
+                                value))) {
+    text += buffer;
+  }
+}
+
+void AppendPadded(std::wstring &text,
+                  const std::wstring &value,
+                  int width,
+                  bool left) {
+  const int padding = width - static_cast<int>(value.size());
+  if (padding > 0 && !left) {
+    text.append(padding, L' ');
+  }
+  text += value;
+  if (padding > 0 && left) {
+    text.append(padding, L' ');
+  }
+}
+
+// Walks |format| and formats each conversion on its own with the type of
+// its argument, so the arguments need not be in a va_list.  Integers are
+// cut to the size the conversion says, as printf would read them.
+void FormatRecord(LPCWSTR format,
+                  const LogArg *args,
+                  DWORD count,
+                  std::wstring &text) {
+  DWORD next = 0;
+  auto nextArg = [&]() -> const LogArg* {
+    return next < count ? &args[next++] : nullptr;
+  };
+  auto asSigned = [](const LogArg &arg) -> LONGLONG {
+    return arg.type == LogArg::Double ? static_cast<LONGLONG>(arg.d) : arg.i;
+  };
+
+  LPCWSTR p = format;
+  while (*p) {
+    if (*p != L'%') {
+      LPCWSTR end = wcschr(p, L'%');
+      if (!end) {
+        end = p + wcslen(p);
+      }
+      text.append(p, end);
+      p = end;
+      continue;
+    }
+
+    LPCWSTR const start = p++;
+    if (*p == L'%') {
+      text += L'%';
+      ++p;
+      continue;
+    }
+
+    // Flags, width and precision are kept, with * replaced by its argument.
+    std::wstring spec(L"%");
+    bool left = false;
+    while (*p && wcschr(L"-+ #0", *p)) {
+      left |= *p == L'-';
+      spec += *p++;
+    }
+    int width = 0;
+    if (*p == L'*') {
+      ++p;
+      if (const LogArg *arg = nextArg()) {
+        width = static_cast<int>(asSigned(*arg));
+      }
+      if (width < 0) {
+        left = true;
+        spec += L'-';
+        width = -width;
+      }
+      spec += std::to_wstring(width);
+    }
+    else {
+      while (*p >= L'0' && *p <= L'9') {
+        width = width * 10 + (*p - L'0');
+        spec += *p++;
+      }
+    }
+    int precision = -1;
+    if (*p == L'.') {
+      spec += *p++;
+      precision = 0;
+      if (*p == L'*') {
+        ++p;
+        if (const LogArg *arg = nextArg()) {
+          precision = max(static_cast<int>(asSigned(*arg)), 0);
+        }
+        spec += std::to_wstring(precision);
+      }
+      else {
+        while (*p >= L'0' && *p <= L'9') {
+          precision = precision * 10 + (*p - L'0');
+          spec += *p++;
+        }
+      }
+    }
+
+    // In bytes, as the Microsoft CRT reads integers.
+    DWORD size = sizeof(int);
+    if (p[0] == L'h' && p[1] == L'h') {
+      size = 1;
+      p += 2;
+    }
+    else if (p[0] == L'l' && p[1] == L'l') {
+      size = 8;
+      p += 2;
+    }
+    else if (p[0] == L'I' && p[1] == L'6' && p[2] == L'4') {
+      size = 8;
+      p += 3;
+    }
+    else if (p[0] == L'I' && p[1] == L'3' && p[2] == L'2') {
+      size = 4;
+      p += 3;
+    }
+    else if (*p == L'h') {
+      size = 2;
+      ++p;
+    }
+    else if (*p == L'j') {
+      size = 8;
+      ++p;
+    }
+    else if (*p == L'I' || *p == L'z' || *p == L't') {
+      size = sizeof(LPVOID);
+      ++p;
+    }
+    else if (*p == L'l' || *p == L'L' || *p == L'w') {
+      ++p;
+    }
+
+    const WCHAR conversion = *p;
+    if (conversion) {
+      ++p;
+    }
+    const LogArg *arg = conversion && conversion != L'n' ? nextArg() : nullptr;
+    if (!arg) {
+      if (conversion != L'n') {
+        text.append(start, p);
+      }
+      continue;
+    }
+
+    const int bits = size * 8;
+    switch (conversion) {
+    case L'd':
+    case L'i': {
+      LONGLONG value = asSigned(*arg);
+      if (bits < 64) {
+        const int shift = 64 - bits;
+        value = static_cast<LONGLONG>(static_cast<ULONGLONG>(value) << shift)
+                >> shift;
+      }
+      spec += L"lld";
+      AppendFormatted(text, spec, value);
+      break;
+    }
+    case L'u':
+    case L'x':
+    case L'X':
+    case L'o': {
+      ULONGLONG value = static_cast<ULONGLONG>(asSigned(*arg));
+      if (bits < 64) {
+        value &= (1ull << bits) - 1;
+      }
+      spec += L"ll";
+      spec += conversion;
+      AppendFormatted(text, spec, value);
+      break;
+    }
+    case L'e':
+    case L'E':
+    case L'f':
+    case L'F':
+    case L'g':
+    case L'G':
+    case L'a':
+    case L'A': {
+      const double value = arg->type == LogArg::Double ? arg->d
+                         : arg->type == LogArg::Unsigned
+                           ? static_cast<double>(arg->u)
+                           : static_cast<double>(arg->i);
+      spec += conversion;
+      AppendFormatted(text, spec, value);
+      break;
+    }
+    case L'p':
+      spec += L'p';
+      AppendFormatted(text, spec, arg->p);
+      break;
+    case L'c':
+    case L'C':
+      AppendPadded(text,
+                   std::wstring(1, static_cast<wchar_t>(arg->u)),
+                   width,
+                   left);
+      break;
+    case L's':
+    case L'S':
+    case L'Z': {
+      std::wstring value;
+      if (arg->type == LogArg::WideString) {
+        value.assign(reinterpret_cast<LPCWSTR>(arg->p), arg->length);
+      }
+      else if (arg->type == LogArg::String) {
+        const int length = MultiByteToWideChar(
+          CP_ACP, 0,
+          reinterpret_cast<LPCSTR>(arg->p), arg->length,
+          nullptr, 0);
+        value.resize(length);
+        if (length) {
+          MultiByteToWideChar(CP_ACP, 0,
+                              reinterpret_cast<LPCSTR>(arg->p), arg->length,
+                              &value[0], length);
+        }
+      }
+      else if (!arg->p) {
+        value = L"(null)";
+      }
+      if (precision >= 0 && value.size() > SIZE_T(precision)) {
+        value.resize(precision);
+      }
+      AppendPadded(text, value, width, left);
+      break;
+    }
+    default:
+      text.append(start, p);
+      break;
+    }
+  }
+}
+
+// Written by one thread and read by the logging thread.  head_ and tail_
+// only grow, and each is written by one side only, so neither needs a lock.
+class LogRing {
+private:
+  ULONGLONG buffer_[kRingSize / sizeof(ULONGLONG)];
+  std::atomic<ULONGLONG> head_;
+  std::atomic<ULONGLONG> tail_;
+
+  LPBYTE At(ULONGLONG position) {
+    return reinterpret_cast<LPBYTE>(buffer_) + position % kRingSize;
+  }
+
+public:
+  // Set when the thread exits, and the ring is freed once empty.
+  std::atomic<bool> orphaned_;
+
+  LogRing()
+    : head_(0),
+      tail_(0),
+      orphaned_(false)
+  {}
+
+  SIZE_T Used() const {
+    return static_cast<SIZE_T>(head_.load(std::memory_order_relaxed)
+                               - tail_.load(std::memory_order_relaxed));
+  }
+
+  bool Push(const RecordHeader &header, const LogArg *args) {
+    ULONGLONG head = head_.load(std::memory_order_relaxed);
+    const ULONGLONG tail = tail_.load(std::memory_order_acquire);
+    const DWORD offset = static_cast<DWORD>(head % kRingSize);
+    const DWORD padding = offset + header.size > kRingSize
+                          ? kRingSize - offset
+                          : 0;
+    if (head + padding + header.size - tail > kRingSize) {
+      return false;
+    }
+    if (padding) {
+      auto *pad = reinterpret_cast<RecordHeader*>(At(head));
+      pad->size = padding;
+      pad->level = kPadding;
+      head += padding;
+    }
+
+    LPBYTE p = At(head);
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, args, sizeof(LogArg) * header.count);
+    p += sizeof(LogArg) * header.count;
+    for (DWORD i = 0; i < header.count; ++i) {
+      SIZE_T bytes = 0;
+      if (args[i].type == LogArg::WideString) {
+        bytes = args[i].length * sizeof(wchar_t);
+      }
+      else if (args[i].type == LogArg::String) {
+        bytes = args[i].length;
+      }
+      if (bytes) {
+        memcpy(p, args[i].p, bytes);
+        p += Align8(bytes);
+      }
+    }
+    head_.store(head + header.size, std::memory_order_release);
+    return true;
+  }
+
+  // Formats every record written so far into |entries|.
+  void Pop(std::vector<Entry> &entries) {
+    const ULONGLONG head = head_.load(std::memory_order_acquire);
+    ULONGLONG tail = tail_.load(std::memory_order_relaxed);
+    std::vector<LogArg> args;
+    while (tail < head) {
+      auto *header = reinterpret_cast<const RecordHeader*>(At(tail));
+      if (header->level != kPadding) {
+        auto *stored = reinterpret_cast<const LogArg*>(header + 1);
+        args.assign(stored, stored + header->count);
+        LPCBYTE strings = reinterpret_cast<LPCBYTE>(stored + header->count);
+        for (auto &arg : args) {
+          if (arg.type == LogArg::WideString || arg.type == LogArg::String) {
+            arg.p = strings;
+            strings += Align8(arg.length * (arg.type == LogArg::WideString
+                                            ? sizeof(wchar_t)
+                                            : 1));
+          }
+        }
+        Entry entry = {header->sequence,
+                       static_cast<LogLevel>(header->level),
+                       header->threadId,
+                       header->time};
+        FormatRecord(header->format, args.data(), header->count, entry.text);
+        entries.push_back(std::move(entry));
+      }
+      tail += header->size;
+    }
+    tail_.store(tail, std::memory_order_release);
+  }
+};
+
+class LogState {
+private:
+  std::mutex lock_;
+  std::condition_variable wake_;
+  std::condition_variable drained_;
+  std::vector<std::shared_ptr<LogRing>> rings_;
+  ULONGLONG started_;
+  ULONGLONG completed_;
+  ULONGLONG wanted_;
+  bool stop_;
+  std::mutex sinksLock_;
+  std::vector<std::unique_ptr<LogSink>> sinks_;
+  ULONGLONG reported_;
+  std::thread thread_;
+
+  void Run();
+  void Drain(const std::vector<std::shared_ptr<LogRing>> &rings);
+
+public:
+  std::atomic<ULONGLONG> sequence_;
+  std::atomic<ULONGLONG> dropped_;
+
+  LogState();
+  ~LogState();
+
+  std::shared_ptr<LogRing> NewRing();
+  void Wake();
+  void Flush();
+  void AddSink(LogSink *sink);
+  void RemoveSink(LogSink *sink);
+};
+
+LogState &State() {
+  static LogState state;
+  return state;
+}
+
+struct RingHolder {
+  std::shared_ptr<LogRing> ring;
+
+  ~RingHolder() {
+    if (ring) {
+      ring->orphaned_ = true;
+    }
+  }
+};
+
+thread_local RingHolder threadRing;
+
+LogState::LogState()
+  : started_(0),
+    completed_(0),
+    wanted_(0),
+    stop_(false),
+    reported_(0),
+    sequence_(0),
+    dropped_(0) {
+  sinks_.emplace_back(new DebugSink);
+  thread_ = std::thread(&LogState::Run, this);
+}
+
+LogState::~LogState() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stop_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+  loggerClosed = true;
+}
+
+std::shared_ptr<LogRing> LogState::NewRing() {
+  auto ring = std::make_shared<LogRing>();
+  std::lock_guard<std::mutex> lock(lock_);
+  rings_.push_back(ring);
+  return ring;
+}
+
+void LogState::Wake() {
+  wake_.notify_one();
+}
+
+// Waits for a pass that starts after now, which sees every record the
+// caller has written.
+void LogState::Flush() {
+  std::unique_lock<std::mutex> lock(lock_);
+  if (stop_) {
+    return;
+  }
+  const ULONGLONG wanted = started_ + 1;
+  wanted_ = max(wanted_, wanted);
+  wake_.notify_one();
+  drained_.wait(lock, [this, wanted]() { return completed_ >= wanted; });
+}
+
+void LogState::AddSink(LogSink *sink) {
+  std::lock_guard<std::mutex> lock(sinksLock_);
+  sinks_.emplace_back(sink);
+}
+
+void LogState::RemoveSink(LogSink *sink) {
+  std::lock_guard<std::mutex> lock(sinksLock_);
+  for (auto it = sinks_.begin(); it != sinks_.end(); ++it) {
+    if (it->get() == sink) {
+      it->release();
+      sinks_.erase(it);
+      break;
+    }
+  }
+}
+
+void LogState::Run() {
+  std::unique_lock<std::mutex> lock(lock_);
+  for (;;) {
+    if (!stop_ && wanted_ <= completed_) {
+      wake_.wait_for(lock, std::chrono::milliseconds(kDrainIntervalMs));
+    }
+    const bool stop = stop_;
+    const ULONGLONG pass = ++started_;
+    std::vector<std::shared_ptr<LogRing>> rings(rings_);
+    lock.unlock();
+
+    Drain(rings);
+
+    lock.lock();
+    rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                [](const std::shared_ptr<LogRing> &ring) {
+                                  return ring->orphaned_
+                                         && ring->Used() == 0;
+                                }),
+                 rings_.end());
+    completed_ = pass;
+    drained_.notify_all();
+    if (stop) {
+      break;
+    }
+  }
+}
+
+// Records of different threads are written in the order they were logged.
+void LogState::Drain(const std::vector<std::shared_ptr<LogRing>> &rings) {
+  std::vector<Entry> entries;
+  for (const auto &ring : rings) {
+    ring->Pop(entries);
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.sequence < b.sequence;
+            });
+
+  const ULONGLONG dropped = dropped_;
+  if (dropped != reported_) {
+    Entry entry = {0, LogLevel::Warning, GetCurrentThreadId()};
+    GetSystemTimeAsFileTime(&entry.time);
+    entry.text = std::to_wstring(dropped - reported_)
+                 + L" log records were dropped.\n";
+    entries.push_back(std::move(entry));
+    reported_ = dropped;
+  }
+
+  std::lock_guard<std::mutex> lock(sinksLock_);
+  for (const auto &entry : entries) {
+    for (const auto &sink : sinks_) {
+      sink->Write(entry.level, entry.threadId, entry.time, entry.text.c_str());
+    }
+  }
+}
+
+}  // namespace
+
+LogSink::~LogSink() {}
+
+void DebugSink::Write(LogLevel, DWORD, const FILETIME &, LPCWSTR text) {
+  OutputDebugString(text);
+}
+
+FileSink::FileSink(LPCWSTR path)
+  : file_(CreateFile(path,
+                     FILE_APPEND_DATA,
+                     FILE_SHARE_READ,
+                     /*lpSecurityAttributes*/nullptr,
+                     OPEN_ALWAYS,
+                     FILE_ATTRIBUTE_NORMAL,
+                     /*hTemplateFile*/nullptr))
+{}
+
+FileSink::~FileSink() {
+  if (file_ != INVALID_HANDLE_VALUE) {
+    CloseHandle(file_);
+  }
+}
+
+bool FileSink::IsOpen() const {
+  return file_ != INVALID_HANDLE_VALUE;
+}
+
+void FileSink::Write(LogLevel level,
+                     DWORD threadId,
+                     const FILETIME &time,
+                     LPCWSTR text) {
+  if (file_ == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  FILETIME local;
+  SYSTEMTIME st = {0};
+  if (FileTimeToLocalFileTime(&time, &local)) {
+    FileTimeToSystemTime(&local, &st);
+  }
+  WCHAR prefix[64];
+  StringCchPrintf(prefix, ARRAYSIZE(prefix),
+                  L"%04u-%02u-%02u %02u:%02u:%02u.%03u %5u %c ",
+                  st.wYear, st.wMonth, st.wDay,
+                  st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+                  threadId,
+                  L"VIWE"[static_cast<int>(level)]);
+  std::wstring line(prefix);
+  line += text;
+  if (line.back() != L'\n') {
+    line += L'\n';
+  }
+
+  const int length = WideCharToMultiByte(CP_UTF8, 0,
+                                         line.data(),
+                                         static_cast<int>(line.size()),
+                                         nullptr, 0,
+                                         nullptr, nullptr);
+  std::string utf8(length, '\0');
+  WideCharToMultiByte(CP_UTF8, 0,
+                      line.data(),
+                      static_cast<int>(line.size()),
+                      &utf8[0], length,
+                      nullptr, nullptr);
+  DWORD written;
+  WriteFile(file_, utf8.data(), length, &written, /*lpOverlapped*/nullptr);
+}
+
+void Logger::Write(LogLevel level,
+                   LPCWSTR format,
+                   const LogArg *args,
+                   DWORD count) {
+  if (loggerClosed) {
+    std::wstring text;
+    FormatRecord(format, args, count, text);
+    OutputDebugString(text.c_str());
+    return;
+  }
+
+  LogState &state = State();
+  if (!threadRing.ring) {
+    threadRing.ring = state.NewRing();
+  }
+
+  SIZE_T size = sizeof(RecordHeader) + sizeof(LogArg) * count;
+  for (DWORD i = 0; i < count; ++i) {
+    if (args[i].type == LogArg::WideString) {
+      size += Align8(args[i].length * sizeof(wchar_t));
+    }
+    else if (args[i].type == LogArg::String) {
+      size += Align8(args[i].length);
+    }
+  }
+  RecordHeader header;
+  header.size = static_cast<DWORD>(min(size, SIZE_T(MAXDWORD)));
+  header.level = static_cast<DWORD>(level);
+  header.threadId = GetCurrentThreadId();
+  header.count = count;
+  header.sequence = state.sequence_++;
+  GetSystemTimeAsFileTime(&header.time);
+  header.format = format;
+
+  // The logging thread is woken once as the ring passes half full, rather
+  // than on every record after that.
+  LogRing &ring = *threadRing.ring;
+  const SIZE_T used = ring.Used();
+  if (size > kRingSize || !ring.Push(header, args)) {
+    ++state.dropped_;
+    state.Wake();
+  }
+  else if (used <= kRingSize / 2 && ring.Used() > kRingSize / 2) {
+    state.Wake();
+  }
+}
+
+void Logger::AddSink(LogSink *sink) {
+  State().AddSink(sink);
+}
+
+void Logger::RemoveSink(LogSink *sink) {
+  State().RemoveSink(sink);
+}
+
+void Logger::Flush() {
+  if (!loggerClosed) {
+    State().Flush();
+  }
+}
+
+ULONGLONG Logger::Dropped() {
+  return State().dropped_;
+}
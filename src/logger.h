@@ -0,0 +1,208 @@
+// Asynchronous logging.  Log and its siblings copy the format and the
+// arguments as they are into a ring buffer of the calling thread, without
+// a lock or formatting, and a background thread formats the records and
+// writes them to the sinks: the debugger, and a file if one is added.
+//
+// Levels below LOG_LEVEL are compiled out, arguments and all, so a verbose
+// trace in a loop costs nothing in a normal build.  Build with
+//   /DLOG_LEVEL=0
+// to keep them.
+//
+// The format is that of printf, and must outlive the logger, e.g. a
+// literal; %s and %c take either wide or narrow arguments.
+enum class LogLevel {
+  Verbose,
+  Info,
+  Warning,
+  Error,
+};
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 1
+#endif
+
+const LogLevel kLogLevel = static_cast<LogLevel>(LOG_LEVEL);
+
+// An argument of a record.  A string is followed by its |length|
+// characters in the record.
+struct LogArg {
+  enum Type : DWORD {
+    Signed,
+    Unsigned,
+    Double,
+    Pointer,
+    WideString,
+    String,
+  };
+
+  DWORD type;
+  DWORD length;
+  union {
+    LONGLONG i;
+    ULONGLONG u;
+    double d;
+    const void *p;
+  };
+};
+
+inline LogArg ToLogArg(long long value) {
+  LogArg arg = {LogArg::Signed};
+  arg.i = value;
+  return arg;
+}
+inline LogArg ToLogArg(char value) {
+  return ToLogArg((long long)value);
+}
+inline LogArg ToLogArg(signed char value) {
+  return ToLogArg((long long)value);
+}
+inline LogArg ToLogArg(short value) {
+  return ToLogArg((long long)value);
+}
+inline LogArg ToLogArg(int value) {
+  return ToLogArg((long long)value);
+}
+inline LogArg ToLogArg(long value) {
+  return ToLogArg((long long)value);
+}
+
+inline LogArg ToLogArg(unsigned long long value) {
+  LogArg arg = {LogArg::Unsigned};
+  arg.u = value;
+  return arg;
+}
+inline LogArg ToLogArg(bool value) {
+  return ToLogArg((unsigned long long)value);
+}
+inline LogArg ToLogArg(wchar_t value) {
+  return ToLogArg((unsigned long long)value);
+}
+inline LogArg ToLogArg(unsigned char value) {
+  return ToLogArg((unsigned long long)value);
+}
+inline LogArg ToLogArg(unsigned short value) {
+  return ToLogArg((unsigned long long)value);
+}
+inline LogArg ToLogArg(unsigned int value) {
+  return ToLogArg((unsigned long long)value);
+}
+inline LogArg ToLogArg(unsigned long value) {
+  return ToLogArg((unsigned long long)value);
+}
+
+inline LogArg ToLogArg(double value) {
+  LogArg arg = {LogArg::Double};
+  arg.d = value;
+  return arg;
+}
+
+// A null string is a null pointer, which %s formats as "(null)".
+inline LogArg ToLogArg(LPCWSTR value) {
+  LogArg arg = {value ? LogArg::WideString : LogArg::Pointer};
+  arg.p = value;
+  arg.length = value ? static_cast<DWORD>(wcslen(value)) : 0;
+  return arg;
+}
+inline LogArg ToLogArg(LPWSTR value) {
+  return ToLogArg(LPCWSTR(value));
+}
+
+inline LogArg ToLogArg(LPCSTR value) {
+  LogArg arg = {value ? LogArg::String : LogArg::Pointer};
+  arg.p = value;
+  arg.length = value ? static_cast<DWORD>(strlen(value)) : 0;
+  return arg;
+}
+inline LogArg ToLogArg(LPSTR value) {
+  return ToLogArg(LPCSTR(value));
+}
+
+template<class T> LogArg ToLogArg(const T *value) {
+  LogArg arg = {LogArg::Pointer};
+  arg.p = value;
+  return arg;
+}
+
+// Receives formatted records on the logging thread, one at a time.
+class LogSink {
+public:
+  virtual ~LogSink();
+  // |text| is the formatted message as it is, usually ending with "\n".
+  // |time| is the system time it was logged at.
+  virtual void Write(LogLevel level,
+                     DWORD threadId,
+                     const FILETIME &time,
+                     LPCWSTR text) = 0;
+};
+
+// OutputDebugString, which is where everything went before.
+class DebugSink : public LogSink {
+public:
+  void Write(LogLevel level,
+             DWORD threadId,
+             const FILETIME &time,
+             LPCWSTR text) override;
+};
+
+// Appends lines of the local time, the thread and the level to a file in
+// UTF-8.
+class FileSink : public LogSink {
+private:
+  HANDLE file_;
+
+public:
+  explicit FileSink(LPCWSTR path);
+  ~FileSink();
+
+  bool IsOpen() const;
+  void Write(LogLevel level,
+             DWORD threadId,
+             const FILETIME &time,
+             LPCWSTR text) override;
+};
+
+// The process-wide logger.  Each thread writes to a ring of its own, which
+// the logging thread empties every few milliseconds, or sooner when it is
+// half full.  A record that does not fit is dropped and counted rather
+// than waiting, and the count is logged.
+class Logger {
+public:
+  static void Write(LogLevel level,
+                    LPCWSTR format,
+                    const LogArg *args,
+                    DWORD count);
+  // Starts with a DebugSink.  The logger owns added sinks until they are
+  // removed.
+  static void AddSink(LogSink *sink);
+  static void RemoveSink(LogSink *sink);
+  // Returns once every record the calling thread logged before is written.
+  static void Flush();
+  static ULONGLONG Dropped();
+};
+
+template<LogLevel level, class... Args>
+inline void LogAt(LPCWSTR format, Args... args) {
+  if (level >= kLogLevel) {
+    const LogArg logArgs[] = {ToLogArg(args)..., LogArg()};
+    Logger::Write(level, format, logArgs, sizeof...(Args));
+  }
+}
+
+// Failures.
+template<class... Args> inline void Log(LPCWSTR format, Args... args) {
+  LogAt<LogLevel::Error>(format, args...);
+}
+
+template<class... Args> inline void LogWarning(LPCWSTR format, Args... args) {
+  LogAt<LogLevel::Warning>(format, args...);
+}
+
+template<class... Args> inline void LogInfo(LPCWSTR format, Args... args) {
+  LogAt<LogLevel::Info>(format, args...);
+}
+
+// Traces, e.g. of every buffer or bitmap made.  Off unless built with
+// LOG_LEVEL=0.
+template<class... Args> inline void LogVerbose(LPCWSTR format, Args... args) {
+  LogAt<LogLevel::Verbose>(format, args...);
+}
@@ -5,11 +5,32 @@
 #include <mshtmhst.h>
 #include <mshtml.h>
 #include <shobjidl.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 #include <fstream>
 #include "resource.h"
 #include "blob.h"
 #include "bitmap.h"
+#include "blank.h"
+#include "logger.h"
+#include "parallel.h"
+#include "phash.h"
+#include "png.h"
+#include "qoi.h"
+#include "quantize.h"
+#include "resample.h"
+#include "stitch.h"
+#include "store.h"
+#include "tiled.h"
+#include "capture.h"
 #include "basewindow.h"
 #include "site.h"
 #include "addressbar.h"
@@ -17,15 +38,6 @@
 
 IDispatch *CreateExternalSink();
 
-void Log(LPCWSTR format, ...) {
-  WCHAR linebuf[1024];
-  va_list v;
-  va_start(v, format);
-  wvsprintf(linebuf, format, v);
-  va_end(v);
-  OutputDebugString(linebuf);
-}
-
 class BrowserContainer : public BaseWindow<BrowserContainer> {
 private:
   CComPtr<OleSite> site_;
@@ -98,9 +110,9 @@ private:
 
 public:
   ~BrowserContainer() {
-    Log(L"> %s\n", __FUNCTIONW__);
-    Log(L"  OleSite      = %p\n", static_cast<LPVOID>(site_));
-    Log(L"  IWebBrowser2 = %p\n", static_cast<LPVOID>(wb_));
+    LogVerbose(L"> %s\n", __FUNCTIONW__);
+    LogVerbose(L"  OleSite      = %p\n", static_cast<LPVOID>(site_));
+    LogVerbose(L"  IWebBrowser2 = %p\n", static_cast<LPVOID>(wb_));
   }
 
   LPCWSTR ClassName() const {
@@ -136,6 +148,12 @@ public:
 class MainWindow : public BaseWindow<MainWindow> {
 private:
   const int ADDRESSBAR_HEIGHT = 20;
+  const int PNG_LEVEL = 6;
+  // The first pause before capturing a blank frame again.  It doubles with
+  // every retry.
+  const DWORD BLANK_RETRY_DELAY = 250;
+  // Time a page gets to paint after scrolling to the next tile.
+  const DWORD SCROLL_SETTLE_DELAY = 100;
 
   BrowserContainer container_;
   AddressBar addressBar_;
@@ -143,9 +161,24 @@ private:
 
   struct Options {
     bool autoCapture;
-    Options() : autoCapture(false) {}
+    // Scale captures from the window's DPI to 96 DPI.
+    bool normalizeDpi;
+    // Times a blank or near-blank frame is captured again before it is
+    // saved anyway.
+    DWORD blankRetries;
+    // Screenshot events capture the whole page rather than the viewport.
+    bool fullPage;
+    Options()
+      : autoCapture(false),
+        normalizeDpi(false),
+        blankRetries(3),
+        fullPage(false)
+    {}
   } options_;
 
+  // Dedup, encoding and thumbnails of the captures saved.
+  CaptureSaver saver_;
+
   bool InitChildControls() {
     RECT parentRect, addressbarArea;
     GetClientRect(hwnd(), &parentRect);
@@ -192,18 +225,18 @@ private:
   }
 
   void DumpInfo() {
-    Log(L"> %s\n", __FUNCTIONW__);
+    LogInfo(L"> %s\n", __FUNCTIONW__);
     if (CComPtr<IWebBrowser2> wb = container_.GetBrowser()) {
       HWND browserWindow;
       IUnknown_GetWindow(wb, &browserWindow);
-      Log(L"  WebBrowser = %p (HWND=%p)\n",
+      LogInfo(L"  WebBrowser = %p (HWND=%p)\n",
           static_cast<LPVOID>(wb),
           browserWindow);
 
       CComPtr<IDispatch> dispatch;
       if (SUCCEEDED(wb->get_Document(&dispatch))) {
         IUnknown_GetWindow(dispatch, &browserWindow);
-        Log(L"  Document   = %p (HWND=%p)\n",
+        LogInfo(L"  Document   = %p (HWND=%p)\n",
             static_cast<LPVOID>(dispatch),
             browserWindow);
       }
@@ -218,6 +251,11 @@ private:
       if (SUCCEEDED(savedialog_.CoCreateInstance(CLSID_FileSaveDialog))) {
         static const COMDLG_FILTERSPEC filetypes[] = {
           {L"Bitmap", L"*.bmp;*.dib"},
+          {L"Bitmap (RLE8 grayscale)", L"*.rle"},
+          {L"PNG", L"*.png"},
+          {L"QOI", L"*.qoi"},
+          {L"Capture store manifest", L"*.cap"},
+          {L"Tiled capture", L"*.tcap"},
         };
         savedialog_->SetFileTypes(ARRAYSIZE(filetypes), filetypes);
         savedialog_->SetDefaultExtension(L"bmp");
@@ -240,6 +278,212 @@ private:
     return ret;
   }
 
+  // Captures are in device pixels, so the same page comes out larger on a
+  // high-DPI monitor.  With --normalize-dpi they are scaled back to 96 DPI.
+  bool NeedsScaling(HWND window) const {
+    return options_.normalizeDpi
+           && GetDpiForWindow(window) != USER_DEFAULT_SCREEN_DPI;
+  }
+
+  void NormalizeDpi(DIB &dib, HWND window) {
+    if (!NeedsScaling(window)) {
+      return;
+    }
+    const int dpi = static_cast<int>(GetDpiForWindow(window));
+    const auto &ih = dib.GetBitmapInfo()->bmiHeader;
+    DIB scaled = dib.Resample(
+      max(MulDiv(ih.biWidth, USER_DEFAULT_SCREEN_DPI, dpi), 1),
+      max(MulDiv(std::abs(ih.biHeight), USER_DEFAULT_SCREEN_DPI, dpi), 1),
+      ResampleFilter::Lanczos3,
+      /*dc*/nullptr);
+    if (scaled) {
+      dib = std::move(scaled);
+    }
+  }
+
+  // Dispatches messages for |milliseconds|, so that the page can paint in
+  // the meantime.
+  void PumpMessages(DWORD milliseconds) {
+    const ULONGLONG deadline = GetTickCount64() + milliseconds;
+    for (ULONGLONG now = GetTickCount64();
+         now < deadline;
+         now = GetTickCount64()) {
+      MsgWaitForMultipleObjects(0,
+                                nullptr,
+                                /*fWaitAll*/FALSE,
+                                static_cast<DWORD>(deadline - now),
+                                QS_ALLINPUT);
+      MSG msg;
+      while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+        if (msg.message == WM_QUIT) {
+          PostQuitMessage(static_cast<int>(msg.wParam));
+          return;
+        }
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+      }
+    }
+  }
+
+  // Captures of a page that has not painted yet come out all one color.
+  // |capture| is called again after a pause, doubling each time, until the
+  // frame has content or the retries run out.  The last frame is returned
+  // either way.
+  DIB CaptureWithRetry(const std::function<DIB()> &capture) {
+    DIB dib = capture();
+    for (DWORD retry = 0; dib && retry < options_.blankRetries; ++retry) {
+      BlankResult blank;
+      if (!dib.Classify(BlankOptions(), blank)
+          || blank.content == FrameContent::Content) {
+        break;
+      }
+      const DWORD delay = BLANK_RETRY_DELAY << retry;
+      LogWarning(L"%s frame (%u pixels off %06x), capturing again "
+                 L"in %u ms\n",
+          blank.content == FrameContent::Blank ? L"Blank" : L"Near-blank",
+          static_cast<DWORD>(blank.differing),
+          blank.background,
+          delay);
+      // A DIB on the output file is closed before it is created again.
+      dib = DIB();
+      PumpMessages(delay);
+      dib = capture();
+    }
+    return dib;
+  }
+
+  // Pages in standards mode scroll the root element, quirks ones the body,
+  // so both are asked and the larger answer wins.  |viewHeight| is the
+  // height of the viewport without scrollbars.
+  static bool GetScroll(IHTMLDocument2 *doc,
+                        long &scrollHeight,
+                        long &scrollTop,
+                        long &viewHeight) {
+    scrollHeight = scrollTop = viewHeight = 0;
+    CComPtr<IHTMLElement> root, body;
+    if (CComQIPtr<IHTMLDocument3> doc3 = doc) {
+      doc3->get_documentElement(&root);
+    }
+    doc->get_body(&body);
+    for (IHTMLElement *element : {root.p, body.p}) {
+      if (CComQIPtr<IHTMLElement2> element2 = element) {
+        long value;
+        if (SUCCEEDED(element2->get_scrollHeight(&value))) {
+          scrollHeight = max(scrollHeight, value);
+        }
+        if (SUCCEEDED(element2->get_scrollTop(&value))) {
+          scrollTop = max(scrollTop, value);
+        }
+        if (SUCCEEDED(element2->get_clientHeight(&value))) {
+          viewHeight = max(viewHeight, value);
+        }
+      }
+    }
+    return scrollHeight > 0 && viewHeight > 0;
+  }
+
+  // Renders the whole document rather than the viewport: the page is
+  // scrolled down one viewport at a time, and the new rows of each tile are
+  // converted and written to |output| before the next is drawn.  Only one
+  // tile is in memory however long the page is.  The page height is taken
+  // when the capture starts, and content fixed to the viewport shows up in
+  // every tile.
+  void CaptureFullPage(LPCWSTR output, WORD bitCount) {
+    CComPtr<IWebBrowser2> wb = container_.GetBrowser();
+    CComPtr<IDispatch> dispatch;
+    long width, height;
+    if (!wb
+        || FAILED(wb->get_Width(&width))
+        || width <= 0
+        || FAILED(wb->get_Height(&height))
+        || height <= 0
+        || FAILED(wb->get_Document(&dispatch))) {
+      return;
+    }
+    CComQIPtr<IHTMLDocument2> doc = dispatch;
+    CComPtr<IHTMLWindow2> window;
+    long pageHeight, originalTop, viewHeight;
+    if (!doc
+        || FAILED(doc->get_parentWindow(&window))
+        || !GetScroll(doc, pageHeight, originalTop, viewHeight)) {
+      Log(L"The document cannot be scrolled.\n");
+      return;
+    }
+    viewHeight = min(viewHeight, height);
+
+    StitchFormat format;
+    switch (FormatFromPath(output)) {
+    case ImageFormat::Bitmap:
+      format = StitchFormat::Bitmap;
+      break;
+    case ImageFormat::Png:
+      format = StitchFormat::Png;
+      break;
+    case ImageFormat::Qoi:
+      format = StitchFormat::Qoi;
+      break;
+    case ImageFormat::Tiled:
+      format = StitchFormat::Tiled;
+      break;
+    default:
+      Log(L"Full-page captures are saved as BMP, PNG, QOI or tiles.\n");
+      return;
+    }
+
+    auto memDC = SafeDC::CreateMemDC(hwnd());
+    DIB tile = DIB::CreateNew(memDC, 32, width, height);
+    if (!tile) {
+      return;
+    }
+    std::ofstream os(output, std::ios::binary);
+    if (!os.is_open()) {
+      return;
+    }
+    RECT viewRect;
+    SetRect(&viewRect, 0, 0, width, height);
+    StitchWriter writer(os, format, bitCount, BI_RGB, PNG_LEVEL, pageHeight);
+    bool ok = true;
+    while (ok && writer.RowsWritten() < static_cast<DWORD>(pageHeight)) {
+      // The last tile stops short where the page ends, so its top rows may
+      // have been written with the tile before.
+      const long next = static_cast<long>(writer.RowsWritten());
+      window->scrollTo(0, next);
+      PumpMessages(SCROLL_SETTLE_DELAY);
+      long scrollHeight, top, view;
+      GetScroll(doc, scrollHeight, top, view);
+      if (top > next || next - top >= viewHeight) {
+        LogWarning(L"Scrolled to %d instead of %d.\n", top, next);
+        ok = false;
+        break;
+      }
+
+      auto oldBitmap = SelectBitmap(memDC, tile);
+      HRESULT hr = ::OleDraw(wb, DVASPECT_CONTENT, memDC, &viewRect);
+      SelectBitmap(memDC, oldBitmap);
+      if (FAILED(hr)) {
+        Log(L"OleDraw failed - %08x\n", hr);
+        ok = false;
+        break;
+      }
+      const DWORD skip = static_cast<DWORD>(next - top);
+      const DWORD rows = static_cast<DWORD>(
+        min(viewHeight - static_cast<long>(skip), pageHeight - next));
+      ok = writer.WriteRows(tile, skip, rows);
+    }
+    ok = ok && writer.End();
+    window->scrollTo(0, originalTop);
+    os.close();
+    if (!ok) {
+      DeleteFile(output);
+    }
+    else {
+      LogInfo(L"Captured %dx%d in %d tiles\n",
+          width,
+          pageHeight,
+          (pageHeight + viewHeight - 1) / viewHeight);
+    }
+  }
+
   void OleDraw(LPCWSTR output, WORD bitCount) {
     if (CComPtr<IWebBrowser2> wb = container_.GetBrowser()) {
       long width, height;
@@ -250,25 +494,74 @@ private:
         RECT scrollerRect;
         SetRect(&scrollerRect, 0, 0, width, height);
 
+        // For BMP, the DIB is created on the output file, so OleDraw
+        // renders straight into the file's pages.  Other formats, and BMP
+        // to be scaled or indexed, are encoded from a DIB in memory after
+        // drawing.  Indexed captures are drawn in 32bpp color.
+        const auto format = FormatFromPath(output);
+        const bool indexed = saver_.SavesIndexed(format);
+        const bool encode = format != ImageFormat::Bitmap
+                            || NeedsScaling(hwnd())
+                            || indexed;
         if (auto memDC = SafeDC::CreateMemDC(hwnd())) {
-          if (auto dib = DIB::CreateNew(memDC,
-                                        bitCount,
-                                        width,
-                                        height,
-                                        /*section*/nullptr,
-                                        /*initWithGrayscaleTable*/true)) {
-            auto oldBitmap = SelectBitmap(memDC, dib);
-            HRESULT hr = ::OleDraw(wb, DVASPECT_CONTENT, memDC, &scrollerRect);
-            if (SUCCEEDED(hr)) {
-              std::ofstream os(output, std::ios::binary);
-              if (os.is_open()) {
-                dib.Save(os);
+          // Whether the output was created or truncated here, and so may be
+          // deleted.  Encoded captures never write it until they are saved.
+          bool created = false;
+          bool drawn = false;
+          DIB dib = CaptureWithRetry([&]() {
+            DIB frame = encode
+              ? DIB::CreateNew(memDC,
+                               indexed ? 32 : bitCount,
+                               width,
+                               height,
+                               /*section*/nullptr,
+                               /*initWithGrayscaleTable*/true)
+              : DIB::CreateOnFile(output,
+                                  memDC,
+                                  bitCount,
+                                  width,
+                                  height,
+                                  /*initWithGrayscaleTable*/true);
+            created = created || (frame && !encode);
+            drawn = false;
+            if (frame) {
+              auto oldBitmap = SelectBitmap(memDC, frame);
+              HRESULT hr =
+                ::OleDraw(wb, DVASPECT_CONTENT, memDC, &scrollerRect);
+              if (SUCCEEDED(hr)) {
+                drawn = true;
               }
+              else {
+                Log(L"OleDraw failed - %08x\n", hr);
+              }
+              SelectBitmap(memDC, oldBitmap);
+            }
+            return drawn ? std::move(frame) : DIB();
+          });
+          if (drawn && encode) {
+            // Hashed, encoded and thumbnailed at once.  A near-duplicate is
+            // never written.
+            NormalizeDpi(dib, hwnd());
+            saver_.Save(DIB::Share(std::move(dib)), output, bitCount);
+          }
+          else if (drawn) {
+            // A duplicate drawn on the output file is deleted again.
+            ImageHash hash;
+            bool hashed = false;
+            if (saver_.ShouldSave(dib, output, hash, hashed)) {
+              if (hashed) {
+                saver_.RecordSaved(hash, output);
+              }
+              saver_.SaveThumbnails(dib, output);
             }
             else {
-              Log(L"OleDraw failed - %08x\n", hr);
+              // Unmap the output before deleting it.
+              dib = DIB();
+              DeleteFile(output);
             }
-            SelectBitmap(memDC, oldBitmap);
+          }
+          else if (created) {
+            DeleteFile(output);
           }
         }
       }
@@ -288,21 +581,53 @@ private:
         if (HDC target = GetDC(targetWindow)) {
           HANDLE section = nullptr;
           DWORD uw = width, uh = height;
-          DIB dib;
-          if (bitCount == 8) {
-            dib = DIB::CaptureFromHDC(target, 32, uw, uh, section);
-            dib.ConvertToGrayscale(target, section);
+          const auto format = FormatFromPath(output);
+          const bool indexed = saver_.SavesIndexed(format);
+          if (format == ImageFormat::Bitmap
+              && !indexed
+              && bitCount == 32
+              && !NeedsScaling(targetWindow)) {
+            // The screen format needs no conversion, so it is blitted
+            // straight into the output file.  A duplicate is deleted again.
+            DIB dib = CaptureWithRetry([&]() {
+              uw = width;
+              uh = height;
+              return DIB::CaptureToFile(target, bitCount, uw, uh, output);
+            });
+            ImageHash hash;
+            bool hashed = false;
+            if (dib && saver_.ShouldSave(dib, output, hash, hashed)) {
+              if (hashed) {
+                saver_.RecordSaved(hash, output);
+              }
+              saver_.SaveThumbnails(dib, output);
+            }
+            else if (dib) {
+              dib = DIB();
+              DeleteFile(output);
+            }
           }
           else {
-            dib = DIB::CaptureFromHDC(target, bitCount, uw, uh, section);
-          }
-          if (dib) {
-            std::ofstream os(output, std::ios::binary);
-            if (os.is_open()) {
-              dib.Save(os);
+            // Other depths are converted from a 32bpp grab strip by strip
+            // while encoding, so the converted frame is never allocated as
+            // a whole.  Indexed captures are quantized from it.
+            DIB dib = CaptureWithRetry([&]() {
+              uw = width;
+              uh = height;
+              return DIB::CaptureFromHDC(
+                target,
+                format == ImageFormat::Bitmap || bitCount == 8 || indexed
+                  ? 32 : bitCount,
+                uw,
+                uh,
+                section);
+            });
+            if (dib) {
+              NormalizeDpi(dib, targetWindow);
+              saver_.Save(DIB::Share(std::move(dib)), output, bitCount);
             }
-            ReleaseDC(targetWindow, target);
           }
+          ReleaseDC(targetWindow, target);
         }
       }
     }
@@ -313,6 +638,38 @@ public:
     return L"Minibrowser2 MainWindow";
   }
 
+  void SetDuplicateBits(int bits) {
+    saver_.GetOptions().duplicateBits = bits;
+  }
+
+  void SetStoreTileSize(DWORD tileSize) {
+    saver_.GetOptions().storeTileSize = tileSize;
+  }
+
+  void SetStoreDeltas(DWORD deltas) {
+    saver_.GetOptions().storeDeltas = deltas;
+  }
+
+  void SetNormalizeDpi(bool normalize) {
+    options_.normalizeDpi = normalize;
+  }
+
+  void SetThumbnailWidths(std::vector<DWORD> &&widths) {
+    saver_.GetOptions().thumbnailWidths = std::move(widths);
+  }
+
+  void SetIndexedColor(bool indexed) {
+    saver_.GetOptions().indexedColor = indexed;
+  }
+
+  void SetBlankRetries(DWORD retries) {
+    options_.blankRetries = retries;
+  }
+
+  void SetFullPage(bool fullPage) {
+    options_.fullPage = fullPage;
+  }
+
   LRESULT HandleMessage(UINT msg, WPARAM w, LPARAM l) {
     LRESULT ret = 0;
     std::wstring output;
@@ -365,10 +722,20 @@ public:
           Capture(output.c_str(), /*bitCount*/8);
         }
         break;
+      case ID_DEBUG_FULLPAGE:
+        if (ShowSaveDialog(L"fullpage", output)) {
+          CaptureFullPage(output.c_str(), /*bitCount*/8);
+        }
+        break;
       case ID_DEBUG_SCREENSHOT_EVENT:
         if (options_.autoCapture) {
           if (ShowSaveDialog(L"screenshot", output)) {
-            OleDraw(output.c_str(), /*bitCount*/8);
+            if (options_.fullPage) {
+              CaptureFullPage(output.c_str(), /*bitCount*/8);
+            }
+            else {
+              OleDraw(output.c_str(), /*bitCount*/8);
+            }
           }
         }
         break;
@@ -408,7 +775,7 @@ std::wstring DetermineAwarenessLevel(const std::wstring &cmdline) {
   }
   if (cmdline.find(L"--v2_thread") != std::string::npos) {
     auto ret = SetThreadDpiAwarenessContext(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
-    Log(L"SetThreadDpiAwarenessContext - %p\n", ret);
+    LogInfo(L"SetThreadDpiAwarenessContext - %p\n", ret);
     suffix += L" V2_THREAD";
   }
   if (cmdline.find(L"--systemdpi_process") != std::string::npos) {
@@ -422,22 +789,157 @@ std::wstring DetermineAwarenessLevel(const std::wstring &cmdline) {
   }
   if (cmdline.find(L"--systemdpi_thread") != std::string::npos) {
     auto ret = SetThreadDpiAwarenessContext(DPI_AWARENESS_CONTEXT_SYSTEM_AWARE);
-    Log(L"SetThreadDpiAwarenessContext - %p\n", ret);
+    LogInfo(L"SetThreadDpiAwarenessContext - %p\n", ret);
     suffix += L" SYSDPI_THREAD";
   }
   return suffix;
 }
 
+// --log=<path> appends the log to a file as well as the debugger.  The path
+// ends at the next space.
+void ConfigureLog(const std::wstring &cmdline) {
+  const std::wstring option(L"--log=");
+  const auto pos = cmdline.find(option);
+  if (pos == std::string::npos) {
+    return;
+  }
+  const auto start = pos + option.size();
+  const std::wstring path =
+    cmdline.substr(start, cmdline.find(L' ', start) - start);
+  auto sink = std::make_unique<FileSink>(path.c_str());
+  if (!sink->IsOpen()) {
+    Log(L"Failed to open %s - %08x\n", path.c_str(), GetLastError());
+    return;
+  }
+  Logger::AddSink(sink.release());
+}
+
+// --threads=N sets the number of threads for pixel kernels.  --threads=1 runs
+// them serially on the UI thread.
+void ConfigureScheduler(const std::wstring &cmdline) {
+  const std::wstring option(L"--threads=");
+  const auto pos = cmdline.find(option);
+  if (pos != std::string::npos) {
+    const auto threads = _wtoi(cmdline.c_str() + pos + option.size());
+    TaskScheduler::Default().SetThreadCount(max(threads, 0));
+  }
+  LogInfo(L"Pixel kernels use %u thread(s)\n",
+      TaskScheduler::Default().ThreadCount());
+}
+
+// --dedup=N skips saving captures within N bits of the dHash of one saved
+// before in the session.  --dedup=0 skips only exact look-alikes.
+int DuplicateBits(const std::wstring &cmdline) {
+  const std::wstring option(L"--dedup=");
+  const auto pos = cmdline.find(option);
+  if (pos == std::string::npos) {
+    return -1;
+  }
+  return min(_wtoi(cmdline.c_str() + pos + option.size()), 64);
+}
+
+// --store-tiles=N splits .cap captures into NxN tiles, so that pages that
+// differ in a small area share the storage of the rest.  N is rounded down
+// to a multiple of 8.
+DWORD StoreTileSize(const std::wstring &cmdline) {
+  const std::wstring option(L"--store-tiles=");
+  const auto pos = cmdline.find(option);
+  if (pos == std::string::npos) {
+    return 0;
+  }
+  return static_cast<DWORD>(max(_wtoi(cmdline.c_str() + pos + option.size()),
+                                0)) & ~7u;
+}
+
+// --store-deltas=N saves up to N captures in a row to the .cap store as
+// deltas on the capture before, listing only the tiles that changed.  Tiles
+// are 64 pixels unless --store-tiles says otherwise.
+DWORD StoreDeltas(const std::wstring &cmdline) {
+  const std::wstring option(L"--store-deltas=");
+  const auto pos = cmdline.find(option);
+  if (pos == std::string::npos) {
+    return 0;
+  }
+  return static_cast<DWORD>(max(_wtoi(cmdline.c_str() + pos + option.size()),
+                                0));
+}
+
+// --normalize-dpi scales captures of a window on a high-DPI monitor down to
+// 96 DPI, so that a page captures at the same size on any monitor.
+bool ShouldNormalizeDpi(const std::wstring &cmdline) {
+  return cmdline.find(L"--normalize-dpi") != std::string::npos;
+}
+
+// --thumbnails=W1,W2,... writes a PNG thumbnail of each width next to every
+// saved capture.
+std::vector<DWORD> ThumbnailWidths(const std::wstring &cmdline) {
+  std::vector<DWORD> widths;
+  const std::wstring option(L"--thumbnails=");
+  const auto pos = cmdline.find(option);
+  if (pos == std::string::npos) {
+    return widths;
+  }
+  for (LPCWSTR p = cmdline.c_str() + pos + option.size();; ++p) {
+    const int width = _wtoi(p);
+    if (width > 0) {
+      widths.push_back(width);
+    }
+    while (iswdigit(*p)) {
+      ++p;
+    }
+    if (*p != L',') {
+      break;
+    }
+  }
+  return widths;
+}
+
+// --indexed saves color captures as PNG and BMP with a palette: exactly in
+// 1, 4 or 8bpp when they have few enough colors, which most pages do.
+bool ShouldSaveIndexed(const std::wstring &cmdline) {
+  return cmdline.find(L"--indexed") != std::string::npos;
+}
+
+// --blank-retries=N captures a blank or near-blank frame again up to N
+// times, 3 by default, waiting longer each time for the page to paint.
+// --blank-retries=0 saves every frame as it is.
+DWORD BlankRetries(const std::wstring &cmdline) {
+  const std::wstring option(L"--blank-retries=");
+  const auto pos = cmdline.find(option);
+  if (pos == std::string::npos) {
+    return 3;
+  }
+  // The pause doubles with each retry, so a few are plenty.
+  return static_cast<DWORD>(
+    min(max(_wtoi(cmdline.c_str() + pos + option.size()), 0), 8));
+}
+
+// --full-page makes screenshot events capture the whole document, however
+// long, instead of the part in the window.
+bool ShouldCaptureFullPage(const std::wstring &cmdline) {
+  return cmdline.find(L"--full-page") != std::string::npos;
+}
+
 int WINAPI wWinMain(HINSTANCE hInstance,
                     HINSTANCE,
                     PWSTR pCmdLine,
                     int nCmdShow) {
   std::wstring title(L"Minibrowser2 -");
+  ConfigureLog(pCmdLine);
   title += DetermineAwarenessLevel(pCmdLine);
+  ConfigureScheduler(pCmdLine);
 
   const auto flags = COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE;
   if (SUCCEEDED(CoInitializeEx(nullptr, flags))) {
     if (auto p = std::make_unique<MainWindow>()) {
+      p->SetDuplicateBits(DuplicateBits(pCmdLine));
+      p->SetStoreTileSize(StoreTileSize(pCmdLine));
+      p->SetStoreDeltas(StoreDeltas(pCmdLine));
+      p->SetNormalizeDpi(ShouldNormalizeDpi(pCmdLine));
+      p->SetThumbnailWidths(ThumbnailWidths(pCmdLine));
+      p->SetIndexedColor(ShouldSaveIndexed(pCmdLine));
+      p->SetBlankRetries(BlankRetries(pCmdLine));
+      p->SetFullPage(ShouldCaptureFullPage(pCmdLine));
       if (p->Create(title.c_str(),
                     WS_OVERLAPPEDWINDOW,
                     /*style_ex*/0,
@@ -0,0 +1,182 @@
+#include <windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "parallel.h"
+
+struct TaskScheduler::Job {
+  const RangeFunc *func;
+  DWORD remaining;
+  std::mutex mutex;
+  std::condition_variable done;
+};
+
+// A kernel running on a worker may call ParallelFor again.  Such a nested
+// call runs inline; the outer loop already keeps every worker busy.
+static thread_local bool insideWorker = false;
+
+TaskScheduler &TaskScheduler::Default() {
+  static TaskScheduler scheduler(/*threadCount*/0);
+  return scheduler;
+}
+
+TaskScheduler::TaskScheduler(DWORD threadCount)
+  : threadCount_(0),
+    pending_(0),
+    stop_(false) {
+  Start(threadCount);
+}
+
+TaskScheduler::~TaskScheduler() {
+  Stop();
+}
+
+DWORD TaskScheduler::ThreadCount() const {
+  return threadCount_;
+}
+
+void TaskScheduler::SetThreadCount(DWORD threadCount) {
+  Stop();
+  Start(threadCount);
+}
+
+void TaskScheduler::Start(DWORD threadCount) {
+  if (threadCount == 0) {
+    threadCount = max(std::thread::hardware_concurrency(), 1u);
+  }
+  threadCount_ = threadCount;
+  stop_ = false;
+
+  // Queue 0 belongs to whichever thread calls ParallelFor.  Queues 1..N-1
+  // belong to the workers.
+  queues_.clear();
+  for (DWORD i = 0; i < threadCount_; ++i) {
+    queues_.emplace_back(new WorkQueue);
+  }
+  for (DWORD i = 1; i < threadCount_; ++i) {
+    workers_.emplace_back(&TaskScheduler::WorkerLoop, this, i);
+  }
+}
+
+void TaskScheduler::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+}
+
+bool TaskScheduler::TryPop(DWORD index, Task &task) {
+  auto &queue = *queues_[index];
+  std::lock_guard<std::mutex> lock(queue.lock);
+  if (queue.tasks.empty()) {
+    return false;
+  }
+  task = queue.tasks.front();
+  queue.tasks.pop_front();
+  --pending_;
+  return true;
+}
+
+// Thieves take from the back so that the owner keeps walking its own rows
+// front to back, which is friendlier to the prefetcher.
+bool TaskScheduler::TrySteal(DWORD index, Task &task) {
+  for (DWORD i = 1; i < threadCount_; ++i) {
+    auto &queue = *queues_[(index + i) % threadCount_];
+    std::lock_guard<std::mutex> lock(queue.lock);
+    if (!queue.tasks.empty()) {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+      --pending_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskScheduler::Run(const Task &task) {
+  (*task.job->func)(task.begin, task.end);
+
+  // Decrement under the lock so that the caller cannot destroy the job
+  // before we are done touching it.
+  std::lock_guard<std::mutex> lock(task.job->mutex);
+  if (--task.job->remaining == 0) {
+    task.job->done.notify_one();
+  }
+}
+
+void TaskScheduler::WorkerLoop(DWORD index) {
+  insideWorker = true;
+  for (;;) {
+    Task task;
+    if (TryPop(index, task) || TrySteal(index, task)) {
+      Run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+    if (stop_) {
+      break;
+    }
+  }
+}
+
+void TaskScheduler::ParallelFor(DWORD begin,
+                                DWORD end,
+                                DWORD grain,
+                                const RangeFunc &func) {
+  if (begin >= end) {
+    return;
+  }
+  grain = max(grain, 1u);
+  const DWORD numChunks = (end - begin + grain - 1) / grain;
+
+  if (threadCount_ <= 1 || numChunks == 1 || insideWorker) {
+    for (DWORD chunk = begin; chunk < end; chunk += min(grain, end - chunk)) {
+      func(chunk, chunk + min(grain, end - chunk));
+    }
+    return;
+  }
+
+  Job job;
+  job.func = &func;
+  job.remaining = numChunks;
+
+  // Deal out contiguous runs of chunks so that each thread starts on its own
+  // band of the image.  Imbalance is fixed up by stealing.
+  for (DWORD q = 0; q < threadCount_; ++q) {
+    const DWORD first = numChunks * q / threadCount_;
+    const DWORD last = numChunks * (q + 1) / threadCount_;
+    auto &queue = *queues_[q];
+    std::lock_guard<std::mutex> lock(queue.lock);
+    for (DWORD i = first; i < last; ++i) {
+      const DWORD chunkBegin = begin + i * grain;
+      queue.tasks.push_back({chunkBegin, min(chunkBegin + grain, end), &job});
+    }
+  }
+  pending_ += numChunks;
+  {
+    // A worker checks pending_ under mutex_ before it sleeps.  Taking the
+    // lock here makes sure it either sees the new count or gets this notify.
+    std::lock_guard<std::mutex> lock(mutex_);
+  }
+  wake_.notify_all();
+
+  Task task;
+  while (TryPop(0, task) || TrySteal(0, task)) {
+    Run(task);
+  }
+
+  std::unique_lock<std::mutex> lock(job.mutex);
+  job.done.wait(lock, [&job]() { return job.remaining == 0; });
+}
@@ -0,0 +1,52 @@
+class TaskScheduler {
+public:
+  typedef std::function<void(DWORD begin, DWORD end)> RangeFunc;
+
+private:
+  struct Job;
+  struct Task {
+    DWORD begin;
+    DWORD end;
+    Job *job;
+  };
+  struct WorkQueue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  DWORD threadCount_;
+  std::vector<std::unique_ptr<WorkQueue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<LONG> pending_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_;
+
+  void Start(DWORD threadCount);
+  void Stop();
+  void WorkerLoop(DWORD index);
+  bool TryPop(DWORD index, Task &task);
+  bool TrySteal(DWORD index, Task &task);
+  void Run(const Task &task);
+
+public:
+  static TaskScheduler &Default();
+
+  // threadCount == 0 picks the number of logical processors.
+  // threadCount == 1 runs everything inline on the caller's thread.
+  explicit TaskScheduler(DWORD threadCount);
+  ~TaskScheduler();
+
+  DWORD ThreadCount() const;
+
+  // Restarts the workers.  Must not be called while ParallelFor is running.
+  void SetThreadCount(DWORD threadCount);
+
+  // Splits [begin, end) into chunks of |grain| items and runs |func| on each
+  // chunk.  The chunks are the same regardless of the thread count, so a
+  // kernel that only writes its own chunk is deterministic.
+  void ParallelFor(DWORD begin,
+                   DWORD end,
+                   DWORD grain,
+                   const RangeFunc &func);
+};
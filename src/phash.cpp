@@ -0,0 +1,228 @@
+#include <windows.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "blob.h"
+#include "bitmap.h"
+#include "phash.h"
+
+static const DWORD kFine = 32;
+static const DWORD kCoarseX = 9;
+static const DWORD kCoarseY = 8;
+static const DWORD kDct = 8;
+static const double kPi = 3.14159265358979323846;
+
+ImageHash::ImageHash()
+  : dhash(0),
+    phash(0)
+{}
+
+void ImageHash::Save(std::ostream &os) const {
+  const auto flags = os.flags();
+  os << std::hex << std::setfill('0')
+     << std::setw(16) << dhash << ' '
+     << std::setw(16) << phash << '\n';
+  os.flags(flags);
+}
+
+bool ImageHash::Load(std::istream &is) {
+  const auto flags = is.flags();
+  is >> std::hex >> dhash >> phash;
+  is.flags(flags);
+  return !!is;
+}
+
+// No popcnt: it is not in every x86 CPU this runs on, and the bit trick is
+// only a few instructions.
+DWORD HashDistance(ULONGLONG a, ULONGLONG b) {
+  ULONGLONG v = a ^ b;
+  v = v - ((v >> 1) & 0x5555555555555555ull);
+  v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+  v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+  return static_cast<DWORD>((v * 0x0101010101010101ull) >> 56);
+}
+
+ImageHasher::ImageHasher(DWORD width, DWORD height)
+  : width_(width),
+    height_(height),
+    fineColumns_(width),
+    coarseColumns_(width) {
+  for (DWORD x = 0; x < width; ++x) {
+    fineColumns_[x] = static_cast<BYTE>(ULONGLONG(x) * kFine / width);
+    coarseColumns_[x] = static_cast<BYTE>(ULONGLONG(x) * kCoarseX / width);
+  }
+}
+
+void ImageHasher::AddRow(LPCBYTE gray, DWORD y, ULONGLONG *sums) const {
+  ULONGLONG *fine = sums + ULONGLONG(y) * kFine / height_ * kFine;
+  ULONGLONG *coarse =
+    sums + kFine * kFine + ULONGLONG(y) * kCoarseY / height_ * kCoarseX;
+
+  // Runs of pixels in the same cell are summed before touching |sums|.
+  DWORD run = 0;
+  BYTE cell = 0;
+  for (DWORD x = 0; x < width_; ++x) {
+    if (fineColumns_[x] != cell) {
+      fine[cell] += run;
+      cell = fineColumns_[x];
+      run = 0;
+    }
+    run += gray[x];
+    coarse[coarseColumns_[x]] += gray[x];
+  }
+  fine[cell] += run;
+}
+
+// Pixels of each grid cell.  The grids split the image as evenly as the
+// integer pixel boundaries allow.
+static std::vector<DWORD> CellSizes(DWORD length, DWORD cells) {
+  std::vector<DWORD> sizes(cells);
+  for (DWORD i = 0; i < length; ++i) {
+    ++sizes[ULONGLONG(i) * cells / length];
+  }
+  return sizes;
+}
+
+ImageHash ImageHasher::Finish(const ULONGLONG *sums) const {
+  ImageHash hash;
+
+  const auto fineX = CellSizes(width_, kFine);
+  const auto fineY = CellSizes(height_, kFine);
+  double fine[kFine][kFine];
+  for (DWORD y = 0; y < kFine; ++y) {
+    for (DWORD x = 0; x < kFine; ++x) {
+      fine[y][x] = static_cast<double>(sums[y * kFine + x])
+                   / (double(fineX[x]) * fineY[y]);
+    }
+  }
+
+  const auto coarseX = CellSizes(width_, kCoarseX);
+  const auto coarseY = CellSizes(height_, kCoarseY);
+  const ULONGLONG *coarse = sums + kFine * kFine;
+  for (DWORD y = 0; y < kCoarseY; ++y) {
+    for (DWORD x = 0; x + 1 < kCoarseX; ++x) {
+      const double left = static_cast<double>(coarse[y * kCoarseX + x])
+                          / (double(coarseX[x]) * coarseY[y]);
+      const double right = static_cast<double>(coarse[y * kCoarseX + x + 1])
+                           / (double(coarseX[x + 1]) * coarseY[y]);
+      if (left > right) {
+        hash.dhash |= 1ull << (y * 8 + x);
+      }
+    }
+  }
+
+  // Separable DCT-II of the 32x32 thumbnail, keeping only the lowest 8x8
+  // frequencies.  The scale factors do not change the signs against the
+  // median, so they are left out.
+  double basis[kDct][kFine];
+  for (DWORD u = 0; u < kDct; ++u) {
+    for (DWORD x = 0; x < kFine; ++x) {
+      basis[u][x] = std::cos((2 * x + 1) * u * kPi / (2 * kFine));
+    }
+  }
+  double columns[kDct][kFine];
+  for (DWORD v = 0; v < kDct; ++v) {
+    for (DWORD x = 0; x < kFine; ++x) {
+      double sum = 0;
+      for (DWORD y = 0; y < kFine; ++y) {
+        sum += basis[v][y] * fine[y][x];
+      }
+      columns[v][x] = sum;
+    }
+  }
+  double dct[kDct * kDct];
+  for (DWORD v = 0; v < kDct; ++v) {
+    for (DWORD u = 0; u < kDct; ++u) {
+      double sum = 0;
+      for (DWORD x = 0; x < kFine; ++x) {
+        sum += basis[u][x] * columns[v][x];
+      }
+      dct[v * kDct + u] = sum;
+    }
+  }
+
+  // The DC term is the mean brightness, far from the others, so it is left
+  // out of the median.
+  double ac[kDct * kDct - 1];
+  std::copy(dct + 1, dct + kDct * kDct, ac);
+  std::nth_element(ac, ac + ARRAYSIZE(ac) / 2, ac + ARRAYSIZE(ac));
+  const double median = ac[ARRAYSIZE(ac) / 2];
+  for (DWORD i = 0; i < kDct * kDct; ++i) {
+    if (dct[i] > median) {
+      hash.phash |= 1ull << i;
+    }
+  }
+  return hash;
+}
+
+HashIndex::HashIndex()
+  : size_(0)
+{}
+
+DWORD HashIndex::Size() const {
+  return size_;
+}
+
+static inline DWORD Chunk(ULONGLONG hash, DWORD chunk) {
+  return static_cast<DWORD>(hash >> (chunk * 16)) & 0xffff;
+}
+
+void HashIndex::Insert(ULONGLONG hash, DWORD id) {
+  if (buckets_.empty()) {
+    buckets_.resize(kChunks << kChunkBits);
+  }
+  const Entry entry = {hash, id};
+  for (DWORD c = 0; c < kChunks; ++c) {
+    buckets_[(c << kChunkBits) + Chunk(hash, c)].push_back(entry);
+  }
+  ++size_;
+}
+
+// Probes chunk values by their distance k from the query's, all chunks at
+// one k before the next.  After k, every hash within 4k + 3 bits has been
+// seen, so the search stops as soon as the best match is that close.
+bool HashIndex::FindNearest(ULONGLONG hash,
+                            DWORD maxDistance,
+                            DWORD &id,
+                            DWORD &distance) const {
+  if (size_ == 0) {
+    return false;
+  }
+
+  bool found = false;
+  DWORD best = maxDistance;
+  for (DWORD k = 0; k <= maxDistance / kChunks; ++k) {
+    for (DWORD c = 0; c < kChunks; ++c) {
+      const DWORD value = Chunk(hash, c);
+      // Every 16-bit mask with k bits set, in increasing order.
+      DWORD mask = (1u << k) - 1;
+      while (mask < (1u << kChunkBits)) {
+        const auto &bucket = buckets_[(c << kChunkBits) + (value ^ mask)];
+        for (const auto &entry : bucket) {
+          const DWORD d = HashDistance(entry.hash, hash);
+          if (d < best || (d == best && !found)) {
+            found = true;
+            best = d;
+            id = entry.id;
+          }
+        }
+        if (mask == 0) {
+          break;
+        }
+        const DWORD lowest = mask & (0 - mask);
+        const DWORD ripple = mask + lowest;
+        mask = (((ripple ^ mask) >> 2) / lowest) | ripple;
+      }
+    }
+    if (found && best <= kChunks * k + kChunks - 1) {
+      break;
+    }
+  }
+  if (found) {
+    distance = best;
+  }
+  return found;
+}
@@ -0,0 +1,71 @@
+// Perceptual fingerprints of captures.  Two captures of the same page hash
+// to values a few bits apart even after small rendering differences, so the
+// Hamming distance of two hashes says whether the pages look alike.
+// Include this after bitmap.h.
+
+struct ImageHash {
+  // Sign of the horizontal gradient over a 9x8 grayscale thumbnail.
+  ULONGLONG dhash;
+  // Low-frequency 8x8 DCT coefficients of a 32x32 grayscale thumbnail,
+  // each against their median.  Robust against scaling and gamma.
+  ULONGLONG phash;
+
+  ImageHash();
+
+  // One line of text, "dhash phash" in 16-digit hex.
+  void Save(std::ostream &os) const;
+  bool Load(std::istream &is);
+};
+
+DWORD HashDistance(ULONGLONG a, ULONGLONG b);
+
+// Averages luma over the thumbnail grids of both hashes.  Rows can be added
+// from multiple threads, each band to its own sums, which are added
+// together before Finish.
+class ImageHasher {
+private:
+  DWORD width_;
+  DWORD height_;
+  std::vector<BYTE> fineColumns_;
+  std::vector<BYTE> coarseColumns_;
+
+public:
+  static const DWORD kGridCells = 32 * 32 + 9 * 8;
+
+  // |width| and |height| are at least 32.
+  ImageHasher(DWORD width, DWORD height);
+
+  // Adds row |y| of 8-bit luma to |sums| of kGridCells elements.
+  void AddRow(LPCBYTE gray, DWORD y, ULONGLONG *sums) const;
+  ImageHash Finish(const ULONGLONG *sums) const;
+};
+
+// Multi-index hashing of 64-bit hashes.  A hash is filed under each of its
+// four 16-bit chunks.  Two hashes within r bits share a chunk within r / 4
+// bits, so a query probes only the chunks that close to its own, instead
+// of comparing against every stored hash.
+class HashIndex {
+private:
+  static const DWORD kChunks = 4;
+  static const DWORD kChunkBits = 16;
+
+  struct Entry {
+    ULONGLONG hash;
+    DWORD id;
+  };
+  // Entries by chunk value, per chunk.  Buckets hold the hashes themselves,
+  // so a probe reads one contiguous array.  Allocated on the first insert.
+  std::vector<std::vector<Entry>> buckets_;
+  DWORD size_;
+
+public:
+  HashIndex();
+
+  DWORD Size() const;
+  void Insert(ULONGLONG hash, DWORD id);
+  // Finds the stored hash closest to |hash| within |maxDistance| bits.
+  bool FindNearest(ULONGLONG hash,
+                   DWORD maxDistance,
+                   DWORD &id,
+                   DWORD &distance) const;
+};
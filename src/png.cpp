@@ -0,0 +1,453 @@
+#include <windows.h>
+#include <emmintrin.h>
+#include <stdlib.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "deflate.h"
+#include "kernel.h"
+#include "logger.h"
+#include "parallel.h"
+#include "png.h"
+
+// Input to each deflate task.  pigz uses 128KB; a bit more keeps the
+// per-chunk dictionary warm-up and block headers in the noise.
+static const SIZE_T kChunkSize = 256 * 1024;
+// Rows are converted and filtered this many bytes at a time.
+static const SIZE_T kBatchBytes = 1024 * 1024;
+static const DWORD kDictionarySize = 32 * 1024;
+// Zero bytes in front of every converted row, so that the filters can read
+// the pixel on the left of the first pixel without a branch.
+static const DWORD kRowPad = 16;
+
+enum PngFilter : BYTE {
+  kFilterNone = 0,
+  kFilterSub = 1,
+  kFilterUp = 2,
+  kFilterAverage = 3,
+  kFilterPaeth = 4,
+};
+
+static inline BYTE Paeth(int a, int b, int c) {
+  const int pa = std::abs(b - c);
+  const int pb = std::abs(a - c);
+  const int pc = std::abs(a + b - 2 * c);
+  return static_cast<BYTE>(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Each filter reads |raw| and |prior| (the row above) from |unit| bytes on
+// the left of the row, and writes |size| filtered bytes to |dst|.  The bytes
+// on the left are the zeros of kRowPad, which is where the left neighbors of
+// the first pixel come from; index them through a pointer moved back by
+// |unit|, since |i - unit| wraps around for the first pixel.
+
+static void FilterSub(LPCBYTE raw, LPCBYTE, LPBYTE dst, DWORD size,
+                      DWORD unit) {
+  DWORD i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+    const __m128i a =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i - unit));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_sub_epi8(x, a));
+  }
+  LPCBYTE left = raw - unit;
+  for (; i < size; ++i) {
+    dst[i] = static_cast<BYTE>(raw[i] - left[i]);
+  }
+}
+
+static void FilterUp(LPCBYTE raw, LPCBYTE prior, LPBYTE dst, DWORD size,
+                     DWORD) {
+  DWORD i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+    const __m128i b =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_sub_epi8(x, b));
+  }
+  for (; i < size; ++i) {
+    dst[i] = static_cast<BYTE>(raw[i] - prior[i]);
+  }
+}
+
+static void FilterAverage(LPCBYTE raw, LPCBYTE prior, LPBYTE dst, DWORD size,
+                          DWORD unit) {
+  const __m128i one = _mm_set1_epi8(1);
+  DWORD i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+    const __m128i a =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i - unit));
+    const __m128i b =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+    // pavgb rounds up.  PNG wants floor((a + b) / 2).
+    const __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                                     _mm_and_si128(_mm_xor_si128(a, b), one));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_sub_epi8(x, avg));
+  }
+  LPCBYTE left = raw - unit;
+  for (; i < size; ++i) {
+    dst[i] = static_cast<BYTE>(raw[i] - ((left[i] + prior[i]) >> 1));
+  }
+}
+
+// Paeth predictor on eight 16bit lanes.
+static inline __m128i Paeth8(__m128i a, __m128i b, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bc = _mm_sub_epi16(b, c);
+  const __m128i ac = _mm_sub_epi16(a, c);
+  const __m128i abc = _mm_add_epi16(bc, ac);
+  const __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+  const __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+  const __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+  const __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb),
+                                    _mm_cmpgt_epi16(pa, pc));
+  const __m128i useC = _mm_cmpgt_epi16(pb, pc);
+  const __m128i bOrC = _mm_or_si128(_mm_andnot_si128(useC, b),
+                                    _mm_and_si128(useC, c));
+  return _mm_or_si128(_mm_andnot_si128(notA, a), _mm_and_si128(notA, bOrC));
+}
+
+static void FilterPaeth(LPCBYTE raw, LPCBYTE prior, LPBYTE dst, DWORD size,
+                        DWORD unit) {
+  const __m128i zero = _mm_setzero_si128();
+  DWORD i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+    const __m128i a =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i - unit));
+    const __m128i b =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i));
+    const __m128i c =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + i - unit));
+    const __m128i lo = Paeth8(_mm_unpacklo_epi8(a, zero),
+                              _mm_unpacklo_epi8(b, zero),
+                              _mm_unpacklo_epi8(c, zero));
+    const __m128i hi = Paeth8(_mm_unpackhi_epi8(a, zero),
+                              _mm_unpackhi_epi8(b, zero),
+                              _mm_unpackhi_epi8(c, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                     _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+  }
+  LPCBYTE left = raw - unit;
+  LPCBYTE upperLeft = prior - unit;
+  for (; i < size; ++i) {
+    dst[i] = static_cast<BYTE>(raw[i] - Paeth(left[i], prior[i], upperLeft[i]));
+  }
+}
+
+// Sum of absolute values of the filtered bytes taken as signed, the
+// heuristic recommended by the PNG specification to pick a filter.
+static ULONGLONG FilterCost(LPCBYTE p, DWORD size) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+  DWORD i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    const __m128i abs = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(abs, zero));
+  }
+  ULONGLONG cost = static_cast<ULONGLONG>(_mm_cvtsi128_si32(sum))
+                   + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+  for (; i < size; ++i) {
+    cost += min(p[i], static_cast<BYTE>(256 - p[i]));
+  }
+  return cost;
+}
+
+static void PutBE32(LPBYTE p, DWORD value) {
+  p[0] = static_cast<BYTE>(value >> 24);
+  p[1] = static_cast<BYTE>(value >> 16);
+  p[2] = static_cast<BYTE>(value >> 8);
+  p[3] = static_cast<BYTE>(value);
+}
+
+PngWriter::PngWriter(std::ostream &os, int level)
+  : os_(os),
+    level_(max(0, min(level, 9))),
+    srcBitCount_(0),
+    toGrayscale_(false),
+    width_(0),
+    height_(0),
+    rowsWritten_(0),
+    rawStride_(0),
+    filterUnit_(1),
+    adaptiveFilter_(false),
+    headerPending_(true),
+    adler_(1),
+    history_(0)
+{}
+
+LPBYTE PngWriter::RawRow(DWORD i) {
+  return raw_.data() + (kRowPad + rawStride_) * i + kRowPad;
+}
+
+bool PngWriter::WriteChunk(LPCSTR type, LPCBYTE data, DWORD size) {
+  BYTE header[8];
+  PutBE32(header, size);
+  memcpy(header + 4, type, 4);
+  BYTE crc[4];
+  PutBE32(crc, Crc32(Crc32(0, header + 4, 4), data, size));
+  os_.write(reinterpret_cast<LPCSTR>(header), sizeof(header));
+  os_.write(reinterpret_cast<LPCSTR>(data), size);
+  os_.write(reinterpret_cast<LPCSTR>(crc), sizeof(crc));
+  return !!os_;
+}
+
+bool PngWriter::Begin(DWORD width,
+                      DWORD height,
+                      WORD bitCount,
+                      const RGBQUAD *colorTable,
+                      bool grayscale) {
+  static const BYTE kSignature[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a,
+  };
+  enum : BYTE {
+    kColorGray = 0,
+    kColorRGB = 2,
+    kColorPalette = 3,
+  };
+
+  if (width == 0 || height == 0 || width > MAXLONG || height > MAXLONG) {
+    Log(L"Invalid PNG dimensions: %ux%u\n", width, height);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+
+  BYTE colorType, bitDepth;
+  switch (bitCount) {
+  case 32:
+  case 24:
+    toGrayscale_ = grayscale && bitCount == 32;
+    colorType = toGrayscale_ ? kColorGray : kColorRGB;
+    bitDepth = 8;
+    rawStride_ = toGrayscale_ ? width : width * 3;
+    filterUnit_ = toGrayscale_ ? 1 : 3;
+    break;
+  case 8:
+  case 4:
+  case 1:
+    if (!colorTable) {
+      os_.setstate(std::ios::failbit);
+      return false;
+    }
+    colorType = IsGrayscaleRamp(colorTable, bitCount)
+                ? kColorGray : kColorPalette;
+    bitDepth = static_cast<BYTE>(bitCount);
+    rawStride_ = (width * bitCount + 7) / 8;
+    filterUnit_ = 1;
+    break;
+  default:
+    Log(L"PNG encoding of %dbpp is not supported.\n", bitCount);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+
+  srcBitCount_ = bitCount;
+  width_ = width;
+  height_ = height;
+  // Filters rarely pay off for palette indices or packed pixels.
+  adaptiveFilter_ = level_ > 0 && colorType != kColorPalette && bitDepth == 8;
+
+  const SIZE_T batchRows =
+    min(static_cast<SIZE_T>(height), max(static_cast<SIZE_T>(1), kBatchBytes / rawStride_));
+  raw_.assign((kRowPad + rawStride_) * (batchRows + 1), 0);
+  pending_.reserve(kDictionarySize
+                   + kChunkSize * TaskScheduler::Default().ThreadCount()
+                   + (1 + rawStride_) * batchRows);
+
+  os_.write(reinterpret_cast<LPCSTR>(kSignature), sizeof(kSignature));
+
+  BYTE ihdr[13];
+  PutBE32(ihdr, width);
+  PutBE32(ihdr + 4, height);
+  ihdr[8] = bitDepth;
+  ihdr[9] = colorType;
+  ihdr[10] = 0;  // deflate
+  ihdr[11] = 0;  // adaptive filtering
+  ihdr[12] = 0;  // no interlace
+  if (!WriteChunk("IHDR", ihdr, sizeof(ihdr))) {
+    return false;
+  }
+
+  if (colorType == kColorPalette) {
+    const DWORD numColors = 1 << bitCount;
+    std::vector<BYTE> plte(numColors * 3);
+    for (DWORD i = 0; i < numColors; ++i) {
+      plte[i * 3 + 0] = colorTable[i].rgbRed;
+      plte[i * 3 + 1] = colorTable[i].rgbGreen;
+      plte[i * 3 + 2] = colorTable[i].rgbBlue;
+    }
+    if (!WriteChunk("PLTE", plte.data(), static_cast<DWORD>(plte.size()))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void PngWriter::ConvertRow(LPCBYTE src, LPBYTE dst) const {
+  if (toGrayscale_) {
+    GrayscaleRow(src, dst, width_);
+  }
+  else if (srcBitCount_ == 32) {
+    for (DWORD x = 0; x < width_; ++x, src += 4, dst += 3) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+    }
+  }
+  else if (srcBitCount_ == 24) {
+    for (DWORD x = 0; x < width_; ++x, src += 3, dst += 3) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+    }
+  }
+  else {
+    // Packed pixels in a DIB are MSB first, the same as PNG.
+    memcpy(dst, src, rawStride_);
+  }
+}
+
+bool PngWriter::WriteRows(LPCBYTE top, LONG stride, DWORD count) {
+  typedef void (*FilterFunc)(LPCBYTE, LPCBYTE, LPBYTE, DWORD, DWORD);
+  static const FilterFunc kFilters[] = {
+    FilterSub, FilterUp, FilterAverage, FilterPaeth,
+  };
+
+  if (!os_ || count > height_ - rowsWritten_) {
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+
+  const DWORD batchRows =
+    static_cast<DWORD>(raw_.size() / (kRowPad + rawStride_)) - 1;
+  const SIZE_T lineSize = 1 + rawStride_;
+  auto &scheduler = TaskScheduler::Default();
+  while (count > 0) {
+    const DWORD rows = min(count, batchRows);
+    const SIZE_T offset = pending_.size();
+    pending_.resize(offset + lineSize * rows);
+    LPBYTE filtered = pending_.data() + offset;
+
+    scheduler.ParallelFor(0, rows, 16, [&](DWORD begin, DWORD end) {
+      for (DWORD i = begin; i < end; ++i) {
+        ConvertRow(top + static_cast<LONG_PTR>(stride) * i, RawRow(i + 1));
+      }
+    });
+
+    scheduler.ParallelFor(0, rows, 16, [&](DWORD begin, DWORD end) {
+      std::vector<BYTE> trial(adaptiveFilter_ ? rawStride_ : 0);
+      for (DWORD i = begin; i < end; ++i) {
+        LPCBYTE raw = RawRow(i + 1);
+        LPBYTE dst = filtered + lineSize * i;
+        dst[0] = kFilterNone;
+        memcpy(dst + 1, raw, rawStride_);
+        if (!adaptiveFilter_) {
+          continue;
+        }
+
+        ULONGLONG best = FilterCost(dst + 1, rawStride_);
+        for (BYTE type = kFilterSub; type <= kFilterPaeth; ++type) {
+          kFilters[type - 1](raw, RawRow(i), trial.data(), rawStride_,
+                             filterUnit_);
+          const ULONGLONG cost = FilterCost(trial.data(), rawStride_);
+          if (cost < best) {
+            best = cost;
+            dst[0] = type;
+            memcpy(dst + 1, trial.data(), rawStride_);
+          }
+        }
+      }
+    });
+
+    memcpy(RawRow(0), RawRow(rows), rawStride_);
+    top += static_cast<LONG_PTR>(stride) * rows;
+    count -= rows;
+    rowsWritten_ += rows;
+    if (!Compress(/*final*/false)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Deflates the pending bytes in kChunkSize pieces, one task per piece.  Until
+// the last call, it waits for enough data to keep every thread busy, and
+// leaves a partial piece for the next call.
+bool PngWriter::Compress(bool final) {
+  auto &scheduler = TaskScheduler::Default();
+  const SIZE_T available = pending_.size() - history_;
+  SIZE_T numChunks = final
+                     ? (available + kChunkSize - 1) / kChunkSize
+                     : available / kChunkSize;
+  if (!final && numChunks < scheduler.ThreadCount()) {
+    return true;
+  }
+
+  std::vector<std::vector<BYTE>> outputs(max(numChunks, static_cast<SIZE_T>(1)));
+  std::vector<DWORD> adlers(numChunks);
+  if (headerPending_) {
+    // CMF/FLG of the zlib stream with FLEVEL matching the level.
+    static const BYTE kFlags[] = {0x01, 0x5e, 0x9c, 0xda};
+    const int index = level_ < 2 ? 0 : level_ < 6 ? 1 : level_ == 6 ? 2 : 3;
+    outputs[0].push_back(0x78);
+    outputs[0].push_back(kFlags[index]);
+    headerPending_ = false;
+  }
+
+  LPCBYTE base = pending_.data();
+  scheduler.ParallelFor(
+    0, static_cast<DWORD>(numChunks), 1,
+    [&](DWORD begin, DWORD end) {
+      for (DWORD i = begin; i < end; ++i) {
+        const SIZE_T offset = history_ + kChunkSize * i;
+        const SIZE_T size = min(kChunkSize, pending_.size() - offset);
+        DeflateChunk(base + offset, size, offset, level_, outputs[i]);
+        adlers[i] = Adler32(1, base + offset, size);
+      }
+    });
+
+  SIZE_T consumed = history_;
+  for (SIZE_T i = 0; i < numChunks; ++i) {
+    const SIZE_T size = min(kChunkSize, pending_.size() - consumed);
+    adler_ = Adler32Combine(adler_, adlers[i], size);
+    consumed += size;
+  }
+
+  if (final) {
+    auto &last = outputs.back();
+    FinishDeflate(last);
+    last.resize(last.size() + 4);
+    PutBE32(last.data() + last.size() - 4, adler_);
+  }
+
+  for (const auto &output : outputs) {
+    if (!output.empty()
+        && !WriteChunk("IDAT",
+                       output.data(),
+                       static_cast<DWORD>(output.size()))) {
+      return false;
+    }
+  }
+
+  const SIZE_T keep = min(consumed, static_cast<SIZE_T>(kDictionarySize));
+  pending_.erase(pending_.begin(), pending_.begin() + (consumed - keep));
+  history_ = keep;
+  return true;
+}
+
+bool PngWriter::End() {
+  if (!os_ || rowsWritten_ != height_) {
+    Log(L"PNG ended after %u of %u rows.\n", rowsWritten_, height_);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+  return Compress(/*final*/true) && WriteChunk("IEND", nullptr, 0);
+}
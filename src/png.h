@@ -0,0 +1,52 @@
+// Streaming PNG encoder.  Rows are given top to bottom in DIB pixel format,
+// so a caller can feed strips of any size and never holds the whole image.
+//
+// Each batch of rows is filtered in parallel, and the filtered stream is cut
+// into fixed-size chunks that are deflated independently on the default
+// TaskScheduler.  Every chunk uses the 32KB before it as its dictionary, so
+// the ratio stays close to a single-threaded deflate.  Each chunk becomes
+// one IDAT.
+class PngWriter {
+private:
+  std::ostream &os_;
+  int level_;
+  WORD srcBitCount_;
+  bool toGrayscale_;
+  DWORD width_;
+  DWORD height_;
+  DWORD rowsWritten_;
+  DWORD rawStride_;
+  DWORD filterUnit_;
+  bool adaptiveFilter_;
+  bool headerPending_;
+  DWORD adler_;
+
+  // Converted rows of the current batch.  Row 0 holds the last row of the
+  // previous batch, which the Up/Avg/Paeth filters refer to.
+  std::vector<BYTE> raw_;
+  // Filtered bytes not yet compressed, preceded by up to 32KB of history.
+  std::vector<BYTE> pending_;
+  SIZE_T history_;
+
+  LPBYTE RawRow(DWORD i);
+  void ConvertRow(LPCBYTE src, LPBYTE dst) const;
+  bool WriteChunk(LPCSTR type, LPCBYTE data, DWORD size);
+  bool Compress(bool final);
+
+public:
+  PngWriter(std::ostream &os, int level);
+
+  // |bitCount| is the bit depth of the rows passed to WriteRows.  32bpp rows
+  // are converted to 8bpp grayscale if |grayscale| is true, otherwise to RGB
+  // without alpha.  For 8bpp or less, |colorTable| is written as PLTE unless
+  // it is a grayscale ramp.
+  bool Begin(DWORD width,
+             DWORD height,
+             WORD bitCount,
+             const RGBQUAD *colorTable,
+             bool grayscale);
+  // |stride| is the distance from one row to the row below, which is
+  // negative for a bottom-up DIB.
+  bool WriteRows(LPCBYTE top, LONG stride, DWORD count);
+  bool End();
+};
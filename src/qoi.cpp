@@ -0,0 +1,326 @@
+#include <windows.h>
+#include <intrin.h>
+#include <emmintrin.h>
+#include "qoi.h"
+
+enum : BYTE {
+  kOpIndex = 0x00,  // 00xxxxxx
+  kOpDiff = 0x40,   // 01xxxxxx
+  kOpLuma = 0x80,   // 10xxxxxx
+  kOpRun = 0xc0,    // 11xxxxxx
+  kOpRGB = 0xfe,
+  kOpRGBA = 0xff,
+  kMask2 = 0xc0,
+};
+
+static const DWORD kMaxRun = 62;
+static const BYTE kMagic[] = {'q', 'o', 'i', 'f'};
+static const BYTE kEndMarker[kQoiEndSize] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+// Pixels are kept as they are laid out in a 32bpp DIB: B, G, R, A from the
+// least significant byte.
+static const DWORD kOpaqueBlack = 0xff000000;
+
+static inline BYTE Blue(DWORD px) { return static_cast<BYTE>(px); }
+static inline BYTE Green(DWORD px) { return static_cast<BYTE>(px >> 8); }
+static inline BYTE Red(DWORD px) { return static_cast<BYTE>(px >> 16); }
+static inline BYTE Alpha(DWORD px) { return static_cast<BYTE>(px >> 24); }
+
+static inline DWORD Hash(DWORD px) {
+  return (Red(px) * 3 + Green(px) * 5 + Blue(px) * 7 + Alpha(px) * 11) & 63;
+}
+
+template<WORD kBitCount>
+static inline DWORD LoadPixel(LPCBYTE p) {
+  switch (kBitCount) {
+  case 8:
+    return kOpaqueBlack | (p[0] * 0x010101u);
+  case 24:
+    return kOpaqueBlack | p[0] | (p[1] << 8) | (p[2] << 16);
+  default:
+    return *reinterpret_cast<const DWORD*>(p);
+  }
+}
+
+template<WORD kBitCount>
+static inline void StorePixel(LPBYTE p, DWORD px) {
+  switch (kBitCount) {
+  case 8:
+    p[0] = Green(px);
+    break;
+  case 24:
+    p[0] = Blue(px);
+    p[1] = Green(px);
+    p[2] = Red(px);
+    break;
+  default:
+    *reinterpret_cast<DWORD*>(p) = px;
+    break;
+  }
+}
+
+static inline void PutBE32(LPBYTE p, DWORD value) {
+  p[0] = static_cast<BYTE>(value >> 24);
+  p[1] = static_cast<BYTE>(value >> 16);
+  p[2] = static_cast<BYTE>(value >> 8);
+  p[3] = static_cast<BYTE>(value);
+}
+
+static inline DWORD GetBE32(LPCBYTE p) {
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Number of pixels from |src| equal to |px|, up to |count|.  Flat web pages
+// are mostly runs, so this is where the encoder spends its time; whole
+// vectors are compared at once for 8bpp and 32bpp.
+template<WORD kBitCount>
+static DWORD RunLength(LPCBYTE src, DWORD count, DWORD px) {
+  DWORD n = 0;
+  if (kBitCount == 32 || kBitCount == 8) {
+    const DWORD perVector = 16 / (kBitCount / 8);
+    const __m128i target = kBitCount == 32
+      ? _mm_set1_epi32(static_cast<int>(px))
+      : _mm_set1_epi8(static_cast<char>(Green(px)));
+    for (; n + perVector <= count; n += perVector) {
+      const __m128i v = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(src + n * (kBitCount / 8)));
+      const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, target));
+      if (mask != 0xffff) {
+        unsigned long firstDiff;
+        _BitScanForward(&firstDiff, ~mask);
+        return n + firstDiff / (kBitCount / 8);
+      }
+    }
+  }
+  for (; n < count && LoadPixel<kBitCount>(src + n * (kBitCount / 8)) == px;
+       ++n) {}
+  return n;
+}
+
+template<WORD kBitCount>
+static SIZE_T EncodeRowT(LPCBYTE src,
+                         DWORD width,
+                         LPBYTE dst,
+                         DWORD *index,
+                         DWORD &prev,
+                         DWORD &run) {
+  const DWORD step = kBitCount / 8;
+  LPBYTE out = dst;
+  for (DWORD x = 0; x < width; ++x, src += step) {
+    const DWORD px = LoadPixel<kBitCount>(src);
+    if (px == prev) {
+      const DWORD n = RunLength<kBitCount>(src, width - x, px);
+      run += n;
+      while (run >= kMaxRun) {
+        *out++ = static_cast<BYTE>(kOpRun | (kMaxRun - 1));
+        run -= kMaxRun;
+      }
+      x += n - 1;
+      src += (n - 1) * step;
+      continue;
+    }
+    if (run) {
+      *out++ = static_cast<BYTE>(kOpRun | (run - 1));
+      run = 0;
+    }
+
+    const DWORD hash = Hash(px);
+    if (index[hash] == px) {
+      *out++ = static_cast<BYTE>(kOpIndex | hash);
+    }
+    else if (Alpha(px) == Alpha(prev)) {
+      index[hash] = px;
+      const signed char dr = static_cast<signed char>(Red(px) - Red(prev));
+      const signed char dg = static_cast<signed char>(Green(px) - Green(prev));
+      const signed char db = static_cast<signed char>(Blue(px) - Blue(prev));
+      const signed char drg = static_cast<signed char>(dr - dg);
+      const signed char dbg = static_cast<signed char>(db - dg);
+      if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        *out++ = static_cast<BYTE>(kOpDiff
+                                   | ((dr + 2) << 4)
+                                   | ((dg + 2) << 2)
+                                   | (db + 2));
+      }
+      else if (dg >= -32 && dg <= 31
+               && drg >= -8 && drg <= 7
+               && dbg >= -8 && dbg <= 7) {
+        *out++ = static_cast<BYTE>(kOpLuma | (dg + 32));
+        *out++ = static_cast<BYTE>(((drg + 8) << 4) | (dbg + 8));
+      }
+      else {
+        *out++ = kOpRGB;
+        *out++ = Red(px);
+        *out++ = Green(px);
+        *out++ = Blue(px);
+      }
+    }
+    else {
+      index[hash] = px;
+      *out++ = kOpRGBA;
+      *out++ = Red(px);
+      *out++ = Green(px);
+      *out++ = Blue(px);
+      *out++ = Alpha(px);
+    }
+    prev = px;
+  }
+  return out - dst;
+}
+
+// Every op checks that its operands are before |end|, so a truncated or
+// corrupted stream fails the row instead of reading past the buffer.
+template<WORD kBitCount>
+static bool DecodeRowT(LPCBYTE &src,
+                       LPCBYTE end,
+                       LPBYTE dst,
+                       DWORD width,
+                       DWORD *index,
+                       DWORD &prev,
+                       DWORD &run) {
+  const DWORD step = kBitCount / 8;
+  LPCBYTE in = src;
+  for (DWORD x = 0; x < width; ++x, dst += step) {
+    if (run) {
+      --run;
+      StorePixel<kBitCount>(dst, prev);
+      continue;
+    }
+    if (in >= end) {
+      return false;
+    }
+
+    DWORD px = prev;
+    const BYTE op = *in++;
+    if (op == kOpRGB || op == kOpRGBA) {
+      const SIZE_T size = op == kOpRGB ? 3 : 4;
+      if (static_cast<SIZE_T>(end - in) < size) {
+        return false;
+      }
+      px = (px & kOpaqueBlack) | (in[0] << 16) | (in[1] << 8) | in[2];
+      if (op == kOpRGBA) {
+        px = (px & ~kOpaqueBlack) | (static_cast<DWORD>(in[3]) << 24);
+      }
+      in += size;
+    }
+    else switch (op & kMask2) {
+    case kOpIndex:
+      px = index[op];
+      break;
+    case kOpDiff: {
+      const BYTE r = static_cast<BYTE>(Red(px) + ((op >> 4) & 3) - 2);
+      const BYTE g = static_cast<BYTE>(Green(px) + ((op >> 2) & 3) - 2);
+      const BYTE b = static_cast<BYTE>(Blue(px) + (op & 3) - 2);
+      px = (px & kOpaqueBlack) | (r << 16) | (g << 8) | b;
+      break;
+    }
+    case kOpLuma: {
+      if (in >= end) {
+        return false;
+      }
+      const int dg = (op & 0x3f) - 32;
+      const BYTE rb = *in++;
+      const BYTE r = static_cast<BYTE>(Red(px) + dg - 8 + (rb >> 4));
+      const BYTE g = static_cast<BYTE>(Green(px) + dg);
+      const BYTE b = static_cast<BYTE>(Blue(px) + dg - 8 + (rb & 0x0f));
+      px = (px & kOpaqueBlack) | (r << 16) | (g << 8) | b;
+      break;
+    }
+    case kOpRun:
+      run = op & 0x3f;
+      break;
+    }
+    index[Hash(px)] = px;
+    StorePixel<kBitCount>(dst, px);
+    prev = px;
+  }
+  src = in;
+  return true;
+}
+
+SIZE_T QoiEncoder::MaxRowSize(DWORD width) {
+  // kOpRGBA for every pixel, plus a run flushed in front.
+  return SIZE_T(width) * 5 + 1;
+}
+
+void QoiEncoder::WriteHeader(LPBYTE dst,
+                             DWORD width,
+                             DWORD height,
+                             WORD bitCount) {
+  memcpy(dst, kMagic, sizeof(kMagic));
+  PutBE32(dst + 4, width);
+  PutBE32(dst + 8, height);
+  dst[12] = static_cast<BYTE>(bitCount / 8);
+  dst[13] = 0;  // sRGB with linear alpha
+}
+
+QoiEncoder::QoiEncoder()
+  : prev_(kOpaqueBlack),
+    run_(0) {
+  memset(index_, 0, sizeof(index_));
+}
+
+SIZE_T QoiEncoder::EncodeRow(LPCBYTE src,
+                             DWORD width,
+                             WORD bitCount,
+                             LPBYTE dst) {
+  switch (bitCount) {
+  case 8:
+    return EncodeRowT<8>(src, width, dst, index_, prev_, run_);
+  case 24:
+    return EncodeRowT<24>(src, width, dst, index_, prev_, run_);
+  case 32:
+    return EncodeRowT<32>(src, width, dst, index_, prev_, run_);
+  }
+  return 0;
+}
+
+SIZE_T QoiEncoder::Finish(LPBYTE dst) {
+  LPBYTE out = dst;
+  if (run_) {
+    *out++ = static_cast<BYTE>(kOpRun | (run_ - 1));
+    run_ = 0;
+  }
+  memcpy(out, kEndMarker, sizeof(kEndMarker));
+  return out + sizeof(kEndMarker) - dst;
+}
+
+bool QoiDecoder::ReadHeader(LPCBYTE src,
+                            SIZE_T size,
+                            DWORD &width,
+                            DWORD &height,
+                            WORD &bitCount) {
+  if (size < kQoiHeaderSize || memcmp(src, kMagic, sizeof(kMagic)) != 0) {
+    return false;
+  }
+  width = GetBE32(src + 4);
+  height = GetBE32(src + 8);
+  bitCount = src[12] * 8;
+  return width > 0
+         && height > 0
+         && width <= MAXLONG
+         && height <= MAXLONG
+         && (bitCount == 8 || bitCount == 24 || bitCount == 32)
+         && src[13] <= 1;
+}
+
+QoiDecoder::QoiDecoder()
+  : prev_(kOpaqueBlack),
+    run_(0) {
+  memset(index_, 0, sizeof(index_));
+}
+
+bool QoiDecoder::DecodeRow(LPCBYTE &src,
+                           LPCBYTE end,
+                           LPBYTE dst,
+                           DWORD width,
+                           WORD bitCount) {
+  switch (bitCount) {
+  case 8:
+    return DecodeRowT<8>(src, end, dst, width, index_, prev_, run_);
+  case 24:
+    return DecodeRowT<24>(src, end, dst, width, index_, prev_, run_);
+  case 32:
+    return DecodeRowT<32>(src, end, dst, width, index_, prev_, run_);
+  }
+  return false;
+}
@@ -0,0 +1,55 @@
+// QOI, the Quite OK Image format (https://qoiformat.org).  One pass over the
+// pixels with a 64-entry color cache, runs, and small deltas.  It does a
+// fraction of the work of deflate and still shrinks flat web content well.
+//
+// 8bpp grayscale is stored with channels == 1, which is our extension.  The
+// pixels are encoded as opaque gray RGBA, so the stream itself is standard.
+//
+// Both sides work one row at a time and keep their state across rows, so a
+// frame can be written or read in strips.
+const SIZE_T kQoiHeaderSize = 14;
+const SIZE_T kQoiEndSize = 8;
+
+class QoiEncoder {
+private:
+  DWORD index_[64];
+  DWORD prev_;
+  DWORD run_;
+
+public:
+  // Worst case of EncodeRow for a row of |width| pixels.
+  static SIZE_T MaxRowSize(DWORD width);
+  // |bitCount| is 8, 24 or 32.  The number of channels is bitCount / 8.
+  static void WriteHeader(LPBYTE dst, DWORD width, DWORD height, WORD bitCount);
+
+  QoiEncoder();
+  SIZE_T EncodeRow(LPCBYTE src, DWORD width, WORD bitCount, LPBYTE dst);
+  // Flushes a pending run and writes the end marker.  Needs up to
+  // kQoiEndSize + 1 bytes.
+  SIZE_T Finish(LPBYTE dst);
+};
+
+class QoiDecoder {
+private:
+  DWORD index_[64];
+  DWORD prev_;
+  DWORD run_;
+
+public:
+  // Returns false unless |src| starts with a valid header.  |bitCount| is the
+  // DIB format the image decodes to.
+  static bool ReadHeader(LPCBYTE src,
+                         SIZE_T size,
+                         DWORD &width,
+                         DWORD &height,
+                         WORD &bitCount);
+
+  QoiDecoder();
+  // Decodes one row from [src, end) and advances |src|.  Returns false if
+  // the data ends in the middle of the row.
+  bool DecodeRow(LPCBYTE &src,
+                 LPCBYTE end,
+                 LPBYTE dst,
+                 DWORD width,
+                 WORD bitCount);
+};
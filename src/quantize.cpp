@@ -0,0 +1,476 @@
+#include <windows.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "parallel.h"
+#include "quantize.h"
+
+static const DWORD kNoColor = 0xffffffff;
+static const DWORD kColorMask = 0x00ffffff;
+static const DWORD kMapperSlots = 1024;
+
+static inline DWORD HashColor(DWORD color) {
+  DWORD h = color * 0x9e3779b1u;
+  return h ^ (h >> 15);
+}
+
+static inline int Channel(DWORD color, int shift) {
+  return static_cast<int>((color >> shift) & 0xff);
+}
+
+ColorCounter::ColorCounter(DWORD limit)
+  : limit_(limit),
+    size_(0),
+    overflow_(false),
+    colors_(64, kNoColor),
+    counts_(64)
+{}
+
+// The table is kept at most half full.
+void ColorCounter::Grow() {
+  std::vector<DWORD> colors(colors_.size() * 2, kNoColor);
+  std::vector<DWORD> counts(colors.size());
+  const DWORD mask = static_cast<DWORD>(colors.size()) - 1;
+  for (SIZE_T i = 0; i < colors_.size(); ++i) {
+    if (colors_[i] != kNoColor) {
+      DWORD slot = HashColor(colors_[i]) & mask;
+      while (colors[slot] != kNoColor) {
+        slot = (slot + 1) & mask;
+      }
+      colors[slot] = colors_[i];
+      counts[slot] = counts_[i];
+    }
+  }
+  colors_.swap(colors);
+  counts_.swap(counts);
+}
+
+void ColorCounter::Add(DWORD color, DWORD count) {
+  const DWORD mask = static_cast<DWORD>(colors_.size()) - 1;
+  for (DWORD slot = HashColor(color) & mask;; slot = (slot + 1) & mask) {
+    if (colors_[slot] == color) {
+      counts_[slot] += count;
+      return;
+    }
+    if (colors_[slot] == kNoColor) {
+      if (size_ == limit_) {
+        overflow_ = true;
+        return;
+      }
+      colors_[slot] = color;
+      counts_[slot] = count;
+      if (++size_ * 2 > colors_.size()) {
+        Grow();
+      }
+      return;
+    }
+  }
+}
+
+bool ColorCounter::AddRow(const DWORD *pixels, DWORD width) {
+  const __m128i mask = _mm_set1_epi32(kColorMask);
+  DWORD x = 0;
+  while (x < width && !overflow_) {
+    const DWORD color = pixels[x] & kColorMask;
+    const __m128i run = _mm_set1_epi32(static_cast<int>(color));
+    DWORD end = x + 1;
+    for (; end + 4 <= width; end += 4) {
+      const __m128i v = _mm_and_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + end)),
+        mask);
+      const int equal = _mm_movemask_epi8(_mm_cmpeq_epi32(v, run));
+      if (equal != 0xffff) {
+        // Each pixel is four bits of the mask.
+        for (int bits = equal; bits & 0xf; bits >>= 4) {
+          ++end;
+        }
+        break;
+      }
+    }
+    while (end < width && (pixels[end] & kColorMask) == color) {
+      ++end;
+    }
+    Add(color, end - x);
+    x = end;
+  }
+  return !overflow_;
+}
+
+bool ColorCounter::Merge(const ColorCounter &other) {
+  overflow_ = overflow_ || other.overflow_;
+  for (SIZE_T i = 0; i < other.colors_.size() && !overflow_; ++i) {
+    if (other.colors_[i] != kNoColor) {
+      Add(other.colors_[i], other.counts_[i]);
+    }
+  }
+  return !overflow_;
+}
+
+bool ColorCounter::Overflow() const {
+  return overflow_;
+}
+
+DWORD ColorCounter::Size() const {
+  return size_;
+}
+
+void ColorCounter::GetColors(std::vector<DWORD> &colors,
+                             std::vector<DWORD> &counts) const {
+  std::vector<ULONGLONG> sorted;
+  sorted.reserve(size_);
+  for (SIZE_T i = 0; i < colors_.size(); ++i) {
+    if (colors_[i] != kNoColor) {
+      sorted.push_back(static_cast<ULONGLONG>(colors_[i]) << 32 | counts_[i]);
+    }
+  }
+  std::sort(sorted.begin(), sorted.end());
+  colors.resize(sorted.size());
+  counts.resize(sorted.size());
+  for (SIZE_T i = 0; i < sorted.size(); ++i) {
+    colors[i] = static_cast<DWORD>(sorted[i] >> 32);
+    counts[i] = static_cast<DWORD>(sorted[i]);
+  }
+}
+
+static inline DWORD BinOf(DWORD color) {
+  return ((color >> 9) & 0x7c00) | ((color >> 6) & 0x03e0)
+         | ((color >> 3) & 0x001f);
+}
+
+ColorHistogram::ColorHistogram()
+  : counts_(kBins),
+    lowBits_(kBins * 3)
+{}
+
+void ColorHistogram::AddRow(const DWORD *pixels, DWORD width) {
+  for (DWORD x = 0; x < width; ++x) {
+    const DWORD color = pixels[x];
+    const DWORD bin = BinOf(color);
+    ++counts_[bin];
+    lowBits_[bin * 3 + 0] += (color >> 16) & 7;
+    lowBits_[bin * 3 + 1] += (color >> 8) & 7;
+    lowBits_[bin * 3 + 2] += color & 7;
+  }
+}
+
+void ColorHistogram::Merge(const ColorHistogram &other) {
+  for (DWORD i = 0; i < kBins; ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  for (DWORD i = 0; i < kBins * 3; ++i) {
+    lowBits_[i] += other.lowBits_[i];
+  }
+}
+
+void ColorHistogram::GetColors(std::vector<DWORD> &colors,
+                               std::vector<DWORD> &counts) const {
+  colors.clear();
+  counts.clear();
+  for (DWORD bin = 0; bin < kBins; ++bin) {
+    const DWORD count = counts_[bin];
+    if (count == 0) {
+      continue;
+    }
+    // The mean of the low bits is at most 7, so channels stay in a byte.
+    const DWORD r =
+      ((bin >> 7) & 0xf8) + (lowBits_[bin * 3] + count / 2) / count;
+    const DWORD g =
+      ((bin >> 2) & 0xf8) + (lowBits_[bin * 3 + 1] + count / 2) / count;
+    const DWORD b =
+      ((bin << 3) & 0xf8) + (lowBits_[bin * 3 + 2] + count / 2) / count;
+    colors.push_back(r << 16 | g << 8 | b);
+    counts.push_back(count);
+  }
+}
+
+namespace {
+
+struct ColorBox {
+  DWORD begin;
+  DWORD end;
+  ULONGLONG pixels;
+  // Bit position of the longest side in 0x00RRGGBB, and its length.
+  int shift;
+  int length;
+};
+
+}  // namespace
+
+static void MeasureBox(const std::vector<ULONGLONG> &entries, ColorBox &box) {
+  int low[3] = {255, 255, 255};
+  int high[3] = {0, 0, 0};
+  box.pixels = 0;
+  for (DWORD i = box.begin; i < box.end; ++i) {
+    const DWORD color = static_cast<DWORD>(entries[i] >> 32);
+    for (int c = 0; c < 3; ++c) {
+      const int value = Channel(color, c * 8);
+      low[c] = min(low[c], value);
+      high[c] = max(high[c], value);
+    }
+    box.pixels += static_cast<DWORD>(entries[i]);
+  }
+  box.shift = 0;
+  box.length = -1;
+  for (int c = 0; c < 3; ++c) {
+    if (high[c] - low[c] > box.length) {
+      box.length = high[c] - low[c];
+      box.shift = c * 8;
+    }
+  }
+}
+
+DWORD MedianCut(const std::vector<DWORD> &colors,
+                const std::vector<DWORD> &counts,
+                DWORD maxColors,
+                RGBQUAD *palette) {
+  if (colors.empty() || maxColors == 0) {
+    return 0;
+  }
+
+  // Color in the high half and count in the low, so a box is sorted along a
+  // side by rewriting the high half.
+  std::vector<ULONGLONG> entries(colors.size());
+  for (SIZE_T i = 0; i < colors.size(); ++i) {
+    entries[i] = static_cast<ULONGLONG>(colors[i]) << 32 | counts[i];
+  }
+  std::vector<ColorBox> boxes(1);
+  boxes[0].begin = 0;
+  boxes[0].end = static_cast<DWORD>(entries.size());
+  MeasureBox(entries, boxes[0]);
+
+  while (boxes.size() < maxColors) {
+    SIZE_T best = boxes.size();
+    ULONGLONG bestScore = 0;
+    for (SIZE_T i = 0; i < boxes.size(); ++i) {
+      const ULONGLONG score = boxes[i].pixels * boxes[i].length;
+      if (boxes[i].end - boxes[i].begin > 1 && score >= bestScore) {
+        best = i;
+        bestScore = score;
+      }
+    }
+    if (best == boxes.size()) {
+      break;
+    }
+
+    ColorBox &box = boxes[best];
+    const int shift = box.shift;
+    std::sort(entries.begin() + box.begin,
+              entries.begin() + box.end,
+              [shift](ULONGLONG a, ULONGLONG b) {
+                return Channel(static_cast<DWORD>(a >> 32), shift)
+                       < Channel(static_cast<DWORD>(b >> 32), shift);
+              });
+    ULONGLONG below = 0;
+    DWORD split = box.begin + 1;
+    for (DWORD i = box.begin; i + 1 < box.end; ++i) {
+      below += static_cast<DWORD>(entries[i]);
+      split = i + 1;
+      if (below * 2 >= box.pixels) {
+        break;
+      }
+    }
+
+    ColorBox upper = box;
+    upper.begin = split;
+    box.end = split;
+    MeasureBox(entries, box);
+    MeasureBox(entries, upper);
+    boxes.push_back(upper);
+  }
+
+  for (SIZE_T i = 0; i < boxes.size(); ++i) {
+    ULONGLONG sums[3] = {};
+    for (DWORD j = boxes[i].begin; j < boxes[i].end; ++j) {
+      const DWORD color = static_cast<DWORD>(entries[j] >> 32);
+      const DWORD count = static_cast<DWORD>(entries[j]);
+      for (int c = 0; c < 3; ++c) {
+        sums[c] += static_cast<ULONGLONG>(Channel(color, c * 8)) * count;
+      }
+    }
+    const ULONGLONG pixels = boxes[i].pixels;
+    auto &entry = palette[i];
+    entry.rgbBlue = static_cast<BYTE>((sums[0] + pixels / 2) / pixels);
+    entry.rgbGreen = static_cast<BYTE>((sums[1] + pixels / 2) / pixels);
+    entry.rgbRed = static_cast<BYTE>((sums[2] + pixels / 2) / pixels);
+    entry.rgbReserved = 0;
+  }
+  return static_cast<DWORD>(boxes.size());
+}
+
+// Squared distance weighted roughly by the eye's sensitivity to each
+// channel.
+static inline int ColorDistance(int dr, int dg, int db) {
+  return 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+}
+
+PaletteMapper::PaletteMapper(const RGBQUAD *palette, DWORD count)
+  : palette_(count),
+    exactColors_(kMapperSlots, kNoColor),
+    exactIndices_(kMapperSlots),
+    nearest_(1 << 15),
+    spread_(count <= 2 ? 128 : count <= 16 ? 64 : 32) {
+  for (DWORD i = 0; i < count; ++i) {
+    const DWORD color = static_cast<DWORD>(palette[i].rgbRed) << 16
+                        | static_cast<DWORD>(palette[i].rgbGreen) << 8
+                        | palette[i].rgbBlue;
+    palette_[i] = color;
+    DWORD slot = HashColor(color) & (kMapperSlots - 1);
+    while (exactColors_[slot] != kNoColor && exactColors_[slot] != color) {
+      slot = (slot + 1) & (kMapperSlots - 1);
+    }
+    if (exactColors_[slot] == kNoColor) {
+      exactColors_[slot] = color;
+      exactIndices_[slot] = static_cast<BYTE>(i);
+    }
+  }
+
+  // The nearest entry to the center of every bin, a slice of red at a time.
+  TaskScheduler::Default().ParallelFor(
+    0, 32, 1,
+    [&](DWORD begin, DWORD end) {
+      for (DWORD r5 = begin; r5 < end; ++r5) {
+        for (DWORD bin = r5 << 10; bin < (r5 + 1) << 10; ++bin) {
+          const int r = static_cast<int>((bin >> 7) & 0xf8) + 4;
+          const int g = static_cast<int>((bin >> 2) & 0xf8) + 4;
+          const int b = static_cast<int>((bin << 3) & 0xf8) + 4;
+          int best = MAXLONG;
+          for (DWORD i = 0; i < count; ++i) {
+            const int d = ColorDistance(r - Channel(palette_[i], 16),
+                                        g - Channel(palette_[i], 8),
+                                        b - Channel(palette_[i], 0));
+            if (d < best) {
+              best = d;
+              nearest_[bin] = static_cast<BYTE>(i);
+            }
+          }
+        }
+      }
+    });
+}
+
+bool PaletteMapper::Find(DWORD color, BYTE &index) const {
+  for (DWORD slot = HashColor(color) & (kMapperSlots - 1);;
+       slot = (slot + 1) & (kMapperSlots - 1)) {
+    if (exactColors_[slot] == color) {
+      index = exactIndices_[slot];
+      return true;
+    }
+    if (exactColors_[slot] == kNoColor) {
+      return false;
+    }
+  }
+}
+
+static inline DWORD ClampChannel(int value) {
+  return static_cast<DWORD>(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+BYTE PaletteMapper::Nearest(int r, int g, int b) const {
+  return nearest_[BinOf(ClampChannel(r) << 16
+                        | ClampChannel(g) << 8
+                        | ClampChannel(b))];
+}
+
+void PaletteMapper::MapRow(const DWORD *pixels,
+                           LPBYTE indices,
+                           DWORD width,
+                           DWORD y,
+                           Dither dither) const {
+  static const int kBayer[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5},
+  };
+  DWORD last = kNoColor;
+  BYTE lastIndex = 0;
+  for (DWORD x = 0; x < width; ++x) {
+    const DWORD color = pixels[x] & kColorMask;
+    if (color == last) {
+      indices[x] = lastIndex;
+      continue;
+    }
+    BYTE index;
+    if (Find(color, index)) {
+      last = color;
+      lastIndex = index;
+    }
+    else if (dither == Dither::None) {
+      index = Nearest(Channel(color, 16), Channel(color, 8),
+                      Channel(color, 0));
+      last = color;
+      lastIndex = index;
+    }
+    else {
+      // From -spread / 2 to spread / 2.
+      const int d = (kBayer[y & 3][x & 3] * 2 - 15) * spread_ / 32;
+      index = Nearest(Channel(color, 16) + d,
+                      Channel(color, 8) + d,
+                      Channel(color, 0) + d);
+    }
+    indices[x] = index;
+  }
+}
+
+// The error of each channel is kept in sixteenths, with a guard pixel at
+// each end of the row.  Colors of the palette take no error, so the error
+// does not bleed into flat areas around antialiased edges.
+void PaletteMapper::DiffuseRow(const DWORD *pixels,
+                               LPBYTE indices,
+                               DWORD width,
+                               std::vector<int> &errors) const {
+  const SIZE_T stride = (SIZE_T(width) + 2) * 3;
+  if (errors.size() != stride * 2) {
+    errors.assign(stride * 2, 0);
+  }
+  int *current = errors.data();
+  int *next = current + stride;
+  for (DWORD x = 0; x < width; ++x) {
+    const DWORD color = pixels[x] & kColorMask;
+    if (Find(color, indices[x])) {
+      continue;
+    }
+    const int *error = current + (x + 1) * 3;
+    const int wanted[3] = {
+      Channel(color, 16) + ((error[0] + 8) >> 4),
+      Channel(color, 8) + ((error[1] + 8) >> 4),
+      Channel(color, 0) + ((error[2] + 8) >> 4),
+    };
+    const BYTE index = Nearest(wanted[0], wanted[1], wanted[2]);
+    indices[x] = index;
+    for (int c = 0; c < 3; ++c) {
+      const int e = static_cast<int>(ClampChannel(wanted[c]))
+                    - Channel(palette_[index], 16 - c * 8);
+      current[(x + 2) * 3 + c] += e * 7;
+      next[x * 3 + c] += e * 3;
+      next[(x + 1) * 3 + c] += e * 5;
+      next[(x + 2) * 3 + c] += e;
+    }
+  }
+  std::copy(next, next + stride, current);
+  std::fill(next, next + stride, 0);
+}
+
+void PackIndices(LPCBYTE indices, LPBYTE row, DWORD width, WORD bitCount) {
+  if (bitCount == 8) {
+    memcpy(row, indices, width);
+    return;
+  }
+  const DWORD perByte = 8 / bitCount;
+  for (DWORD x = 0; x < width; x += perByte) {
+    BYTE packed = 0;
+    for (DWORD i = 0; i < perByte; ++i) {
+      packed = static_cast<BYTE>(packed << bitCount);
+      if (x + i < width) {
+        packed |= indices[x + i];
+      }
+    }
+    row[x / perByte] = packed;
+  }
+}
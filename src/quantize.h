@@ -0,0 +1,108 @@
+// Reduction of color captures to indexed color.  Web pages are mostly flat
+// areas of a few colors, so the colors are counted first: a capture of at
+// most 256 colors is stored exactly, in the smallest indexed format that
+// holds them.  Others get a palette by median cut, optionally dithered.
+
+enum class Dither {
+  None,
+  // 4x4 Bayer matrix.  Rows stay independent and are mapped in parallel.
+  Ordered,
+  // Floyd-Steinberg error diffusion.  Smoothest, but rows are mapped in
+  // order.
+  FloydSteinberg,
+};
+
+// Distinct colors of 32bpp pixels and how many pixels have each, up to a
+// limit.  The high byte is ignored.  Runs of one color, which make up most
+// of a page, are skipped four pixels at a time with SSE2, so the
+// open-addressing table is probed about once per change of color.
+class ColorCounter {
+private:
+  DWORD limit_;
+  DWORD size_;
+  bool overflow_;
+  std::vector<DWORD> colors_;
+  std::vector<DWORD> counts_;
+
+  void Add(DWORD color, DWORD count);
+  void Grow();
+
+public:
+  explicit ColorCounter(DWORD limit);
+
+  // Both return false once there are more than the limit of colors.  The
+  // counts are incomplete from then on.
+  bool AddRow(const DWORD *pixels, DWORD width);
+  bool Merge(const ColorCounter &other);
+  bool Overflow() const;
+  DWORD Size() const;
+  // Colors as 0x00RRGGBB in ascending order, and their pixel counts.
+  void GetColors(std::vector<DWORD> &colors, std::vector<DWORD> &counts) const;
+};
+
+// Pixel counts at 5 bits per channel, for captures with too many colors to
+// count exactly.  The low 3 bits are summed per bin, so that the mean color
+// of a bin is exact.
+class ColorHistogram {
+private:
+  static const DWORD kBins = 1 << 15;
+
+  std::vector<DWORD> counts_;
+  // Red, green and blue of each bin.
+  std::vector<DWORD> lowBits_;
+
+public:
+  ColorHistogram();
+
+  void AddRow(const DWORD *pixels, DWORD width);
+  void Merge(const ColorHistogram &other);
+  // The mean color of each bin with pixels, and its count.
+  void GetColors(std::vector<DWORD> &colors, std::vector<DWORD> &counts) const;
+};
+
+// Median cut.  The box of colors with the most pixels times its longest side
+// is split at the median pixel along that side, until there are |maxColors|
+// boxes.  The color of a box is the mean of its pixels, so a box of a single
+// color keeps it exactly.  Returns the number of colors in |palette|.
+DWORD MedianCut(const std::vector<DWORD> &colors,
+                const std::vector<DWORD> &counts,
+                DWORD maxColors,
+                RGBQUAD *palette);
+
+// Maps 32bpp pixels to the indices of a palette.  A color in the palette
+// maps to its own entry and is never dithered, so flat areas stay flat.
+// Other colors are looked up in a table of the nearest entry for every color
+// at 5 bits per channel.
+class PaletteMapper {
+private:
+  std::vector<DWORD> palette_;
+  // Open-addressing table of the palette colors and their indices.
+  std::vector<DWORD> exactColors_;
+  std::vector<BYTE> exactIndices_;
+  std::vector<BYTE> nearest_;
+  // Amplitude of the ordered dither, about the distance between entries.
+  int spread_;
+
+  bool Find(DWORD color, BYTE &index) const;
+  BYTE Nearest(int r, int g, int b) const;
+
+public:
+  PaletteMapper(const RGBQUAD *palette, DWORD count);
+
+  // |dither| is Dither::None or Dither::Ordered.  |y| is the position of
+  // the row, for the dither matrix.
+  void MapRow(const DWORD *pixels,
+              LPBYTE indices,
+              DWORD width,
+              DWORD y,
+              Dither dither) const;
+  // Floyd-Steinberg.  |errors| starts empty and carries the error from row
+  // to row.
+  void DiffuseRow(const DWORD *pixels,
+                  LPBYTE indices,
+                  DWORD width,
+                  std::vector<int> &errors) const;
+};
+
+// Packs a row of 8-bit indices into |bitCount| bits per pixel: 1, 4 or 8.
+void PackIndices(LPCBYTE indices, LPBYTE row, DWORD width, WORD bitCount);
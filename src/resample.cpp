@@ -0,0 +1,255 @@
+#include <windows.h>
+#include <emmintrin.h>
+#include <cmath>
+#include <vector>
+#include "resample.h"
+
+static const double kPi = 3.14159265358979323846;
+
+static double Support(ResampleFilter filter) {
+  switch (filter) {
+  case ResampleFilter::Box:
+    return 0.5;
+  case ResampleFilter::Bilinear:
+    return 1.0;
+  default:
+    return 3.0;
+  }
+}
+
+static double Sinc(double x) {
+  if (x == 0) {
+    return 1.0;
+  }
+  x *= kPi;
+  return std::sin(x) / x;
+}
+
+static double Weight(ResampleFilter filter, double x) {
+  switch (filter) {
+  case ResampleFilter::Box:
+    return x > -0.5 && x <= 0.5 ? 1.0 : 0.0;
+  case ResampleFilter::Bilinear:
+    x = std::fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+  default:
+    return x > -3.0 && x < 3.0 ? Sinc(x) * Sinc(x / 3) : 0.0;
+  }
+}
+
+// When downscaling, the filter is stretched over the source pixels that
+// fall into one output pixel, so that every source pixel is accounted for.
+ResampleKernel::ResampleKernel(ResampleFilter filter,
+                               DWORD sourceSize,
+                               DWORD size)
+  : first_(size) {
+  const double scale = static_cast<double>(sourceSize) / size;
+  const double filterScale = scale > 1.0 ? scale : 1.0;
+  const double support = Support(filter) * filterScale;
+  taps_ = min(static_cast<DWORD>(std::ceil(support)) * 2 + 1, sourceSize);
+  weights_.resize(SIZE_T(size) * taps_);
+
+  std::vector<double> weights(taps_);
+  for (DWORD i = 0; i < size; ++i) {
+    const double center = (i + 0.5) * scale;
+    const LONG low =
+      max(static_cast<LONG>(std::floor(center - support + 0.5)), 0L);
+    const LONG high =
+      min(static_cast<LONG>(std::floor(center + support + 0.5)),
+          static_cast<LONG>(sourceSize));
+    const LONG first = min(low, static_cast<LONG>(sourceSize - taps_));
+    first_[i] = first;
+
+    double total = 0;
+    for (DWORD t = 0; t < taps_; ++t) {
+      const LONG x = first + static_cast<LONG>(t);
+      weights[t] = x >= low && x < high
+        ? Weight(filter, (x + 0.5 - center) / filterScale)
+        : 0.0;
+      total += weights[t];
+    }
+
+    // Rounding leaves the sum a little off, which goes to the largest
+    // weight, so that a flat area stays exactly flat.
+    short *fixed = &weights_[SIZE_T(i) * taps_];
+    int sum = 0;
+    DWORD largest = 0;
+    for (DWORD t = 0; t < taps_; ++t) {
+      const double w = total != 0 ? weights[t] / total : 0.0;
+      fixed[t] = static_cast<short>(std::floor(w * (1 << kPrecision) + 0.5));
+      sum += fixed[t];
+      if (weights[t] > weights[largest]) {
+        largest = t;
+      }
+    }
+    fixed[largest] = static_cast<short>(fixed[largest]
+                                        + (1 << kPrecision) - sum);
+  }
+}
+
+DWORD ResampleKernel::Size() const {
+  return static_cast<DWORD>(first_.size());
+}
+
+DWORD ResampleKernel::Taps() const {
+  return taps_;
+}
+
+DWORD ResampleKernel::First(DWORD i) const {
+  return first_[i];
+}
+
+const short *ResampleKernel::Weights(DWORD i) const {
+  return &weights_[SIZE_T(i) * taps_];
+}
+
+static inline BYTE Clamp(int value) {
+  return static_cast<BYTE>(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Two weights in one lane of 32 bits, for _mm_madd_epi16.  |second| is 0 for
+// a single tap.
+static inline __m128i WeightPair(short first, short second) {
+  const DWORD pair = static_cast<WORD>(first)
+                     | static_cast<DWORD>(static_cast<WORD>(second)) << 16;
+  return _mm_set1_epi32(static_cast<int>(pair));
+}
+
+// b0 g0 r0 a0 b1 g1 r1 a1 to b0 b1 g0 g1 r0 r1 a0 a1, the pairs that
+// _mm_madd_epi16 multiplies by two weights and adds.
+static inline __m128i PairChannels(__m128i pixels) {
+  return _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+}
+
+static void ResampleRow32(LPCBYTE source,
+                          LPBYTE output,
+                          const ResampleKernel &kernel) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round =
+    _mm_set1_epi32(1 << (ResampleKernel::kPrecision - 1));
+  const DWORD taps = kernel.Taps();
+  for (DWORD i = 0; i < kernel.Size(); ++i) {
+    LPCBYTE p = source + SIZE_T(kernel.First(i)) * 4;
+    const short *w = kernel.Weights(i);
+    __m128i sum = round;
+    DWORD t = 0;
+    for (; t + 4 <= taps; t += 4) {
+      const __m128i px =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + t * 4));
+      sum = _mm_add_epi32(
+        sum,
+        _mm_madd_epi16(PairChannels(_mm_unpacklo_epi8(px, zero)),
+                       WeightPair(w[t], w[t + 1])));
+      sum = _mm_add_epi32(
+        sum,
+        _mm_madd_epi16(PairChannels(_mm_unpackhi_epi8(px, zero)),
+                       WeightPair(w[t + 2], w[t + 3])));
+    }
+    for (; t + 2 <= taps; t += 2) {
+      const __m128i px =
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + t * 4));
+      sum = _mm_add_epi32(
+        sum,
+        _mm_madd_epi16(PairChannels(_mm_unpacklo_epi8(px, zero)),
+                       WeightPair(w[t], w[t + 1])));
+    }
+    if (t < taps) {
+      int pixel;
+      memcpy(&pixel, p + t * 4, sizeof(pixel));
+      const __m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero);
+      sum = _mm_add_epi32(
+        sum,
+        _mm_madd_epi16(_mm_unpacklo_epi16(px, zero), WeightPair(w[t], 0)));
+    }
+    sum = _mm_srai_epi32(sum, ResampleKernel::kPrecision);
+    sum = _mm_packs_epi32(sum, sum);
+    const int pixel = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    memcpy(output + SIZE_T(i) * 4, &pixel, sizeof(pixel));
+  }
+}
+
+static void ResampleRow8(LPCBYTE source,
+                         LPBYTE output,
+                         const ResampleKernel &kernel) {
+  const __m128i zero = _mm_setzero_si128();
+  const DWORD taps = kernel.Taps();
+  for (DWORD i = 0; i < kernel.Size(); ++i) {
+    LPCBYTE p = source + kernel.First(i);
+    const short *w = kernel.Weights(i);
+    __m128i sums = zero;
+    DWORD t = 0;
+    for (; t + 8 <= taps; t += 8) {
+      const __m128i px = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + t)), zero);
+      const __m128i weights =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + t));
+      sums = _mm_add_epi32(sums, _mm_madd_epi16(px, weights));
+    }
+    sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 8));
+    sums = _mm_add_epi32(sums, _mm_srli_si128(sums, 4));
+    int sum =
+      _mm_cvtsi128_si32(sums) + (1 << (ResampleKernel::kPrecision - 1));
+    for (; t < taps; ++t) {
+      sum += p[t] * w[t];
+    }
+    output[i] = Clamp(sum >> ResampleKernel::kPrecision);
+  }
+}
+
+void ResampleRow(LPCBYTE source,
+                 LPBYTE output,
+                 const ResampleKernel &kernel,
+                 DWORD channels) {
+  if (channels == 4) {
+    ResampleRow32(source, output, kernel);
+  }
+  else {
+    ResampleRow8(source, output, kernel);
+  }
+}
+
+// Sixteen bytes at a time: bytes of two rows are interleaved into pairs and
+// multiplied by the two rows' weights in one _mm_madd_epi16.
+void ResampleColumns(LPCBYTE first,
+                     SIZE_T stride,
+                     LPBYTE output,
+                     SIZE_T bytes,
+                     const short *weights,
+                     DWORD taps) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round =
+    _mm_set1_epi32(1 << (ResampleKernel::kPrecision - 1));
+  SIZE_T x = 0;
+  for (; x + 16 <= bytes; x += 16) {
+    __m128i s0 = round, s1 = round, s2 = round, s3 = round;
+    for (DWORD t = 0; t < taps; t += 2) {
+      const bool pair = t + 1 < taps;
+      LPCBYTE a = first + stride * t + x;
+      LPCBYTE b = pair ? a + stride : a;
+      const __m128i w = WeightPair(weights[t], pair ? weights[t + 1] : 0);
+      const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+      const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+      const __m128i low = _mm_unpacklo_epi8(va, vb);
+      const __m128i high = _mm_unpackhi_epi8(va, vb);
+      s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(low, zero), w));
+      s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(low, zero), w));
+      s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(high, zero), w));
+      s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(high, zero), w));
+    }
+    const __m128i low =
+      _mm_packs_epi32(_mm_srai_epi32(s0, ResampleKernel::kPrecision),
+                      _mm_srai_epi32(s1, ResampleKernel::kPrecision));
+    const __m128i high =
+      _mm_packs_epi32(_mm_srai_epi32(s2, ResampleKernel::kPrecision),
+                      _mm_srai_epi32(s3, ResampleKernel::kPrecision));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + x),
+                     _mm_packus_epi16(low, high));
+  }
+  for (; x < bytes; ++x) {
+    int sum = 1 << (ResampleKernel::kPrecision - 1);
+    for (DWORD t = 0; t < taps; ++t) {
+      sum += first[stride * t + x] * weights[t];
+    }
+    output[x] = Clamp(sum >> ResampleKernel::kPrecision);
+  }
+}
@@ -0,0 +1,53 @@
+// Separable resampling for thumbnails and DPI normalization.  Each axis is
+// filtered in turn with weights computed once per output size in fixed
+// point: rows across into an intermediate of the output width, then columns
+// down.  Both passes multiply pairs of taps at a time with SSE2.
+
+enum class ResampleFilter {
+  // Mean of the source pixels under each output pixel.  Fastest, and exact
+  // for integer downscales.
+  Box,
+  // Triangle filter: bilinear interpolation when upscaling, and its
+  // antialiased equivalent when downscaling.
+  Bilinear,
+  // Windowed sinc with three lobes.  Sharpest, at three times the taps of
+  // Bilinear.
+  Lanczos3,
+};
+
+// The weights of one axis.  Output pixel i is the sum of Taps() source
+// pixels from First(i), weighted in fixed point with kPrecision fractional
+// bits, summing to exactly 1.  Windows at the edges are moved inside the
+// source with zero weights, so every tap can be read without a bounds check.
+class ResampleKernel {
+private:
+  DWORD taps_;
+  std::vector<DWORD> first_;
+  std::vector<short> weights_;
+
+public:
+  static const int kPrecision = 14;
+
+  ResampleKernel(ResampleFilter filter, DWORD sourceSize, DWORD size);
+
+  DWORD Size() const;
+  DWORD Taps() const;
+  DWORD First(DWORD i) const;
+  const short *Weights(DWORD i) const;
+};
+
+// Filters a row of pixels of |channels| bytes, 1 or 4, across to
+// |kernel|.Size() pixels.
+void ResampleRow(LPCBYTE source,
+                 LPBYTE output,
+                 const ResampleKernel &kernel,
+                 DWORD channels);
+
+// Filters |taps| rows of |bytes| bytes, |stride| apart from |first|, down to
+// one row.  Channels do not matter here.
+void ResampleColumns(LPCBYTE first,
+                     SIZE_T stride,
+                     LPBYTE output,
+                     SIZE_T bytes,
+                     const short *weights,
+                     DWORD taps);
@@ -2,16 +2,15 @@
 #include <atlbase.h>
 #include <exdisp.h>
 #include <mshtmhst.h>
+#include "logger.h"
 #include "site.h"
 
-void Log(LPCWSTR format, ...);
-
 OleSite::OleSite(HWND hwnd, IDispatch *external)
   : ref_(1), hwnd_(hwnd), external_(external)
 {}
 
 OleSite::~OleSite() {
-  Log(L"%s\n", __FUNCTIONW__);
+  LogVerbose(L"%s\n", __FUNCTIONW__);
 }
 
 STDMETHODIMP OleSite::QueryInterface(REFIID riid, void **ppvObject) {
@@ -0,0 +1,235 @@
+#include <windows.h>
+#include <emmintrin.h>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include "blob.h"
+#include "bitmap.h"
+#include "pixelview.h"
+#include "ssim.h"
+
+// With N pixels in a window and S the sums over it, the SSIM of
+//   ((2 mu_a mu_b + C1) (2 cov + C2)) / ((mu_a^2 + mu_b^2 + C1) (var_a + var_b + C2))
+// is, multiplied through by N^2,
+//   ((2 Sa Sb + C1 N^2) (2 (N Sab - Sa Sb) + C2 N^2))
+//   / ((Sa^2 + Sb^2 + C1 N^2) (N Saa - Sa^2 + N Sbb - Sb^2 + C2 N^2)).
+// Every product there fits in 32 bits for 8x8 windows of 8-bit pixels, so
+// they are computed exactly and only the final ratio is in floating point.
+static const int kWindowShift = 6;  // N = 64
+static const float kC1 = 6.5025f * 4096;     // (0.01 * 255)^2 * N^2
+static const float kC2 = 58.5225f * 4096;    // (0.03 * 255)^2 * N^2
+
+struct WindowSums {
+  std::vector<int> a, b, aa, bb, ab;
+
+  explicit WindowSums(DWORD size)
+    : a(size), b(size), aa(size), bb(size), ab(size) {}
+};
+
+static inline float Score(int a, int b, int aa, int bb, int ab) {
+  const int sab = a * b;
+  const int saa = a * a;
+  const int sbb = b * b;
+  const float f1 = static_cast<float>(2 * sab) + kC1;
+  const float f2 = static_cast<float>(2 * ((ab << kWindowShift) - sab)) + kC2;
+  const float f3 = static_cast<float>(saa + sbb) + kC1;
+  const float f4 = static_cast<float>((aa << kWindowShift) - saa
+                                      + (bb << kWindowShift) - sbb) + kC2;
+  return (f1 * f2) / (f3 * f4);
+}
+
+// Adds row |na|/|nb| to the column sums and subtracts row |oa|/|ob|.
+static void SlideColumns(LPCBYTE na,
+                         LPCBYTE oa,
+                         LPCBYTE nb,
+                         LPCBYTE ob,
+                         DWORD width,
+                         WindowSums &cols) {
+  const __m128i zero = _mm_setzero_si128();
+  DWORD x = 0;
+  for (; x + 8 <= width; x += 8) {
+    auto load = [&](LPCBYTE p) {
+      return _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + x)), zero);
+    };
+    const __m128i vna = load(na), voa = load(oa);
+    const __m128i vnb = load(nb), vob = load(ob);
+    const __m128i negOa = _mm_sub_epi16(zero, voa);
+    const __m128i negOb = _mm_sub_epi16(zero, vob);
+
+    // (new, old) pairs against (new, -old) pairs: pmaddwd gives
+    // new * new' - old * old' per column, exact in 32 bits.
+    const __m128i aPairs[] = {_mm_unpacklo_epi16(vna, voa),
+                              _mm_unpackhi_epi16(vna, voa)};
+    const __m128i aNeg[] = {_mm_unpacklo_epi16(vna, negOa),
+                            _mm_unpackhi_epi16(vna, negOa)};
+    const __m128i bPairs[] = {_mm_unpacklo_epi16(vnb, vob),
+                              _mm_unpackhi_epi16(vnb, vob)};
+    const __m128i bNeg[] = {_mm_unpacklo_epi16(vnb, negOb),
+                            _mm_unpackhi_epi16(vnb, negOb)};
+    // (new, old) . (1, -1) is the plain difference.
+    const __m128i plusMinus = _mm_set1_epi32(static_cast<int>(0xffff0001));
+
+    for (int half = 0; half < 2; ++half) {
+      const DWORD i = x + half * 4;
+      auto update = [&](std::vector<int> &sums, __m128i delta) {
+        auto p = reinterpret_cast<__m128i*>(&sums[i]);
+        _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), delta));
+      };
+      update(cols.a, _mm_madd_epi16(aPairs[half], plusMinus));
+      update(cols.b, _mm_madd_epi16(bPairs[half], plusMinus));
+      update(cols.aa, _mm_madd_epi16(aPairs[half], aNeg[half]));
+      update(cols.bb, _mm_madd_epi16(bPairs[half], bNeg[half]));
+      update(cols.ab, _mm_madd_epi16(aPairs[half], bNeg[half]));
+    }
+  }
+  for (; x < width; ++x) {
+    cols.a[x] += na[x] - oa[x];
+    cols.b[x] += nb[x] - ob[x];
+    cols.aa[x] += na[x] * na[x] - oa[x] * oa[x];
+    cols.bb[x] += nb[x] * nb[x] - ob[x] * ob[x];
+    cols.ab[x] += na[x] * nb[x] - oa[x] * ob[x];
+  }
+}
+
+// Scores of the windows at [0, count), four at a time.
+static void ScoreRow(const WindowSums &w, DWORD count, float *scores) {
+  const __m128 c1 = _mm_set1_ps(kC1);
+  const __m128 c2 = _mm_set1_ps(kC2);
+  DWORD x = 0;
+  for (; x + 4 <= count; x += 4) {
+    auto load = [&](const std::vector<int> &v) {
+      return _mm_loadu_si128(reinterpret_cast<const __m128i*>(&v[x]));
+    };
+    // Window sums of pixels are below 2^15, so pmaddwd on the low halves
+    // of the 32-bit lanes is an exact 32-bit multiply.
+    const __m128i a = load(w.a), b = load(w.b);
+    const __m128i sab = _mm_madd_epi16(a, b);
+    const __m128i saa = _mm_madd_epi16(a, a);
+    const __m128i sbb = _mm_madd_epi16(b, b);
+    const __m128i nab = _mm_slli_epi32(load(w.ab), kWindowShift);
+    const __m128i naa = _mm_slli_epi32(load(w.aa), kWindowShift);
+    const __m128i nbb = _mm_slli_epi32(load(w.bb), kWindowShift);
+
+    const __m128 f1 = _mm_add_ps(_mm_cvtepi32_ps(_mm_add_epi32(sab, sab)), c1);
+    const __m128i cov = _mm_sub_epi32(nab, sab);
+    const __m128 f2 = _mm_add_ps(_mm_cvtepi32_ps(_mm_add_epi32(cov, cov)), c2);
+    const __m128 f3 = _mm_add_ps(_mm_cvtepi32_ps(_mm_add_epi32(saa, sbb)), c1);
+    const __m128i var = _mm_add_epi32(_mm_sub_epi32(naa, saa),
+                                      _mm_sub_epi32(nbb, sbb));
+    const __m128 f4 = _mm_add_ps(_mm_cvtepi32_ps(var), c2);
+    _mm_storeu_ps(scores + x, _mm_div_ps(_mm_mul_ps(f1, f2),
+                                         _mm_mul_ps(f3, f4)));
+  }
+  for (; x < count; ++x) {
+    scores[x] = Score(w.a[x], w.b[x], w.aa[x], w.bb[x], w.ab[x]);
+  }
+}
+
+SsimResult::SsimResult()
+  : score(0),
+    tileSize(0),
+    tilesX(0),
+    tilesY(0)
+{}
+
+SsimScorer::SsimScorer(DWORD width, DWORD height, DWORD tileSize)
+  : width_(width),
+    height_(height),
+    tileSize_(tileSize),
+    tilesX_((width - kSsimWindow + tileSize) / tileSize),
+    tilesY_((height - kSsimWindow + tileSize) / tileSize),
+    tileSums_(SIZE_T(tilesX_) * tilesY_)
+{}
+
+DWORD SsimScorer::TileRows() const {
+  return tilesY_;
+}
+
+void SsimScorer::ScoreTileRow(DWORD tileRow,
+                              const PixelView<const BYTE> &a,
+                              const PixelView<const BYTE> &b) {
+  const DWORD windowsX = width_ - kSsimWindow + 1;
+  const DWORD windowsY = height_ - kSsimWindow + 1;
+  const DWORD first = tileRow * tileSize_;
+  const DWORD last = min(first + tileSize_, windowsY);
+
+  WindowSums cols(width_), windows(windowsX);
+  std::vector<float> scores(windowsX);
+  const std::vector<BYTE> zeros(width_);
+  double *tiles = &tileSums_[SIZE_T(tileRow) * tilesX_];
+
+  for (DWORD y = 0; y < kSsimWindow; ++y) {
+    SlideColumns(a.Row(first + y), zeros.data(),
+                 b.Row(first + y), zeros.data(),
+                 width_, cols);
+  }
+  for (DWORD y = first; y < last; ++y) {
+    // Columns cover rows [y, y + kSsimWindow).
+    if (y > first) {
+      const DWORD bottom = y + kSsimWindow - 1;
+      SlideColumns(a.Row(bottom), a.Row(y - 1),
+                   b.Row(bottom), b.Row(y - 1),
+                   width_, cols);
+    }
+
+    int sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+    for (DWORD x = 0; x < kSsimWindow - 1; ++x) {
+      sa += cols.a[x];
+      sb += cols.b[x];
+      saa += cols.aa[x];
+      sbb += cols.bb[x];
+      sab += cols.ab[x];
+    }
+    for (DWORD x = 0; x < windowsX; ++x) {
+      const DWORD right = x + kSsimWindow - 1;
+      sa += cols.a[right];
+      sb += cols.b[right];
+      saa += cols.aa[right];
+      sbb += cols.bb[right];
+      sab += cols.ab[right];
+      windows.a[x] = sa;
+      windows.b[x] = sb;
+      windows.aa[x] = saa;
+      windows.bb[x] = sbb;
+      windows.ab[x] = sab;
+      sa -= cols.a[x];
+      sb -= cols.b[x];
+      saa -= cols.aa[x];
+      sbb -= cols.bb[x];
+      sab -= cols.ab[x];
+    }
+
+    ScoreRow(windows, windowsX, scores.data());
+    for (DWORD tx = 0; tx < tilesX_; ++tx) {
+      const DWORD end = min((tx + 1) * tileSize_, windowsX);
+      float sum = 0;
+      for (DWORD x = tx * tileSize_; x < end; ++x) {
+        sum += scores[x];
+      }
+      tiles[tx] += sum;
+    }
+  }
+}
+
+void SsimScorer::GetResult(SsimResult &result) const {
+  const DWORD windowsX = width_ - kSsimWindow + 1;
+  const DWORD windowsY = height_ - kSsimWindow + 1;
+  result.tileSize = tileSize_;
+  result.tilesX = tilesX_;
+  result.tilesY = tilesY_;
+  result.tiles.resize(tileSums_.size());
+
+  double total = 0;
+  for (DWORD ty = 0; ty < tilesY_; ++ty) {
+    const DWORD rows = min(tileSize_, windowsY - ty * tileSize_);
+    for (DWORD tx = 0; tx < tilesX_; ++tx) {
+      const DWORD columns = min(tileSize_, windowsX - tx * tileSize_);
+      const double sum = tileSums_[SIZE_T(ty) * tilesX_ + tx];
+      result.tiles[SIZE_T(ty) * tilesX_ + tx] =
+        static_cast<float>(sum / (rows * columns));
+      total += sum;
+    }
+  }
+  result.score = total / (double(windowsX) * windowsY);
+}
@@ -0,0 +1,43 @@
+// Structural similarity (SSIM) of two 8bpp grayscale images, over every 8x8
+// window with uniform weights.  Unlike a pixel diff, it tolerates the small
+// shifts of antialiasing and font hinting, and drops for changes in layout
+// or content.  Include this after bitmap.h and pixelview.h.
+
+const DWORD kSsimWindow = 8;
+
+struct SsimResult {
+  // Mean SSIM of all windows, from -1 to 1.  1 means identical.
+  double score;
+  // Mean SSIM of the windows whose top-left pixel is in each tile of
+  // tileSize x tileSize pixels, row by row from the top.
+  DWORD tileSize;
+  DWORD tilesX;
+  DWORD tilesY;
+  std::vector<float> tiles;
+
+  SsimResult();
+};
+
+// Window sums are kept per column and slid down one row at a time, then
+// slid across the row, so every window costs the same small number of
+// additions whatever its size.  Tile rows are independent and can be scored
+// in parallel.
+class SsimScorer {
+private:
+  DWORD width_;
+  DWORD height_;
+  DWORD tileSize_;
+  DWORD tilesX_;
+  DWORD tilesY_;
+  std::vector<double> tileSums_;
+
+public:
+  // |width| and |height| are at least kSsimWindow.
+  SsimScorer(DWORD width, DWORD height, DWORD tileSize);
+
+  DWORD TileRows() const;
+  void ScoreTileRow(DWORD tileRow,
+                    const PixelView<const BYTE> &a,
+                    const PixelView<const BYTE> &b);
+  void GetResult(SsimResult &result) const;
+};
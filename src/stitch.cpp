@@ -0,0 +1,195 @@
+#include <windows.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "blob.h"
+#include "bitmap.h"
+#include "kernel.h"
+#include "logger.h"
+#include "png.h"
+#include "qoi.h"
+#include "stitch.h"
+#include "tiled.h"
+
+static DWORD RowBytes(DWORD width, WORD bitCount) {
+  return ((width * bitCount + 31) / 32) * 4;
+}
+
+StitchWriter::StitchWriter(std::ostream &os,
+                           StitchFormat format,
+                           WORD bitCount,
+                           DWORD compression,
+                           int level,
+                           DWORD height)
+  : os_(os),
+    format_(format),
+    bitCount_(bitCount),
+    compression_(compression),
+    level_(level),
+    width_(0),
+    height_(height),
+    rowsWritten_(0)
+{}
+
+StitchWriter::~StitchWriter() {}
+
+DWORD StitchWriter::RowsWritten() const {
+  return rowsWritten_;
+}
+
+// The headers are taken from the first strip in the output format, so the
+// color table and masks are the ones ConvertTo packed the rows with.
+bool StitchWriter::Begin(const DIB &strip) {
+  const BITMAPINFO *bi = strip.GetBitmapInfo();
+  const auto &ih = bi->bmiHeader;
+  width_ = ih.biWidth;
+  if (height_ == 0 || height_ > MAXLONG) {
+    Log(L"Invalid height: %u\n", height_);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+
+  switch (format_) {
+  case StitchFormat::Bitmap: {
+    const DWORD tableSize =
+      ih.biBitCount <= 8 ? sizeof(RGBQUAD) << ih.biBitCount
+      : ih.biCompression == BI_BITFIELDS ? sizeof(DWORD) * 3
+      : 0;
+    // The pixels start at a DWORD boundary, as DIB::Save puts them.
+    static const char kPadding[sizeof(DWORD)] = {0};
+    const DWORD headerSize = sizeof(BITMAPFILEHEADER) + ih.biSize + tableSize;
+    const DWORD offset = (headerSize + 3) & ~3u;
+    const ULONGLONG imageSize =
+      ULONGLONG(RowBytes(width_, ih.biBitCount)) * height_;
+    if (offset + imageSize > MAXDWORD) {
+      Log(L"A BMP of %ux%u %dbpp does not fit in 4GB.\n",
+          width_, height_, ih.biBitCount);
+      os_.setstate(std::ios::failbit);
+      return false;
+    }
+    BITMAPFILEHEADER fh = {0};
+    fh.bfType = 0x4D42;
+    fh.bfSize = static_cast<DWORD>(offset + imageSize);
+    fh.bfOffBits = offset;
+    BITMAPINFOHEADER header = ih;
+    header.biHeight = -static_cast<LONG>(height_);
+    header.biSizeImage = static_cast<DWORD>(imageSize);
+    os_.write(reinterpret_cast<LPCSTR>(&fh), sizeof(fh));
+    os_.write(reinterpret_cast<LPCSTR>(&header), sizeof(header));
+    os_.write(reinterpret_cast<LPCSTR>(bi) + ih.biSize, tableSize);
+    os_.write(kPadding, offset - headerSize);
+    return !!os_;
+  }
+  case StitchFormat::Png:
+    png_ = std::make_unique<PngWriter>(os_, level_);
+    return png_->Begin(width_,
+                       height_,
+                       ih.biBitCount,
+                       bi->bmiColors,
+                       /*grayscale*/false);
+  default:
+    break;
+  }
+
+  // Tiles are QOI streams too.
+  if ((ih.biBitCount != 8 && ih.biBitCount != 24 && ih.biBitCount != 32)
+      || (ih.biBitCount == 8 && !IsGrayscaleRamp(bi->bmiColors, 8))) {
+    Log(L"QOI encoding of %dbpp is not supported.\n", ih.biBitCount);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+  if (format_ == StitchFormat::Tiled) {
+    tiled_ = std::make_unique<TiledWriter>(os_, kDefaultTileSize);
+    return tiled_->Begin(width_, height_, ih.biBitCount);
+  }
+  encoded_.resize(kQoiHeaderSize);
+  QoiEncoder::WriteHeader(encoded_.data(), width_, height_, ih.biBitCount);
+  os_.write(reinterpret_cast<LPCSTR>(encoded_.data()), encoded_.size());
+  return !!os_;
+}
+
+bool StitchWriter::WriteRows(const DIB &strip, DWORD first, DWORD count) {
+  const auto &ih = strip.GetBitmapInfo()->bmiHeader;
+  if (!os_
+      || first + count > static_cast<DWORD>(std::abs(ih.biHeight))
+      || rowsWritten_ + count > height_) {
+    Log(L"Rows %u to %u do not fit.\n", first, first + count);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+  if (count == 0) {
+    return true;
+  }
+
+  DIB converted;
+  if (ih.biBitCount != bitCount_ || ih.biCompression != compression_) {
+    converted = strip.ConvertTo(bitCount_,
+                                /*dc*/nullptr,
+                                /*section*/nullptr,
+                                compression_);
+    if (!converted) {
+      os_.setstate(std::ios::failbit);
+      return false;
+    }
+  }
+  const DIB &rows = converted ? converted : strip;
+  if (width_ == 0 && !Begin(rows)) {
+    return false;
+  }
+  if (static_cast<DWORD>(ih.biWidth) != width_) {
+    Log(L"A strip of width %d after %u.\n", ih.biWidth, width_);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+
+  const LONG rowBytes = static_cast<LONG>(RowBytes(width_, bitCount_));
+  const LONG stride = rows.GetBitmapInfo()->bmiHeader.biHeight < 0
+                      ? rowBytes
+                      : -rowBytes;
+  switch (format_) {
+  case StitchFormat::Bitmap:
+    for (DWORD i = 0; i < count && os_; ++i) {
+      os_.write(reinterpret_cast<LPCSTR>(rows.At(0, first + i)), rowBytes);
+    }
+    break;
+  case StitchFormat::Png:
+    png_->WriteRows(rows.At(0, first), stride, count);
+    break;
+  case StitchFormat::Tiled:
+    tiled_->WriteRows(rows.At(0, first), stride, count);
+    break;
+  default:
+    encoded_.resize(QoiEncoder::MaxRowSize(width_));
+    for (DWORD i = 0; i < count && os_; ++i) {
+      const SIZE_T size = qoi_.EncodeRow(rows.At(0, first + i),
+                                         width_,
+                                         bitCount_,
+                                         encoded_.data());
+      os_.write(reinterpret_cast<LPCSTR>(encoded_.data()), size);
+    }
+    break;
+  }
+  rowsWritten_ += count;
+  return !!os_;
+}
+
+bool StitchWriter::End() {
+  if (rowsWritten_ != height_) {
+    Log(L"%u of %u rows were written.\n", rowsWritten_, height_);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+  if (format_ == StitchFormat::Png) {
+    png_->End();
+  }
+  else if (format_ == StitchFormat::Tiled) {
+    tiled_->End();
+  }
+  else if (format_ == StitchFormat::Qoi) {
+    encoded_.resize(kQoiEndSize + 1);
+    const SIZE_T size = qoi_.Finish(encoded_.data());
+    os_.write(reinterpret_cast<LPCSTR>(encoded_.data()), size);
+  }
+  return !!os_;
+}
@@ -0,0 +1,56 @@
+// Writes an image taller than anything held in memory, such as a whole web
+// page rendered one viewport at a time, straight to a stream.  Strips come
+// in from the top, each converted to the output format and encoded as soon
+// as it arrives, so memory stays at about one strip.  Include this after
+// bitmap.h, png.h and qoi.h.
+
+class TiledWriter;
+
+enum class StitchFormat {
+  // Top-down BMP.  BI_RLE8 is bottom-up and cannot be written in order.
+  Bitmap,
+  Png,
+  Qoi,
+  // Tiles of kDefaultTileSize; see tiled.h.
+  Tiled,
+};
+
+class StitchWriter {
+private:
+  std::ostream &os_;
+  StitchFormat format_;
+  WORD bitCount_;
+  DWORD compression_;
+  int level_;
+  DWORD width_;
+  DWORD height_;
+  DWORD rowsWritten_;
+  std::unique_ptr<PngWriter> png_;
+  QoiEncoder qoi_;
+  std::unique_ptr<TiledWriter> tiled_;
+  std::vector<BYTE> encoded_;
+
+  bool Begin(const DIB &strip);
+
+public:
+  // |bitCount| and |compression| are the output format as in
+  // DIB::ConvertTo.  PNG takes 1, 4, 8, 24 or 32bpp, and QOI and tiles 8,
+  // 24 or 32.
+  // |level| is the deflate level of PNG.  |height| is the height of the
+  // whole image, which every format needs up front; the first strip fixes
+  // the width.
+  StitchWriter(std::ostream &os,
+               StitchFormat format,
+               WORD bitCount,
+               DWORD compression,
+               int level,
+               DWORD height);
+  ~StitchWriter();
+
+  DWORD RowsWritten() const;
+  // Appends |count| rows of |strip| from row |first|, counted from the top.
+  // Strips may be of any height and in any format ConvertTo reads.
+  bool WriteRows(const DIB &strip, DWORD first, DWORD count);
+  // Fails unless every row of the height has been written.
+  bool End();
+};
@@ -0,0 +1,610 @@
+#include <windows.h>
+#include <emmintrin.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "blob.h"
+#include "logger.h"
+#include "parallel.h"
+#include "store.h"
+
+// The hash follows the structure of XXH3: each 64-bit lane accumulates the
+// product of the low and high halves of (data ^ secret), plus the data of
+// the neighboring lane so that no input bit is lost when a half is zero.
+// The secret advances by one lane per stripe, and every kBlockStripes
+// stripes the accumulators are scrambled, so stripes do not commute.
+static const DWORD kBlockStripes = 16;
+static const ULONGLONG kSecret[kBlockStripes + 8] = {
+  0x1d1289f435e91911ull, 0x0501e50fc9871f8aull,
+  0x626d1234ed1f846cull, 0xe98ea0202c2c1d1cull,
+  0xa6c1227939ef756eull, 0xf10de7e587ba9bafull,
+  0x6f6b4952bb56d776ull, 0xfbcbe5a28ba23bfaull,
+  0x028cec73f3734644ull, 0x6b517fb3c77aa6d2ull,
+  0x487ae65957c219c1ull, 0xbf0e9f3cdfb5ead9ull,
+  0xa4a11a448d17dcc1ull, 0x9ec218d6f2e4210aull,
+  0x1fa695a74de12cd6ull, 0xeb4b570b2c557344ull,
+  0xea3692e397674fa3ull, 0x2a61b21360b8e92bull,
+  0xfffc4ab24eb64691ull, 0xb8ab01ad8fcac1a1ull,
+  0xa82726e7c9935133ull, 0xf66d773fb6fbaa51ull,
+  0x1ea30b8043c1a2e0ull, 0x01e8fd51fcd0a421ull,
+};
+static const DWORD kPrime32 = 0x9e3779b1;
+static const ULONGLONG kPrime64 = 0x9e3779b185ebca87ull;
+
+static const DWORD kManifestMagic = 0x5343424d;  // 'MBCS'
+static const DWORD kDeltaMagic = 0x4443424d;  // 'MBCD'
+static const DWORD kManifestVersion = 1;
+static const DWORD kMaxInfoSize = 4096;
+static const DWORD kMaxObjects = 1u << 24;
+// Longer chains are taken for a cycle.
+static const DWORD kMaxDeltaDepth = 1024;
+// Of an extended-length path.
+static const DWORD kMaxBaseLength = 32767;
+
+bool ContentKey::operator==(const ContentKey &other) const {
+  return low == other.low && high == other.high;
+}
+
+ContentHasher::ContentHasher()
+  : length_(0),
+    stripes_(0) {
+  for (DWORD i = 0; i < kLanes; ++i) {
+    acc_[i] = kSecret[kBlockStripes + i];
+  }
+}
+
+void ContentHasher::Stripe(LPCBYTE data) {
+  auto acc = reinterpret_cast<__m128i*>(acc_);
+  const auto secret =
+    reinterpret_cast<const __m128i*>(kSecret + stripes_ % kBlockStripes);
+  for (DWORD i = 0; i < kLanes / 2; ++i) {
+    const __m128i d =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + i);
+    const __m128i k = _mm_xor_si128(d, _mm_loadu_si128(secret + i));
+    const __m128i product =
+      _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(2, 3, 0, 1)));
+    const __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+    _mm_storeu_si128(acc + i,
+                     _mm_add_epi64(_mm_loadu_si128(acc + i),
+                                   _mm_add_epi64(product, swapped)));
+  }
+
+  if (++stripes_ % kBlockStripes == 0) {
+    const __m128i prime = _mm_set1_epi32(static_cast<int>(kPrime32));
+    for (DWORD i = 0; i < kLanes / 2; ++i) {
+      __m128i a = _mm_loadu_si128(acc + i);
+      a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+      a = _mm_xor_si128(a, _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(kSecret + kBlockStripes) + i));
+      // a * kPrime32 in 64 bits: low * p + ((high * p) << 32).
+      const __m128i low = _mm_mul_epu32(a, prime);
+      const __m128i high = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+      _mm_storeu_si128(acc + i, _mm_add_epi64(low, _mm_slli_epi64(high, 32)));
+    }
+  }
+}
+
+// Each call is absorbed as a unit: the tail is padded to a stripe and the
+// size is mixed in, so rows of different widths do not run together.
+void ContentHasher::Update(LPCBYTE data, SIZE_T size) {
+  SIZE_T offset = 0;
+  for (; offset + kStripeSize <= size; offset += kStripeSize) {
+    Stripe(data + offset);
+  }
+  BYTE tail[kStripeSize] = {};
+  memcpy(tail, data + offset, size - offset);
+  Stripe(tail);
+  acc_[stripes_ % kLanes] += size * kPrime64;
+  length_ += size;
+}
+
+static inline ULONGLONG Avalanche(ULONGLONG h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+ContentKey ContentHasher::Finish() const {
+  ContentKey key;
+  key.low = length_ * kPrime64;
+  key.high = ~length_;
+  for (DWORD i = 0; i < kLanes; ++i) {
+    key.low = Avalanche(key.low ^ acc_[i]);
+    key.high = Avalanche(key.high + acc_[i] * (2 * i + 1));
+  }
+  return key;
+}
+
+SIZE_T CaptureStore::KeyHash::operator()(const ContentKey &key) const {
+  return static_cast<SIZE_T>(key.low);
+}
+
+CaptureStore::Stats::Stats()
+  : captures(0),
+    objects(0),
+    reused(0),
+    unchanged(0),
+    bytesIn(0),
+    bytesWritten(0)
+{}
+
+CaptureStore::Manifest::Manifest()
+  : width(0),
+    height(0),
+    bitCount(0),
+    tileSize(0),
+    changed(0)
+{}
+
+CaptureStore::CaptureStore(LPCWSTR directory, DWORD tileSize)
+  : directory_(directory),
+    tileSize_(tileSize),
+    basesLoaded_(false) {
+  CreateDirectory(directory, nullptr);
+  for (auto &created : fanOutCreated_) {
+    created = false;
+  }
+}
+
+const CaptureStore::Stats &CaptureStore::GetStats() const {
+  return stats_;
+}
+
+static void AppendHex(std::wstring &s, ULONGLONG value, int digits) {
+  static const WCHAR kDigits[] = L"0123456789abcdef";
+  for (int i = digits - 1; i >= 0; --i) {
+    s += kDigits[(value >> (i * 4)) & 0xf];
+  }
+}
+
+// Objects are spread over 256 directories by their first byte.
+std::wstring CaptureStore::ObjectPath(const ContentKey &key) const {
+  std::wstring path = directory_;
+  path += L'\\';
+  AppendHex(path, key.high >> 56, 2);
+  path += L'\\';
+  AppendHex(path, key.high, 14);
+  AppendHex(path, key.low, 16);
+  return path;
+}
+
+// Objects written by an earlier session are found on disk once, then
+// remembered.
+bool CaptureStore::Contains(const ContentKey &key) {
+  if (known_.count(key)) {
+    return true;
+  }
+  if (GetFileAttributes(ObjectPath(key).c_str()) != INVALID_FILE_ATTRIBUTES) {
+    known_.insert(key);
+    return true;
+  }
+  return false;
+}
+
+// Written to a temporary file and renamed, so an object that exists is
+// always complete.
+bool CaptureStore::WriteObject(const ContentKey &key,
+                               LPCBYTE bits,
+                               SIZE_T rowBytes,
+                               DWORD rows,
+                               SIZE_T stride) {
+  const DWORD fanOut = static_cast<DWORD>(key.high >> 56);
+  if (!fanOutCreated_[fanOut]) {
+    std::wstring dir = directory_;
+    dir += L'\\';
+    AppendHex(dir, fanOut, 2);
+    CreateDirectory(dir.c_str(), nullptr);
+    fanOutCreated_[fanOut] = true;
+  }
+
+  const std::wstring path = ObjectPath(key);
+  const std::wstring temp = path + L".tmp";
+  {
+    std::ofstream os(temp.c_str(), std::ios::binary);
+    for (DWORD y = 0; y < rows && os; ++y) {
+      os.write(reinterpret_cast<LPCSTR>(bits + stride * y), rowBytes);
+    }
+    if (!os) {
+      Log(L"Failed to write %s\n", temp.c_str());
+      os.close();
+      DeleteFile(temp.c_str());
+      return false;
+    }
+  }
+  if (!MoveFileEx(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+    Log(L"MoveFileEx failed - %08x\n", GetLastError());
+    DeleteFile(temp.c_str());
+    return false;
+  }
+  known_.insert(key);
+  stats_.bytesWritten += rowBytes * rows;
+  return true;
+}
+
+static std::wstring FullPath(LPCWSTR path) {
+  WCHAR buffer[MAX_PATH];
+  const DWORD length = GetFullPathName(path, MAX_PATH, buffer, nullptr);
+  return length > 0 && length < MAX_PATH ? std::wstring(buffer, length)
+                                         : std::wstring(path);
+}
+
+// The bases file is a list of paths, each a DWORD length and its characters.
+bool CaptureStore::IsBase(const std::wstring &fullPath) {
+  if (!basesLoaded_) {
+    const std::wstring basesPath = directory_ + L"\\bases";
+    std::ifstream is(basesPath.c_str(), std::ios::binary);
+    DWORD length;
+    while (is.read(reinterpret_cast<LPSTR>(&length), sizeof(length))
+           && length <= kMaxBaseLength) {
+      std::wstring path(length, L'\0');
+      if (!is.read(reinterpret_cast<LPSTR>(&path[0]), sizeof(WCHAR) * length)) {
+        break;
+      }
+      bases_.insert(std::move(path));
+    }
+    basesLoaded_ = true;
+  }
+  return bases_.count(fullPath) > 0;
+}
+
+void CaptureStore::AddBase(const std::wstring &fullPath) {
+  if (IsBase(fullPath)) {
+    return;
+  }
+  const std::wstring basesPath = directory_ + L"\\bases";
+  std::ofstream os(basesPath.c_str(), std::ios::binary | std::ios::app);
+  const DWORD length = static_cast<DWORD>(fullPath.size());
+  os.write(reinterpret_cast<LPCSTR>(&length), sizeof(length));
+  os.write(reinterpret_cast<LPCSTR>(fullPath.c_str()), sizeof(WCHAR) * length);
+  if (!os) {
+    Log(L"Failed to write %s\n", basesPath.c_str());
+  }
+  bases_.insert(fullPath);
+}
+
+// Bytes [first, last) of each row that belong to tile column |tx|.  Tiles
+// are a multiple of 8 pixels wide, so they start on a byte for any depth.
+static void TileColumnBytes(DWORD tx,
+                            DWORD tileSize,
+                            DWORD width,
+                            WORD bitCount,
+                            SIZE_T &first,
+                            SIZE_T &last) {
+  const DWORD right = min((tx + 1) * tileSize, width);
+  first = SIZE_T(tx) * tileSize * bitCount / 8;
+  last = (SIZE_T(right) * bitCount + 7) / 8;
+}
+
+// The directory part of |path|, with its trailing separator.
+static std::wstring DirectoryOf(const std::wstring &path) {
+  const auto slash = path.find_last_of(L"\\/");
+  return slash == std::wstring::npos ? std::wstring() : path.substr(0, slash + 1);
+}
+
+bool CaptureStore::Put(LPCWSTR manifestPath,
+                       const BITMAPINFO *info,
+                       SIZE_T infoSize,
+                       LPCBYTE bits,
+                       SIZE_T stride,
+                       LPCWSTR basePath) {
+  if (tileSize_ % 8 != 0 || infoSize > kMaxInfoSize) {
+    Log(L"Invalid store parameters.\n");
+    return false;
+  }
+  // The deltas on a manifest are kept however long ago they were written,
+  // so a manifest that has ever been a base is never overwritten.
+  const std::wstring fullPath = FullPath(manifestPath);
+  if (IsBase(fullPath)) {
+    Log(L"%s is the base of a delta and cannot be overwritten.\n",
+        manifestPath);
+    return false;
+  }
+
+  const auto &ih = info->bmiHeader;
+  const DWORD width = ih.biWidth;
+  const DWORD height = std::abs(ih.biHeight);
+  const DWORD tileSize = tileSize_ ? tileSize_ : max(width, height);
+  const DWORD tilesX = tileSize_ ? (width + tileSize - 1) / tileSize : 1;
+  const DWORD tilesY = tileSize_ ? (height + tileSize - 1) / tileSize : 1;
+
+  // Hashing is the CPU-bound part and runs in parallel by tile row.
+  std::vector<ContentKey> keys(SIZE_T(tilesX) * tilesY);
+  TaskScheduler::Default().ParallelFor(
+    0, tilesY, 1,
+    [&](DWORD begin, DWORD end) {
+      for (DWORD ty = begin; ty < end; ++ty) {
+        const DWORD top = ty * tileSize;
+        const DWORD rows = min(tileSize, height - top);
+        for (DWORD tx = 0; tx < tilesX; ++tx) {
+          SIZE_T first = 0, last = stride;
+          if (tileSize_) {
+            TileColumnBytes(tx, tileSize, width, ih.biBitCount, first, last);
+          }
+          ContentHasher hasher;
+          for (DWORD y = top; y < top + rows; ++y) {
+            hasher.Update(bits + stride * y + first, last - first);
+          }
+          keys[SIZE_T(ty) * tilesX + tx] = hasher.Finish();
+        }
+      }
+    });
+
+  // The base is usually the manifest written last, whose keys are kept.
+  Manifest read;
+  const Manifest *base = nullptr;
+  const std::wstring fullBasePath = basePath ? FullPath(basePath)
+                                             : std::wstring();
+  if (basePath && tileSize_ && fullBasePath != fullPath) {
+    if (lastPath_ == basePath) {
+      base = &last_;
+    }
+    else if (ReadManifest(basePath, read)) {
+      base = &read;
+    }
+    if (base && (base->tileSize != tileSize_
+                 || base->width != width
+                 || base->height != height
+                 || base->bitCount != ih.biBitCount
+                 || base->objects.size() != keys.size())) {
+      base = nullptr;
+    }
+  }
+
+  std::vector<DWORD> changed;
+  for (DWORD i = 0; i < keys.size(); ++i) {
+    if (!base || !(keys[i] == base->objects[i])) {
+      changed.push_back(i);
+    }
+  }
+  stats_.unchanged += keys.size() - changed.size();
+  const SIZE_T rowBytes =
+    tileSize_ ? (SIZE_T(width) * ih.biBitCount + 7) / 8 : stride;
+  stats_.bytesIn += rowBytes * height;
+
+  for (DWORD i : changed) {
+    const DWORD ty = i / tilesX;
+    const DWORD tx = i % tilesX;
+    const DWORD top = ty * tileSize;
+    const DWORD rows = min(tileSize, height - top);
+    SIZE_T first = 0, last = stride;
+    if (tileSize_) {
+      TileColumnBytes(tx, tileSize, width, ih.biBitCount, first, last);
+    }
+    ++stats_.objects;
+    if (Contains(keys[i])) {
+      ++stats_.reused;
+    }
+    else if (!WriteObject(keys[i],
+                          bits + stride * top + first,
+                          last - first,
+                          rows,
+                          stride)) {
+      return false;
+    }
+  }
+
+  // A base next to the manifest is recorded by its name only, so that the
+  // captures can be moved together.
+  std::wstring baseName;
+  if (base) {
+    baseName = basePath;
+    const std::wstring directory = DirectoryOf(baseName);
+    if (directory == DirectoryOf(manifestPath)) {
+      baseName.erase(0, directory.size());
+    }
+  }
+
+  // Recorded before the delta exists, so that no delta is left unprotected.
+  if (base) {
+    AddBase(fullBasePath);
+  }
+
+  std::ofstream os(manifestPath, std::ios::binary);
+  const DWORD header[] = {
+    base ? kDeltaMagic : kManifestMagic,
+    kManifestVersion,
+    tileSize_,
+    static_cast<DWORD>(infoSize),
+  };
+  const DWORD count = static_cast<DWORD>(changed.size());
+  SIZE_T written = sizeof(header) + infoSize + sizeof(count);
+  os.write(reinterpret_cast<LPCSTR>(header), sizeof(header));
+  os.write(reinterpret_cast<LPCSTR>(info), infoSize);
+  if (base) {
+    // A delta: the base, then the indices of the changed tiles and their
+    // keys.
+    const DWORD length = static_cast<DWORD>(baseName.size());
+    os.write(reinterpret_cast<LPCSTR>(&length), sizeof(length));
+    os.write(reinterpret_cast<LPCSTR>(baseName.c_str()),
+             sizeof(WCHAR) * length);
+    os.write(reinterpret_cast<LPCSTR>(&count), sizeof(count));
+    os.write(reinterpret_cast<LPCSTR>(changed.data()), sizeof(DWORD) * count);
+    for (DWORD i : changed) {
+      os.write(reinterpret_cast<LPCSTR>(&keys[i]), sizeof(ContentKey));
+    }
+    written += sizeof(length) + sizeof(WCHAR) * length
+               + (sizeof(DWORD) + sizeof(ContentKey)) * count;
+  }
+  else {
+    os.write(reinterpret_cast<LPCSTR>(&count), sizeof(count));
+    os.write(reinterpret_cast<LPCSTR>(keys.data()),
+             sizeof(ContentKey) * count);
+    written += sizeof(ContentKey) * count;
+  }
+  if (!os) {
+    Log(L"Failed to write %s\n", manifestPath);
+    return false;
+  }
+  ++stats_.captures;
+  stats_.bytesWritten += written;
+
+  lastPath_ = manifestPath;
+  last_.width = width;
+  last_.height = height;
+  last_.bitCount = ih.biBitCount;
+  last_.tileSize = tileSize_;
+  last_.objects = std::move(keys);
+  return true;
+}
+
+bool CaptureStore::ReadManifest(LPCWSTR manifestPath,
+                                Manifest &manifest) const {
+  return ReadManifest(manifestPath, manifest, /*depth*/0);
+}
+
+bool CaptureStore::ReadManifest(LPCWSTR manifestPath,
+                                Manifest &manifest,
+                                DWORD depth) const {
+  std::ifstream is(manifestPath, std::ios::binary);
+  DWORD header[4];
+  if (!is.read(reinterpret_cast<LPSTR>(header), sizeof(header))
+      || (header[0] != kManifestMagic && header[0] != kDeltaMagic)
+      || header[1] != kManifestVersion
+      || header[3] < sizeof(BITMAPINFOHEADER)
+      || header[3] > kMaxInfoSize
+      || !manifest.info.Alloc(header[3])
+      || !is.read(reinterpret_cast<LPSTR>(LPBYTE(manifest.info)), header[3])) {
+    Log(L"Invalid manifest %s\n", manifestPath);
+    return false;
+  }
+  // The header is handed to CreateDIBSection, which reads the colors, or
+  // the masks, after biSize bytes.
+  const auto &ih = manifest.info.As<BITMAPINFO>()->bmiHeader;
+  const ULONGLONG colors =
+    ih.biClrUsed > 0 ? ih.biClrUsed
+                     : ih.biBitCount <= 8 ? 1u << ih.biBitCount : 0;
+  const ULONGLONG masks =
+    ih.biCompression == BI_BITFIELDS && ih.biSize == sizeof(BITMAPINFOHEADER)
+    ? 3 * sizeof(DWORD) : 0;
+  if (ih.biSize < sizeof(BITMAPINFOHEADER)
+      || ih.biSize + masks + colors * sizeof(RGBQUAD) > header[3]) {
+    Log(L"Invalid manifest %s\n", manifestPath);
+    return false;
+  }
+  manifest.width = ih.biWidth;
+  manifest.height = std::abs(ih.biHeight);
+  manifest.bitCount = ih.biBitCount;
+  manifest.tileSize = header[2];
+
+  if (header[0] == kManifestMagic) {
+    DWORD count;
+    if (!is.read(reinterpret_cast<LPSTR>(&count), sizeof(count))
+        || count > kMaxObjects) {
+      Log(L"Invalid manifest %s\n", manifestPath);
+      return false;
+    }
+    manifest.objects.resize(count);
+    if (!is.read(reinterpret_cast<LPSTR>(manifest.objects.data()),
+                 sizeof(ContentKey) * count)) {
+      Log(L"Invalid manifest %s\n", manifestPath);
+      return false;
+    }
+    manifest.base.clear();
+    manifest.changed = count;
+    return true;
+  }
+
+  DWORD length;
+  if (depth >= kMaxDeltaDepth
+      || !is.read(reinterpret_cast<LPSTR>(&length), sizeof(length))
+      || length == 0
+      || length > kMaxBaseLength) {
+    Log(L"Invalid delta manifest %s\n", manifestPath);
+    return false;
+  }
+  std::wstring base(length, L'\0');
+  DWORD count;
+  if (!is.read(reinterpret_cast<LPSTR>(&base[0]), sizeof(WCHAR) * length)
+      || !is.read(reinterpret_cast<LPSTR>(&count), sizeof(count))
+      || count > kMaxObjects) {
+    Log(L"Invalid delta manifest %s\n", manifestPath);
+    return false;
+  }
+  std::vector<DWORD> changed(count);
+  std::vector<ContentKey> keys(count);
+  if (!is.read(reinterpret_cast<LPSTR>(changed.data()), sizeof(DWORD) * count)
+      || !is.read(reinterpret_cast<LPSTR>(keys.data()),
+                  sizeof(ContentKey) * count)) {
+    Log(L"Invalid delta manifest %s\n", manifestPath);
+    return false;
+  }
+  if (base.find_first_of(L"\\/") == std::wstring::npos) {
+    base = DirectoryOf(manifestPath) + base;
+  }
+
+  Manifest baseManifest;
+  if (!ReadManifest(base.c_str(), baseManifest, depth + 1)) {
+    return false;
+  }
+  if (baseManifest.tileSize != manifest.tileSize
+      || baseManifest.width != manifest.width
+      || baseManifest.height != manifest.height
+      || baseManifest.bitCount != manifest.bitCount) {
+    Log(L"The base of %s has another geometry.\n", manifestPath);
+    return false;
+  }
+  manifest.objects = std::move(baseManifest.objects);
+  for (DWORD i = 0; i < count; ++i) {
+    if (changed[i] >= manifest.objects.size()) {
+      Log(L"Invalid delta manifest %s\n", manifestPath);
+      return false;
+    }
+    manifest.objects[changed[i]] = keys[i];
+  }
+  manifest.base = base;
+  manifest.changed = count;
+  return true;
+}
+
+bool CaptureStore::ReadPixels(const Manifest &manifest,
+                              LPBYTE bits,
+                              SIZE_T stride) const {
+  const DWORD width = manifest.width;
+  const DWORD height = manifest.height;
+  const DWORD tileSize =
+    manifest.tileSize ? manifest.tileSize : max(width, height);
+  const DWORD tilesX =
+    manifest.tileSize ? (width + tileSize - 1) / tileSize : 1;
+  const DWORD tilesY =
+    manifest.tileSize ? (height + tileSize - 1) / tileSize : 1;
+  if (manifest.tileSize % 8 != 0
+      || manifest.objects.size() != SIZE_T(tilesX) * tilesY) {
+    Log(L"The manifest does not match its header.\n");
+    return false;
+  }
+
+  for (DWORD ty = 0; ty < tilesY; ++ty) {
+    const DWORD top = ty * tileSize;
+    const DWORD rows = min(tileSize, height - top);
+    for (DWORD tx = 0; tx < tilesX; ++tx) {
+      SIZE_T first = 0, last = stride;
+      if (manifest.tileSize) {
+        TileColumnBytes(tx, tileSize, width, manifest.bitCount, first, last);
+      }
+      const std::wstring path =
+        ObjectPath(manifest.objects[SIZE_T(ty) * tilesX + tx]);
+      std::ifstream is(path.c_str(), std::ios::binary);
+      for (DWORD y = top; y < top + rows; ++y) {
+        is.read(reinterpret_cast<LPSTR>(bits + stride * y + first),
+                last - first);
+      }
+      if (!is || is.peek() != std::char_traits<char>::eof()) {
+        Log(L"Missing or corrupt object %s\n", path.c_str());
+        return false;
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,129 @@
+// Content-addressed storage of captures.  Pixels are stored as objects named
+// by the hash of their bytes, each written once however many captures share
+// it.  A capture itself is a small manifest: the bitmap header and the keys
+// of its objects.  With a tile size, the pixels are split into tiles stored
+// separately, so pages that differ only in a banner share the other tiles.
+// A manifest can also be a delta on the manifest of the previous capture,
+// listing only the tiles that changed, so that recapturing a page on a
+// schedule writes in proportion to what changed rather than to the page.
+// Include this after blob.h.
+
+struct ContentKey {
+  ULONGLONG low;
+  ULONGLONG high;
+
+  bool operator==(const ContentKey &other) const;
+};
+
+// 128-bit non-cryptographic hash of rows of bytes, eight 64-bit lanes at a
+// time with SSE2.  Rows are absorbed one by one, so the key of a tile is
+// computed in place without copying it out of the bitmap.
+class ContentHasher {
+private:
+  static const DWORD kLanes = 8;
+  static const DWORD kStripeSize = kLanes * sizeof(ULONGLONG);
+
+  ULONGLONG acc_[kLanes];
+  ULONGLONG length_;
+  DWORD stripes_;
+
+  void Stripe(LPCBYTE data);
+
+public:
+  ContentHasher();
+
+  void Update(LPCBYTE data, SIZE_T size);
+  ContentKey Finish() const;
+};
+
+class CaptureStore {
+public:
+  struct Stats {
+    ULONGLONG captures;
+    ULONGLONG objects;
+    // Objects that were already in the store and not written.
+    ULONGLONG reused;
+    // Tiles left out of delta manifests because they match the base.
+    ULONGLONG unchanged;
+    ULONGLONG bytesIn;
+    ULONGLONG bytesWritten;
+
+    Stats();
+  };
+
+  // What a manifest holds.  The geometry is copied out of the header, which
+  // can be handed over to a new DIB.
+  struct Manifest {
+    Blob info;
+    DWORD width;
+    DWORD height;
+    WORD bitCount;
+    // 0 for a single object holding all rows, stride included.
+    DWORD tileSize;
+    // Tiles row by row from the first row in memory.
+    std::vector<ContentKey> objects;
+    // For a delta, the path of its base and the number of tiles the delta
+    // itself lists.  |objects| has the tiles of the base applied.
+    std::wstring base;
+    DWORD changed;
+
+    Manifest();
+  };
+
+private:
+  struct KeyHash {
+    SIZE_T operator()(const ContentKey &key) const;
+  };
+
+  std::wstring directory_;
+  DWORD tileSize_;
+  std::unordered_set<ContentKey, KeyHash> known_;
+  bool fanOutCreated_[256];
+  Stats stats_;
+  // The last manifest written, so that a delta on it needs no read.  Its
+  // info is left empty.
+  std::wstring lastPath_;
+  Manifest last_;
+  // Full paths of the manifests any delta in the store was written on,
+  // kept in a file in |directory_| across sessions and read on first use.
+  std::unordered_set<std::wstring> bases_;
+  bool basesLoaded_;
+
+  bool Contains(const ContentKey &key);
+  bool IsBase(const std::wstring &fullPath);
+  void AddBase(const std::wstring &fullPath);
+  bool WriteObject(const ContentKey &key,
+                   LPCBYTE bits,
+                   SIZE_T rowBytes,
+                   DWORD rows,
+                   SIZE_T stride);
+  bool ReadManifest(LPCWSTR manifestPath,
+                    Manifest &manifest,
+                    DWORD depth) const;
+
+public:
+  // Objects are kept under |directory|, which is created if needed.
+  // |tileSize| is 0 to store whole frames, or a multiple of 8 pixels.
+  CaptureStore(LPCWSTR directory, DWORD tileSize);
+
+  const Stats &GetStats() const;
+  std::wstring ObjectPath(const ContentKey &key) const;
+
+  // Stores |height| rows of |stride| bytes under the header |info| of
+  // |infoSize| bytes, and writes the manifest to |manifestPath|.  With
+  // |basePath|, the manifest of an earlier capture of the same size, the
+  // manifest is a delta that lists only the tiles differing from the base.
+  // Without a tile size or with a base of another geometry, a full manifest
+  // is written instead.  Fails rather than overwrite the base of a delta,
+  // which would change what the delta reads back.
+  bool Put(LPCWSTR manifestPath,
+           const BITMAPINFO *info,
+           SIZE_T infoSize,
+           LPCBYTE bits,
+           SIZE_T stride,
+           LPCWSTR basePath = nullptr);
+  // Reads a manifest, following a delta through its bases.
+  bool ReadManifest(LPCWSTR manifestPath, Manifest &manifest) const;
+  // Fills the rows of a bitmap created from the header of |manifest|.
+  bool ReadPixels(const Manifest &manifest, LPBYTE bits, SIZE_T stride) const;
+};
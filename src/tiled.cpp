@@ -0,0 +1,323 @@
+#include <windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "logger.h"
+#include "parallel.h"
+#include "qoi.h"
+#include "tiled.h"
+
+static bool IsTiledBitCount(WORD bitCount) {
+  return bitCount == 8 || bitCount == 24 || bitCount == 32;
+}
+
+TiledWriter::TiledWriter(std::ostream &os, DWORD tileSize)
+  : os_(os),
+    tileSize_(tileSize),
+    width_(0),
+    height_(0),
+    bitCount_(0),
+    rowBytes_(0),
+    rowsWritten_(0),
+    start_(0),
+    offset_(0),
+    bandRows_(0)
+{}
+
+bool TiledWriter::Begin(DWORD width, DWORD height, WORD bitCount) {
+  if (width == 0 || height == 0 || tileSize_ == 0
+      || tileSize_ > kMaxTileSize
+      || !IsTiledBitCount(bitCount)) {
+    Log(L"Tiles of %u pixels of %ux%u %dbpp are not supported.\n",
+        tileSize_, width, height, bitCount);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+  width_ = width;
+  height_ = height;
+  bitCount_ = bitCount;
+  rowBytes_ = width * (bitCount / 8);
+  band_.resize(SIZE_T(rowBytes_) * min(tileSize_, height));
+  index_.reserve(SIZE_T((width + tileSize_ - 1) / tileSize_)
+                 * ((height + tileSize_ - 1) / tileSize_));
+
+  // The header is written again by End with the offset of the index.
+  start_ = os_.tellp();
+  TiledHeader header = {0};
+  os_.write(reinterpret_cast<LPCSTR>(&header), sizeof(header));
+  offset_ = sizeof(header);
+  return !!os_;
+}
+
+// Encodes each tile of the band into its own worst-case buffer, in
+// parallel, and then writes them in order.
+bool TiledWriter::Flush() {
+  const DWORD across = (width_ + tileSize_ - 1) / tileSize_;
+  const DWORD bpp = bitCount_ / 8;
+  std::vector<std::vector<BYTE>> tiles(across);
+  TaskScheduler::Default().ParallelFor(0, across, 1,
+    [&](DWORD begin, DWORD end) {
+      for (DWORD tx = begin; tx < end; ++tx) {
+        const DWORD left = tx * tileSize_;
+        const DWORD width = min(tileSize_, width_ - left);
+        auto &tile = tiles[tx];
+        tile.resize(QoiEncoder::MaxRowSize(width) * bandRows_
+                    + kQoiEndSize + 1);
+        QoiEncoder encoder;
+        SIZE_T used = 0;
+        for (DWORD y = 0; y < bandRows_; ++y) {
+          used += encoder.EncodeRow(band_.data() + SIZE_T(rowBytes_) * y
+                                      + left * bpp,
+                                    width,
+                                    bitCount_,
+                                    tile.data() + used);
+        }
+        used += encoder.Finish(tile.data() + used);
+        tile.resize(used);
+      }
+    });
+
+  for (const auto &tile : tiles) {
+    TiledEntry entry = {0};
+    entry.offset = offset_;
+    entry.size = static_cast<DWORD>(tile.size());
+    index_.push_back(entry);
+    os_.write(reinterpret_cast<LPCSTR>(tile.data()), tile.size());
+    offset_ += tile.size();
+  }
+  bandRows_ = 0;
+  return !!os_;
+}
+
+bool TiledWriter::WriteRows(LPCBYTE top, LONG stride, DWORD count) {
+  if (!os_ || width_ == 0 || rowsWritten_ + count > height_) {
+    Log(L"%u rows do not fit.\n", count);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+  for (DWORD i = 0; i < count; ++i) {
+    memcpy(band_.data() + SIZE_T(rowBytes_) * bandRows_,
+           top + LONG_PTR(stride) * i,
+           rowBytes_);
+    ++rowsWritten_;
+    if (++bandRows_ == tileSize_ || rowsWritten_ == height_) {
+      if (!Flush()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool TiledWriter::End() {
+  if (!os_ || rowsWritten_ != height_ || height_ == 0) {
+    Log(L"%u of %u rows were written.\n", rowsWritten_, height_);
+    os_.setstate(std::ios::failbit);
+    return false;
+  }
+  TiledHeader header = {0};
+  header.magic = kTiledMagic;
+  header.version = kTiledVersion;
+  header.bitCount = bitCount_;
+  header.width = width_;
+  header.height = height_;
+  header.tileSize = tileSize_;
+  header.indexOffset = offset_;
+  os_.write(reinterpret_cast<LPCSTR>(index_.data()),
+            index_.size() * sizeof(TiledEntry));
+  const std::streampos end = os_.tellp();
+  os_.seekp(start_);
+  os_.write(reinterpret_cast<LPCSTR>(&header), sizeof(header));
+  os_.seekp(end);
+  return !!os_;
+}
+
+TiledReader::TiledReader()
+  : mapping_(nullptr),
+    fileSize_(0),
+    granularity_(0),
+    header_(),
+    tilesAcross_(0)
+{}
+
+TiledReader::~TiledReader() {
+  Close();
+}
+
+void TiledReader::Close() {
+  if (mapping_) {
+    CloseHandle(mapping_);
+    mapping_ = nullptr;
+  }
+  index_.clear();
+}
+
+const TiledHeader &TiledReader::GetHeader() const {
+  return header_;
+}
+
+bool TiledReader::Open(LPCWSTR path) {
+  Close();
+  std::ifstream is(path, std::ios::binary);
+  if (!is.is_open()) {
+    Log(L"Failed to open %ls\n", path);
+    return false;
+  }
+  if (!is.read(reinterpret_cast<LPSTR>(&header_), sizeof(header_))
+      || header_.magic != kTiledMagic
+      || header_.version != kTiledVersion
+      || !IsTiledBitCount(header_.bitCount)
+      || header_.width == 0
+      || header_.height == 0
+      || header_.tileSize == 0
+      || header_.tileSize > kMaxTileSize) {
+    Log(L"Invalid tiled capture.\n");
+    return false;
+  }
+
+  tilesAcross_ = static_cast<DWORD>(
+    (ULONGLONG(header_.width) + header_.tileSize - 1) / header_.tileSize);
+  const ULONGLONG tilesDown =
+    (ULONGLONG(header_.height) + header_.tileSize - 1) / header_.tileSize;
+  is.seekg(0, std::ios::end);
+  fileSize_ = static_cast<ULONGLONG>(is.tellg());
+  const ULONGLONG count = tilesDown * tilesAcross_;
+  if (header_.indexOffset < sizeof(header_)
+      || header_.indexOffset > fileSize_
+      || (fileSize_ - header_.indexOffset) / sizeof(TiledEntry) < count) {
+    Log(L"Invalid tile index.\n");
+    return false;
+  }
+  index_.resize(static_cast<SIZE_T>(count));
+  is.seekg(header_.indexOffset, std::ios::beg);
+  if (!is.read(reinterpret_cast<LPSTR>(index_.data()),
+               index_.size() * sizeof(TiledEntry))) {
+    Log(L"Failed to read the tile index.\n");
+    return false;
+  }
+  // Tiles lie between the header and the index.  Written so that a huge
+  // offset cannot wrap around.
+  for (const auto &entry : index_) {
+    if (entry.offset < sizeof(header_)
+        || entry.offset > header_.indexOffset
+        || entry.size > header_.indexOffset - entry.offset) {
+      Log(L"Invalid tile index.\n");
+      return false;
+    }
+  }
+
+  HANDLE file = CreateFile(path,
+                           GENERIC_READ,
+                           FILE_SHARE_READ,
+                           /*lpSecurityAttributes*/nullptr,
+                           OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL,
+                           /*hTemplateFile*/nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    Log(L"CreateFile failed - %08x\n", GetLastError());
+    return false;
+  }
+  mapping_ = CreateFileMapping(file,
+                               /*lpAttributes*/nullptr,
+                               PAGE_READONLY,
+                               0, 0,
+                               /*lpName*/nullptr);
+  CloseHandle(file);
+  if (!mapping_) {
+    Log(L"CreateFileMapping failed - %08x\n", GetLastError());
+    return false;
+  }
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  granularity_ = si.dwAllocationGranularity;
+  return true;
+}
+
+bool TiledReader::ReadRect(const RECT &rect, LPBYTE bits, LONG stride) const {
+  if (!mapping_
+      || rect.left < 0 || rect.top < 0
+      || rect.left >= rect.right || rect.top >= rect.bottom
+      || static_cast<DWORD>(rect.right) > header_.width
+      || static_cast<DWORD>(rect.bottom) > header_.height) {
+    Log(L"Invalid rectangle.\n");
+    return false;
+  }
+
+  const DWORD tileSize = header_.tileSize;
+  const DWORD bpp = header_.bitCount / 8;
+  const DWORD firstColumn = rect.left / tileSize;
+  const DWORD lastColumn = (rect.right - 1) / tileSize;
+  for (DWORD ty = rect.top / tileSize; ty <= (rect.bottom - 1) / tileSize; ++ty) {
+    // Tiles of a band are written one after another, so the ones needed
+    // are a single range of the file.
+    const TiledEntry *entries = &index_[SIZE_T(ty) * tilesAcross_];
+    ULONGLONG begin = entries[firstColumn].offset, end = 0;
+    for (DWORD tx = firstColumn; tx <= lastColumn; ++tx) {
+      begin = min(begin, entries[tx].offset);
+      end = max(end, entries[tx].offset + entries[tx].size);
+    }
+    const ULONGLONG viewOffset = begin - begin % granularity_;
+    if (end - viewOffset > MAXSIZE_T) {
+      Log(L"A band of tiles does not fit in memory.\n");
+      return false;
+    }
+    auto view = reinterpret_cast<LPCBYTE>(
+      MapViewOfFile(mapping_,
+                    FILE_MAP_READ,
+                    static_cast<DWORD>(viewOffset >> 32),
+                    static_cast<DWORD>(viewOffset),
+                    static_cast<SIZE_T>(end - viewOffset)));
+    if (!view) {
+      Log(L"MapViewOfFile failed - %08x\n", GetLastError());
+      return false;
+    }
+
+    // Rows of the band above the rectangle are decoded and dropped, since
+    // a QOI stream cannot start in the middle.
+    const DWORD bandTop = ty * tileSize;
+    const DWORD firstRow = max(bandTop, static_cast<DWORD>(rect.top));
+    const DWORD endRow = min(bandTop + tileSize,
+                             static_cast<DWORD>(rect.bottom));
+    std::atomic<bool> ok(true);
+    TaskScheduler::Default().ParallelFor(firstColumn, lastColumn + 1, 1,
+      [&](DWORD columnBegin, DWORD columnEnd) {
+        std::vector<BYTE> row;
+        for (DWORD tx = columnBegin; tx < columnEnd && ok; ++tx) {
+          const DWORD left = tx * tileSize;
+          const DWORD width = min(tileSize, header_.width - left);
+          const DWORD copyLeft = max(left, static_cast<DWORD>(rect.left));
+          const DWORD copyRight = min(left + width,
+                                      static_cast<DWORD>(rect.right));
+          row.resize(SIZE_T(width) * bpp);
+          LPCBYTE src = view + (entries[tx].offset - viewOffset);
+          LPCBYTE srcEnd = src + entries[tx].size;
+          QoiDecoder decoder;
+          for (DWORD y = bandTop; y < endRow; ++y) {
+            if (!decoder.DecodeRow(src, srcEnd, row.data(), width,
+                                   header_.bitCount)) {
+              Log(L"Failed to decode a tile.\n");
+              ok = false;
+              break;
+            }
+            if (y >= firstRow) {
+              memcpy(bits + LONG_PTR(stride) * (y - rect.top)
+                       + SIZE_T(copyLeft - rect.left) * bpp,
+                     row.data() + SIZE_T(copyLeft - left) * bpp,
+                     SIZE_T(copyRight - copyLeft) * bpp);
+            }
+          }
+        }
+      });
+    UnmapViewOfFile(view);
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,96 @@
+// Tiled captures, for images too large for one BMP or to read in part.  The
+// file is a header, then tiles of tileSize x tileSize pixels compressed
+// independently with QOI band by band from the top, then an index of where
+// each tile is.  A reader maps and decodes only the tiles a rectangle
+// crosses, so opening a tall page and showing one screen of it costs about
+// one screen.
+//
+//   TiledHeader
+//   tiles        row by row from the top, each a QOI stream of its rows
+//                without the QOI header, ending with the end marker
+//   TiledEntry   for each tile in the same order, at indexOffset
+const DWORD kTiledMagic = 0x4c49544d;  // "MTIL"
+const WORD kTiledVersion = 1;
+const DWORD kDefaultTileSize = 256;
+// Readers keep a row of a tile per thread and decode whole bands, so a
+// file cannot ask for tiles larger than this.
+const DWORD kMaxTileSize = 4096;
+
+struct TiledHeader {
+  DWORD magic;
+  WORD version;
+  // 8 (grayscale), 24 or 32.
+  WORD bitCount;
+  DWORD width;
+  DWORD height;
+  DWORD tileSize;
+  DWORD reserved;
+  // From the start of the header.
+  ULONGLONG indexOffset;
+};
+
+struct TiledEntry {
+  ULONGLONG offset;
+  DWORD size;
+  DWORD reserved;
+};
+
+// Rows come in from the top in strips of any height.  One band of tiles is
+// kept until it is full, and its tiles are then encoded in parallel and
+// written.  The header is written again at the end with the offset of the
+// index, so the stream must be seekable.
+class TiledWriter {
+private:
+  std::ostream &os_;
+  DWORD tileSize_;
+  DWORD width_;
+  DWORD height_;
+  WORD bitCount_;
+  DWORD rowBytes_;
+  DWORD rowsWritten_;
+  std::streampos start_;
+  ULONGLONG offset_;
+  // Rows of the current band, rowBytes_ apart.
+  std::vector<BYTE> band_;
+  DWORD bandRows_;
+  std::vector<TiledEntry> index_;
+
+  bool Flush();
+
+public:
+  // |tileSize| is the width and height of a tile in pixels, up to
+  // kMaxTileSize.
+  TiledWriter(std::ostream &os, DWORD tileSize);
+
+  // |bitCount| is 8 for grayscale, 24 or 32.
+  bool Begin(DWORD width, DWORD height, WORD bitCount);
+  // |stride| is the distance from one row to the row below, which is
+  // negative for a bottom-up DIB.
+  bool WriteRows(LPCBYTE top, LONG stride, DWORD count);
+  // Fails unless every row has been written.
+  bool End();
+};
+
+class TiledReader {
+private:
+  HANDLE mapping_;
+  ULONGLONG fileSize_;
+  DWORD granularity_;
+  TiledHeader header_;
+  DWORD tilesAcross_;
+  std::vector<TiledEntry> index_;
+
+  void Close();
+
+public:
+  TiledReader();
+  ~TiledReader();
+
+  // Reads the header and the index.  No tile is read until ReadRect.
+  bool Open(LPCWSTR path);
+  const TiledHeader &GetHeader() const;
+  // Decodes the pixels of |rect| to |bits|, its top row first and each row
+  // |stride| bytes below the one before.  The rows of a band are mapped one
+  // band at a time, and the tiles of a band are decoded in parallel.
+  bool ReadRect(const RECT &rect, LPBYTE bits, LONG stride) const;
+};
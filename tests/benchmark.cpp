@@ -0,0 +1,891 @@
+#include <windows.h>
+#include <strsafe.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <blank.h>
+#include <diff.h>
+#include <kernel.h>
+#include <logger.h>
+#include <parallel.h>
+#include <phash.h>
+#include <pixelview.h>
+#include <quantize.h>
+#include <resample.h>
+#include <ssim.h>
+#include <store.h>
+#include <tiled.h>
+
+// Benchmarks are disabled by default.  Run them with "nmake bench" or
+//   t.exe --gtest_also_run_disabled_tests --gtest_filter=Benchmark.*
+
+class Stopwatch {
+private:
+  LARGE_INTEGER freq_;
+  LARGE_INTEGER start_;
+
+public:
+  Stopwatch() {
+    QueryPerformanceFrequency(&freq_);
+    QueryPerformanceCounter(&start_);
+  }
+
+  double ElapsedMilliseconds() const {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (now.QuadPart - start_.QuadPart) * 1000.0 / freq_.QuadPart;
+  }
+};
+
+struct Resolution {
+  LPCSTR name;
+  DWORD width;
+  DWORD height;
+};
+
+static const Resolution kResolutions[] = {
+  {"1080p", 1920, 1080},
+  {"4K", 3840, 2160},
+  {"8K", 7680, 4320},
+};
+
+// The loop Blob::Dump used before HexDump, one byte at a time through the
+// stream.
+static void DumpPerByte(std::wostream &os, LPCBYTE p, size_t size) {
+  const size_t width = 16;
+  for (size_t i = 0; i < size; ++i) {
+    if (i % width == 0) {
+      os << std::hex << std::setfill(L'0') << std::setw(4) << i << L':';
+    }
+    os << (i % width > 0 && i % 8 == 0 ? L"  " : L" ")
+       << std::hex << std::setfill(L'0') << std::setw(2) << int(p[i]);
+    if (i % width == width - 1) {
+      os << L"\r\n";
+    }
+  }
+}
+
+// What Log did before the logger, less OutputDebugString.
+static void FormatNow(LPWSTR buffer, LPCWSTR format, ...) {
+  va_list v;
+  va_start(v, format);
+  StringCchVPrintf(buffer, 1024, format, v);
+  va_end(v);
+}
+
+// The loop DIB::ConvertToGrayscale used before the fixed-point kernels.
+static void GrayscaleRowFloat(LPCBYTE src, LPBYTE dst, DWORD width) {
+  const float B2YF = 0.114f;
+  const float G2YF = 0.587f;
+  const float R2YF = 0.299f;
+  auto bitsSrc = reinterpret_cast<CONST RGBQUAD *>(src);
+  for (DWORD x = 0; x < width; ++x) {
+    *(dst++) = static_cast<BYTE>(R2YF * bitsSrc->rgbRed
+                                 + G2YF * bitsSrc->rgbGreen
+                                 + B2YF * bitsSrc->rgbBlue);
+    ++bitsSrc;
+  }
+}
+
+template<class F>
+static double BestOf(int repeat, F f) {
+  double best = 1e30;
+  for (int i = 0; i < repeat; ++i) {
+    Stopwatch sw;
+    f();
+    best = min(best, sw.ElapsedMilliseconds());
+  }
+  return best;
+}
+
+TEST(Benchmark, DISABLED_Grayscale) {
+  const struct {
+    LPCSTR name;
+    GrayscaleRowFunc func;
+    bool supported;
+  } kernels[] = {
+    {"float", GrayscaleRowFloat, true},
+    {"scalar", GrayscaleRowScalar, true},
+    {"sse2", GrayscaleRowSSE2, true},
+    {"avx2", GrayscaleRowAVX2, HasAVX2()},
+  };
+
+  for (const auto &res : kResolutions) {
+    Blob src(res.width * res.height * 4), dst(res.width * res.height);
+    ASSERT_TRUE(src && dst);
+    for (SIZE_T i = 0; i < src.Size(); ++i) {
+      src[i] = static_cast<BYTE>(i * 31 + i / 4093);
+    }
+
+    for (const auto &k : kernels) {
+      if (!k.supported) continue;
+      const double ms = BestOf(5, [&]() {
+        for (DWORD y = 0; y < res.height; ++y) {
+          k.func(src + y * res.width * 4, dst + y * res.width, res.width);
+        }
+      });
+      printf("Grayscale %-6s %-6s %8.2f ms %8.1f Mpx/s\n",
+             res.name,
+             k.name,
+             ms,
+             res.width * res.height / ms / 1000.0);
+    }
+  }
+}
+
+TEST(Benchmark, DISABLED_GrayscaleScaling) {
+  // A full-page capture of a long page at 1920px.
+  const DWORD width = 1920, height = 32768;
+  auto &scheduler = TaskScheduler::Default();
+  const auto original = scheduler.ThreadCount();
+  const DWORD maxThreads = max(std::thread::hardware_concurrency(), 1u);
+  if (auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr)) {
+    double serial = 0;
+    for (DWORD threads = 1; threads <= maxThreads; threads *= 2) {
+      scheduler.SetThreadCount(threads);
+      double ms = 1e30;
+      for (int i = 0; i < 3; ++i) {
+        DIB dib = DIB::CreateNew(memDC, 32, width, height);
+        memset(dib.GetBits(), 0x80, width * height * 4);
+        Stopwatch sw;
+        dib.ConvertToGrayscale(memDC, /*section*/nullptr);
+        ms = min(ms, sw.ElapsedMilliseconds());
+      }
+      if (threads == 1) serial = ms;
+      printf("GrayscaleScaling %2u threads %8.2f ms  x%.2f\n",
+             threads,
+             ms,
+             serial / ms);
+    }
+  }
+  scheduler.SetThreadCount(original);
+}
+
+// Something like a rendered web page: a white background, flat boxes, and
+// rows of small dark glyph-like noise.
+static void FillPageLike(LPBYTE bits, DWORD width, DWORD height) {
+  auto pixels = reinterpret_cast<LPDWORD>(bits);
+  DWORD seed = 1;
+  for (DWORD y = 0; y < height; ++y) {
+    for (DWORD x = 0; x < width; ++x) {
+      DWORD color = 0xffffff;
+      if ((x / 640 + y / 360) % 3 == 0) {
+        color = 0xe8eef8;
+      }
+      if (y % 24 < 14 && x % 600 < 520) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 3 == 0) {
+          color = 0x202020 + ((seed >> 20) & 0x0f) * 0x030303;
+        }
+      }
+      pixels[SIZE_T(width) * y + x] = color;
+    }
+  }
+}
+
+TEST(Benchmark, DISABLED_Png) {
+  auto &scheduler = TaskScheduler::Default();
+  const auto original = scheduler.ThreadCount();
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB dib = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    FillPageLike(dib.GetBits(), res.width, res.height);
+    const double bmpBytes = res.width * res.height * 4.0;
+
+    for (WORD bitCount : {32, 8}) {
+      for (int level : {0, 1, 3, 6, 9}) {
+        const DWORD threadCounts[] = {1, original};
+        for (DWORD i = 0; i < (original > 1 ? 2u : 1u); ++i) {
+          const DWORD threads = threadCounts[i];
+          scheduler.SetThreadCount(threads);
+          SIZE_T size = 0;
+          const double ms = BestOf(3, [&]() {
+            std::ostringstream oss;
+            dib.SavePng(oss, bitCount, level);
+            size = oss.str().size();
+          });
+          printf("Png %-6s %2ubpp level %d %2u threads %8.2f ms"
+                 " %8.1f MB/s  ratio %6.2f%%\n",
+                 res.name,
+                 bitCount,
+                 level,
+                 threads,
+                 ms,
+                 bmpBytes / ms / 1000.0,
+                 size * 100.0 / bmpBytes);
+        }
+      }
+    }
+  }
+  scheduler.SetThreadCount(original);
+}
+
+TEST(Benchmark, DISABLED_Qoi) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB dib = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    FillPageLike(dib.GetBits(), res.width, res.height);
+    const SIZE_T bmpBytes = SIZE_T(res.width) * res.height * 4;
+
+    Blob copy(bmpBytes);
+    const double memcpyMs = BestOf(5, [&]() {
+      memcpy(copy, dib.GetBits(), bmpBytes);
+    });
+    printf("Qoi %-6s memcpy      %8.2f ms %8.1f MB/s\n",
+           res.name,
+           memcpyMs,
+           bmpBytes / memcpyMs / 1000.0);
+
+    for (WORD bitCount : {32, 8}) {
+      Blob qoi;
+      const double encodeMs = BestOf(5, [&]() {
+        dib.SaveQoi(qoi, bitCount);
+      });
+      const std::string data(qoi.As<char>(), qoi.Size());
+      const double decodeMs = BestOf(5, [&]() {
+        std::istringstream iss(data, std::ios::binary | std::ios::in);
+        DIB::LoadFromStream(iss, memDC);
+      });
+      printf("Qoi %-6s %2ubpp encode %8.2f ms %8.1f MB/s"
+             "  decode %8.2f ms  ratio %6.2f%% (x%.1f of %ubpp)\n",
+             res.name,
+             bitCount,
+             encodeMs,
+             bmpBytes / encodeMs / 1000.0,
+             decodeMs,
+             qoi.Size() * 100.0 / bmpBytes,
+             bmpBytes * bitCount / 32.0 / qoi.Size(),
+             bitCount);
+    }
+  }
+}
+
+TEST(Benchmark, DISABLED_Convert) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB dib = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    FillPageLike(dib.GetBits(), res.width, res.height);
+    const double megapixels = res.width * res.height / 1e6;
+
+    for (WORD bitCount : {1, 4, 8, 16, 24}) {
+      DIB converted;
+      const double packMs = BestOf(3, [&]() {
+        converted = dib.ConvertTo(bitCount, memDC);
+      });
+      const double expandMs = BestOf(3, [&]() {
+        converted.ConvertTo(32, memDC);
+      });
+      printf("Convert %-6s 32 -> %2ubpp %8.2f ms %8.1f Mpx/s"
+             "  %2ubpp -> 32 %8.2f ms %8.1f Mpx/s\n",
+             res.name,
+             bitCount,
+             packMs,
+             megapixels * 1000.0 / packMs,
+             bitCount,
+             expandMs,
+             megapixels * 1000.0 / expandMs);
+    }
+  }
+}
+
+// Sums the green channel of a 32bpp frame three ways: At per pixel, a typed
+// view, and a raw pointer walk that is the lower bound.
+TEST(Benchmark, DISABLED_PixelAccess) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB dib = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    FillPageLike(dib.GetBits(), res.width, res.height);
+    const DIB &frame = dib;
+
+    ULONGLONG sums[3] = {0};
+    const double atMs = BestOf(3, [&]() {
+      ULONGLONG sum = 0;
+      for (DWORD y = 0; y < res.height; ++y) {
+        for (DWORD x = 0; x < res.width; ++x) {
+          sum += frame.At(x, y)[1];
+        }
+      }
+      sums[0] = sum;
+    });
+    const double viewMs = BestOf(3, [&]() {
+      ULONGLONG sum = 0;
+      for (auto row : frame.View<RGBQUAD>()) {
+        for (const RGBQUAD &px : row) {
+          sum += px.rgbGreen;
+        }
+      }
+      sums[1] = sum;
+    });
+    const double rawMs = BestOf(3, [&]() {
+      ULONGLONG sum = 0;
+      auto p = reinterpret_cast<const RGBQUAD*>(dib.GetBits());
+      for (SIZE_T i = 0; i < SIZE_T(res.width) * res.height; ++i) {
+        sum += p[i].rgbGreen;
+      }
+      sums[2] = sum;
+    });
+    EXPECT_EQ(sums[0], sums[1]);
+    EXPECT_EQ(sums[0], sums[2]);
+    printf("PixelAccess %-6s At %8.2f ms  View %8.2f ms  raw %8.2f ms\n",
+           res.name,
+           atMs,
+           viewMs,
+           rawMs);
+  }
+}
+
+// A golden page against a capture with a few changed lines, the common case.
+TEST(Benchmark, DISABLED_Diff) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB golden = DIB::CreateNew(memDC, 32, res.width, res.height);
+    DIB capture = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(golden), nullptr);
+    ASSERT_NE(HBITMAP(capture), nullptr);
+    FillPageLike(golden.GetBits(), res.width, res.height);
+    FillPageLike(capture.GetBits(), res.width, res.height);
+    for (DWORD x = 0; x < res.width; ++x) {
+      capture.At(x, res.height / 2)[0] ^= 0xff;
+    }
+
+    DiffOptions options;
+    DiffResult result;
+    const double ms = BestOf(5, [&]() {
+      golden.Diff(capture, options, result);
+    });
+    printf("Diff %-6s %8.2f ms %8.1f Mpx/s  %llu changed in %u regions\n",
+           res.name,
+           ms,
+           res.width * res.height / ms / 1000.0,
+           result.changedPixels,
+           static_cast<DWORD>(result.regions.size()));
+  }
+}
+
+TEST(Benchmark, DISABLED_Ssim) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB page = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(page), nullptr);
+    FillPageLike(page.GetBits(), res.width, res.height);
+    DIB golden = page.ConvertTo(8, memDC);
+    DIB capture = page.ConvertTo(8, memDC);
+    for (DWORD x = 0; x < res.width; ++x) {
+      capture.At(x, res.height / 2)[0] ^= 0xff;
+    }
+
+    SsimResult result;
+    const double ms = BestOf(5, [&]() {
+      golden.Ssim(capture, result);
+    });
+    printf("Ssim %-6s %8.2f ms %8.1f Mpx/s  score %.4f\n",
+           res.name,
+           ms,
+           res.width * res.height / ms / 1000.0,
+           result.score);
+  }
+}
+
+TEST(Benchmark, DISABLED_Hash) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB dib = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    FillPageLike(dib.GetBits(), res.width, res.height);
+    ImageHash hash;
+    const double ms = BestOf(5, [&]() {
+      dib.Hash(hash);
+    });
+    printf("Hash %-6s %8.2f ms %8.1f Mpx/s\n",
+           res.name,
+           ms,
+           res.width * res.height / ms / 1000.0);
+  }
+
+  HashIndex index;
+  ULONGLONG seed = 1;
+  const DWORD stored = 1000000;
+  for (DWORD i = 0; i < stored; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    index.Insert(seed, i);
+  }
+  for (DWORD maxDistance : {4u, 8u, 12u}) {
+    const DWORD queries = 1000;
+    DWORD found = 0;
+    const double ms = BestOf(3, [&]() {
+      found = 0;
+      for (DWORD q = 0; q < queries; ++q) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        DWORD id, distance;
+        found += index.FindNearest(seed, maxDistance, id, distance);
+      }
+    });
+    printf("HashIndex %u hashes within %2u bits %8.2f us/query\n",
+           stored,
+           maxDistance,
+           ms * 1000.0 / queries);
+  }
+}
+
+// A crawl of 4 template pages, 6 captures each.  A third of the captures are
+// exact repeats; the others differ from their template in the banner only.
+TEST(Benchmark, DISABLED_Store) {
+  const DWORD kWidth = 1920;
+  const DWORD kHeight = 4320;
+  const DWORD kBannerRows = 90;
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  std::vector<DIB> corpus;
+  for (DWORD t = 0; t < 4; ++t) {
+    for (DWORD v = 0; v < 6; ++v) {
+      DIB dib = DIB::CreateNew(memDC, 32, kWidth, -LONG(kHeight));
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      FillPageLike(dib.GetBits(), kWidth, kHeight);
+      auto pixels = reinterpret_cast<LPDWORD>(dib.GetBits());
+      for (DWORD y = 600 + t * 900; y < 1000 + t * 900; ++y) {
+        for (DWORD x = 0; x < kWidth; ++x) {
+          pixels[SIZE_T(y) * kWidth + x] ^= 0x00ffffff;
+        }
+      }
+      if (v % 3) {
+        for (DWORD i = 0; i < kWidth * kBannerRows; ++i) {
+          pixels[i] = 0x400000 * v + i % 97;
+        }
+      }
+      corpus.push_back(std::move(dib));
+    }
+  }
+
+  for (DWORD tileSize : {0, 256, 64}) {
+    const LPCWSTR directory = L"benchmark-store";
+    std::vector<std::wstring> manifests;
+    CaptureStore store(directory, tileSize);
+    Stopwatch sw;
+    for (const auto &dib : corpus) {
+      manifests.push_back(L"benchmark" + std::to_wstring(manifests.size())
+                          + L".cap");
+      dib.SaveToStore(store, manifests.back().c_str());
+    }
+    const double ms = sw.ElapsedMilliseconds();
+    const auto &stats = store.GetStats();
+    printf("Store tiles %3u %8.2f ms %8.1f MB/s  %7.1f MB in %7.1f MB written"
+           " (%4.1f%%)\n",
+           tileSize,
+           ms,
+           stats.bytesIn / ms / 1000.0,
+           stats.bytesIn / 1e6,
+           stats.bytesWritten / 1e6,
+           stats.bytesWritten * 100.0 / stats.bytesIn);
+
+    std::unordered_set<std::wstring> fanOuts;
+    for (const auto &path : manifests) {
+      CaptureStore::Manifest manifest;
+      if (store.ReadManifest(path.c_str(), manifest)) {
+        for (const auto &key : manifest.objects) {
+          const std::wstring object = store.ObjectPath(key);
+          DeleteFile(object.c_str());
+          fanOuts.insert(object.substr(0, object.rfind(L'\\')));
+        }
+      }
+      DeleteFile(path.c_str());
+    }
+    for (const auto &dir : fanOuts) {
+      RemoveDirectory(dir.c_str());
+    }
+    RemoveDirectory(directory);
+  }
+}
+
+// A page recaptured on a schedule, where only a ticker and a clock change
+// between captures.  Each capture is a delta on the one before.
+TEST(Benchmark, DISABLED_StoreDeltas) {
+  const DWORD kWidth = 1920;
+  const DWORD kHeight = 4320;
+  const DWORD kCaptures = 20;
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  DIB dib = DIB::CreateNew(memDC, 32, kWidth, -LONG(kHeight));
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  FillPageLike(dib.GetBits(), kWidth, kHeight);
+  auto pixels = reinterpret_cast<LPDWORD>(dib.GetBits());
+
+  for (DWORD deltas : {0, 1}) {
+    const LPCWSTR directory = L"benchmark-deltas";
+    std::vector<std::wstring> manifests;
+    CaptureStore store(directory, /*tileSize*/64);
+    double ms = 0;
+    CaptureStore::Stats first;
+    for (DWORD i = 0; i < kCaptures; ++i) {
+      for (DWORD y = 100; y < 140; ++y) {
+        for (DWORD x = 1700; x < 1900; ++x) {
+          pixels[SIZE_T(y) * kWidth + x] = 0x10101 * (i + x / 16);
+        }
+      }
+      for (DWORD y = 2000; y < 2030; ++y) {
+        for (DWORD x = 0; x < kWidth; ++x) {
+          pixels[SIZE_T(y) * kWidth + x] = 0x30303 * ((x + i * 37) / 24 % 64);
+        }
+      }
+      manifests.push_back(L"benchmark-delta" + std::to_wstring(i) + L".cap");
+      Stopwatch sw;
+      dib.SaveToStore(store,
+                      manifests.back().c_str(),
+                      deltas && i ? manifests[i - 1].c_str() : nullptr);
+      if (i == 0) {
+        first = store.GetStats();
+      }
+      else {
+        ms += sw.ElapsedMilliseconds();
+      }
+    }
+    // Steady state, after the first capture.
+    const auto &stats = store.GetStats();
+    const DWORD recaptures = kCaptures - 1;
+    const double bytesIn = double(stats.bytesIn - first.bytesIn);
+    const double written = double(stats.bytesWritten - first.bytesWritten);
+    const double listed = double(stats.objects - first.objects);
+    printf("Store %s %8.2f ms/capture %8.1f KB written/capture"
+           " (%5.2f%% of the frame), %6.1f tiles listed/capture\n",
+           deltas ? "deltas" : "frames",
+           ms / recaptures,
+           written / 1e3 / recaptures,
+           written * 100.0 / bytesIn,
+           listed / recaptures);
+
+    std::unordered_set<std::wstring> objects;
+    for (const auto &path : manifests) {
+      CaptureStore::Manifest manifest;
+      if (store.ReadManifest(path.c_str(), manifest)) {
+        for (const auto &key : manifest.objects) {
+          objects.insert(store.ObjectPath(key));
+        }
+      }
+    }
+    std::unordered_set<std::wstring> fanOuts;
+    for (const auto &object : objects) {
+      DeleteFile(object.c_str());
+      fanOuts.insert(object.substr(0, object.rfind(L'\\')));
+    }
+    for (const auto &path : manifests) {
+      DeleteFile(path.c_str());
+    }
+    for (const auto &dir : fanOuts) {
+      RemoveDirectory(dir.c_str());
+    }
+    RemoveDirectory(directory);
+  }
+}
+
+TEST(Benchmark, DISABLED_Resample) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  const struct {
+    LPCSTR name;
+    ResampleFilter filter;
+  } filters[] = {
+    {"box", ResampleFilter::Box},
+    {"bilinear", ResampleFilter::Bilinear},
+    {"lanczos3", ResampleFilter::Lanczos3},
+  };
+  for (const auto &res : kResolutions) {
+    DIB dib = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    FillPageLike(dib.GetBits(), res.width, res.height);
+    for (const auto &f : filters) {
+      // 150% to 100%, as for DPI normalization.
+      const double ms = BestOf(5, [&]() {
+        dib.Resample(res.width * 2 / 3, res.height * 2 / 3, f.filter, memDC);
+      });
+      printf("Resample %-6s %-8s 2/3 %8.2f ms %8.1f Mpx/s\n",
+             res.name,
+             f.name,
+             ms,
+             res.width * res.height / ms / 1000.0);
+    }
+
+    // Thumbnails of three widths, at once and one by one.
+    SIZE sizes[3];
+    for (DWORD i = 0; i < 3; ++i) {
+      sizes[i].cx = 160 << i;
+      sizes[i].cy = static_cast<LONG>(res.height * (160 << i) / res.width);
+    }
+    std::vector<DIB> outputs;
+    const double once = BestOf(5, [&]() {
+      dib.Resample(sizes, 3, ResampleFilter::Lanczos3, memDC, outputs);
+    });
+    const double separately = BestOf(5, [&]() {
+      for (const auto &size : sizes) {
+        dib.Resample(size.cx, size.cy, ResampleFilter::Lanczos3, memDC);
+      }
+    });
+    printf("Resample %-6s 3 thumbnails %8.2f ms at once, %8.2f ms separately\n",
+           res.name,
+           once,
+           separately);
+  }
+}
+
+TEST(Benchmark, DISABLED_Quantize) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB page = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(page), nullptr);
+    FillPageLike(page.GetBits(), res.width, res.height);
+    DIB indexed;
+    const double lossless = BestOf(3, [&]() {
+      indexed = page.Quantize(0, Dither::None, memDC);
+    });
+    ASSERT_NE(HBITMAP(indexed), nullptr);
+    std::ostringstream full, small;
+    page.SavePng(full, 32, 6);
+    indexed.SavePng(small, indexed.GetBitmapInfo()->bmiHeader.biBitCount, 6);
+    printf("Quantize %-6s lossless %2ubpp %8.2f ms %8.1f Mpx/s"
+           "  png %6.2f%% of 32bpp\n",
+           res.name,
+           indexed.GetBitmapInfo()->bmiHeader.biBitCount,
+           lossless,
+           res.width * res.height / lossless / 1000.0,
+           small.str().size() * 100.0 / full.str().size());
+
+    // A photo-like gradient of far more than 256 colors.
+    DIB photo = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(photo), nullptr);
+    for (DWORD y = 0; y < res.height; ++y) {
+      auto row = reinterpret_cast<LPDWORD>(photo.At(0, y));
+      for (DWORD x = 0; x < res.width; ++x) {
+        row[x] = (x * 255 / res.width) << 16
+                 | (y * 255 / res.height) << 8
+                 | ((x + y) & 0xff);
+      }
+    }
+    const struct {
+      LPCSTR name;
+      Dither dither;
+    } dithers[] = {
+      {"none", Dither::None},
+      {"ordered", Dither::Ordered},
+      {"fs", Dither::FloydSteinberg},
+    };
+    for (const auto &d : dithers) {
+      const double ms = BestOf(3, [&]() {
+        photo.Quantize(8, d.dither, memDC);
+      });
+      printf("Quantize %-6s 8bpp %-7s %8.2f ms %8.1f Mpx/s\n",
+             res.name,
+             d.name,
+             ms,
+             res.width * res.height / ms / 1000.0);
+    }
+  }
+}
+
+TEST(Benchmark, DISABLED_Blank) {
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  for (const auto &res : kResolutions) {
+    DIB dib = DIB::CreateNew(memDC, 32, res.width, res.height);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    // The worst case is a frame that is blank to the end.
+    memset(dib.GetBits(), 0xff, SIZE_T(res.width) * res.height * 4);
+    BlankResult result;
+    const double blank = BestOf(5, [&]() {
+      dib.Classify(BlankOptions(), result);
+    });
+    EXPECT_EQ(result.content, FrameContent::Blank);
+
+    FillPageLike(dib.GetBits(), res.width, res.height);
+    const double content = BestOf(5, [&]() {
+      dib.Classify(BlankOptions(), result);
+    });
+    EXPECT_EQ(result.content, FrameContent::Content);
+    printf("Blank %-6s blank %8.2f ms %8.1f Mpx/s, content %8.3f ms\n",
+           res.name,
+           blank,
+           res.width * res.height / blank / 1000.0,
+           content);
+  }
+}
+
+// A page 15 screens tall, saved in tiles, and one screen of it read back.
+TEST(Benchmark, DISABLED_Tiled) {
+  const LPCWSTR path = L"benchmark.tcap";
+  const DWORD width = 1920, height = 1080 * 15;
+  auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr);
+  DIB dib = DIB::CreateNew(memDC, 32, width, -static_cast<LONG>(height));
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  FillPageLike(dib.GetBits(), width, height);
+
+  const double save = BestOf(3, [&]() {
+    std::ofstream os(path, std::ios::binary);
+    dib.SaveTiled(os, kDefaultTileSize);
+  });
+  RECT screen;
+  SetRect(&screen, 0, 1080 * 7, width, 1080 * 8);
+  const double open = BestOf(5, [&]() {
+    DIB part = DIB::LoadTiled(path, memDC, &screen);
+    EXPECT_NE(HBITMAP(part), nullptr);
+  });
+  const double all = BestOf(3, [&]() {
+    DIB whole = DIB::LoadTiled(path, memDC);
+    EXPECT_NE(HBITMAP(whole), nullptr);
+  });
+  printf("Tiled %ux%u save %8.2f ms, one screen %8.2f ms, all %8.2f ms\n",
+         width,
+         height,
+         save,
+         open,
+         all);
+  DeleteFile(path);
+}
+
+// The buffers of a capture: a header, an encoding strip, and a copy of the
+// pixels, each written page by page as a capture would.  Allocated straight
+// from the heap as Blob used to, and from the pool.
+TEST(Benchmark, DISABLED_BlobPool) {
+  const int kCaptures = 10000;
+  const SIZE_T sizes[] = {sizeof(BITMAPINFOHEADER) + 1024,
+                          256 * 1024,
+                          640 * 480 * 4};
+  auto touch = [](LPBYTE p, SIZE_T size) {
+    for (SIZE_T i = 0; i < size; i += 4096) {
+      p[i] = 1;
+    }
+  };
+
+  const HANDLE heap = GetProcessHeap();
+  Stopwatch heapWatch;
+  for (int i = 0; i < kCaptures; ++i) {
+    LPVOID buffers[ARRAYSIZE(sizes)];
+    for (int b = 0; b < ARRAYSIZE(sizes); ++b) {
+      buffers[b] = HeapAlloc(heap, 0, sizes[b]);
+      touch(static_cast<LPBYTE>(buffers[b]), sizes[b]);
+    }
+    for (int b = 0; b < ARRAYSIZE(sizes); ++b) {
+      HeapFree(heap, 0, buffers[b]);
+    }
+  }
+  const double direct = heapWatch.ElapsedMilliseconds();
+
+  BlobPool pool(/*maxCached*/64 * 1024 * 1024);
+  Stopwatch poolWatch;
+  for (int i = 0; i < kCaptures; ++i) {
+    Blob blobs[ARRAYSIZE(sizes)] = {Blob(pool), Blob(pool), Blob(pool)};
+    for (int b = 0; b < ARRAYSIZE(sizes); ++b) {
+      blobs[b].Alloc(sizes[b]);
+      touch(blobs[b], sizes[b]);
+    }
+  }
+  const double pooled = poolWatch.ElapsedMilliseconds();
+  const auto stats = pool.GetStats();
+  printf("BlobPool %d captures: heap %8.2f ms, pool %8.2f ms"
+         " (%u of %u reused, peak %u KB)\n",
+         kCaptures,
+         direct,
+         pooled,
+         static_cast<DWORD>(stats.reused),
+         static_cast<DWORD>(stats.acquired),
+         static_cast<DWORD>(stats.peakBytesInUse / 1024));
+}
+
+// A buffer grown a strip at a time, like SaveQoi into a Blob, copied on
+// every new class from the heap and extended in place from virtual memory.
+TEST(Benchmark, DISABLED_BlobGrowth) {
+  const SIZE_T kStrip = 256 * 1024;
+  const SIZE_T kTotal = 64 * 1024 * 1024;
+  for (auto backing : {BlobBacking::Heap, BlobBacking::Virtual}) {
+    BlobPool pool(/*maxCached*/0);
+    const double ms = BestOf(5, [&]() {
+      Blob blob(kStrip, kBlobAlignment, backing, pool);
+      for (SIZE_T used = kStrip; used < kTotal; used += kStrip) {
+        blob.Alloc(used + kStrip);
+        memset(blob + used, 0, kStrip);
+      }
+    });
+    const auto stats = pool.GetStats();
+    printf("BlobGrowth %-7s %8.2f ms (%u extended of %u)\n",
+           backing == BlobBacking::Heap ? "heap" : "virtual",
+           ms,
+           static_cast<DWORD>(stats.extended),
+           static_cast<DWORD>(stats.extended + stats.acquired));
+  }
+}
+
+TEST(Benchmark, DISABLED_HexDump) {
+  const SIZE_T kSize = 8 * 1024 * 1024;
+  Blob blob(kSize);
+  for (SIZE_T i = 0; i < kSize; ++i) {
+    blob[i] = static_cast<BYTE>(i * 7);
+  }
+  SIZE_T chars = 0;
+  const double stream = BestOf(3, [&]() {
+    std::wostringstream oss;
+    DumpPerByte(oss, blob, kSize);
+    chars = oss.str().size();
+  });
+  const double table = BestOf(3, [&]() {
+    std::wostringstream oss;
+    blob.Dump(oss, 16, kSize);
+    chars = oss.str().size();
+  });
+  const double ascii = BestOf(3, [&]() {
+    std::wostringstream oss;
+    blob.Dump(oss, 16, kSize, /*ascii*/true);
+  });
+  printf("HexDump 8MB  per byte %8.2f ms  tables %8.2f ms  ascii %8.2f ms"
+         "  (%u chars)\n",
+         stream, table, ascii, static_cast<DWORD>(chars));
+}
+
+// The cost on the calling thread.  Batches stay under half a ring, so the
+// logging thread is not woken inside the timing, and the logger is flushed
+// between them.
+TEST(Benchmark, DISABLED_Log) {
+  const int kBatches = 200;
+  const int kBatch = 100;
+  const LPCWSTR path = L"C:\\captures\\page.png";
+  WCHAR buffer[1024];
+  double format = 0, async = 0, disabled = 0;
+  for (int b = 0; b < kBatches; ++b) {
+    Stopwatch formatWatch;
+    for (int i = 0; i < kBatch; ++i) {
+      FormatNow(buffer, L"Stored %s: %u bytes written, %u tiles unchanged\n",
+                path, i * 4096, i);
+    }
+    format += formatWatch.ElapsedMilliseconds();
+
+    Stopwatch asyncWatch;
+    for (int i = 0; i < kBatch; ++i) {
+      LogInfo(L"Stored %s: %u bytes written, %u tiles unchanged\n",
+              path, i * 4096, i);
+    }
+    async += asyncWatch.ElapsedMilliseconds();
+    Logger::Flush();
+
+    Stopwatch disabledWatch;
+    for (int i = 0; i < kBatch; ++i) {
+      LogVerbose(L"Stored %s: %u bytes written, %u tiles unchanged\n",
+                 path, i * 4096, i);
+    }
+    disabled += disabledWatch.ElapsedMilliseconds();
+  }
+  const double records = kBatches * kBatch;
+  printf("Log  formatted %6.0f ns  async %6.0f ns  disabled %6.0f ns"
+         "  per record (%u dropped)\n",
+         format * 1e6 / records,
+         async * 1e6 / records,
+         disabled * 1e6 / records,
+         static_cast<DWORD>(Logger::Dropped()));
+}
@@ -1,19 +1,13 @@
 #include <windows.h>
 #include <windowsx.h>
-#include <strsafe.h>
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <fstream>
+#include <functional>
+#include <sstream>
 #include <blob.h>
 #include <bitmap.h>
 
-void Log(LPCWSTR format, ...) {
-  WCHAR linebuf[1024];
-  va_list v;
-  va_start(v, format);
-  StringCbVPrintf(linebuf, sizeof(linebuf), format, v);
-  OutputDebugString(linebuf);
-}
-
 static DIB LoadFromBlob(const std::string &blob, HWND hwnd) {
   DIB dib;
   if (auto memDC = SafeDC::CreateMemDC(hwnd)) {
@@ -53,9 +47,14 @@ TEST(DIB, StreamLoadSave) {
   DIB dib = LoadFromBlob(bitmapStr, /*hwnd*/nullptr);
   EXPECT_NE(HBITMAP(dib), nullptr);
 
+  // Save puts the pixels at a DWORD boundary, two bytes further.
+  std::string saved = bitmapStr;
+  saved.insert(0x36, 2, '\0');
+  saved[0x02] = 0x68;  // bfSize
+  saved[0x0a] = 0x38;  // bfOffBits
   std::ostringstream oss;
   ASSERT_TRUE(dib.Save(oss));
-  EXPECT_EQ(oss.str(), bitmapStr);
+  EXPECT_EQ(oss.str(), saved);
 
   Blob pixels;
   dib.CopyTo(pixels);
@@ -91,8 +90,11 @@ TEST(DIB, CreateDIBSection) {
     dib.CopyTo(bits);
     EXPECT_EQ(bits.Size(), 48);
 
+    // 16bpp has no color table.
     dib = DIB::CreateNew(memDC, 16, 100, 4);
-    EXPECT_EQ(HBITMAP(dib), nullptr);
+    EXPECT_NE(HBITMAP(dib), nullptr);
+    dib.CopyTo(bits);
+    EXPECT_EQ(bits.Size(), 200 * 4);
 
     dib = DIB::CreateNew(memDC, 24, 9, -2);
     EXPECT_NE(HBITMAP(dib), nullptr);
@@ -100,3 +102,212 @@ TEST(DIB, CreateDIBSection) {
     EXPECT_EQ(bits.Size(), 28 * 2);
   }
 }
+
+TEST(DIB, SaveAsGrayscale) {
+  if (auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr)) {
+    // Width 301 leaves padding at the end of each 8bpp row, and 300 rows
+    // span more than one strip.
+    std::string files[2];
+    const LONG heights[] = {300, -300};
+    for (int i = 0; i < 2; ++i) {
+      DIB dib = DIB::CreateNew(memDC, 32, 301, heights[i]);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      auto bits = dib.GetBits();
+      for (DWORD j = 0; j < 301 * 300 * 4; ++j) {
+        bits[j] = static_cast<BYTE>(j * 7 + j / 1204);
+      }
+
+      std::ostringstream streamed;
+      ASSERT_TRUE(dib.SaveAs(streamed, 8));
+      files[i] = streamed.str();
+    }
+
+    // Bottom-up: must match the DIB that ConvertToGrayscale produces.
+    DIB dib = LoadFromBlob(files[0], /*hwnd*/nullptr);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    EXPECT_EQ(dib.GetBitmapInfo()->bmiHeader.biBitCount, 8);
+    DIB reference = DIB::CreateNew(memDC, 32, 301, 300);
+    auto bits = reference.GetBits();
+    for (DWORD j = 0; j < 301 * 300 * 4; ++j) {
+      bits[j] = static_cast<BYTE>(j * 7 + j / 1204);
+    }
+    ASSERT_TRUE(reference.ConvertToGrayscale(memDC, /*section*/nullptr));
+    std::ostringstream converted;
+    ASSERT_TRUE(reference.Save(converted));
+    EXPECT_EQ(files[0], converted.str());
+
+    // Top-down: same rows in memory, only the sign of the height differs.
+    DIB topDown = LoadFromBlob(files[1], /*hwnd*/nullptr);
+    ASSERT_NE(HBITMAP(topDown), nullptr);
+    EXPECT_EQ(topDown.GetBitmapInfo()->bmiHeader.biHeight, -300);
+    Blob expected, actual;
+    reference.CopyTo(expected);
+    topDown.CopyTo(actual);
+    ASSERT_EQ(actual.Size(), expected.Size());
+    EXPECT_EQ(memcmp(actual, expected, expected.Size()), 0);
+  }
+}
+
+TEST(DIB, LoadFromFile) {
+  if (auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr)) {
+    DIB source = DIB::CreateNew(memDC, 24, 7, 5);
+    ASSERT_NE(HBITMAP(source), nullptr);
+    for (DWORD y = 0; y < 5; ++y) {
+      for (DWORD x = 0; x < 7; ++x) {
+        auto p = source.At(x, y);
+        p[0] = static_cast<BYTE>(x);
+        p[1] = static_cast<BYTE>(y);
+        p[2] = 0x80;
+      }
+    }
+    std::ostringstream oss;
+    ASSERT_TRUE(source.Save(oss));
+    // Save puts the pixels at a DWORD boundary, so that the file can back
+    // the DIB section directly.
+    const auto aligned = oss.str();
+    BITMAPFILEHEADER fh;
+    memcpy(&fh, aligned.data(), sizeof(fh));
+    ASSERT_EQ(fh.bfOffBits, 56u);
+
+    // Files of other writers have the pixels right after the header.
+    auto unaligned = aligned;
+    unaligned.erase(fh.bfOffBits - 2, 2);
+    fh.bfOffBits -= 2;
+    fh.bfSize -= 2;
+    memcpy(&unaligned[0], &fh, sizeof(fh));
+
+    const std::string files[] = {unaligned, aligned};
+    for (const auto &file : files) {
+      const bool mapped = &file == &files[1];
+      {
+        std::ofstream os("loadfromfile.bmp", std::ios::binary);
+        os.write(file.data(), file.size());
+      }
+
+      DIB dib = DIB::LoadFromFile(L"loadfromfile.bmp", memDC);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      EXPECT_EQ(dib.IsMapped(), mapped);
+      std::ostringstream saved;
+      ASSERT_TRUE(dib.Save(saved));
+      EXPECT_EQ(saved.str(), aligned);
+
+      // Rows 1..3 counted from the top.
+      dib = DIB::LoadFromFile(L"loadfromfile.bmp", memDC, 1, 3);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      EXPECT_EQ(dib.IsMapped(), mapped);
+      EXPECT_EQ(dib.GetBitmapInfo()->bmiHeader.biHeight, 3);
+      for (DWORD y = 0; y < 3; ++y) {
+        EXPECT_EQ(memcmp(dib.At(0, y), source.At(0, y + 1), 7 * 3), 0);
+      }
+      EXPECT_EQ(dib.At(0, 3), nullptr);
+
+      // Past the bottom of the image, rows are clipped.
+      dib = DIB::LoadFromFile(L"loadfromfile.bmp", memDC, 4, 10);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      EXPECT_EQ(memcmp(dib.At(0, 0), source.At(0, 4), 7 * 3), 0);
+
+      dib = DIB::LoadFromFile(L"loadfromfile.bmp", memDC, 5, 1);
+      EXPECT_EQ(HBITMAP(dib), nullptr);
+    }
+
+    // Loading leaves the file as it was.
+    std::ifstream is("loadfromfile.bmp", std::ios::binary);
+    std::string reloaded((std::istreambuf_iterator<char>(is)),
+                         std::istreambuf_iterator<char>());
+    EXPECT_EQ(reloaded, aligned);
+  }
+  DeleteFile(L"loadfromfile.bmp");
+}
+
+TEST(DIB, CreateOnFile) {
+  if (auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr)) {
+    Blob expected;
+    {
+      DIB dib = DIB::CreateOnFile(L"createonfile.bmp", memDC, 24, 5, -3,
+                                  /*initWithGrayscaleTable*/false);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      EXPECT_TRUE(dib.IsMapped());
+      for (DWORD y = 0; y < 3; ++y) {
+        for (DWORD x = 0; x < 5; ++x) {
+          auto p = dib.At(x, y);
+          p[0] = static_cast<BYTE>(x);
+          p[1] = static_cast<BYTE>(y);
+          p[2] = 0xff;
+        }
+      }
+      dib.CopyTo(expected);
+    }
+
+    std::ifstream is("createonfile.bmp", std::ios::binary);
+    std::string file((std::istreambuf_iterator<char>(is)),
+                     std::istreambuf_iterator<char>());
+    is.close();
+    ASSERT_GE(file.size(), sizeof(BITMAPFILEHEADER));
+    auto &fh = *reinterpret_cast<const BITMAPFILEHEADER*>(file.data());
+    EXPECT_EQ(fh.bfType, 0x4D42);
+    EXPECT_EQ(fh.bfSize, file.size());
+    EXPECT_EQ(fh.bfOffBits % 4, 0u);
+    EXPECT_EQ(file.size(), fh.bfOffBits + expected.Size());
+    EXPECT_EQ(memcmp(file.data() + fh.bfOffBits, expected, expected.Size()), 0);
+
+    DIB loaded = DIB::LoadFromFile(L"createonfile.bmp", memDC);
+    ASSERT_NE(HBITMAP(loaded), nullptr);
+    EXPECT_EQ(loaded.GetBitmapInfo()->bmiHeader.biHeight, -3);
+    Blob actual;
+    loaded.CopyTo(actual);
+    EXPECT_EQ(memcmp(actual, expected, expected.Size()), 0);
+  }
+  DeleteFile(L"createonfile.bmp");
+}
+
+TEST(DIB, Share) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (LONG height : {30, -30}) {
+    DIB dib = DIB::CreateNew(memDC, 24, 33, height);
+    for (DWORD y = 0; y < 30; ++y) {
+      memset(dib.At(0, y), static_cast<int>(y), 33 * 3);
+    }
+    LPCBYTE top = dib.At(0, 0);
+    BlobSlice pixels = DIB::Share(std::move(dib));
+    EXPECT_EQ(HBITMAP(dib), nullptr);
+    EXPECT_EQ(LPCBYTE(pixels), top);
+    EXPECT_EQ(pixels.Rows(), 30u);
+    EXPECT_EQ(pixels.RowBytes(), 99u);
+    EXPECT_EQ(pixels.Stride(), height < 0 ? 100 : -100);
+    const DIB *shared = DIB::Shared(pixels);
+    ASSERT_NE(shared, nullptr);
+    EXPECT_EQ(shared->At(0, 0), top);
+
+    BlobSlice tile = pixels.Rows(10, 10).Columns(30, 30);
+    EXPECT_EQ(DIB::Shared(tile), nullptr);
+    EXPECT_EQ(DIB::Shared(pixels.Rows(0, 30)), shared);
+    pixels = BlobSlice();
+    for (DWORD y = 0; y < 10; ++y) {
+      EXPECT_EQ(tile.Row(y)[29], y + 10);
+    }
+  }
+}
+
+TEST(DIB, DumpDiff) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB reference = DIB::CreateNew(memDC, 32, 10, 4);
+  DIB dib = DIB::CreateNew(memDC, 32, 10, -4);
+  for (DWORD y = 0; y < 4; ++y) {
+    memset(reference.At(0, y), 0x41, 40);
+    memset(dib.At(0, y), 0x41, 40);
+  }
+  dib.At(9, 2)[1] = 0x42;
+
+  std::wostringstream oss;
+  ASSERT_TRUE(dib.DumpDiff(reference, oss, 16, /*ascii*/true));
+  EXPECT_EQ(oss.str(),
+            L"Row 2\r\n"
+            L"-0020: 41 41 41 41 41 41 41 41"
+            L"                           AAAAAAAA\r\n"
+            L"+0020: 41 41 41 41 41 42 41 41"
+            L"                           AAAAABAA\r\n"
+            L"1 of 4 rows differ.\r\n");
+
+  DIB other = DIB::CreateNew(memDC, 32, 10, 5);
+  EXPECT_FALSE(dib.DumpDiff(other, oss));
+}
@@ -0,0 +1,90 @@
+#include <windows.h>
+#include <functional>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <blank.h>
+#include "pages.h"
+
+TEST(Blank, Blank) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {8, 24, 32}) {
+    DIB dib = CreatePage(memDC, bitCount, 101, 67, PagePattern::Background);
+    BlankResult result;
+    ASSERT_TRUE(dib.Classify(BlankOptions(), result)) << bitCount;
+    EXPECT_EQ(result.content, FrameContent::Blank) << bitCount;
+    EXPECT_EQ(result.differing, 0u);
+    const DWORD expected[] = {0xf0, 0, 0xd0e0f0, 0xc0d0e0f0};
+    EXPECT_EQ(result.background, expected[bitCount / 8 - 1]) << bitCount;
+
+    // Within the tolerance, and alpha, still count as the background.
+    for (DWORD y = 0; y < 67; ++y) {
+      for (DWORD x = 0; x < 101; x += 2) {
+        dib.At(x, y)[0] += 4;
+        if (bitCount == 32) {
+          dib.At(x, y)[3] = 0;
+        }
+      }
+    }
+    ASSERT_TRUE(dib.Classify(BlankOptions(), result));
+    EXPECT_EQ(result.content, FrameContent::Blank) << bitCount;
+    BlankOptions exact;
+    exact.tolerance[0] = 0;
+    ASSERT_TRUE(dib.Classify(exact, result));
+    EXPECT_EQ(result.content, FrameContent::Content) << bitCount;
+  }
+}
+
+TEST(Blank, NearBlank) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {8, 24, 32}) {
+    const WORD bpp = bitCount / 8;
+    DIB dib = CreatePage(memDC, bitCount, 1000, 1000, PagePattern::Background);
+    // A 20x20 spinner is 400 pixels, under 1000 per million.
+    for (DWORD y = 500; y < 520; ++y) {
+      memset(dib.At(490, y), 0, 20 * bpp);
+    }
+    BlankResult result;
+    ASSERT_TRUE(dib.Classify(BlankOptions(), result)) << bitCount;
+    EXPECT_EQ(result.content, FrameContent::NearBlank) << bitCount;
+    EXPECT_EQ(result.differing, 400u) << bitCount;
+
+    // The last pixel of a row, past the whole chunks, counts too.
+    for (DWORD y = 0; y < 1000; ++y) {
+      dib.At(999, y)[0] = 0;
+    }
+    ASSERT_TRUE(dib.Classify(BlankOptions(), result)) << bitCount;
+    EXPECT_EQ(result.content, FrameContent::Content) << bitCount;
+    EXPECT_GT(result.differing, 1000u) << bitCount;
+
+    BlankOptions options;
+    options.nearBlankPpm = 2000;
+    ASSERT_TRUE(dib.Classify(options, result)) << bitCount;
+    EXPECT_EQ(result.content, FrameContent::NearBlank) << bitCount;
+    EXPECT_EQ(result.differing, 1400u) << bitCount;
+  }
+}
+
+TEST(Blank, Content) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 32, 300, 200);
+  for (DWORD y = 0; y < 200; ++y) {
+    auto row = reinterpret_cast<LPDWORD>(dib.At(0, y));
+    for (DWORD x = 0; x < 300; ++x) {
+      row[x] = x < 100 ? 0x00ffffff : 0x00202020 + (x % 7);
+    }
+  }
+  BlankResult result;
+  ASSERT_TRUE(dib.Classify(BlankOptions(), result));
+  EXPECT_EQ(result.content, FrameContent::Content);
+
+  DIB gray = DIB::CreateNew(memDC, 16, 64, 64);
+  EXPECT_FALSE(gray.Classify(BlankOptions(), result));
+}
+
+TEST(Blank, MostCommon) {
+  EXPECT_EQ(MostCommon({3, 1, 3, 2, 1, 3}), 3u);
+  EXPECT_EQ(MostCommon({7}), 7u);
+  EXPECT_EQ(MostCommon({}), 0u);
+}
@@ -0,0 +1,231 @@
+#include <windows.h>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+
+TEST(BlobPool, SizeClasses) {
+  EXPECT_EQ(BlobPool::ClassOf(0), 0u);
+  EXPECT_EQ(BlobPool::ClassOf(64), 0u);
+  EXPECT_EQ(BlobPool::ClassSize(BlobPool::ClassOf(65)), 80u);
+  EXPECT_EQ(BlobPool::ClassSize(BlobPool::ClassOf(128)), 128u);
+  EXPECT_EQ(BlobPool::ClassSize(BlobPool::ClassOf(129)), 160u);
+  EXPECT_EQ(BlobPool::ClassSize(BlobPool::ClassOf(1920 * 1080 * 4)),
+            8388608u);
+
+  // Every size fits its class and wastes less than a quarter of it.
+  SIZE_T previous = 0;
+  for (DWORD index = 0; index < 100; ++index) {
+    const SIZE_T size = BlobPool::ClassSize(index);
+    EXPECT_GT(size, previous);
+    EXPECT_EQ(BlobPool::ClassOf(size), index);
+    EXPECT_EQ(BlobPool::ClassOf(previous + 1), index);
+    if (index > 0) {
+      EXPECT_LE((size - previous) * 5, size);
+    }
+    previous = size;
+  }
+}
+
+TEST(BlobPool, Reuse) {
+  BlobPool pool(/*maxCached*/1 << 20);
+  LPCBYTE first;
+  {
+    Blob blob(100000, pool);
+    first = blob;
+  }
+  {
+    // Another size of the same class gets the same buffer back.
+    Blob blob(110000, pool);
+    EXPECT_EQ(LPCBYTE(blob), first);
+  }
+  auto stats = pool.GetStats();
+  EXPECT_EQ(stats.acquired, 2u);
+  EXPECT_EQ(stats.reused, 1u);
+  EXPECT_EQ(stats.released, 2u);
+  EXPECT_EQ(stats.bytesInUse, 0u);
+  EXPECT_EQ(stats.bytesCached, BlobPool::ClassSize(BlobPool::ClassOf(100000)));
+
+  // Beyond the cap, buffers go back to the heap.
+  {
+    std::vector<Blob> blobs;
+    for (int i = 0; i < 20; ++i) {
+      blobs.emplace_back(100000, pool);
+    }
+    EXPECT_EQ(pool.GetStats().peakBytesInUse,
+              20 * BlobPool::ClassSize(BlobPool::ClassOf(100000)));
+  }
+  stats = pool.GetStats();
+  EXPECT_LE(stats.bytesCached, SIZE_T(1) << 20);
+  EXPECT_GT(stats.dropped, 0u);
+
+  pool.Trim();
+  EXPECT_EQ(pool.GetStats().bytesCached, 0u);
+}
+
+TEST(BlobPool, Alloc) {
+  BlobPool pool(/*maxCached*/1 << 20);
+  Blob blob(pool);
+  EXPECT_FALSE(blob.Alloc(0));
+  ASSERT_TRUE(blob.Alloc(100));
+  for (int i = 0; i < 100; ++i) {
+    blob[i] = static_cast<BYTE>(i);
+  }
+
+  // Growing within the class keeps the buffer, and beyond it the contents.
+  LPCBYTE buffer = blob;
+  ASSERT_TRUE(blob.Alloc(112));
+  EXPECT_EQ(LPCBYTE(blob), buffer);
+  ASSERT_TRUE(blob.Alloc(5000));
+  EXPECT_EQ(blob.Size(), 5000u);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(blob[i], i);
+  }
+  ASSERT_TRUE(blob.Alloc(50));
+  EXPECT_EQ(blob.Size(), 50u);
+  EXPECT_EQ(blob[49], 49);
+
+  Blob moved = std::move(blob);
+  EXPECT_EQ(blob.Size(), 0u);
+  EXPECT_EQ(moved.Size(), 50u);
+  moved = Blob();
+  EXPECT_EQ(pool.GetStats().bytesInUse, 0u);
+}
+
+TEST(BlobPool, Alignment) {
+  BlobPool pool(/*maxCached*/1 << 20);
+  for (SIZE_T size : {1, 100, 5000, 100000}) {
+    Blob blob(size, pool);
+    EXPECT_EQ(reinterpret_cast<ULONG_PTR>(LPCBYTE(blob)) % kBlobAlignment, 0u)
+      << size;
+  }
+  for (auto backing : {BlobBacking::Heap,
+                       BlobBacking::Virtual,
+                       BlobBacking::LargePages}) {
+    Blob blob(5000, /*alignment*/4096, backing, pool);
+    ASSERT_NE(LPCBYTE(blob), nullptr);
+    EXPECT_EQ(reinterpret_cast<ULONG_PTR>(LPCBYTE(blob)) % 4096, 0u);
+    memset(blob, 0xcc, 5000);
+  }
+  Blob unaligned(100, /*alignment*/3, BlobBacking::Heap, pool);
+  EXPECT_EQ(LPCBYTE(unaligned), nullptr);
+}
+
+TEST(BlobPool, Extend) {
+  BlobPool pool(/*maxCached*/1 << 20);
+  Blob blob(100000, kBlobAlignment, BlobBacking::Virtual, pool);
+  ASSERT_NE(LPCBYTE(blob), nullptr);
+  for (SIZE_T i = 0; i < 100000; ++i) {
+    blob[i] = static_cast<BYTE>(i);
+  }
+
+  // Twice the first size is reserved, so this grows into the reservation.
+  LPCBYTE buffer = blob;
+  ASSERT_TRUE(blob.Alloc(190000));
+  EXPECT_EQ(LPCBYTE(blob), buffer);
+  EXPECT_EQ(pool.GetStats().extended, 1u);
+  memset(blob + 100000, 0xcc, 90000);
+  for (SIZE_T i = 0; i < 100000; ++i) {
+    ASSERT_EQ(blob[i], static_cast<BYTE>(i));
+  }
+
+  // Past it, the buffer moves.
+  ASSERT_TRUE(blob.Alloc(1000000));
+  EXPECT_NE(LPCBYTE(blob), buffer);
+  EXPECT_EQ(blob[99999], static_cast<BYTE>(99999));
+  EXPECT_EQ(blob[189999], 0xcc);
+  blob = Blob();
+  EXPECT_EQ(pool.GetStats().bytesInUse, 0u);
+}
+
+TEST(BlobSlice, Slices) {
+  // 10 rows of 100 bytes in a stride of 128.
+  Blob blob(1280);
+  for (DWORD i = 0; i < 1280; ++i) {
+    blob[i] = static_cast<BYTE>(i / 128 * 16 + i % 128);
+  }
+  LPCBYTE buffer = blob;
+  BlobSlice all(std::move(blob), 100, 128, 10);
+  EXPECT_EQ(LPCBYTE(all), buffer);
+  EXPECT_EQ(blob.Size(), 0u);
+  EXPECT_EQ(all.RefCount(), 1);
+
+  BlobSlice tile = all.Rows(2, 5).Columns(30, 40);
+  EXPECT_EQ(all.RefCount(), 2);
+  EXPECT_EQ(tile.Rows(), 5u);
+  EXPECT_EQ(tile.RowBytes(), 40u);
+  EXPECT_EQ(tile.Stride(), 128);
+  for (DWORD y = 0; y < 5; ++y) {
+    EXPECT_EQ(tile.Row(y), buffer + (y + 2) * 128 + 30);
+    EXPECT_EQ(tile.Row(y)[0], (y + 2) * 16 + 30);
+  }
+  EXPECT_EQ(tile.Row(5), nullptr);
+
+  EXPECT_EQ(LPCBYTE(all.Rows(8, 3)), nullptr);
+  EXPECT_EQ(LPCBYTE(all.Rows(3, 0)), nullptr);
+  EXPECT_EQ(LPCBYTE(all.Columns(90, 11)), nullptr);
+
+  BlobSlice bytes(Blob(16));
+  EXPECT_EQ(bytes.Rows(), 1u);
+  EXPECT_EQ(bytes.RowBytes(), 16u);
+  EXPECT_EQ(LPCBYTE(BlobSlice(Blob())), nullptr);
+}
+
+// The memory stays until the last reader, on whichever thread, is done.
+TEST(BlobSlice, Lifetime) {
+  BlobPool pool(/*maxCached*/1 << 20);
+  BlobSlice slice(Blob(1 << 16, pool));
+  const auto capacity = pool.GetStats().bytesInUse;
+  std::vector<std::thread> readers;
+  for (DWORD i = 0; i < 4; ++i) {
+    BlobSlice part = slice.Columns(i << 14, 1 << 14);
+    readers.emplace_back([part]() {
+      volatile BYTE sum = 0;
+      for (SIZE_T j = 0; j < part.RowBytes(); ++j) {
+        sum += part.Row(0)[j];
+      }
+    });
+  }
+  slice = BlobSlice();
+  EXPECT_EQ(slice.RefCount(), 0);
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  readers.clear();
+  EXPECT_EQ(pool.GetStats().bytesInUse, 0u);
+  EXPECT_GT(capacity, 0u);
+}
+
+TEST(HexDump, Format) {
+  BYTE bytes[20];
+  for (int i = 0; i < 20; ++i) {
+    bytes[i] = static_cast<BYTE>(0x3c + i * 3);
+  }
+  std::wostringstream hex, ascii;
+  {
+    HexDump dump(hex, 16, /*ascii*/false);
+    dump.Write(bytes, 20, 0xfff8);
+    dump.WriteText(L"-");
+    dump.Write(bytes + 19, 1, 0x123456789);
+  }
+  EXPECT_EQ(hex.str(),
+            L"fff8: 3c 3f 42 45 48 4b 4e 51  54 57 5a 5d 60 63 66 69\r\n"
+            L"10008: 6c 6f 72 75\r\n"
+            L"-123456789: 75\r\n");
+
+  HexDump(ascii, 8, /*ascii*/true).Write(bytes + 10, 10, 0);
+  EXPECT_EQ(ascii.str(),
+            L"0000: 5a 5d 60 63 66 69 6c 6f  Z]`cfilo\r\n"
+            L"0008: 72 75                    ru\r\n");
+
+  Blob blob(40);
+  memset(blob, 0x80, 40);
+  std::wostringstream total;
+  blob.Dump(total, 16, 24);
+  EXPECT_EQ(total.str(),
+            L"Total: 40 (=0x28) bytes\r\n"
+            L"0000: 80 80 80 80 80 80 80 80  80 80 80 80 80 80 80 80\r\n"
+            L"0010: 80 80 80 80 80 80 80 80\r\n"
+            L" ...\r\n");
+}
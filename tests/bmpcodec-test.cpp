@@ -0,0 +1,299 @@
+#include <windows.h>
+#include <functional>
+#include <sstream>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <bmpcodec.h>
+
+static DIB LoadFromString(const std::string &data, HDC dc) {
+  std::istringstream iss(data, std::ios::binary | std::ios::in);
+  return DIB::LoadFromStream(iss, dc);
+}
+
+template<class T>
+static void Append(std::string &s, const T &value) {
+  s.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// A bitmap file with |headerSize| bytes of info header.  |extra| goes
+// between the header and the pixels: masks or a color table.
+static std::string MakeBitmap(DWORD headerSize,
+                              LONG width,
+                              LONG height,
+                              WORD bitCount,
+                              DWORD compression,
+                              const std::string &extra,
+                              const std::string &pixels,
+                              const DWORD *masks = nullptr) {
+  BITMAPFILEHEADER fh = {0};
+  fh.bfType = 0x4D42;
+  fh.bfOffBits = static_cast<DWORD>(sizeof(fh) + headerSize + extra.size());
+  fh.bfSize = static_cast<DWORD>(fh.bfOffBits + pixels.size());
+
+  std::vector<BYTE> header(headerSize);
+  auto &ih = *reinterpret_cast<BITMAPINFOHEADER*>(header.data());
+  ih.biSize = headerSize;
+  ih.biWidth = width;
+  ih.biHeight = height;
+  ih.biPlanes = 1;
+  ih.biBitCount = bitCount;
+  ih.biCompression = compression;
+  ih.biSizeImage = static_cast<DWORD>(pixels.size());
+  if (masks) {
+    memcpy(header.data() + sizeof(ih), masks, 4 * sizeof(DWORD));
+  }
+
+  std::string s;
+  Append(s, fh);
+  s.append(reinterpret_cast<const char*>(header.data()), header.size());
+  return s + extra + pixels;
+}
+
+static std::string GrayTable(int entries) {
+  std::string table;
+  for (int i = 0; i < entries; ++i) {
+    const BYTE v = static_cast<BYTE>(i * 255 / (entries - 1));
+    RGBQUAD q = {v, v, v, 0};
+    Append(table, q);
+  }
+  return table;
+}
+
+TEST(BMP, Rle8Decode) {
+  // Bottom row: a run, an absolute run of 3 (padded), end of line.
+  // Second row: a delta of (2, 0), a run of 2, end of bitmap.  The last row
+  // is never written.
+  const BYTE rle[] = {
+    3, 7, 0, 3, 1, 2, 3, 0, 0, 0,
+    0, 2, 2, 0, 2, 9, 0, 1,
+  };
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = LoadFromString(
+    MakeBitmap(40, 7, 3, 8, BI_RLE8, GrayTable(256),
+               std::string(reinterpret_cast<const char*>(rle), sizeof(rle))),
+    memDC);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  EXPECT_EQ(dib.GetBitmapInfo()->bmiHeader.biCompression, BI_RGB);
+
+  const BYTE expected[3][7] = {
+    {0, 0, 0, 0, 0, 0, 0},
+    {0, 0, 9, 9, 0, 0, 0},
+    {7, 7, 7, 1, 2, 3, 0},
+  };
+  for (DWORD y = 0; y < 3; ++y) {
+    EXPECT_EQ(memcmp(dib.At(0, y), expected[y], 7), 0) << y;
+  }
+}
+
+TEST(BMP, Rle4Decode) {
+  // A run of 5 alternating nibbles, then an absolute run of 3 nibbles.
+  const BYTE rle[] = {5, 0x12, 0, 3, 0x34, 0x50, 0, 1};
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = LoadFromString(
+    MakeBitmap(40, 9, 1, 4, BI_RLE4, GrayTable(16),
+               std::string(reinterpret_cast<const char*>(rle), sizeof(rle))),
+    memDC);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+
+  const BYTE expected[] = {0x12, 0x12, 0x13, 0x45, 0x00};
+  EXPECT_EQ(memcmp(dib.At(0, 0), expected, sizeof(expected)), 0);
+}
+
+TEST(BMP, RleInvalid) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  // Top-down RLE does not exist.
+  const std::string rle("\x02\x01\x00\x01", 4);
+  EXPECT_EQ(HBITMAP(LoadFromString(
+              MakeBitmap(40, 2, -1, 8, BI_RLE8, GrayTable(256), rle),
+              memDC)),
+            nullptr);
+  // An absolute run cut short.
+  const std::string cut("\x00\x05\x01\x02", 4);
+  EXPECT_EQ(HBITMAP(LoadFromString(
+              MakeBitmap(40, 5, 1, 8, BI_RLE8, GrayTable(256), cut),
+              memDC)),
+            nullptr);
+  // Runs and deltas past the edges of a 5x2 image.
+  const std::string outside[] = {
+    std::string("\x06\x01\x00\x01", 4),                  // encoded run
+    std::string("\x03\x01\x00\x03\x01\x02\x03\x00", 8),  // absolute run
+    std::string("\x00\x02\x06\x00\x00\x01", 6),          // delta right
+    std::string("\x00\x02\x00\x03\x00\x01", 6),          // delta up
+  };
+  for (const auto &codes : outside) {
+    EXPECT_EQ(HBITMAP(LoadFromString(
+                MakeBitmap(40, 5, 2, 8, BI_RLE8, GrayTable(256), codes),
+                memDC)),
+              nullptr) << &codes - outside;
+  }
+}
+
+TEST(BMP, Rle8RoundTrip) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {8, 32}) {
+    for (LONG height : {133, -133}) {
+      const LONG width = 517;
+      DIB dib = DIB::CreateNew(memDC, bitCount, width, height, nullptr,
+                               /*initWithGrayscaleTable*/true);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      DWORD seed = 1;
+      for (LONG y = 0; y < std::abs(height); ++y) {
+        LPBYTE row = dib.At(0, y);
+        for (LONG x = 0; x < width * bitCount / 8; ++x) {
+          seed = seed * 1103515245 + 12345;
+          // Runs of every length, single pixels, and noise.
+          row[x] = x < width / 3 ? static_cast<BYTE>(x / (y % 7 + 1))
+                 : x < width * 2 / 3 ? static_cast<BYTE>(seed >> 16)
+                 : static_cast<BYTE>(y);
+        }
+      }
+
+      std::ostringstream oss;
+      ASSERT_TRUE(dib.SaveRle8(oss));
+      const std::string rle = oss.str();
+      const auto &fileHeader =
+        *reinterpret_cast<const BITMAPINFOHEADER*>(
+          rle.data() + sizeof(BITMAPFILEHEADER));
+      EXPECT_EQ(fileHeader.biCompression, BI_RLE8);
+      EXPECT_EQ(fileHeader.biHeight, std::abs(height));
+
+      std::ostringstream gray;
+      ASSERT_TRUE(dib.SaveAs(gray, 8));
+      DIB expected = LoadFromString(gray.str(), memDC);
+      DIB loaded = LoadFromString(rle, memDC);
+      ASSERT_NE(HBITMAP(loaded), nullptr);
+      for (LONG y = 0; y < std::abs(height); ++y) {
+        ASSERT_EQ(memcmp(loaded.At(0, y), expected.At(0, y), width), 0)
+          << bitCount << "bpp row " << y;
+      }
+      EXPECT_EQ(memcmp(loaded.GetBitmapInfo()->bmiColors,
+                       expected.GetBitmapInfo()->bmiColors,
+                       sizeof(RGBQUAD) * 256), 0);
+    }
+  }
+}
+
+TEST(BMP, Rle8Compresses) {
+  BYTE flat[640];
+  memset(flat, 0xee, sizeof(flat));
+  flat[100] = 1;
+  BYTE out[2 * 640 + 2];
+  ASSERT_LE(MaxRle8RowSize(640), sizeof(out));
+  // A run of 100, one pixel, 255 + 255 + 29, end of line.
+  EXPECT_EQ(EncodeRle8Row(flat, 640, /*last*/false, out), 12u);
+}
+
+TEST(BMP, Bitfields16) {
+  // 5-6-5, top-down, with an odd width to exercise the row padding.
+  const DWORD masks[] = {0xf800, 0x07e0, 0x001f, 0};
+  const WORD pixels[] = {0xf800, 0x07e0, 0x001f, 0, 0xffff, 0x8410, 0, 0};
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  std::string extra;
+  for (int i = 0; i < 3; ++i) {
+    Append(extra, masks[i]);
+  }
+  DIB dib = LoadFromString(
+    MakeBitmap(40, 3, -2, 16, BI_BITFIELDS, extra,
+               std::string(reinterpret_cast<const char*>(pixels),
+                           sizeof(pixels))),
+    memDC);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  EXPECT_EQ(dib.GetBitmapInfo()->bmiHeader.biBitCount, 32);
+  EXPECT_EQ(dib.GetBitmapInfo()->bmiHeader.biHeight, -2);
+
+  const DWORD expected[2][3] = {
+    {0x00ff0000, 0x0000ff00, 0x000000ff},
+    {0x00ffffff, 0x00848284, 0x00000000},
+  };
+  for (DWORD y = 0; y < 2; ++y) {
+    EXPECT_EQ(memcmp(dib.At(0, y), expected[y], sizeof(expected[y])), 0) << y;
+  }
+}
+
+TEST(BMP, Default16bpp) {
+  // BI_RGB 16bpp is X1R5G5B5.
+  const WORD pixels[] = {0x7c00, 0x03e0};
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = LoadFromString(
+    MakeBitmap(40, 2, 1, 16, BI_RGB, std::string(),
+               std::string(reinterpret_cast<const char*>(pixels),
+                           sizeof(pixels))),
+    memDC);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  const DWORD expected[] = {0x00ff0000, 0x0000ff00};
+  EXPECT_EQ(memcmp(dib.At(0, 0), expected, sizeof(expected)), 0);
+}
+
+TEST(BMP, V5Bitfields32) {
+  // RGBA byte order with alpha in a BITMAPV5HEADER.  The SIMD path handles
+  // the first four pixels and the scalar one the rest.
+  const DWORD masks[] = {0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000};
+  std::vector<DWORD> pixels;
+  for (DWORD i = 0; i < 7; ++i) {
+    pixels.push_back(0x80000000 | (i << 16) | (i * 3 << 8) | (i * 5));
+  }
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = LoadFromString(
+    MakeBitmap(124, 7, 1, 32, BI_BITFIELDS, std::string(),
+               std::string(reinterpret_cast<const char*>(pixels.data()),
+                           pixels.size() * sizeof(DWORD)),
+               masks),
+    memDC);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  for (DWORD i = 0; i < 7; ++i) {
+    const DWORD expected = 0x80000000 | (i * 5 << 16) | (i * 3 << 8) | i;
+    EXPECT_EQ(*reinterpret_cast<const DWORD*>(dib.At(i, 0)), expected) << i;
+  }
+}
+
+TEST(BMP, BitfieldUnpacker) {
+  // 10-10-10-2 needs the vector path for the wide channels and the scalar
+  // Expand for the 2-bit alpha, so it goes scalar as a whole.  X8R8G8B8
+  // shifted into the top bytes takes the vector path.  Both must agree with
+  // the per-pixel definition.
+  struct {
+    DWORD masks[4];
+  } cases[] = {
+    {{0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000}},
+    {{0xff000000, 0x00ff0000, 0x0000ff00, 0}},
+  };
+  std::vector<DWORD> src(37);
+  DWORD seed = 7;
+  for (auto &px : src) {
+    seed = seed * 1103515245 + 12345;
+    px = seed;
+  }
+  for (const auto &c : cases) {
+    BitfieldUnpacker unpacker(32,
+                              c.masks[0], c.masks[1], c.masks[2], c.masks[3]);
+    std::vector<DWORD> dst(src.size());
+    unpacker.UnpackRow(reinterpret_cast<LPCBYTE>(src.data()),
+                       reinterpret_cast<LPBYTE>(dst.data()),
+                       static_cast<DWORD>(src.size()));
+    for (size_t i = 0; i < src.size(); ++i) {
+      const DWORD px = src[i];
+      DWORD expected = 0;
+      for (int ch = 0; ch < 4; ++ch) {
+        // masks are R, G, B, A; the result is B, G, R, A.
+        const DWORD mask = c.masks[ch == 3 ? 3 : 2 - ch];
+        if (!mask) {
+          continue;
+        }
+        DWORD shift = 0;
+        while (!(mask >> shift & 1)) {
+          ++shift;
+        }
+        const DWORD width = (mask >> shift) == 0x3ff ? 10
+                          : (mask >> shift) == 3 ? 2 : 8;
+        const DWORD top = (1u << width) - 1;
+        const DWORD value = (px & mask) >> shift;
+        const DWORD scaled = width >= 8 ? value >> (width - 8)
+                                        : (value * 255 + top / 2) / top;
+        expected |= scaled << (ch * 8);
+      }
+      EXPECT_EQ(dst[i], expected) << i;
+    }
+  }
+}
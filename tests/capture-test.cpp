@@ -0,0 +1,161 @@
+#include <windows.h>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <phash.h>
+#include <store.h>
+#include <capture.h>
+#include "pages.h"
+#include "stores.h"
+
+static bool Exists(const std::wstring &path) {
+  return GetFileAttributes(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+static std::string ReadAll(const std::wstring &path) {
+  std::ifstream is(path.c_str(), std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(is),
+                     std::istreambuf_iterator<char>());
+}
+
+TEST(CaptureSaver, Save) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  CaptureSaver saver;
+  saver.GetOptions().duplicateBits = 0;
+  saver.GetOptions().thumbnailWidths = {10, 20};
+  const std::wstring output(L"saver.bmp");
+
+  DIB page = CreatePage(memDC, 32, 40, -40);
+  BlobSlice capture = DIB::Share(CreatePage(memDC, 32, 40, -40));
+  ASSERT_TRUE(saver.Save(capture, output.c_str(), 32));
+  // Every stage has let go of the capture.
+  EXPECT_EQ(capture.RefCount(), 1);
+  EXPECT_FALSE(Exists(output + L".tmp"));
+  EXPECT_TRUE(Exists(output + L".phash"));
+  EXPECT_TRUE(Exists(output + L".10.png"));
+  EXPECT_TRUE(Exists(output + L".20.png"));
+  DIB loaded = DIB::LoadFromFile(output.c_str(), memDC);
+  ASSERT_NE(HBITMAP(loaded), nullptr);
+  ExpectSamePixels(page, loaded);
+
+  // A near-duplicate is not written, and leaves the file where it was to
+  // go as it was.
+  const std::wstring duplicate(L"saver-duplicate.bmp");
+  {
+    std::ofstream os(duplicate.c_str(), std::ios::binary);
+    os << "before";
+  }
+  EXPECT_FALSE(saver.Save(capture, duplicate.c_str(), 32));
+  EXPECT_EQ(ReadAll(duplicate), "before");
+  EXPECT_FALSE(Exists(duplicate + L".tmp"));
+  EXPECT_FALSE(Exists(duplicate + L".phash"));
+  EXPECT_FALSE(Exists(duplicate + L".10.png"));
+
+  // Only whole captures from DIB::Share are saved.
+  EXPECT_FALSE(saver.Save(capture.Rows(0, 10), duplicate.c_str(), 32));
+  EXPECT_FALSE(saver.Save(BlobSlice(), duplicate.c_str(), 32));
+  EXPECT_EQ(ReadAll(duplicate), "before");
+
+  for (LPCWSTR suffix : {L"", L".phash", L".10.png", L".20.png"}) {
+    DeleteFile((output + suffix).c_str());
+  }
+  DeleteFile(duplicate.c_str());
+}
+
+TEST(CaptureSaver, Indexed) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  CaptureSaver saver;
+  saver.GetOptions().indexedColor = true;
+  const std::wstring output(L"saver-indexed.bmp");
+
+  // Two colors are saved exactly in 1bpp.
+  DIB page = DIB::CreateNew(memDC, 32, 40, -40);
+  for (DWORD y = 0; y < 40; ++y) {
+    auto row = reinterpret_cast<LPDWORD>(page.At(0, y));
+    for (DWORD x = 0; x < 40; ++x) {
+      row[x] = (x + y) % 2 ? 0xff0000 : 0x00ff00;
+    }
+  }
+  ASSERT_TRUE(saver.Save(DIB::Share(std::move(page)), output.c_str(), 8));
+  DIB loaded = DIB::LoadFromFile(output.c_str(), memDC);
+  ASSERT_NE(HBITMAP(loaded), nullptr);
+  EXPECT_EQ(loaded.GetBitmapInfo()->bmiHeader.biBitCount, 1);
+  DeleteFile(output.c_str());
+  DeleteFile((output + L".phash").c_str());
+}
+
+TEST(CaptureSaver, Failed) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  CaptureSaver saver;
+  const std::wstring output(L"saver-failed.rle");
+  {
+    std::ofstream os(output.c_str(), std::ios::binary);
+    os << "before";
+  }
+  // RLE8 is not written from 24bpp.  The file there before is left alone.
+  EXPECT_FALSE(saver.Save(DIB::Share(CreatePage(memDC, 24, 40, -40)),
+                          output.c_str(),
+                          8));
+  EXPECT_EQ(ReadAll(output), "before");
+  EXPECT_FALSE(Exists(output + L".tmp"));
+  EXPECT_FALSE(Exists(output + L".phash"));
+  DeleteFile(output.c_str());
+}
+
+// Saving over a manifest that a delta is based on fails, in the session
+// that wrote the delta or a later one, and leaves both as they were.
+TEST(CaptureSaver, Bases) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LPCWSTR directory = L"saver-store";
+  const std::vector<std::wstring> manifests = {
+    L"saver-store\\a.cap", L"saver-store\\b.cap",
+  };
+  const LPCWSTR base = manifests[0].c_str();
+  const LPCWSTR delta = manifests[1].c_str();
+  ASSERT_TRUE(CreateDirectory(directory, nullptr));
+  DIB page = CreatePage(memDC, 32, 70, -40);
+  DIB banner = CreatePage(memDC, 32, 70, -40, PagePattern::Text);
+
+  CaptureSaver saver;
+  saver.GetOptions().storeDeltas = 4;
+  ASSERT_TRUE(saver.Save(DIB::Share(CreatePage(memDC, 32, 70, -40)),
+                         base,
+                         32));
+  ASSERT_TRUE(saver.Save(
+    DIB::Share(CreatePage(memDC, 32, 70, -40, PagePattern::Text)),
+    delta,
+    32));
+  EXPECT_FALSE(saver.Save(
+    DIB::Share(CreatePage(memDC, 32, 70, -40, PagePattern::Text)),
+    base,
+    32));
+  CaptureSaver later;
+  EXPECT_FALSE(later.Save(
+    DIB::Share(CreatePage(memDC, 32, 70, -40, PagePattern::Text)),
+    base,
+    32));
+
+  CaptureStore store(L"saver-store\\objects", /*tileSize*/64);
+  CaptureStore::Manifest manifest;
+  ASSERT_TRUE(store.ReadManifest(delta, manifest));
+  EXPECT_EQ(manifest.base, base);
+  DIB loaded = DIB::LoadFromStore(store, base, memDC);
+  ASSERT_NE(HBITMAP(loaded), nullptr);
+  ExpectSamePixels(page, loaded);
+  loaded = DIB::LoadFromStore(store, delta, memDC);
+  ASSERT_NE(HBITMAP(loaded), nullptr);
+  ExpectSamePixels(banner, loaded);
+
+  for (const auto &path : manifests) {
+    DeleteFile((path + L".phash").c_str());
+  }
+  RemoveStore(store, L"saver-store\\objects", manifests);
+  RemoveDirectory(directory);
+}
@@ -0,0 +1,170 @@
+#include <windows.h>
+#include <functional>
+#include <sstream>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <kernel.h>
+
+static DIB LoadFromString(const std::string &data, HDC dc) {
+  std::istringstream iss(data, std::ios::binary | std::ios::in);
+  return DIB::LoadFromStream(iss, dc);
+}
+
+// Random 32bpp pixels with the fourth byte cleared, as GDI leaves it.
+static DIB CreateRandom32(HDC dc, LONG width, LONG height) {
+  DIB dib = DIB::CreateNew(dc, 32, width, height);
+  DWORD seed = 3;
+  for (LONG y = 0; y < std::abs(height); ++y) {
+    auto row = reinterpret_cast<LPDWORD>(dib.At(0, y));
+    for (LONG x = 0; x < width; ++x) {
+      seed = seed * 1103515245 + 12345;
+      row[x] = (seed >> 8) & 0x00ffffff;
+    }
+  }
+  return dib;
+}
+
+static DWORD PixelAt(const DIB &dib, DWORD x, DWORD y) {
+  return *reinterpret_cast<const DWORD*>(dib.At(x, y));
+}
+
+TEST(Convert, Lossless24) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  // Widths around the 4-pixel vectors, and both orientations.
+  for (LONG width : {1, 5, 6, 33}) {
+    for (LONG height : {3, -3}) {
+      DIB dib = CreateRandom32(memDC, width, height);
+      DIB rgb = dib.ConvertTo(24, memDC);
+      ASSERT_NE(HBITMAP(rgb), nullptr);
+      EXPECT_EQ(rgb.GetBitmapInfo()->bmiHeader.biHeight, height);
+      DIB back = rgb.ConvertTo(32, memDC);
+      ASSERT_NE(HBITMAP(back), nullptr);
+      for (LONG y = 0; y < 3; ++y) {
+        ASSERT_EQ(memcmp(back.At(0, y), dib.At(0, y), width * 4), 0)
+          << width << "x" << height << " row " << y;
+        ASSERT_EQ(memcmp(rgb.At(width - 1, y), dib.At(width - 1, y), 3), 0);
+      }
+    }
+  }
+}
+
+TEST(Convert, Rgb16) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LONG width = 37;
+  DIB dib = CreateRandom32(memDC, width, 2);
+  for (DWORD compression : {BI_RGB, BI_BITFIELDS}) {
+    const bool is565 = compression == BI_BITFIELDS;
+    DIB rgb16 = dib.ConvertTo(16, memDC, nullptr, compression);
+    ASSERT_NE(HBITMAP(rgb16), nullptr);
+    EXPECT_EQ(rgb16.GetBitmapInfo()->bmiHeader.biCompression, compression);
+    DIB back = rgb16.ConvertTo(32, memDC);
+    ASSERT_NE(HBITMAP(back), nullptr);
+    for (DWORD y = 0; y < 2; ++y) {
+      for (DWORD x = 0; x < width; ++x) {
+        const DWORD px = PixelAt(dib, x, y);
+        const WORD packed = reinterpret_cast<const WORD*>(rgb16.At(0, y))[x];
+        const DWORD r = (px >> 19) & 0x1f;
+        const DWORD g = is565 ? (px >> 10) & 0x3f : (px >> 11) & 0x1f;
+        const DWORD b = (px >> 3) & 0x1f;
+        ASSERT_EQ(packed, is565 ? (r << 11) | (g << 5) | b
+                                : (r << 10) | (g << 5) | b) << x;
+
+        // Expanding back rounds to the nearest 8-bit level.
+        const DWORD gTop = is565 ? 63 : 31;
+        const DWORD expected = ((r * 255 + 15) / 31) << 16
+                             | ((g * 255 + gTop / 2) / gTop) << 8
+                             | ((b * 255 + 15) / 31);
+        ASSERT_EQ(PixelAt(back, x, y), expected) << x;
+      }
+    }
+  }
+}
+
+TEST(Convert, Indexed) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LONG width = 11;
+  DIB dib = DIB::CreateNew(memDC, 4, width, 1);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  auto colors = dib.GetColorTable();
+  for (int i = 0; i < 16; ++i) {
+    colors[i].rgbBlue = static_cast<BYTE>(i * 16);
+    colors[i].rgbGreen = static_cast<BYTE>(255 - i * 3);
+    colors[i].rgbRed = static_cast<BYTE>(i * i);
+    colors[i].rgbReserved = 0;
+  }
+  LPBYTE bits = dib.At(0, 0);
+  for (LONG x = 0; x < width; x += 2) {
+    bits[x / 2] = static_cast<BYTE>(((x % 16) << 4) | ((x + 1) % 16));
+  }
+
+  DIB rgb = dib.ConvertTo(32, memDC);
+  DIB gray = dib.ConvertTo(8, memDC);
+  DIB mono = dib.ConvertTo(1, memDC);
+  ASSERT_NE(HBITMAP(rgb), nullptr);
+  ASSERT_NE(HBITMAP(gray), nullptr);
+  ASSERT_NE(HBITMAP(mono), nullptr);
+  BYTE luma[width];
+  GrayscaleRowScalar(rgb.At(0, 0), luma, width);
+  for (LONG x = 0; x < width; ++x) {
+    const auto &c = colors[x % 16];
+    EXPECT_EQ(PixelAt(rgb, x, 0),
+              c.rgbBlue | (c.rgbGreen << 8) | (c.rgbRed << 16)) << x;
+    EXPECT_EQ(gray.At(0, 0)[x], luma[x]) << x;
+    const BYTE bit = (mono.At(0, 0)[x / 8] >> (7 - x % 8)) & 1;
+    EXPECT_EQ(bit, luma[x] >= 128 ? 1 : 0) << x;
+  }
+  EXPECT_EQ(mono.GetColorTable()[1].rgbGreen, 255);
+}
+
+TEST(Convert, GrayDepths) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB gray = DIB::CreateNew(memDC, 8, 256, 1, nullptr,
+                            /*initWithGrayscaleTable*/true);
+  for (DWORD x = 0; x < 256; ++x) {
+    gray.At(0, 0)[x] = static_cast<BYTE>(x);
+  }
+  DIB gray4 = gray.ConvertTo(4, memDC);
+  DIB back = gray4.ConvertTo(8, memDC);
+  DIB rgb = gray.ConvertTo(24, memDC);
+  ASSERT_NE(HBITMAP(back), nullptr);
+  ASSERT_NE(HBITMAP(rgb), nullptr);
+  for (DWORD x = 0; x < 256; ++x) {
+    // Each level goes to the nearest of 0, 17, ..., 255.
+    EXPECT_EQ(back.At(0, 0)[x], (x * 15 + 127) / 255 * 17) << x;
+    const BYTE expected[] = {BYTE(x), BYTE(x), BYTE(x)};
+    EXPECT_EQ(memcmp(rgb.At(x, 0), expected, 3), 0) << x;
+  }
+  EXPECT_TRUE(IsGrayscaleRamp(gray4.GetColorTable(), 4));
+}
+
+TEST(Convert, SaveAsMatchesConvertTo) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = CreateRandom32(memDC, 301, -200);
+  for (WORD bitCount : {1, 4, 16, 24}) {
+    std::ostringstream streamed;
+    ASSERT_TRUE(dib.SaveAs(streamed, bitCount)) << bitCount;
+    DIB loaded = LoadFromString(streamed.str(), memDC);
+    DIB converted = dib.ConvertTo(bitCount, memDC);
+    ASSERT_NE(HBITMAP(loaded), nullptr);
+    ASSERT_NE(HBITMAP(converted), nullptr);
+
+    // 16bpp files load as 32bpp.  Compare them through the same path.
+    if (bitCount == 16) {
+      converted = converted.ConvertTo(32, memDC);
+    }
+    Blob expected, actual;
+    converted.CopyTo(expected);
+    loaded.CopyTo(actual);
+    ASSERT_EQ(actual.Size(), expected.Size()) << bitCount;
+    EXPECT_EQ(memcmp(actual, expected, expected.Size()), 0) << bitCount;
+  }
+}
+
+TEST(Convert, Unsupported) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = CreateRandom32(memDC, 4, 4);
+  EXPECT_EQ(HBITMAP(dib.ConvertTo(2, memDC)), nullptr);
+  EXPECT_EQ(HBITMAP(dib.ConvertTo(24, memDC, nullptr, BI_BITFIELDS)), nullptr);
+  EXPECT_EQ(HBITMAP(DIB().ConvertTo(24, memDC)), nullptr);
+}
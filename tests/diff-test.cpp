@@ -0,0 +1,111 @@
+#include <windows.h>
+#include <functional>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <diff.h>
+#include "pages.h"
+
+TEST(Diff, Identical) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {8, 24, 32}) {
+    DIB a = CreatePage(memDC, bitCount, 100, 70);
+    DIB b = CreatePage(memDC, bitCount, 100, -70);
+    DiffResult result;
+    ASSERT_TRUE(a.Diff(b, DiffOptions(), result)) << bitCount;
+    EXPECT_EQ(result.changedPixels, 0u);
+    EXPECT_FALSE(result.exceeded);
+    EXPECT_TRUE(result.regions.empty());
+  }
+}
+
+TEST(Diff, Regions) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {8, 24, 32}) {
+    const WORD bpp = bitCount / 8;
+    DIB a = CreatePage(memDC, bitCount, 200, 150);
+    DIB b = CreatePage(memDC, bitCount, 200, 150);
+    // Two pixels 40 apart, in neighboring cells, make one region.  A block
+    // far away is another.
+    b.At(10, 10)[0] ^= 0x80;
+    b.At(50, 12)[0] ^= 0x80;
+    for (DWORD y = 100; y < 110; ++y) {
+      for (DWORD x = 150; x < 170; ++x) {
+        b.At(x, y)[bpp == 4 ? 2 : bpp - 1] ^= 0x40;
+      }
+    }
+
+    DiffOptions options;
+    options.makeImage = true;
+    DiffResult result;
+    ASSERT_TRUE(a.Diff(b, options, result, memDC)) << bitCount;
+    EXPECT_EQ(result.changedPixels, 2u + 200u);
+    ASSERT_EQ(result.regions.size(), 2u) << bitCount;
+    const RECT first = {10, 10, 51, 13};
+    const RECT second = {150, 100, 170, 110};
+    EXPECT_EQ(memcmp(&result.regions[0], &first, sizeof(RECT)), 0);
+    EXPECT_EQ(memcmp(&result.regions[1], &second, sizeof(RECT)), 0);
+
+    ASSERT_NE(HBITMAP(result.image), nullptr);
+    EXPECT_EQ(result.image.At(10, 10)[0], 0x80);
+    EXPECT_EQ(result.image.At(160, 105)[0], 0x40);
+    EXPECT_EQ(result.image.At(11, 10)[0], 0);
+  }
+}
+
+TEST(Diff, ToleranceAndIgnore) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB a = CreatePage(memDC, 32, 64, 64);
+  DIB b = CreatePage(memDC, 32, 64, 64);
+  for (DWORD y = 0; y < 64; ++y) {
+    for (DWORD x = 0; x < 64; ++x) {
+      LPBYTE px = b.At(x, y);
+      // Green off by 2, within the tolerance below.
+      px[1] = static_cast<BYTE>(px[1] < 254 ? px[1] + 2 : px[1] - 2);
+      px[3] = 0x55;  // alpha, ignored by default
+    }
+  }
+  // A clock in the corner.
+  for (DWORD y = 0; y < 8; ++y) {
+    for (DWORD x = 40; x < 64; ++x) {
+      b.At(x, y)[2] ^= 0xff;
+    }
+  }
+
+  DiffOptions options;
+  DiffResult result;
+  ASSERT_TRUE(a.Diff(b, options, result));
+  EXPECT_EQ(result.changedPixels, 64u * 64u);
+
+  options.tolerance[1] = 2;
+  ASSERT_TRUE(a.Diff(b, options, result));
+  EXPECT_EQ(result.changedPixels, 24u * 8u);
+
+  options.ignore.push_back({40, 0, 64, 8});
+  ASSERT_TRUE(a.Diff(b, options, result));
+  EXPECT_EQ(result.changedPixels, 0u);
+}
+
+TEST(Diff, Budget) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB a = CreatePage(memDC, 8, 256, 512);
+  DIB b = DIB::CreateNew(memDC, 8, 256, 512);
+  DiffOptions options;
+  options.maxChangedPixels = 1000;
+  DiffResult result;
+  ASSERT_TRUE(a.Diff(b, options, result));
+  EXPECT_TRUE(result.exceeded);
+  EXPECT_GT(result.changedPixels, 1000u);
+  EXPECT_LT(result.changedPixels, 256u * 512u);
+}
+
+TEST(Diff, Mismatch) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB a = CreatePage(memDC, 32, 10, 10);
+  DIB b = CreatePage(memDC, 24, 10, 10);
+  DIB c = CreatePage(memDC, 32, 10, 11);
+  DiffResult result;
+  EXPECT_FALSE(a.Diff(b, DiffOptions(), result));
+  EXPECT_FALSE(a.Diff(c, DiffOptions(), result));
+}
@@ -0,0 +1,50 @@
+#include <windows.h>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <kernel.h>
+
+static void FillPseudoRandom(LPBYTE p, SIZE_T size, DWORD seed) {
+  for (SIZE_T i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    p[i] = static_cast<BYTE>(seed >> 16);
+  }
+}
+
+TEST(Kernel, GrayscaleRowReference) {
+  const BYTE pixels[] = {
+    0x00, 0x00, 0x00, 0x00,  // black
+    0xff, 0xff, 0xff, 0x00,  // white
+    0x00, 0x00, 0xff, 0x00,  // red
+    0x00, 0xff, 0x00, 0x00,  // green
+    0xff, 0x00, 0x00, 0x00,  // blue
+    0x01, 0x80, 0xff, 0xff,  // orange
+  };
+  const BYTE expected[] = {0, 255, 76, 149, 29, 151};
+  BYTE gray[ARRAYSIZE(expected)];
+  GrayscaleRowScalar(pixels, gray, ARRAYSIZE(expected));
+  EXPECT_EQ(memcmp(gray, expected, sizeof(expected)), 0);
+}
+
+TEST(Kernel, GrayscaleRowBitIdentical) {
+  // Odd widths exercise the scalar tail of every vectorized variant.
+  const DWORD widths[] = {1, 7, 15, 16, 17, 31, 32, 33, 63, 1920, 3841};
+  for (auto width : widths) {
+    Blob src(width * 4), expected(width), actual(width);
+    FillPseudoRandom(src, src.Size(), width);
+    GrayscaleRowScalar(src, expected, width);
+
+    memset(actual, 0xcc, width);
+    GrayscaleRowSSE2(src, actual, width);
+    EXPECT_EQ(memcmp(actual, expected, width), 0) << "SSE2 width=" << width;
+
+    if (HasAVX2()) {
+      memset(actual, 0xcc, width);
+      GrayscaleRowAVX2(src, actual, width);
+      EXPECT_EQ(memcmp(actual, expected, width), 0) << "AVX2 width=" << width;
+    }
+
+    memset(actual, 0xcc, width);
+    GrayscaleRow(src, actual, width);
+    EXPECT_EQ(memcmp(actual, expected, width), 0) << "Dispatch width=" << width;
+  }
+}
@@ -0,0 +1,136 @@
+#include <windows.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include <logger.h>
+
+class MemorySink : public LogSink {
+private:
+  std::mutex lock_;
+  std::vector<std::wstring> lines_;
+
+public:
+  void Write(LogLevel, DWORD, const FILETIME &, LPCWSTR text) override {
+    std::lock_guard<std::mutex> lock(lock_);
+    lines_.push_back(text);
+  }
+
+  std::vector<std::wstring> Lines() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return lines_;
+  }
+};
+
+// Adds a sink for the length of a test.
+class LoggerTest : public ::testing::Test {
+protected:
+  MemorySink *sink_;
+
+  void SetUp() override {
+    Logger::Flush();
+    sink_ = new MemorySink;
+    Logger::AddSink(sink_);
+  }
+
+  void TearDown() override {
+    Logger::Flush();
+    Logger::RemoveSink(sink_);
+    delete sink_;
+  }
+};
+
+TEST_F(LoggerTest, Format) {
+  const DWORD minusOne = MAXDWORD;
+  const ULONGLONG big = 0x123456789ull;
+  WCHAR path[] = L"C:\\page.png";
+  LogInfo(L"%d %u %08x %X\n", minusOne, minusOne, 0xbeef, 0xab);
+  LogInfo(L"%llu %I64x %x\n", big, big, big);
+  LogInfo(L"[%s] [%ls] [%S] [%hs]\n", path, L"wide", "narrow", "hs");
+  LogInfo(L"[%-6s] [%6s] [%.3s] [%*d] [%c%c]\n",
+          L"ab", L"cd", L"efgh", 4, 7, L'x', 'y');
+  LogInfo(L"%.2f %5.1f %g\n", 3.14159, 2.5f, 100.0);
+  LogInfo(L"100%% [%s] %d %d\n", static_cast<LPCWSTR>(nullptr), -5);
+  LogInfo(L"no arguments\n");
+  Logger::Flush();
+
+  const auto lines = sink_->Lines();
+  ASSERT_EQ(lines.size(), 7u);
+  EXPECT_EQ(lines[0], L"-1 4294967295 0000beef AB\n");
+  EXPECT_EQ(lines[1], L"4886718345 123456789 23456789\n");
+  EXPECT_EQ(lines[2], L"[C:\\page.png] [wide] [narrow] [hs]\n");
+  EXPECT_EQ(lines[3], L"[ab    ] [    cd] [efg] [   7] [xy]\n");
+  EXPECT_EQ(lines[4], L"3.14   2.5 100\n");
+  // A missing argument leaves its conversion as it is.
+  EXPECT_EQ(lines[5], L"100% [(null)] -5 %d\n");
+  EXPECT_EQ(lines[6], L"no arguments\n");
+}
+
+TEST_F(LoggerTest, Levels) {
+  LogVerbose(L"verbose %d\n", 1);
+  LogInfo(L"info\n");
+  LogWarning(L"warning\n");
+  Log(L"error\n");
+  Logger::Flush();
+
+  std::vector<std::wstring> expected;
+  if (kLogLevel <= LogLevel::Verbose) {
+    expected.push_back(L"verbose 1\n");
+  }
+  if (kLogLevel <= LogLevel::Info) {
+    expected.push_back(L"info\n");
+  }
+  if (kLogLevel <= LogLevel::Warning) {
+    expected.push_back(L"warning\n");
+  }
+  expected.push_back(L"error\n");
+  EXPECT_EQ(sink_->Lines(), expected);
+}
+
+// Records of each thread come out in order, and the strings they refer to
+// are copied before the caller moves on.
+TEST_F(LoggerTest, Threads) {
+  const int kThreads = 4;
+  const int kRecords = 300;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([t]() {
+      for (int i = 0; i < kRecords; ++i) {
+        std::wstring name(L"thread" + std::to_wstring(t));
+        Log(L"%s %d\n", name.c_str(), i);
+        name.assign(name.size(), L'?');
+        if (i % 50 == 49) {
+          Logger::Flush();
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  Logger::Flush();
+
+  std::vector<int> next(kThreads, 0);
+  for (const auto &line : sink_->Lines()) {
+    int t, i;
+    ASSERT_EQ(swscanf(line.c_str(), L"thread%d %d", &t, &i), 2) << line;
+    ASSERT_LT(t, kThreads);
+    EXPECT_EQ(i, next[t]++);
+  }
+  for (int t = 0; t < kThreads; ++t) {
+    EXPECT_EQ(next[t], kRecords);
+  }
+}
+
+// A record that can never fit is dropped and counted, not cut short.
+TEST_F(LoggerTest, Dropped) {
+  const ULONGLONG dropped = Logger::Dropped();
+  const std::wstring huge(100000, L'x');
+  Log(L"%s\n", huge.c_str());
+  Logger::Flush();
+  EXPECT_EQ(Logger::Dropped(), dropped + 1);
+  const auto lines = sink_->Lines();
+  ASSERT_EQ(lines.size(), 1u);
+  EXPECT_EQ(lines[0], L"1 log records were dropped.\n");
+}
@@ -0,0 +1,91 @@
+// Synthetic pages and pixel comparisons shared by the test suites.  Include
+// this after gtest.h and bitmap.h.
+
+enum class PagePattern {
+  // Bytes stepping across each row and down the rows, so that no two tiles
+  // or strips are alike.
+  Gradient,
+  // Text-like runs on white: 12 rows of every 20 and 40 columns of every
+  // 50, each channel a gradient of its own.
+  Text,
+  // Dark specks at random on a light background, from |seed|.
+  Noise,
+  // A few columns of light blue, text and white blocks that move every 80
+  // rows as |seed| says, so that pages of other seeds differ in layout.
+  Layout,
+  // All one color, a different byte in each channel.
+  Background,
+};
+
+// Creates a |width| x |height| page of |pattern|.  Depths below 8bpp are
+// filled byte by byte; 8bpp and lower get a grayscale table.
+inline DIB CreatePage(HDC dc,
+                      WORD bitCount,
+                      LONG width,
+                      LONG height,
+                      PagePattern pattern = PagePattern::Gradient,
+                      DWORD seed = 1) {
+  DIB dib = DIB::CreateNew(dc, bitCount, width, height, nullptr,
+                           /*initWithGrayscaleTable*/true);
+  if (!dib) {
+    return dib;
+  }
+  const DWORD bpp = max(bitCount / 8, 1);
+  const DWORD rowBytes = (width * bitCount + 7) / 8;
+  const DWORD columns = 2 + seed % 3;
+  for (LONG y = 0; y < std::abs(height); ++y) {
+    LPBYTE row = dib.At(0, y);
+    DWORD color = 0;
+    for (DWORD i = 0; i < rowBytes; ++i) {
+      const LONG x = i / bpp;
+      const DWORD c = i % bpp;
+      switch (pattern) {
+      case PagePattern::Gradient:
+        row[i] = static_cast<BYTE>(i * 7 + y * 3);
+        break;
+      case PagePattern::Text:
+        row[i] = y % 20 < 12 && x % 50 < 40
+                 ? static_cast<BYTE>(x * 7 + y * 3 + c * 50)
+                 : 0xff;
+        break;
+      case PagePattern::Noise:
+        if (c == 0) {
+          seed = seed * 1103515245 + 12345;
+        }
+        row[i] = (seed >> 16) % 5 == 0 ? 0x20 : 0xf0;
+        break;
+      case PagePattern::Layout:
+        if (c == 0) {
+          const DWORD block = (x * columns / width + y / 80 * seed) % 4;
+          color = 0xffffff;
+          if (block == 0) {
+            color = 0xe0e8f0;
+          }
+          else if (block == 1 && y % 16 < 10 && (x * 7 + y) % 5 < 3) {
+            color = 0x202020;
+          }
+        }
+        row[i] = static_cast<BYTE>(color >> (c * 8));
+        break;
+      case PagePattern::Background:
+        row[i] = static_cast<BYTE>(0xf0 - c * 0x10);
+        break;
+      }
+    }
+  }
+  return dib;
+}
+
+// Expects |actual| to be the size and depth of |expected|, with the same
+// pixels row by row from the top, whichever way up each is stored.
+inline void ExpectSamePixels(const DIB &expected, const DIB &actual) {
+  const auto &ih = expected.GetBitmapInfo()->bmiHeader;
+  const auto &other = actual.GetBitmapInfo()->bmiHeader;
+  ASSERT_EQ(ih.biWidth, other.biWidth);
+  ASSERT_EQ(std::abs(ih.biHeight), std::abs(other.biHeight));
+  ASSERT_EQ(ih.biBitCount, other.biBitCount);
+  const DWORD rowBytes = (ih.biWidth * ih.biBitCount + 7) / 8;
+  for (LONG y = 0; y < std::abs(ih.biHeight); ++y) {
+    EXPECT_EQ(memcmp(expected.At(0, y), actual.At(0, y), rowBytes), 0) << y;
+  }
+}
@@ -0,0 +1,85 @@
+#include <windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <parallel.h>
+
+TEST(TaskScheduler, CoversRangeOnce) {
+  const DWORD threadCounts[] = {1, 2, 3, 8};
+  for (auto threads : threadCounts) {
+    TaskScheduler scheduler(threads);
+    EXPECT_EQ(scheduler.ThreadCount(), threads);
+
+    std::vector<std::atomic<int>> hits(1000);
+    for (auto &hit : hits) hit = 0;
+    scheduler.ParallelFor(3, 1000, 7, [&](DWORD begin, DWORD end) {
+      EXPECT_LE(end - begin, 7u);
+      for (DWORD i = begin; i < end; ++i) {
+        ++hits[i];
+      }
+    });
+    for (DWORD i = 0; i < hits.size(); ++i) {
+      EXPECT_EQ(hits[i], i < 3 ? 0 : 1) << "threads=" << threads << " i=" << i;
+    }
+  }
+}
+
+TEST(TaskScheduler, SerialModeRunsInOrder) {
+  TaskScheduler scheduler(/*threadCount*/1);
+  const auto caller = std::this_thread::get_id();
+  std::vector<DWORD> order;
+  scheduler.ParallelFor(0, 10, 3, [&](DWORD begin, DWORD end) {
+    EXPECT_EQ(std::this_thread::get_id(), caller);
+    order.push_back(begin);
+    order.push_back(end);
+  });
+  const std::vector<DWORD> expected = {0, 3, 3, 6, 6, 9, 9, 10};
+  EXPECT_EQ(order, expected);
+}
+
+TEST(TaskScheduler, Nested) {
+  TaskScheduler scheduler(/*threadCount*/4);
+  std::atomic<int> total(0);
+  scheduler.ParallelFor(0, 16, 1, [&](DWORD, DWORD) {
+    scheduler.ParallelFor(0, 16, 1, [&](DWORD begin, DWORD end) {
+      total += end - begin;
+    });
+  });
+  EXPECT_EQ(total, 16 * 16);
+}
+
+TEST(TaskScheduler, GrayscaleMatchesSerial) {
+  if (auto memDC = SafeDC::CreateMemDC(/*hwnd*/nullptr)) {
+    auto &scheduler = TaskScheduler::Default();
+    const auto original = scheduler.ThreadCount();
+
+    DIB results[2];
+    const DWORD threadCounts[] = {1, 4};
+    for (int i = 0; i < 2; ++i) {
+      scheduler.SetThreadCount(threadCounts[i]);
+      DIB dib = DIB::CreateNew(memDC, 32, 333, 1001);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      auto bits = dib.GetBits();
+      for (DWORD j = 0; j < 333 * 4 * 1001; ++j) {
+        bits[j] = static_cast<BYTE>(j * 13 + j / 1332);
+      }
+      ASSERT_TRUE(dib.ConvertToGrayscale(memDC, /*section*/nullptr));
+      results[i] = std::move(dib);
+    }
+    scheduler.SetThreadCount(original);
+
+    Blob serial, parallel;
+    results[0].CopyTo(serial);
+    results[1].CopyTo(parallel);
+    ASSERT_EQ(serial.Size(), parallel.Size());
+    EXPECT_EQ(memcmp(serial, parallel, serial.Size()), 0);
+  }
+}
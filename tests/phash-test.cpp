@@ -0,0 +1,102 @@
+#include <windows.h>
+#include <functional>
+#include <sstream>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <phash.h>
+#include "pages.h"
+
+TEST(PHash, Distance) {
+  EXPECT_EQ(HashDistance(0, 0), 0u);
+  EXPECT_EQ(HashDistance(0, ~0ull), 64u);
+  EXPECT_EQ(HashDistance(0x8000000000000001ull, 1), 1u);
+  EXPECT_EQ(HashDistance(0xf0f0f0f0f0f0f0f0ull, 0x0f0f0f0f0f0f0f0full), 64u);
+  EXPECT_EQ(HashDistance(0x123456789abcdef0ull, 0x123456789abcdef1ull), 1u);
+}
+
+TEST(PHash, NearDuplicates) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB page = CreatePage(memDC, 32, 320, 480, PagePattern::Layout, 1);
+  DIB same = CreatePage(memDC, 32, 320, -480, PagePattern::Layout, 1);
+  DIB other = CreatePage(memDC, 32, 320, 480, PagePattern::Layout, 6);
+  DIB edited = CreatePage(memDC, 32, 320, 480, PagePattern::Layout, 1);
+  // A blinking cursor and a changed counter.
+  for (DWORD y = 20; y < 36; ++y) {
+    for (DWORD x = 100; x < 130; ++x) {
+      reinterpret_cast<LPDWORD>(edited.At(x, y))[0] ^= 0x808080;
+    }
+  }
+
+  ImageHash a, b, c, d;
+  ASSERT_TRUE(page.Hash(a));
+  ASSERT_TRUE(same.Hash(b));
+  ASSERT_TRUE(other.Hash(c));
+  ASSERT_TRUE(edited.Hash(d));
+  EXPECT_EQ(a.dhash, b.dhash);
+  EXPECT_EQ(a.phash, b.phash);
+  EXPECT_LE(HashDistance(a.dhash, d.dhash), 4u);
+  EXPECT_GT(HashDistance(a.dhash, c.dhash), 12u);
+  EXPECT_LT(HashDistance(a.phash, d.phash), HashDistance(a.phash, c.phash));
+
+  // The grayscale copy hashes the same as the capture.
+  DIB gray = page.ConvertTo(8, memDC);
+  ImageHash e;
+  ASSERT_TRUE(gray.Hash(e));
+  EXPECT_EQ(a.dhash, e.dhash);
+  EXPECT_EQ(a.phash, e.phash);
+
+  DIB tiny = CreatePage(memDC, 32, 31, 100, PagePattern::Layout, 1);
+  EXPECT_FALSE(tiny.Hash(e));
+}
+
+TEST(PHash, SaveLoad) {
+  ImageHash hash;
+  hash.dhash = 0x0123456789abcdefull;
+  hash.phash = 0xfedcba9876543210ull;
+  std::stringstream ss;
+  hash.Save(ss);
+  EXPECT_EQ(ss.str(), "0123456789abcdef fedcba9876543210\n");
+
+  ImageHash loaded;
+  ASSERT_TRUE(loaded.Load(ss));
+  EXPECT_EQ(loaded.dhash, hash.dhash);
+  EXPECT_EQ(loaded.phash, hash.phash);
+
+  std::stringstream bad("xyz");
+  EXPECT_FALSE(loaded.Load(bad));
+}
+
+TEST(PHash, Index) {
+  HashIndex index;
+  DWORD id, distance;
+  EXPECT_FALSE(index.FindNearest(0, 64, id, distance));
+
+  std::vector<ULONGLONG> hashes;
+  ULONGLONG seed = 1;
+  for (DWORD i = 0; i < 5000; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    hashes.push_back(seed);
+    index.Insert(seed, i);
+  }
+  EXPECT_EQ(index.Size(), 5000u);
+
+  for (DWORD q = 0; q < 200; ++q) {
+    // Queries near stored hashes and random ones, against a full scan.
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    ULONGLONG query = q % 2 ? hashes[q * 7] ^ (1ull << (seed >> 58)) : seed;
+    for (DWORD maxDistance : {0u, 3u, 20u}) {
+      DWORD best = 65;
+      for (ULONGLONG hash : hashes) {
+        best = min(best, HashDistance(hash, query));
+      }
+      const bool found = index.FindNearest(query, maxDistance, id, distance);
+      EXPECT_EQ(found, best <= maxDistance) << q;
+      if (found) {
+        EXPECT_EQ(distance, best);
+        EXPECT_EQ(HashDistance(hashes[id], query), best);
+      }
+    }
+  }
+}
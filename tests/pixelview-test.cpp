@@ -0,0 +1,80 @@
+#include <windows.h>
+#include <functional>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <pixelview.h>
+
+TEST(PixelView, MatchesAt) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (LONG height : {5, -5}) {
+    DIB dib = DIB::CreateNew(memDC, 24, 7, height);
+    ASSERT_NE(HBITMAP(dib), nullptr);
+    auto view = dib.View<RGBTRIPLE>();
+    ASSERT_TRUE(!!view);
+    EXPECT_EQ(view.Width(), 7u);
+    EXPECT_EQ(view.Height(), 5u);
+    EXPECT_EQ(view.Stride(), height > 0 ? -24 : 24);
+
+    for (DWORD y = 0; y < 5; ++y) {
+      for (DWORD x = 0; x < 7; ++x) {
+        EXPECT_EQ(reinterpret_cast<LPBYTE>(&view[y][x]), dib.At(x, y));
+        view[y][x].rgbtRed = static_cast<BYTE>(x * 10 + y);
+      }
+    }
+    EXPECT_EQ(dib.At(3, 4)[2], 34);
+  }
+}
+
+TEST(PixelView, Iteration) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 32, 3, 4);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  DWORD value = 0;
+  for (auto row : dib.View<DWORD>()) {
+    for (DWORD &px : row) {
+      px = value++;
+    }
+  }
+  EXPECT_EQ(*reinterpret_cast<LPDWORD>(dib.At(0, 0)), 0u);
+  EXPECT_EQ(*reinterpret_cast<LPDWORD>(dib.At(2, 3)), 11u);
+
+  // A band of rows, read through a const view.
+  const DIB &constDib = dib;
+  auto band = constDib.View<DWORD>().Rows(1, 2);
+  EXPECT_EQ(band.Height(), 2u);
+  EXPECT_EQ(band[0][0], 3u);
+  EXPECT_EQ(band[1][2], 8u);
+}
+
+TEST(PixelView, Packed) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 4, 5, -2);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  auto view = dib.View<Packed<4>>();
+  ASSERT_TRUE(!!view);
+  for (DWORD x = 0; x < 5; ++x) {
+    view[1].Set(x, static_cast<BYTE>(x + 10));
+  }
+  const BYTE expected[] = {0xab, 0xcd, 0xe0};
+  EXPECT_EQ(memcmp(dib.At(0, 1), expected, sizeof(expected)), 0);
+  EXPECT_EQ(static_cast<const DIB&>(dib).View<Packed<4>>()[1].Get(3), 13);
+
+  DIB mono = DIB::CreateNew(memDC, 1, 10, 1);
+  auto bits = mono.View<Packed<1>>()[0];
+  bits.Set(0, 1);
+  bits.Set(9, 1);
+  EXPECT_EQ(mono.At(0, 0)[0], 0x80);
+  EXPECT_EQ(mono.At(0, 0)[1], 0x40);
+  EXPECT_EQ(bits.Get(9), 1);
+  EXPECT_EQ(bits.Get(8), 0);
+}
+
+TEST(PixelView, WrongFormat) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 32, 3, 4);
+  EXPECT_FALSE(!!dib.View<BYTE>());
+  EXPECT_FALSE(!!dib.View<RGBTRIPLE>());
+  EXPECT_TRUE(!!dib.View<RGBQUAD>());
+  EXPECT_FALSE(!!DIB().View<DWORD>());
+}
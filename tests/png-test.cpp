@@ -0,0 +1,571 @@
+#include <windows.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <deflate.h>
+#include <kernel.h>
+#include <parallel.h>
+
+// Minimal inflater after zlib's puff.c, just enough to check our output.
+class Inflater {
+private:
+  LPCBYTE in_;
+  SIZE_T size_;
+  SIZE_T pos_;
+  DWORD bitBuf_;
+  int bitCount_;
+
+  struct Huffman {
+    WORD count[16];
+    WORD symbol[288];
+  };
+
+  int Bits(int need) {
+    DWORD value = bitBuf_;
+    while (bitCount_ < need) {
+      if (pos_ >= size_) {
+        throw std::runtime_error("out of input");
+      }
+      value |= static_cast<DWORD>(in_[pos_++]) << bitCount_;
+      bitCount_ += 8;
+    }
+    bitBuf_ = value >> need;
+    bitCount_ -= need;
+    return static_cast<int>(value & ((1u << need) - 1));
+  }
+
+  int Decode(const Huffman &h) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; ++len) {
+      code |= Bits(1);
+      const int count = h.count[len];
+      if (code - count < first) {
+        return h.symbol[index + (code - first)];
+      }
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+    throw std::runtime_error("bad code");
+  }
+
+  static void Construct(Huffman &h, const BYTE *lengths, int n) {
+    WORD offsets[16];
+    memset(h.count, 0, sizeof(h.count));
+    for (int i = 0; i < n; ++i) {
+      ++h.count[lengths[i]];
+    }
+    offsets[1] = 0;
+    for (int len = 1; len < 15; ++len) {
+      offsets[len + 1] = offsets[len] + h.count[len];
+    }
+    for (int i = 0; i < n; ++i) {
+      if (lengths[i]) {
+        h.symbol[offsets[lengths[i]]++] = static_cast<WORD>(i);
+      }
+    }
+  }
+
+  void Codes(std::vector<BYTE> &out, const Huffman &lencode,
+             const Huffman &distcode) {
+    static const WORD kLenBase[] = {
+      3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const WORD kLenExtra[] = {
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+      3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const WORD kDistBase[] = {
+      1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+      257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+      8193, 12289, 16385, 24577};
+    static const WORD kDistExtra[] = {
+      0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+      7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    for (;;) {
+      int symbol = Decode(lencode);
+      if (symbol < 256) {
+        out.push_back(static_cast<BYTE>(symbol));
+        continue;
+      }
+      if (symbol == 256) {
+        return;
+      }
+      symbol -= 257;
+      if (symbol >= 29) {
+        throw std::runtime_error("bad length");
+      }
+      const int len = kLenBase[symbol] + Bits(kLenExtra[symbol]);
+      symbol = Decode(distcode);
+      if (symbol >= 30) {
+        throw std::runtime_error("bad distance");
+      }
+      const SIZE_T dist = kDistBase[symbol] + Bits(kDistExtra[symbol]);
+      if (dist > out.size()) {
+        throw std::runtime_error("distance too far");
+      }
+      for (int i = 0; i < len; ++i) {
+        out.push_back(out[out.size() - dist]);
+      }
+    }
+  }
+
+public:
+  Inflater(LPCBYTE in, SIZE_T size)
+    : in_(in), size_(size), pos_(0), bitBuf_(0), bitCount_(0)
+  {}
+
+  SIZE_T Position() const {
+    return pos_;
+  }
+
+  void Inflate(std::vector<BYTE> &out) {
+    static const BYTE kOrder[19] = {
+      16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    int last;
+    do {
+      last = Bits(1);
+      const int type = Bits(2);
+      Huffman lencode, distcode;
+      BYTE lengths[320];
+      if (type == 0) {
+        bitBuf_ = 0;
+        bitCount_ = 0;
+        if (pos_ + 4 > size_) {
+          throw std::runtime_error("out of input");
+        }
+        const WORD len = in_[pos_] | (in_[pos_ + 1] << 8);
+        const WORD nlen = in_[pos_ + 2] | (in_[pos_ + 3] << 8);
+        if (len != static_cast<WORD>(~nlen) || pos_ + 4 + len > size_) {
+          throw std::runtime_error("bad stored block");
+        }
+        out.insert(out.end(), in_ + pos_ + 4, in_ + pos_ + 4 + len);
+        pos_ += 4 + len;
+        continue;
+      }
+      else if (type == 1) {
+        int i = 0;
+        for (; i < 144; ++i) lengths[i] = 8;
+        for (; i < 256; ++i) lengths[i] = 9;
+        for (; i < 280; ++i) lengths[i] = 7;
+        for (; i < 288; ++i) lengths[i] = 8;
+        Construct(lencode, lengths, 288);
+        for (i = 0; i < 30; ++i) lengths[i] = 5;
+        Construct(distcode, lengths, 30);
+      }
+      else if (type == 2) {
+        const int nlen = Bits(5) + 257;
+        const int ndist = Bits(5) + 1;
+        const int ncode = Bits(4) + 4;
+        memset(lengths, 0, sizeof(lengths));
+        for (int i = 0; i < ncode; ++i) {
+          lengths[kOrder[i]] = static_cast<BYTE>(Bits(3));
+        }
+        Construct(lencode, lengths, 19);
+        int index = 0;
+        while (index < nlen + ndist) {
+          int symbol = Decode(lencode);
+          if (symbol < 16) {
+            lengths[index++] = static_cast<BYTE>(symbol);
+            continue;
+          }
+          BYTE len = 0;
+          int repeat;
+          if (symbol == 16) {
+            if (index == 0) {
+              throw std::runtime_error("repeat with no length");
+            }
+            len = lengths[index - 1];
+            repeat = 3 + Bits(2);
+          }
+          else if (symbol == 17) {
+            repeat = 3 + Bits(3);
+          }
+          else {
+            repeat = 11 + Bits(7);
+          }
+          if (index + repeat > nlen + ndist) {
+            throw std::runtime_error("too many lengths");
+          }
+          while (repeat--) {
+            lengths[index++] = len;
+          }
+        }
+        Construct(lencode, lengths, nlen);
+        Construct(distcode, lengths + nlen, ndist);
+      }
+      else {
+        throw std::runtime_error("bad block type");
+      }
+      Codes(out, lencode, distcode);
+    } while (!last);
+  }
+};
+
+static DWORD ReadBE32(LPCBYTE p) {
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void FillPseudoRandom(LPBYTE p, SIZE_T size, DWORD seed) {
+  for (SIZE_T i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    p[i] = static_cast<BYTE>(seed >> 16);
+  }
+}
+
+// Text-like data with repeats at every distance.
+static std::vector<BYTE> MakeCompressible(SIZE_T size) {
+  std::vector<BYTE> data(size);
+  DWORD seed = 1;
+  for (SIZE_T i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    const DWORD r = seed >> 16;
+    data[i] = i >= 300 && (r & 3) != 0
+              ? data[i - 1 - r % 300] : static_cast<BYTE>('a' + r % 26);
+  }
+  return data;
+}
+
+struct PngImage {
+  DWORD width;
+  DWORD height;
+  BYTE bitDepth;
+  BYTE colorType;
+  std::vector<BYTE> palette;
+  std::vector<BYTE> pixels;  // unfiltered rows without filter bytes
+};
+
+// Parses |png| strictly: chunk CRCs, zlib header and Adler-32, then undoes
+// the filters.
+static bool DecodePng(const std::string &png, PngImage &image) {
+  static const BYTE kSignature[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a,
+  };
+  auto p = reinterpret_cast<LPCBYTE>(png.data());
+  if (png.size() < 8 || memcmp(p, kSignature, 8) != 0) {
+    return false;
+  }
+
+  std::vector<BYTE> zlib;
+  bool ended = false;
+  for (SIZE_T pos = 8; pos < png.size(); ) {
+    if (pos + 12 > png.size()) {
+      return false;
+    }
+    const DWORD length = ReadBE32(p + pos);
+    const std::string type(png, pos + 4, 4);
+    if (pos + 12 + length > png.size()
+        || Crc32(0, p + pos + 4, length + 4) != ReadBE32(p + pos + 8 + length)) {
+      return false;
+    }
+    LPCBYTE data = p + pos + 8;
+    if (type == "IHDR") {
+      image.width = ReadBE32(data);
+      image.height = ReadBE32(data + 4);
+      image.bitDepth = data[8];
+      image.colorType = data[9];
+    }
+    else if (type == "PLTE") {
+      image.palette.assign(data, data + length);
+    }
+    else if (type == "IDAT") {
+      zlib.insert(zlib.end(), data, data + length);
+    }
+    else if (type == "IEND") {
+      ended = pos + 12 == png.size();
+    }
+    pos += 12 + length;
+  }
+  if (!ended || zlib.size() < 6 || (zlib[0] * 256 + zlib[1]) % 31 != 0) {
+    return false;
+  }
+
+  std::vector<BYTE> filtered;
+  Inflater inflater(zlib.data() + 2, zlib.size() - 2);
+  try {
+    inflater.Inflate(filtered);
+  }
+  catch (const std::exception&) {
+    return false;
+  }
+  const SIZE_T adlerPos = 2 + inflater.Position();
+  if (adlerPos + 4 != zlib.size()
+      || ReadBE32(zlib.data() + adlerPos)
+         != Adler32(1, filtered.data(), filtered.size())) {
+    return false;
+  }
+
+  const DWORD channels = image.colorType == 2 ? 3 : 1;
+  const DWORD bitsPerPixel = channels * image.bitDepth;
+  const DWORD stride = (image.width * bitsPerPixel + 7) / 8;
+  const DWORD unit = max(bitsPerPixel / 8, 1u);
+  if (filtered.size() != SIZE_T(stride + 1) * image.height) {
+    return false;
+  }
+  image.pixels.assign(SIZE_T(stride) * image.height, 0);
+  std::vector<BYTE> zero(stride);
+  for (DWORD y = 0; y < image.height; ++y) {
+    LPCBYTE in = filtered.data() + SIZE_T(stride + 1) * y;
+    LPBYTE out = image.pixels.data() + SIZE_T(stride) * y;
+    LPCBYTE prior = y ? out - stride : zero.data();
+    for (DWORD i = 0; i < stride; ++i) {
+      const int a = i >= unit ? out[i - unit] : 0;
+      const int b = prior[i];
+      const int c = i >= unit ? prior[i - unit] : 0;
+      int predictor;
+      switch (in[0]) {
+      case 0: predictor = 0; break;
+      case 1: predictor = a; break;
+      case 2: predictor = b; break;
+      case 3: predictor = (a + b) / 2; break;
+      case 4: {
+        const int pa = std::abs(b - c);
+        const int pb = std::abs(a - c);
+        const int pc = std::abs(a + b - 2 * c);
+        predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        break;
+      }
+      default:
+        return false;
+      }
+      out[i] = static_cast<BYTE>(in[1 + i] + predictor);
+    }
+  }
+  return true;
+}
+
+TEST(Deflate, Checksums) {
+  const BYTE check[] = "123456789";
+  EXPECT_EQ(Crc32(0, check, 9), 0xCBF43926);
+  const BYTE wikipedia[] = "Wikipedia";
+  EXPECT_EQ(Adler32(1, wikipedia, 9), 0x11E60398);
+
+  std::vector<BYTE> data(100000);
+  FillPseudoRandom(data.data(), data.size(), 7);
+  const DWORD whole = Adler32(1, data.data(), data.size());
+  for (SIZE_T split : {SIZE_T(0), SIZE_T(1), SIZE_T(5552), SIZE_T(77777)}) {
+    EXPECT_EQ(Adler32Combine(Adler32(1, data.data(), split),
+                             Adler32(1, data.data() + split,
+                                     data.size() - split),
+                             data.size() - split),
+              whole);
+  }
+}
+
+TEST(Deflate, RoundTrip) {
+  std::vector<BYTE> random(70000);
+  FillPseudoRandom(random.data(), random.size(), 3);
+  const std::vector<std::vector<BYTE>> inputs = {
+    {},
+    {'a'},
+    std::vector<BYTE>(100000, 0x55),
+    random,
+    MakeCompressible(300000),
+  };
+  for (const auto &input : inputs) {
+    for (int level : {0, 1, 4, 6, 9}) {
+      for (SIZE_T chunk : {SIZE_T(4096), SIZE_T(1) << 30}) {
+        std::vector<BYTE> compressed;
+        for (SIZE_T offset = 0; offset < input.size(); offset += chunk) {
+          DeflateChunk(input.data() + offset,
+                       min(chunk, input.size() - offset),
+                       offset,
+                       level,
+                       compressed);
+        }
+        FinishDeflate(compressed);
+
+        std::vector<BYTE> output;
+        Inflater inflater(compressed.data(), compressed.size());
+        EXPECT_NO_THROW(inflater.Inflate(output));
+        EXPECT_EQ(inflater.Position(), compressed.size());
+        EXPECT_EQ(output, input) << "level " << level << " chunk " << chunk;
+      }
+    }
+  }
+
+  const auto text = MakeCompressible(300000);
+  std::vector<BYTE> compressed;
+  DeflateChunk(text.data(), text.size(), 0, 6, compressed);
+  EXPECT_LT(compressed.size(), text.size() * 3 / 5);
+}
+
+TEST(PNG, Formats) {
+  const LONG width = 67, height = 45;
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {1, 4, 8, 24, 32}) {
+    for (bool grayTable : {false, true}) {
+      DIB dib = DIB::CreateNew(memDC, bitCount, width, height, nullptr,
+                               grayTable);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      for (LONG y = 0; y < height; ++y) {
+        // Gradients with noise make every filter type win somewhere.
+        LPBYTE row = dib.At(0, y);
+        const DWORD stride = ((width * bitCount + 31) / 32) * 4;
+        for (DWORD i = 0; i < stride; ++i) {
+          row[i] = static_cast<BYTE>(i * 3 + y * 5 + ((i * y) % 7 == 0) * 40);
+        }
+      }
+      if (!grayTable && bitCount <= 8) {
+        RGBQUAD *colors = dib.GetColorTable();
+        for (DWORD i = 0; i < (1u << bitCount); ++i) {
+          colors[i].rgbRed = static_cast<BYTE>(i * 7);
+          colors[i].rgbGreen = static_cast<BYTE>(i * 3);
+          colors[i].rgbBlue = static_cast<BYTE>(255 - i);
+        }
+      }
+
+      for (int level : {0, 1, 6, 9}) {
+        std::ostringstream oss;
+        ASSERT_TRUE(dib.SavePng(oss, bitCount, level));
+        PngImage png;
+        ASSERT_TRUE(DecodePng(oss.str(), png));
+        ASSERT_EQ(png.width, DWORD(width));
+        ASSERT_EQ(png.height, DWORD(height));
+
+        const DWORD stride = bitCount >= 24 ? width * 3
+                                            : (width * bitCount + 7) / 8;
+        for (LONG y = 0; y < height; ++y) {
+          LPCBYTE src = dib.At(0, y);
+          LPCBYTE dst = png.pixels.data() + stride * y;
+          if (bitCount >= 24) {
+            EXPECT_EQ(png.colorType, 2);
+            for (LONG x = 0; x < width; ++x) {
+              LPCBYTE pixel = src + x * bitCount / 8;
+              ASSERT_EQ(dst[x * 3 + 0], pixel[2]);
+              ASSERT_EQ(dst[x * 3 + 1], pixel[1]);
+              ASSERT_EQ(dst[x * 3 + 2], pixel[0]);
+            }
+          }
+          else {
+            EXPECT_EQ(png.colorType, grayTable ? 0 : 3);
+            EXPECT_EQ(png.bitDepth, bitCount);
+            ASSERT_EQ(memcmp(src, dst, stride), 0);
+          }
+        }
+        if (!grayTable && bitCount <= 8) {
+          ASSERT_EQ(png.palette.size(), 3u << bitCount);
+          EXPECT_EQ(png.palette[3 + 0], 7);
+          EXPECT_EQ(png.palette[3 + 1], 3);
+          EXPECT_EQ(png.palette[3 + 2], 254);
+        }
+        if (!grayTable && bitCount >= 4 && bitCount <= 8) {
+          EXPECT_EQ(png.palette[3 * 5 + 0], 35);
+          EXPECT_EQ(png.palette[3 * 5 + 1], 15);
+          EXPECT_EQ(png.palette[3 * 5 + 2], 250);
+        }
+      }
+    }
+  }
+}
+
+// Rows narrower than the SIMD loops leave every byte to the scalar tails,
+// whose first pixel takes its left neighbors from the row padding.
+TEST(PNG, NarrowRows) {
+  const LONG height = 9;
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {1, 4, 8, 24, 32}) {
+    for (LONG width = 1; width <= 17; ++width) {
+      DIB dib = DIB::CreateNew(memDC, bitCount, width, height, nullptr,
+                               /*grayTable*/true);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      const DWORD stride = ((width * bitCount + 31) / 32) * 4;
+      for (LONG y = 0; y < height; ++y) {
+        FillPseudoRandom(dib.At(0, y), stride, width * height + y);
+      }
+
+      std::ostringstream oss;
+      ASSERT_TRUE(dib.SavePng(oss, bitCount, 6));
+      PngImage png;
+      ASSERT_TRUE(DecodePng(oss.str(), png));
+      ASSERT_EQ(png.width, DWORD(width));
+      ASSERT_EQ(png.height, DWORD(height));
+
+      const DWORD pngStride = bitCount >= 24 ? width * 3
+                                             : (width * bitCount + 7) / 8;
+      for (LONG y = 0; y < height; ++y) {
+        LPCBYTE src = dib.At(0, y);
+        LPCBYTE dst = png.pixels.data() + pngStride * y;
+        if (bitCount >= 24) {
+          for (LONG x = 0; x < width; ++x) {
+            LPCBYTE pixel = src + x * bitCount / 8;
+            ASSERT_EQ(dst[x * 3 + 0], pixel[2])
+              << "depth " << bitCount << " width " << width;
+            ASSERT_EQ(dst[x * 3 + 1], pixel[1]);
+            ASSERT_EQ(dst[x * 3 + 2], pixel[0]);
+          }
+        }
+        else {
+          // The bits past the width of the last byte are not pixels.
+          const DWORD bits = width * bitCount;
+          ASSERT_EQ(memcmp(src, dst, bits / 8), 0)
+            << "depth " << bitCount << " width " << width;
+          if (bits % 8) {
+            const BYTE mask = static_cast<BYTE>(0xff00 >> (bits % 8));
+            ASSERT_EQ(src[bits / 8] & mask, dst[bits / 8] & mask)
+              << "depth " << bitCount << " width " << width;
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(PNG, GrayscaleLargeImage) {
+  // Big enough for several deflate chunks and filter batches.
+  const LONG width = 1500, height = 900;
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 32, width, -height);
+  ASSERT_NE(HBITMAP(dib), nullptr);
+  for (LONG y = 0; y < height; ++y) {
+    FillPseudoRandom(dib.At(0, y), width * 4 / 8, y);
+    for (LONG x = width / 8; x < width; ++x) {
+      *reinterpret_cast<DWORD*>(dib.At(x, y)) = x * 0x010203 + y * 0x030201;
+    }
+  }
+
+  std::ostringstream rgb, gray;
+  ASSERT_TRUE(dib.SavePng(rgb, 32, 6));
+  ASSERT_TRUE(dib.SavePng(gray, 8, 6));
+
+  PngImage png;
+  ASSERT_TRUE(DecodePng(rgb.str(), png));
+  EXPECT_EQ(png.colorType, 2);
+  EXPECT_EQ(png.pixels.size(), SIZE_T(width) * height * 3);
+  EXPECT_EQ(memcmp(png.pixels.data() + (width * 30 + 1000) * 3,
+                   dib.At(1000, 30) + 2, 1), 0);
+
+  ASSERT_TRUE(DecodePng(gray.str(), png));
+  EXPECT_EQ(png.colorType, 0);
+  EXPECT_EQ(png.bitDepth, 8);
+  std::vector<BYTE> expected(width);
+  for (LONG y = 0; y < height; ++y) {
+    GrayscaleRowScalar(dib.At(0, y), expected.data(), width);
+    ASSERT_EQ(memcmp(png.pixels.data() + width * y, expected.data(), width), 0);
+  }
+
+  // Chunking must not change the bits from one thread count to another.
+  TaskScheduler &scheduler = TaskScheduler::Default();
+  const DWORD threads = scheduler.ThreadCount();
+  scheduler.SetThreadCount(1);
+  std::ostringstream serial;
+  dib.SavePng(serial, 8, 6);
+  scheduler.SetThreadCount(threads);
+  EXPECT_EQ(serial.str(), gray.str());
+}
+
+TEST(PNG, Unsupported) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 24, 4, 4);
+  std::ostringstream oss;
+  EXPECT_FALSE(dib.SavePng(oss, 8, 6));
+}
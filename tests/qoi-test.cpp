@@ -0,0 +1,146 @@
+#include <windows.h>
+#include <functional>
+#include <sstream>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <kernel.h>
+#include <qoi.h>
+#include "pages.h"
+
+static DIB LoadFromString(const std::string &data, HDC dc) {
+  std::istringstream iss(data, std::ios::binary | std::ios::in);
+  return DIB::LoadFromStream(iss, dc);
+}
+
+// Flat areas, gradients, noise, and a few alpha values, so that every op
+// shows up.
+static void FillMixed(DIB &dib, LONG width, LONG height, WORD bitCount) {
+  DWORD seed = 1;
+  for (LONG y = 0; y < height; ++y) {
+    LPBYTE row = dib.At(0, y);
+    for (LONG x = 0; x < width * bitCount / 8; ++x) {
+      seed = seed * 1103515245 + 12345;
+      BYTE value = 0xff;
+      if (x > width / 2) {
+        value = static_cast<BYTE>(seed >> 16);
+      }
+      else if (y % 5 == 0) {
+        value = static_cast<BYTE>(x + y);
+      }
+      else if (y % 5 == 1) {
+        value = static_cast<BYTE>(x / 7 * 40);
+      }
+      row[x] = value;
+    }
+  }
+}
+
+TEST(QOI, RoundTrip) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {8, 24, 32}) {
+    for (LONG height : {37, -37}) {
+      const LONG width = 301;
+      DIB dib = DIB::CreateNew(memDC, bitCount, width, height, nullptr,
+                               /*initWithGrayscaleTable*/true);
+      ASSERT_NE(HBITMAP(dib), nullptr);
+      FillMixed(dib, width, std::abs(height), bitCount);
+
+      std::ostringstream oss;
+      ASSERT_TRUE(dib.SaveQoi(oss, bitCount));
+      const std::string qoi = oss.str();
+      EXPECT_EQ(qoi.compare(0, 4, "qoif"), 0);
+      EXPECT_EQ(qoi[12], bitCount / 8);
+      EXPECT_EQ(qoi.compare(qoi.size() - 8, 8, std::string("\0\0\0\0\0\0\0\1", 8)),
+                0);
+
+      DIB loaded = LoadFromString(qoi, memDC);
+      ASSERT_NE(HBITMAP(loaded), nullptr);
+      const auto &ih = loaded.GetBitmapInfo()->bmiHeader;
+      EXPECT_EQ(ih.biBitCount, bitCount);
+      EXPECT_EQ(ih.biWidth, width);
+      EXPECT_EQ(std::abs(ih.biHeight), std::abs(height));
+      ExpectSamePixels(dib, loaded);
+
+      Blob blob;
+      ASSERT_TRUE(dib.SaveQoi(blob, bitCount));
+      EXPECT_EQ(std::string(blob.As<char>(), blob.Size()), qoi);
+    }
+  }
+}
+
+TEST(QOI, Grayscale) {
+  const LONG width = 50, height = 20;
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 32, width, height);
+  FillMixed(dib, width, height, 32);
+
+  std::ostringstream oss;
+  ASSERT_TRUE(dib.SaveQoi(oss, 8));
+  DIB gray = LoadFromString(oss.str(), memDC);
+  ASSERT_NE(HBITMAP(gray), nullptr);
+  ASSERT_EQ(gray.GetBitmapInfo()->bmiHeader.biBitCount, 8);
+  BYTE expected[width];
+  for (LONG y = 0; y < height; ++y) {
+    GrayscaleRowScalar(dib.At(0, y), expected, width);
+    EXPECT_EQ(memcmp(gray.At(0, y), expected, width), 0);
+  }
+
+  // Indices without a grayscale table would lose their colors.
+  DIB palette = DIB::CreateNew(memDC, 8, width, height);
+  palette.GetColorTable()[1].rgbRed = 0x80;
+  std::ostringstream fail;
+  EXPECT_FALSE(palette.SaveQoi(fail, 8));
+}
+
+TEST(QOI, KnownEncoding) {
+  // Opaque white (a wrapping diff from the initial black), a run, a small
+  // diff, a luma diff, a cached color, and a new alpha.
+  const DWORD pixels[] = {
+    0xffffffff, 0xffffffff, 0xffffffff, 0xfffeffff,
+    0xfffc05fd, 0xffffffff, 0x80ffffff,
+  };
+  const BYTE expected[] = {
+    0x55,                          // DIFF -1 -1 -1
+    0xc1,                          // RUN 2
+    0x5a,                          // DIFF r-1
+    0xa6, 0x00,                    // LUMA dg=6, dr-dg=-8, db-dg=-8
+    0x26,                          // INDEX 38, opaque white
+    0xff, 0xff, 0xff, 0xff, 0x80,  // RGBA
+  };
+  QoiEncoder encoder;
+  BYTE out[64];
+  SIZE_T size = encoder.EncodeRow(reinterpret_cast<LPCBYTE>(pixels),
+                                  ARRAYSIZE(pixels), 32, out);
+  ASSERT_EQ(size, sizeof(expected));
+  EXPECT_EQ(memcmp(out, expected, size), 0);
+  EXPECT_EQ(encoder.Finish(out), kQoiEndSize);
+
+  QoiDecoder decoder;
+  DWORD decoded[ARRAYSIZE(pixels)];
+  LPCBYTE src = expected;
+  ASSERT_TRUE(decoder.DecodeRow(src, expected + sizeof(expected),
+                                reinterpret_cast<LPBYTE>(decoded),
+                                ARRAYSIZE(pixels), 32));
+  EXPECT_EQ(src, expected + sizeof(expected));
+  EXPECT_EQ(memcmp(decoded, pixels, sizeof(pixels)), 0);
+}
+
+TEST(QOI, Truncated) {
+  const LONG width = 64, height = 64;
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 24, width, height);
+  FillMixed(dib, width, height, 24);
+  std::ostringstream oss;
+  ASSERT_TRUE(dib.SaveQoi(oss, 24));
+  const std::string qoi = oss.str();
+
+  for (SIZE_T size : {SIZE_T(3), kQoiHeaderSize, qoi.size() / 2,
+                      qoi.size() - kQoiEndSize - 2}) {
+    DIB loaded = LoadFromString(qoi.substr(0, size), memDC);
+    EXPECT_EQ(HBITMAP(loaded), nullptr) << size;
+  }
+  std::string badChannels = qoi;
+  badChannels[12] = 2;
+  EXPECT_EQ(HBITMAP(LoadFromString(badChannels, memDC)), nullptr);
+}
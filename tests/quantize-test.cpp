@@ -0,0 +1,284 @@
+#include <windows.h>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <quantize.h>
+
+static const Dither kDithers[] = {
+  Dither::None,
+  Dither::Ordered,
+  Dither::FloydSteinberg,
+};
+
+// A distinct color for each index, spread over all three channels.
+static DWORD ColorOf(DWORD index) {
+  return (index * 37 & 0xff) << 16 | (index * 101 & 0xff) << 8 | index;
+}
+
+static DIB CreateColors(HDC dc, DWORD colors, LONG width, LONG height) {
+  DIB dib = DIB::CreateNew(dc, 32, width, height);
+  for (LONG y = 0; y < std::abs(height); ++y) {
+    auto row = reinterpret_cast<LPDWORD>(dib.At(0, y));
+    for (LONG x = 0; x < width; ++x) {
+      // Runs of a few pixels, and an alpha that does not count.
+      row[x] = ColorOf((x / 3 + y * 7) % colors) | 0xff000000;
+    }
+  }
+  return dib;
+}
+
+static DWORD Unpack(const DIB &dib, DWORD x, DWORD y) {
+  const WORD bitCount = dib.GetBitmapInfo()->bmiHeader.biBitCount;
+  const DWORD perByte = 8 / bitCount;
+  const BYTE packed = dib.At(0, y)[x / perByte];
+  const DWORD shift = (perByte - 1 - x % perByte) * bitCount;
+  return (packed >> shift) & ((1u << bitCount) - 1);
+}
+
+static DWORD PaletteColor(const DIB &dib, DWORD index) {
+  const RGBQUAD &c = dib.GetBitmapInfo()->bmiColors[index];
+  return static_cast<DWORD>(c.rgbRed) << 16
+         | static_cast<DWORD>(c.rgbGreen) << 8
+         | c.rgbBlue;
+}
+
+TEST(Quantize, Lossless) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const struct {
+    DWORD colors;
+    WORD bitCount;
+  } cases[] = {{1, 1}, {2, 1}, {3, 4}, {16, 4}, {17, 8}, {256, 8}};
+  for (const auto &c : cases) {
+    DIB dib = CreateColors(memDC, c.colors, 101, -67);
+    for (Dither dither : kDithers) {
+      DIB indexed = dib.Quantize(0, dither, memDC);
+      ASSERT_NE(HBITMAP(indexed), nullptr) << c.colors;
+      const auto &ih = indexed.GetBitmapInfo()->bmiHeader;
+      EXPECT_EQ(ih.biBitCount, c.bitCount) << c.colors;
+      EXPECT_EQ(ih.biWidth, 101);
+      EXPECT_EQ(ih.biHeight, -67);
+      for (DWORD y = 0; y < 67; ++y) {
+        auto row = reinterpret_cast<const DWORD*>(dib.At(0, y));
+        for (DWORD x = 0; x < 101; ++x) {
+          ASSERT_EQ(PaletteColor(indexed, Unpack(indexed, x, y)),
+                    row[x] & 0xffffff)
+            << c.colors << " colors at " << x << "," << y;
+        }
+      }
+    }
+  }
+
+  DIB many = CreateColors(memDC, 257, 64, 64);
+  EXPECT_EQ(HBITMAP(many.Quantize(0, Dither::None, memDC)), nullptr);
+  // An explicit depth keeps exact colors that fit.
+  DIB wide = CreateColors(memDC, 5, 64, 64).Quantize(8, Dither::None, memDC);
+  ASSERT_NE(HBITMAP(wide), nullptr);
+  EXPECT_EQ(wide.GetBitmapInfo()->bmiHeader.biBitCount, 8);
+  EXPECT_EQ(PaletteColor(wide, Unpack(wide, 0, 0)), ColorOf(0));
+  EXPECT_EQ(HBITMAP(wide.Quantize(2, Dither::None, memDC)), nullptr);
+}
+
+// What --indexed saves: the exact colors in the smallest depth, or 8bpp with
+// a dithered palette beyond 256 colors, as indexed PNG and BMP.
+TEST(Quantize, IndexedFiles) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const struct {
+    DWORD colors;
+    WORD bitCount;
+  } cases[] = {{2, 1}, {16, 4}, {256, 8}, {4000, 8}};
+  for (const auto &c : cases) {
+    DIB dib = CreateColors(memDC, c.colors, 1500, -40);
+    DIB indexed = dib.Quantize(0, Dither::FloydSteinberg, memDC,
+                               /*section*/nullptr, /*fallback*/8);
+    ASSERT_NE(HBITMAP(indexed), nullptr) << c.colors;
+    const WORD bitCount = indexed.GetBitmapInfo()->bmiHeader.biBitCount;
+    EXPECT_EQ(bitCount, c.bitCount) << c.colors;
+
+    // The bit depth and color type of IHDR, palette.
+    std::ostringstream png;
+    ASSERT_TRUE(indexed.SavePng(png, bitCount, /*level*/1));
+    const std::string pngBytes = png.str();
+    ASSERT_GT(pngBytes.size(), 26u);
+    EXPECT_EQ(pngBytes.compare(12, 4, "IHDR"), 0);
+    EXPECT_EQ(static_cast<BYTE>(pngBytes[24]), c.bitCount) << c.colors;
+    EXPECT_EQ(pngBytes[25], 3) << c.colors;
+
+    std::ostringstream bmp;
+    ASSERT_TRUE(indexed.SaveAs(bmp, bitCount));
+    std::istringstream iss(bmp.str(), std::ios::binary | std::ios::in);
+    DIB loaded = DIB::LoadFromStream(iss, memDC);
+    ASSERT_NE(HBITMAP(loaded), nullptr) << c.colors;
+    EXPECT_EQ(loaded.GetBitmapInfo()->bmiHeader.biBitCount, c.bitCount);
+    EXPECT_EQ(PaletteColor(loaded, Unpack(loaded, 0, 0)),
+              PaletteColor(indexed, Unpack(indexed, 0, 0)));
+  }
+}
+
+TEST(Quantize, Formats) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = CreateColors(memDC, 40, 50, 30);
+  for (WORD bitCount : {16, 24}) {
+    DIB converted = dib.ConvertTo(bitCount, memDC);
+    DIB back = converted.ConvertTo(32, memDC);
+    DIB indexed = converted.Quantize(0, Dither::None, memDC);
+    ASSERT_NE(HBITMAP(indexed), nullptr) << bitCount;
+    for (DWORD y = 0; y < 30; ++y) {
+      auto row = reinterpret_cast<const DWORD*>(back.At(0, y));
+      for (DWORD x = 0; x < 50; ++x) {
+        ASSERT_EQ(PaletteColor(indexed, Unpack(indexed, x, y)),
+                  row[x] & 0xffffff)
+          << bitCount << "bpp at " << x << "," << y;
+      }
+    }
+  }
+}
+
+TEST(Quantize, Gradient) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const DWORD size = 256;
+  DIB dib = DIB::CreateNew(memDC, 32, size, size);
+  for (DWORD y = 0; y < size; ++y) {
+    auto row = reinterpret_cast<LPDWORD>(dib.At(0, y));
+    for (DWORD x = 0; x < size; ++x) {
+      row[x] = x << 16 | y << 8 | ((x + y) / 2);
+    }
+  }
+  for (WORD bitCount : {4, 8}) {
+    double undithered = 0;
+    for (Dither dither : kDithers) {
+      DIB indexed = dib.Quantize(bitCount, dither, memDC);
+      ASSERT_NE(HBITMAP(indexed), nullptr);
+      ASSERT_EQ(indexed.GetBitmapInfo()->bmiHeader.biBitCount, bitCount);
+      // Mean of each channel over 8x8 blocks, where dithering evens out.
+      double worst = 0;
+      for (DWORD by = 0; by < size; by += 8) {
+        for (DWORD bx = 0; bx < size; bx += 8) {
+          int error[3] = {};
+          for (DWORD y = by; y < by + 8; ++y) {
+            auto row = reinterpret_cast<const DWORD*>(dib.At(0, y));
+            for (DWORD x = bx; x < bx + 8; ++x) {
+              const DWORD q = PaletteColor(indexed, Unpack(indexed, x, y));
+              for (int c = 0; c < 3; ++c) {
+                error[c] += static_cast<int>((q >> (c * 8)) & 0xff)
+                            - static_cast<int>((row[x] >> (c * 8)) & 0xff);
+              }
+            }
+          }
+          for (int c = 0; c < 3; ++c) {
+            worst = max(worst, std::abs(error[c]) / 64.0);
+          }
+        }
+      }
+      // 16 colors leave boxes of about 100 levels a side.
+      EXPECT_LT(worst, bitCount == 8 ? 16.0 : 72.0)
+        << bitCount << "bpp dither " << static_cast<int>(dither);
+      if (dither == Dither::None) {
+        undithered = worst;
+      }
+      else {
+        EXPECT_LT(worst, undithered)
+          << bitCount << "bpp dither " << static_cast<int>(dither);
+      }
+    }
+  }
+}
+
+TEST(Quantize, Mapper) {
+  const RGBQUAD palette[] = {
+    {0xff, 0xff, 0xff, 0},
+    {0x00, 0x00, 0x00, 0},
+    {0x00, 0x00, 0xff, 0},
+    {0x80, 0x80, 0x80, 0},
+  };
+  const PaletteMapper mapper(palette, 4);
+  const DWORD pixels[] = {
+    0xffffff, 0xff000000, 0x00ff0000, 0x808080,
+    0x7f7f7f, 0xf00000, 0x101010, 0xffffff,
+  };
+  const BYTE expected[] = {0, 1, 2, 3, 3, 2, 1, 0};
+  BYTE indices[8];
+  mapper.MapRow(pixels, indices, 8, 0, Dither::None);
+  EXPECT_EQ(memcmp(indices, expected, 8), 0);
+
+  // Colors of the palette are never dithered, even with error carried to
+  // them from the rows before.
+  std::vector<int> errors;
+  for (DWORD y = 0; y < 4; ++y) {
+    mapper.DiffuseRow(pixels, indices, 8, errors);
+    for (DWORD x : {0, 1, 2, 3, 7}) {
+      EXPECT_EQ(indices[x], expected[x]) << x << "," << y;
+    }
+    mapper.MapRow(pixels, indices, 8, y, Dither::Ordered);
+    for (DWORD x : {0, 1, 2, 3, 7}) {
+      EXPECT_EQ(indices[x], expected[x]) << x << "," << y;
+    }
+  }
+}
+
+TEST(Quantize, Counter) {
+  std::vector<DWORD> row(100);
+  for (DWORD x = 0; x < 100; ++x) {
+    row[x] = x < 50 ? 0xff123456 : 0x00123456 + (x / 10);
+  }
+  ColorCounter counter(10);
+  EXPECT_TRUE(counter.AddRow(row.data(), 100));
+  EXPECT_TRUE(counter.AddRow(row.data() + 1, 99));
+  EXPECT_EQ(counter.Size(), 6u);
+  std::vector<DWORD> colors, counts;
+  counter.GetColors(colors, counts);
+  ASSERT_EQ(colors.size(), 6u);
+  EXPECT_EQ(colors[0], 0x123456u);
+  EXPECT_EQ(counts[0], 99u);
+  EXPECT_EQ(colors[5], 0x123456u + 9);
+  EXPECT_EQ(counts[5], 20u);
+
+  ColorCounter other(10);
+  for (DWORD x = 0; x < 100; ++x) {
+    row[x] = x / 10 * 0x010101;
+  }
+  EXPECT_TRUE(other.AddRow(row.data(), 100));
+  EXPECT_EQ(other.Size(), 10u);
+  EXPECT_FALSE(counter.Merge(other));
+  EXPECT_TRUE(counter.Overflow());
+
+  ColorCounter small(3);
+  EXPECT_FALSE(small.AddRow(row.data(), 100));
+  EXPECT_TRUE(small.Overflow());
+}
+
+TEST(Quantize, MedianCut) {
+  const std::vector<DWORD> colors = {0x000000, 0x0000ff, 0xff0000, 0xffffff};
+  const std::vector<DWORD> counts = {10, 1, 1, 10};
+  RGBQUAD palette[4];
+  ASSERT_EQ(MedianCut(colors, counts, 4, palette), 4u);
+  std::vector<DWORD> found;
+  for (const auto &c : palette) {
+    found.push_back(static_cast<DWORD>(c.rgbRed) << 16
+                    | static_cast<DWORD>(c.rgbGreen) << 8
+                    | c.rgbBlue);
+  }
+  std::sort(found.begin(), found.end());
+  EXPECT_EQ(found, colors);
+
+  // Two boxes: the heavy colors stay apart.
+  ASSERT_EQ(MedianCut(colors, counts, 2, palette), 2u);
+  EXPECT_NE(palette[0].rgbGreen, palette[1].rgbGreen);
+  EXPECT_EQ(MedianCut(colors, counts, 8, palette), 4u);
+}
+
+TEST(Quantize, Pack) {
+  const BYTE indices[] = {1, 0, 1, 1, 0, 0, 0, 1, 1, 1};
+  BYTE row[2] = {};
+  PackIndices(indices, row, 10, 1);
+  EXPECT_EQ(row[0], 0xb1);
+  EXPECT_EQ(row[1], 0xc0);
+  const BYTE nibbles[] = {0xa, 0x3, 0xf};
+  PackIndices(nibbles, row, 3, 4);
+  EXPECT_EQ(row[0], 0xa3);
+  EXPECT_EQ(row[1], 0xf0);
+}
@@ -0,0 +1,210 @@
+#include <windows.h>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <quantize.h>
+#include <resample.h>
+#include "pages.h"
+
+static const ResampleFilter kFilters[] = {
+  ResampleFilter::Box,
+  ResampleFilter::Bilinear,
+  ResampleFilter::Lanczos3,
+};
+
+// Both passes in plain loops with the weights of the kernels, rounded the
+// same way as the SIMD code.
+static void ResampleReference(const DIB &source,
+                              DWORD width,
+                              DWORD height,
+                              ResampleFilter filter,
+                              std::vector<BYTE> &pixels) {
+  const auto &ih = source.GetBitmapInfo()->bmiHeader;
+  const DWORD channels = ih.biBitCount / 8;
+  const DWORD sourceHeight = std::abs(ih.biHeight);
+  const ResampleKernel across(filter, ih.biWidth, width);
+  const ResampleKernel down(filter, sourceHeight, height);
+  const int round = 1 << (ResampleKernel::kPrecision - 1);
+  auto clamp = [](int v) {
+    return static_cast<BYTE>(v < 0 ? 0 : v > 255 ? 255 : v);
+  };
+
+  std::vector<BYTE> rows(SIZE_T(width) * channels * sourceHeight);
+  for (DWORD y = 0; y < sourceHeight; ++y) {
+    for (DWORD x = 0; x < width; ++x) {
+      for (DWORD c = 0; c < channels; ++c) {
+        int sum = round;
+        for (DWORD t = 0; t < across.Taps(); ++t) {
+          sum += source.At(across.First(x) + t, y)[c] * across.Weights(x)[t];
+        }
+        rows[(SIZE_T(y) * width + x) * channels + c] =
+          clamp(sum >> ResampleKernel::kPrecision);
+      }
+    }
+  }
+  pixels.resize(SIZE_T(width) * channels * height);
+  for (DWORD y = 0; y < height; ++y) {
+    for (SIZE_T i = 0; i < SIZE_T(width) * channels; ++i) {
+      int sum = round;
+      for (DWORD t = 0; t < down.Taps(); ++t) {
+        sum += rows[(down.First(y) + t) * SIZE_T(width) * channels + i]
+               * down.Weights(y)[t];
+      }
+      pixels[SIZE_T(y) * width * channels + i] =
+        clamp(sum >> ResampleKernel::kPrecision);
+    }
+  }
+}
+
+TEST(Resample, Kernel) {
+  for (ResampleFilter filter : kFilters) {
+    for (DWORD source : {1, 7, 100, 333}) {
+      for (DWORD size : {1, 3, 50, 100, 500}) {
+        const ResampleKernel kernel(filter, source, size);
+        ASSERT_EQ(kernel.Size(), size);
+        ASSERT_LE(kernel.Taps(), source);
+        for (DWORD i = 0; i < size; ++i) {
+          EXPECT_LE(kernel.First(i) + kernel.Taps(), source);
+          int sum = 0;
+          for (DWORD t = 0; t < kernel.Taps(); ++t) {
+            sum += kernel.Weights(i)[t];
+          }
+          EXPECT_EQ(sum, 1 << ResampleKernel::kPrecision)
+            << source << " -> " << size << " at " << i;
+        }
+      }
+    }
+  }
+
+  // Halving with a box averages pairs.
+  const ResampleKernel box(ResampleFilter::Box, 10, 5);
+  ASSERT_EQ(box.Taps(), 3u);
+  for (DWORD i = 0; i < 5; ++i) {
+    const short *w = box.Weights(i);
+    for (DWORD t = 0; t < 3; ++t) {
+      const DWORD x = box.First(i) + t;
+      EXPECT_EQ(w[t], x / 2 == i ? 1 << (ResampleKernel::kPrecision - 1) : 0);
+    }
+  }
+}
+
+TEST(Resample, Identity) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {8, 32}) {
+    DIB dib = CreatePage(memDC, bitCount, 37, -19);
+    for (ResampleFilter filter : kFilters) {
+      DIB copy = dib.Resample(37, 19, filter, memDC);
+      ASSERT_NE(HBITMAP(copy), nullptr);
+      EXPECT_EQ(copy.GetBitmapInfo()->bmiHeader.biHeight, -19);
+      for (DWORD y = 0; y < 19; ++y) {
+        EXPECT_EQ(memcmp(dib.At(0, y), copy.At(0, y), 37 * bitCount / 8), 0)
+          << bitCount << "bpp, row " << y;
+      }
+    }
+  }
+}
+
+TEST(Resample, Reference) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  for (WORD bitCount : {8, 32}) {
+    // Odd sizes leave tails in both passes.
+    DIB dib = CreatePage(memDC, bitCount, 101, 53);
+    const DWORD channels = bitCount / 8;
+    for (ResampleFilter filter : kFilters) {
+      for (const SIZE &size : {SIZE{33, 17}, SIZE{101, 20}, SIZE{250, 131}}) {
+        DIB resized = dib.Resample(size.cx, size.cy, filter, memDC);
+        ASSERT_NE(HBITMAP(resized), nullptr);
+        std::vector<BYTE> expected;
+        ResampleReference(dib, size.cx, size.cy, filter, expected);
+        for (LONG y = 0; y < size.cy; ++y) {
+          const SIZE_T rowBytes = SIZE_T(size.cx) * channels;
+          EXPECT_EQ(memcmp(resized.At(0, y),
+                           expected.data() + rowBytes * y,
+                           rowBytes), 0)
+            << bitCount << "bpp " << size.cx << "x" << size.cy
+            << " row " << y;
+        }
+      }
+    }
+  }
+}
+
+TEST(Resample, Flat) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = DIB::CreateNew(memDC, 32, 64, 48);
+  for (DWORD y = 0; y < 48; ++y) {
+    auto row = reinterpret_cast<LPDWORD>(dib.At(0, y));
+    for (DWORD x = 0; x < 64; ++x) {
+      row[x] = 0xff8040c0;
+    }
+  }
+  for (ResampleFilter filter : kFilters) {
+    for (const SIZE &size : {SIZE{5, 3}, SIZE{64, 20}, SIZE{211, 97}}) {
+      DIB resized = dib.Resample(size.cx, size.cy, filter, memDC);
+      ASSERT_NE(HBITMAP(resized), nullptr);
+      for (LONG y = 0; y < size.cy; ++y) {
+        auto row = reinterpret_cast<const DWORD*>(resized.At(0, y));
+        for (LONG x = 0; x < size.cx; ++x) {
+          ASSERT_EQ(row[x], 0xff8040c0u) << x << "," << y;
+        }
+      }
+    }
+  }
+}
+
+TEST(Resample, Several) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB dib = CreatePage(memDC, 32, 200, 150);
+  const SIZE sizes[] = {{160, 120}, {40, 30}, {400, 300}};
+  std::vector<DIB> outputs;
+  ASSERT_TRUE(dib.Resample(sizes, 3, ResampleFilter::Lanczos3, memDC,
+                           outputs));
+  ASSERT_EQ(outputs.size(), 3u);
+  for (DWORD i = 0; i < 3; ++i) {
+    DIB single = dib.Resample(sizes[i].cx, sizes[i].cy,
+                              ResampleFilter::Lanczos3, memDC);
+    for (LONG y = 0; y < sizes[i].cy; ++y) {
+      EXPECT_EQ(memcmp(outputs[i].At(0, y), single.At(0, y), sizes[i].cx * 4),
+                0);
+    }
+  }
+
+  const SIZE empty[] = {{10, 10}, {0, 10}};
+  EXPECT_FALSE(dib.Resample(empty, 2, ResampleFilter::Box, memDC, outputs));
+  EXPECT_TRUE(outputs.empty());
+  DIB rgb = CreatePage(memDC, 24, 20, 20);
+  EXPECT_EQ(HBITMAP(rgb.Resample(10, 10, ResampleFilter::Box, memDC)),
+            nullptr);
+}
+
+// Palette indices are not levels to filter.  A palette image is resampled
+// in color instead.
+TEST(Resample, Palette) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB page = CreatePage(memDC, 32, 64, 48, PagePattern::Layout);
+  DIB indexed = page.Quantize(8, Dither::None, memDC);
+  ASSERT_NE(HBITMAP(indexed), nullptr);
+  ASSERT_EQ(indexed.GetBitmapInfo()->bmiHeader.biBitCount, 8);
+  EXPECT_EQ(HBITMAP(indexed.Resample(32, 24, ResampleFilter::Box, memDC)),
+            nullptr);
+  std::vector<DIB> outputs;
+  const SIZE size = {32, 24};
+  EXPECT_FALSE(indexed.Resample(&size, 1, ResampleFilter::Box, memDC,
+                                outputs));
+  EXPECT_TRUE(outputs.empty());
+
+  DIB color = indexed.ConvertTo(32, memDC);
+  ASSERT_NE(HBITMAP(color), nullptr);
+  DIB resized = color.Resample(32, 24, ResampleFilter::Box, memDC);
+  ASSERT_NE(HBITMAP(resized), nullptr);
+  ExpectSamePixels(page.Resample(32, 24, ResampleFilter::Box, memDC),
+                   resized);
+
+  // A grayscale table is fine.
+  DIB gray = CreatePage(memDC, 8, 64, 48);
+  EXPECT_NE(HBITMAP(gray.Resample(32, 24, ResampleFilter::Box, memDC)),
+            nullptr);
+}
@@ -0,0 +1,128 @@
+#include <windows.h>
+#include <functional>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <pixelview.h>
+#include <ssim.h>
+#include "pages.h"
+
+// SSIM of one window, straight from the definition.
+static double ReferenceSsim(const DIB &a, const DIB &b, DWORD x0, DWORD y0) {
+  const double c1 = (0.01 * 255) * (0.01 * 255);
+  const double c2 = (0.03 * 255) * (0.03 * 255);
+  const double n = kSsimWindow * kSsimWindow;
+  double ma = 0, mb = 0;
+  for (DWORD y = y0; y < y0 + kSsimWindow; ++y) {
+    for (DWORD x = x0; x < x0 + kSsimWindow; ++x) {
+      ma += a.At(x, y)[0];
+      mb += b.At(x, y)[0];
+    }
+  }
+  ma /= n;
+  mb /= n;
+  double va = 0, vb = 0, cov = 0;
+  for (DWORD y = y0; y < y0 + kSsimWindow; ++y) {
+    for (DWORD x = x0; x < x0 + kSsimWindow; ++x) {
+      const double da = a.At(x, y)[0] - ma;
+      const double db = b.At(x, y)[0] - mb;
+      va += da * da;
+      vb += db * db;
+      cov += da * db;
+    }
+  }
+  va /= n;
+  vb /= n;
+  cov /= n;
+  return ((2 * ma * mb + c1) * (2 * cov + c2))
+         / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+}
+
+TEST(Ssim, Identical) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB a = CreatePage(memDC, 8, 100, 70, PagePattern::Noise);
+  DIB b = CreatePage(memDC, 8, 100, 70, PagePattern::Noise);
+  SsimResult result;
+  ASSERT_TRUE(a.Ssim(b, result, 32));
+  EXPECT_NEAR(result.score, 1.0, 1e-6);
+  EXPECT_EQ(result.tileSize, 32u);
+  EXPECT_EQ(result.tilesX, 3u);
+  EXPECT_EQ(result.tilesY, 2u);
+  ASSERT_EQ(result.tiles.size(), 6u);
+  for (float tile : result.tiles) {
+    EXPECT_NEAR(tile, 1.0f, 1e-5f);
+  }
+}
+
+TEST(Ssim, Reference) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  // Widths that leave a tail after the vector loops.
+  DIB a = CreatePage(memDC, 8, 37, 21, PagePattern::Noise, 1);
+  DIB b = CreatePage(memDC, 8, 37, -21, PagePattern::Noise, 2);
+  for (DWORD y = 0; y < 21; ++y) {
+    for (DWORD x = 0; x < 37; ++x) {
+      b.At(x, y)[0] = static_cast<BYTE>((b.At(x, y)[0] + a.At(x, y)[0]) / 2);
+    }
+  }
+
+  SsimResult result;
+  ASSERT_TRUE(a.Ssim(b, result, 16));
+  double total = 0;
+  const DWORD windowsX = 37 - kSsimWindow + 1;
+  const DWORD windowsY = 21 - kSsimWindow + 1;
+  double tile = 0;
+  for (DWORD y = 0; y < windowsY; ++y) {
+    for (DWORD x = 0; x < windowsX; ++x) {
+      const double score = ReferenceSsim(a, b, x, y);
+      total += score;
+      if (x < 16 && y < 14) {
+        tile += score;
+      }
+    }
+  }
+  EXPECT_NEAR(result.score, total / (windowsX * windowsY), 1e-5);
+  EXPECT_NEAR(result.tiles[0], tile / (16 * 14), 1e-5);
+  EXPECT_LT(result.score, 0.99);
+}
+
+TEST(Ssim, LocalChange) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB a = CreatePage(memDC, 8, 256, 256, PagePattern::Noise);
+  DIB b = CreatePage(memDC, 8, 256, 256, PagePattern::Noise);
+  // A different paragraph in the tile at (2, 1).
+  DIB other = CreatePage(memDC, 8, 64, 64, PagePattern::Noise, 7);
+  for (DWORD y = 72; y < 120; ++y) {
+    for (DWORD x = 136; x < 184; ++x) {
+      b.At(x, y)[0] = other.At(x - 136, y - 72)[0];
+    }
+  }
+
+  SsimResult result;
+  ASSERT_TRUE(a.Ssim(b, result));
+  EXPECT_LT(result.score, 0.99);
+  ASSERT_EQ(result.tilesX, 4u);
+  ASSERT_EQ(result.tilesY, 4u);
+  DWORD worst = 0;
+  for (DWORD i = 1; i < result.tiles.size(); ++i) {
+    if (result.tiles[i] < result.tiles[worst]) {
+      worst = i;
+    }
+  }
+  EXPECT_EQ(worst, 1u * 4 + 2);
+  EXPECT_LT(result.tiles[worst], 0.7f);
+  EXPECT_NEAR(result.tiles[0], 1.0f, 1e-5f);
+  EXPECT_NEAR(result.tiles[15], 1.0f, 1e-5f);
+}
+
+TEST(Ssim, Mismatch) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB a = CreatePage(memDC, 8, 20, 20, PagePattern::Noise);
+  DIB b = CreatePage(memDC, 8, 20, 21, PagePattern::Noise);
+  DIB c = DIB::CreateNew(memDC, 32, 20, 20);
+  DIB d = CreatePage(memDC, 8, 20, 7, PagePattern::Noise);
+  SsimResult result;
+  EXPECT_FALSE(a.Ssim(b, result));
+  EXPECT_FALSE(a.Ssim(c, result));
+  EXPECT_FALSE(d.Ssim(d, result));
+}
@@ -0,0 +1,130 @@
+#include <windows.h>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <png.h>
+#include <qoi.h>
+#include <stitch.h>
+#include <tiled.h>
+#include "pages.h"
+
+// Feeds |page| to |writer| the way a full-page capture does: tiles of
+// |tileHeight| rows from the top, the last one moved up to end at the
+// bottom, with only the rows not written yet taken from each.
+static bool Stitch(const DIB &page,
+                   DWORD tileHeight,
+                   StitchWriter &writer,
+                   HDC dc) {
+  const auto &ih = page.GetBitmapInfo()->bmiHeader;
+  const DWORD height = std::abs(ih.biHeight);
+  DIB tile = DIB::CreateNew(dc, 32, ih.biWidth, -static_cast<LONG>(tileHeight));
+  while (writer.RowsWritten() < height) {
+    const DWORD next = writer.RowsWritten();
+    const DWORD top = min(next, height - tileHeight);
+    for (DWORD y = 0; y < tileHeight; ++y) {
+      memcpy(tile.At(0, y), page.At(0, top + y), ih.biWidth * 4);
+    }
+    if (!writer.WriteRows(tile,
+                          next - top,
+                          min(tileHeight - (next - top), height - next))) {
+      return false;
+    }
+  }
+  return writer.End();
+}
+
+TEST(Stitch, Bitmap) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB page = CreatePage(memDC, 32, 101, 333, PagePattern::Text);
+  const struct {
+    WORD bitCount;
+    DWORD compression;
+  } formats[] = {
+    {1, BI_RGB}, {4, BI_RGB}, {8, BI_RGB}, {16, BI_RGB}, {16, BI_BITFIELDS},
+    {24, BI_RGB}, {32, BI_RGB},
+  };
+  for (const auto &f : formats) {
+    std::ostringstream oss;
+    StitchWriter writer(oss, StitchFormat::Bitmap, f.bitCount, f.compression,
+                        /*level*/6, 333);
+    ASSERT_TRUE(Stitch(page, 64, writer, memDC)) << f.bitCount;
+
+    std::istringstream iss(oss.str(), std::ios::binary | std::ios::in);
+    DIB loaded = DIB::LoadFromStream(iss, memDC);
+    ASSERT_NE(HBITMAP(loaded), nullptr) << f.bitCount;
+    const auto &ih = loaded.GetBitmapInfo()->bmiHeader;
+    EXPECT_EQ(ih.biHeight, -333);
+    DIB expected = page.ConvertTo(f.bitCount, memDC, nullptr, f.compression);
+    // 16bpp and BI_BITFIELDS load as 32bpp.
+    if (ih.biBitCount != f.bitCount) {
+      expected = expected.ConvertTo(ih.biBitCount, memDC);
+    }
+    const DWORD rowBytes = (101 * ih.biBitCount + 7) / 8;
+    for (DWORD y = 0; y < 333; ++y) {
+      ASSERT_EQ(memcmp(loaded.At(0, y), expected.At(0, y), rowBytes), 0)
+        << f.bitCount << "bpp row " << y;
+    }
+  }
+}
+
+// The same bytes as saving the whole image at once.
+TEST(Stitch, Encoded) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB page = CreatePage(memDC, 32, 150, 500, PagePattern::Text);
+  for (WORD bitCount : {8, 24, 32}) {
+    DIB whole = page.ConvertTo(bitCount, memDC);
+    for (DWORD tileHeight : {1, 37, 128, 500}) {
+      std::ostringstream png, qoi, expectedPng, expectedQoi;
+      StitchWriter pngWriter(png, StitchFormat::Png, bitCount, BI_RGB,
+                             /*level*/6, 500);
+      ASSERT_TRUE(Stitch(page, tileHeight, pngWriter, memDC));
+      whole.SavePng(expectedPng, bitCount, 6);
+      EXPECT_EQ(png.str(), expectedPng.str())
+        << bitCount << "bpp in tiles of " << tileHeight;
+
+      StitchWriter qoiWriter(qoi, StitchFormat::Qoi, bitCount, BI_RGB,
+                             /*level*/0, 500);
+      ASSERT_TRUE(Stitch(page, tileHeight, qoiWriter, memDC));
+      whole.SaveQoi(expectedQoi, bitCount);
+      EXPECT_EQ(qoi.str(), expectedQoi.str())
+        << bitCount << "bpp in tiles of " << tileHeight;
+
+      std::ostringstream tiled, expectedTiled;
+      StitchWriter tiledWriter(tiled, StitchFormat::Tiled, bitCount, BI_RGB,
+                               /*level*/0, 500);
+      ASSERT_TRUE(Stitch(page, tileHeight, tiledWriter, memDC));
+      whole.SaveTiled(expectedTiled, kDefaultTileSize);
+      EXPECT_EQ(tiled.str(), expectedTiled.str())
+        << bitCount << "bpp in tiles of " << tileHeight;
+    }
+  }
+}
+
+TEST(Stitch, Errors) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB page = CreatePage(memDC, 32, 40, 30, PagePattern::Text);
+  DIB narrow = CreatePage(memDC, 32, 39, 30, PagePattern::Text);
+
+  std::ostringstream short_;
+  StitchWriter incomplete(short_, StitchFormat::Bitmap, 32, BI_RGB, 0, 31);
+  EXPECT_TRUE(incomplete.WriteRows(page, 0, 30));
+  EXPECT_FALSE(incomplete.End());
+
+  std::ostringstream over;
+  StitchWriter tooMany(over, StitchFormat::Png, 32, BI_RGB, 0, 30);
+  EXPECT_TRUE(tooMany.WriteRows(page, 0, 20));
+  EXPECT_FALSE(tooMany.WriteRows(page, 0, 11));
+
+  std::ostringstream mixed;
+  StitchWriter widths(mixed, StitchFormat::Qoi, 32, BI_RGB, 0, 60);
+  EXPECT_TRUE(widths.WriteRows(page, 0, 30));
+  EXPECT_FALSE(widths.WriteRows(narrow, 0, 30));
+
+  std::ostringstream qoi16;
+  StitchWriter unsupported(qoi16, StitchFormat::Qoi, 16, BI_RGB, 0, 30);
+  EXPECT_FALSE(unsupported.WriteRows(page, 0, 30));
+}
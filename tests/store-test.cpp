@@ -0,0 +1,289 @@
+#include <windows.h>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <store.h>
+#include "pages.h"
+#include "stores.h"
+
+TEST(Store, Hash) {
+  BYTE data[300];
+  for (int i = 0; i < 300; ++i) {
+    data[i] = static_cast<BYTE>(i * 13);
+  }
+  auto hash = [](LPCBYTE p, SIZE_T size, SIZE_T rowSize) {
+    ContentHasher hasher;
+    for (SIZE_T offset = 0; offset < size; offset += rowSize) {
+      hasher.Update(p + offset, min(rowSize, size - offset));
+    }
+    return hasher.Finish();
+  };
+
+  const ContentKey key = hash(data, 300, 300);
+  EXPECT_TRUE(key == hash(data, 300, 300));
+  // Rows of other widths, and one bit anywhere, change the key.
+  EXPECT_FALSE(key == hash(data, 300, 150));
+  EXPECT_FALSE(key == hash(data, 299, 299));
+  for (int i : {0, 63, 64, 150, 299}) {
+    data[i] ^= 0x10;
+    EXPECT_FALSE(key == hash(data, 300, 300)) << i;
+    data[i] ^= 0x10;
+  }
+  // Swapping two stripes changes the key too.
+  BYTE swapped[300];
+  memcpy(swapped, data + 64, 64);
+  memcpy(swapped + 64, data, 64);
+  memcpy(swapped + 128, data + 128, 172);
+  EXPECT_FALSE(key == hash(swapped, 300, 300));
+}
+
+TEST(Store, Frames) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LPCWSTR directory = L"store-frames";
+  CaptureStore store(directory, /*tileSize*/0);
+  std::vector<std::wstring> manifests;
+  for (WORD bitCount : {8, 24, 32}) {
+    DIB dib = CreatePage(memDC, bitCount, 133, -40);
+    const SIZE_T pixelBytes = (133 * bitCount + 31) / 32 * 4 * 40;
+    const std::wstring first = L"frame" + std::to_wstring(bitCount) + L"a.cap";
+    const std::wstring second = L"frame" + std::to_wstring(bitCount) + L"b.cap";
+    manifests.push_back(first);
+    manifests.push_back(second);
+
+    const auto before = store.GetStats();
+    ASSERT_TRUE(dib.SaveToStore(store, first.c_str()));
+    const auto after = store.GetStats();
+    EXPECT_EQ(after.objects - before.objects, 1u);
+    EXPECT_EQ(after.reused, before.reused);
+
+    EXPECT_GT(after.bytesWritten - before.bytesWritten, pixelBytes);
+
+    // The same pixels again are only a reference.
+    ASSERT_TRUE(dib.SaveToStore(store, second.c_str()));
+    const auto again = store.GetStats();
+    EXPECT_EQ(again.reused - after.reused, 1u);
+    EXPECT_LT(again.bytesWritten - after.bytesWritten, pixelBytes / 4);
+
+    DIB loaded = DIB::LoadFromStore(store, second.c_str(), memDC);
+    ASSERT_NE(HBITMAP(loaded), nullptr);
+    ExpectSamePixels(dib, loaded);
+    if (bitCount == 8) {
+      EXPECT_EQ(memcmp(dib.GetBitmapInfo()->bmiColors,
+                       loaded.GetBitmapInfo()->bmiColors,
+                       256 * sizeof(RGBQUAD)), 0);
+    }
+  }
+
+  // A second store on the same directory finds the objects on disk.
+  CaptureStore reopened(directory, /*tileSize*/0);
+  DIB dib = CreatePage(memDC, 24, 133, -40);
+  manifests.push_back(L"frame24c.cap");
+  ASSERT_TRUE(dib.SaveToStore(reopened, L"frame24c.cap"));
+  EXPECT_EQ(reopened.GetStats().reused, 1u);
+
+  RemoveStore(store, directory, manifests);
+}
+
+TEST(Store, Tiles) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LPCWSTR directory = L"store-tiles";
+  CaptureStore store(directory, /*tileSize*/16);
+  std::vector<std::wstring> manifests;
+  for (WORD bitCount : {4, 32}) {
+    // 5x3 tiles; the last column and row are partial.  Top-down, so that
+    // the banner is in the first tile row.
+    DIB page = CreatePage(memDC, bitCount, 70, -40);
+    DIB banner = CreatePage(memDC, bitCount, 70, -40);
+    for (DWORD y = 0; y < 10; ++y) {
+      LPBYTE row = banner.At(0, y);
+      for (DWORD x = 0; x < 8u * bitCount / 8; ++x) {
+        row[x] ^= 0xff;
+      }
+    }
+    const std::wstring first = L"tiles" + std::to_wstring(bitCount) + L"a.cap";
+    const std::wstring second = L"tiles" + std::to_wstring(bitCount) + L"b.cap";
+    manifests.push_back(first);
+    manifests.push_back(second);
+
+    const auto before = store.GetStats();
+    ASSERT_TRUE(page.SaveToStore(store, first.c_str()));
+    const auto after = store.GetStats();
+    EXPECT_EQ(after.objects - before.objects, 15u);
+    ASSERT_TRUE(banner.SaveToStore(store, second.c_str()));
+    const auto again = store.GetStats();
+    // Only the tile with the banner is new.
+    EXPECT_EQ(again.objects - after.objects, 15u);
+    EXPECT_EQ(again.reused - after.reused, 14u);
+
+    for (const DIB *source : {&page, &banner}) {
+      const auto &path = source == &page ? first : second;
+      DIB loaded = DIB::LoadFromStore(store, path.c_str(), memDC);
+      ASSERT_NE(HBITMAP(loaded), nullptr);
+      ExpectSamePixels(*source, loaded);
+    }
+  }
+  RemoveStore(store, directory, manifests);
+}
+
+TEST(Store, Deltas) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LPCWSTR directory = L"store-deltas";
+  CaptureStore store(directory, /*tileSize*/16);
+  std::vector<std::wstring> manifests = {
+    L"deltaa.cap", L"deltab.cap", L"deltac.cap", L"deltad.cap", L"deltae.cap",
+  };
+  // 5x3 tiles, with a banner over the first two tiles of the first row.
+  DIB page = CreatePage(memDC, 32, 70, -40);
+  DIB banner = CreatePage(memDC, 32, 70, -40);
+  for (DWORD y = 0; y < 10; ++y) {
+    LPBYTE row = banner.At(0, y);
+    for (DWORD x = 0; x < 20 * 4; ++x) {
+      row[x] ^= 0xff;
+    }
+  }
+
+  ASSERT_TRUE(page.SaveToStore(store, L"deltaa.cap"));
+  const auto full = store.GetStats();
+  ASSERT_TRUE(banner.SaveToStore(store, L"deltab.cap", L"deltaa.cap"));
+  const auto first = store.GetStats();
+  EXPECT_EQ(first.objects - full.objects, 2u);
+  EXPECT_EQ(first.unchanged - full.unchanged, 13u);
+  // Two tiles, and a manifest smaller than a full one.
+  EXPECT_LT(first.bytesWritten - full.bytesWritten,
+            2 * 16 * 16 * 4 + 15 * sizeof(ContentKey));
+
+  // Back to the page: both tiles are in the store already.
+  ASSERT_TRUE(page.SaveToStore(store, L"deltac.cap", L"deltab.cap"));
+  const auto second = store.GetStats();
+  EXPECT_EQ(second.objects - first.objects, 2u);
+  EXPECT_EQ(second.reused - first.reused, 2u);
+
+  // A store without the last keys reads the base.  Nothing changed.
+  CaptureStore reopened(directory, /*tileSize*/16);
+  ASSERT_TRUE(page.SaveToStore(reopened, L"deltad.cap", L"deltac.cap"));
+  EXPECT_EQ(reopened.GetStats().objects, 0u);
+  EXPECT_EQ(reopened.GetStats().unchanged, 15u);
+
+  CaptureStore::Manifest manifest;
+  ASSERT_TRUE(store.ReadManifest(L"deltad.cap", manifest));
+  EXPECT_EQ(manifest.base, L"deltac.cap");
+  EXPECT_EQ(manifest.changed, 0u);
+  EXPECT_EQ(manifest.objects.size(), 15u);
+  for (const auto &path : manifests) {
+    if (path == L"deltae.cap") {
+      continue;
+    }
+    const DIB &source = path == L"deltab.cap" ? banner : page;
+    DIB loaded = DIB::LoadFromStore(store, path.c_str(), memDC);
+    ASSERT_NE(HBITMAP(loaded), nullptr);
+    ExpectSamePixels(source, loaded);
+  }
+
+  // Another size is saved in full.
+  DIB other = CreatePage(memDC, 32, 40, -40);
+  ASSERT_TRUE(other.SaveToStore(store, L"deltae.cap", L"deltad.cap"));
+  ASSERT_TRUE(store.ReadManifest(L"deltae.cap", manifest));
+  EXPECT_TRUE(manifest.base.empty());
+  EXPECT_EQ(manifest.changed, 9u);
+
+  // A delta on itself is written in full.
+  ASSERT_TRUE(other.SaveToStore(store, L"deltae.cap", L"deltae.cap"));
+  ASSERT_TRUE(store.ReadManifest(L"deltae.cap", manifest));
+  EXPECT_TRUE(manifest.base.empty());
+
+  // Bases are never overwritten, in this session or a later one, while
+  // the last delta and a full manifest can be.
+  EXPECT_FALSE(banner.SaveToStore(store, L"deltaa.cap"));
+  CaptureStore later(directory, /*tileSize*/16);
+  EXPECT_FALSE(banner.SaveToStore(later, L"deltac.cap"));
+  EXPECT_TRUE(page.SaveToStore(later, L"deltad.cap", L"deltac.cap"));
+  EXPECT_TRUE(other.SaveToStore(later, L"deltae.cap"));
+  for (const auto &path : manifests) {
+    const DIB &source = path == L"deltab.cap" ? banner
+                        : path == L"deltae.cap" ? other
+                        : page;
+    DIB loaded = DIB::LoadFromStore(store, path.c_str(), memDC);
+    ASSERT_NE(HBITMAP(loaded), nullptr);
+    ExpectSamePixels(source, loaded);
+  }
+
+  RemoveStore(store, directory, manifests);
+}
+
+TEST(Store, Missing) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LPCWSTR directory = L"store-missing";
+  CaptureStore store(directory, /*tileSize*/0);
+  DIB dib = CreatePage(memDC, 24, 10, 10);
+  ASSERT_TRUE(dib.SaveToStore(store, L"missing.cap"));
+
+  CaptureStore::Manifest manifest;
+  ASSERT_TRUE(store.ReadManifest(L"missing.cap", manifest));
+  ASSERT_EQ(manifest.objects.size(), 1u);
+  EXPECT_EQ(manifest.width, 10u);
+  EXPECT_EQ(manifest.height, 10u);
+  EXPECT_EQ(manifest.bitCount, 24);
+  const std::wstring object = store.ObjectPath(manifest.objects[0]);
+  DeleteFile(object.c_str());
+  EXPECT_EQ(HBITMAP(DIB::LoadFromStore(store, L"missing.cap", memDC)),
+            nullptr);
+  EXPECT_EQ(HBITMAP(DIB::LoadFromStore(store, L"nothing.cap", memDC)),
+            nullptr);
+
+  RemoveStore(store, directory, {L"missing.cap"});
+}
+
+// A header too short for the colors it declares is not handed to GDI.
+TEST(Store, ShortColorTable) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LPCWSTR directory = L"store-colors";
+  const LPCWSTR path = L"colors.cap";
+  CaptureStore store(directory, /*tileSize*/0);
+  DIB dib = CreatePage(memDC, 8, 10, 10);
+  ASSERT_TRUE(dib.SaveToStore(store, path));
+
+  std::string bytes;
+  {
+    std::ifstream is(path, std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(is),
+                 std::istreambuf_iterator<char>());
+  }
+  const SIZE_T infoOffset = 4 * sizeof(DWORD);
+  const SIZE_T tableOffset = infoOffset + sizeof(BITMAPINFOHEADER);
+  const SIZE_T tableSize = 256 * sizeof(RGBQUAD);
+  ASSERT_GT(bytes.size(), tableOffset + tableSize);
+
+  CaptureStore::Manifest manifest;
+  auto expectRejected = [&](const std::string &patched) {
+    {
+      std::ofstream os(path, std::ios::binary | std::ios::trunc);
+      os.write(patched.data(), patched.size());
+    }
+    EXPECT_FALSE(store.ReadManifest(path, manifest));
+    EXPECT_EQ(HBITMAP(DIB::LoadFromStore(store, path, memDC)), nullptr);
+  };
+
+  // The color table cut out.
+  std::string cut = bytes;
+  cut.erase(tableOffset, tableSize);
+  *reinterpret_cast<DWORD*>(&cut[3 * sizeof(DWORD)]) =
+    sizeof(BITMAPINFOHEADER);
+  expectRejected(cut);
+
+  // More colors than the header holds.
+  std::string used = bytes;
+  reinterpret_cast<BITMAPINFOHEADER*>(&used[infoOffset])->biClrUsed = 257;
+  expectRejected(used);
+
+  {
+    std::ofstream os(path, std::ios::binary | std::ios::trunc);
+    os.write(bytes.data(), bytes.size());
+  }
+  RemoveStore(store, directory, {path});
+}
@@ -0,0 +1,31 @@
+// Cleanup of the capture stores tests write.  Include this after blob.h and
+// store.h.
+
+// Deletes the manifests, their objects, and the store directory.  All the
+// manifests are read first, because deltas read their bases.
+inline void RemoveStore(const CaptureStore &store,
+                        LPCWSTR directory,
+                        const std::vector<std::wstring> &manifests) {
+  std::unordered_set<std::wstring> objects;
+  for (const auto &path : manifests) {
+    CaptureStore::Manifest manifest;
+    if (store.ReadManifest(path.c_str(), manifest)) {
+      for (const auto &key : manifest.objects) {
+        objects.insert(store.ObjectPath(key));
+      }
+    }
+  }
+  std::unordered_set<std::wstring> fanOuts;
+  for (const auto &object : objects) {
+    DeleteFile(object.c_str());
+    fanOuts.insert(object.substr(0, object.rfind(L'\\')));
+  }
+  for (const auto &path : manifests) {
+    DeleteFile(path.c_str());
+  }
+  for (const auto &dir : fanOuts) {
+    RemoveDirectory(dir.c_str());
+  }
+  DeleteFile((std::wstring(directory) + L"\\bases").c_str());
+  RemoveDirectory(directory);
+}
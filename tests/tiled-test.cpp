@@ -0,0 +1,139 @@
+#include <windows.h>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <blob.h>
+#include <bitmap.h>
+#include <tiled.h>
+#include "pages.h"
+
+static bool SaveTiled(const DIB &dib, LPCWSTR path, DWORD tileSize) {
+  std::ofstream os(path, std::ios::binary);
+  return dib.SaveTiled(os, tileSize) && os.good();
+}
+
+TEST(Tiled, RoundTrip) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LPCWSTR path = L"tiled.tcap";
+  const RECT rects[] = {
+    {0, 0, 1, 1},
+    {63, 63, 65, 65},
+    {250, 900, 300, 1000},
+    {10, 100, 290, 700},
+    {0, 0, 300, 1000},
+  };
+  for (WORD bitCount : {8, 24, 32}) {
+    for (LONG height : {1000, -1000}) {
+      DIB page = CreatePage(memDC, bitCount, 300, height, PagePattern::Text);
+      ASSERT_TRUE(SaveTiled(page, path, 64)) << bitCount;
+
+      TiledReader reader;
+      ASSERT_TRUE(reader.Open(path));
+      EXPECT_EQ(reader.GetHeader().width, 300u);
+      EXPECT_EQ(reader.GetHeader().height, 1000u);
+      EXPECT_EQ(reader.GetHeader().bitCount, bitCount);
+
+      for (const auto &rect : rects) {
+        DIB loaded = DIB::LoadTiled(path, memDC, &rect);
+        ASSERT_NE(HBITMAP(loaded), nullptr);
+        const auto &ih = loaded.GetBitmapInfo()->bmiHeader;
+        EXPECT_EQ(ih.biWidth, rect.right - rect.left);
+        EXPECT_EQ(ih.biHeight, rect.top - rect.bottom);
+        EXPECT_EQ(ih.biBitCount, bitCount);
+        for (LONG y = rect.top; y < rect.bottom; ++y) {
+          ASSERT_EQ(memcmp(loaded.At(0, y - rect.top),
+                           page.At(rect.left, y),
+                           (rect.right - rect.left) * bitCount / 8),
+                    0)
+            << bitCount << "bpp row " << y << " of " << rect.left << ","
+            << rect.top;
+        }
+      }
+    }
+  }
+  DeleteFile(path);
+}
+
+// Tall and narrow, with a tile size that leaves partial tiles on both edges.
+TEST(Tiled, Strips) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  DIB page = CreatePage(memDC, 32, 70, -500, PagePattern::Text);
+  std::ostringstream whole, strips;
+  ASSERT_TRUE(page.SaveTiled(whole, 32));
+
+  TiledWriter writer(strips, 32);
+  ASSERT_TRUE(writer.Begin(70, 500, 32));
+  for (DWORD y = 0; y < 500; y += 37) {
+    ASSERT_TRUE(writer.WriteRows(page.At(0, y), 70 * 4, min(37u, 500 - y)));
+  }
+  ASSERT_TRUE(writer.End());
+  EXPECT_EQ(strips.str(), whole.str());
+}
+
+TEST(Tiled, Errors) {
+  auto memDC = SafeDC::CreateMemDC(nullptr);
+  const LPCWSTR path = L"tiled-errors.tcap";
+  DIB page = CreatePage(memDC, 32, 100, 100, PagePattern::Text);
+  ASSERT_TRUE(SaveTiled(page, path, 64));
+
+  const RECT outside = {50, 50, 101, 60};
+  const RECT empty = {10, 10, 10, 20};
+  EXPECT_EQ(HBITMAP(DIB::LoadTiled(path, memDC, &outside)), nullptr);
+  EXPECT_EQ(HBITMAP(DIB::LoadTiled(path, memDC, &empty)), nullptr);
+
+  // Without the index.
+  std::string bytes;
+  {
+    std::ifstream is(path, std::ios::binary);
+    std::ostringstream oss;
+    oss << is.rdbuf();
+    bytes = oss.str();
+  }
+  {
+    std::ofstream os(path, std::ios::binary);
+    os.write(bytes.data(), bytes.size() - sizeof(TiledEntry));
+  }
+  TiledReader reader;
+  EXPECT_FALSE(reader.Open(path));
+
+  // A tile whose end wraps around to before the index, and tiles too large
+  // to decode.
+  TiledHeader header;
+  memcpy(&header, bytes.data(), sizeof(header));
+  auto corrupt = bytes;
+  TiledEntry entry;
+  entry.offset = ~ULONGLONG(0) - 10;
+  entry.size = 100;
+  entry.reserved = 0;
+  memcpy(&corrupt[static_cast<SIZE_T>(header.indexOffset)],
+         &entry,
+         sizeof(entry));
+  {
+    std::ofstream os(path, std::ios::binary);
+    os.write(corrupt.data(), corrupt.size());
+  }
+  EXPECT_FALSE(reader.Open(path));
+  corrupt = bytes;
+  header.tileSize = kMaxTileSize + 1;
+  memcpy(&corrupt[0], &header, sizeof(header));
+  {
+    std::ofstream os(path, std::ios::binary);
+    os.write(corrupt.data(), corrupt.size());
+  }
+  EXPECT_FALSE(reader.Open(path));
+  DeleteFile(path);
+
+  std::ostringstream oss;
+  EXPECT_FALSE(DIB::CreateNew(memDC, 16, 10, 10).SaveTiled(oss, 64));
+  TiledWriter large(oss, kMaxTileSize + 1);
+  EXPECT_FALSE(large.Begin(100, 100, 32));
+  std::ostringstream incomplete;
+  TiledWriter writer(incomplete, 64);
+  ASSERT_TRUE(writer.Begin(100, 100, 32));
+  EXPECT_TRUE(writer.WriteRows(page.At(0, 0), -100 * 4, 99));
+  EXPECT_FALSE(writer.WriteRows(page.At(0, 0), -100 * 4, 2));
+  EXPECT_FALSE(writer.End());
+}